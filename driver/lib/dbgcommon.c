@@ -31,6 +31,7 @@ static namecode_t	namecodes_usbip_command[] = {
 	K_V(USBIP_CMD_UNLINK)
 	K_V(USBIP_RET_SUBMIT)
 	K_V(USBIP_RET_UNLINK)
+	K_V(USBIP_CMD_UNLINK_BATCH)
 	{0,0}
 };
 
@@ -61,6 +62,10 @@ dbg_usbip_hdr(struct usbip_header *hdr)
 	case USBIP_RET_UNLINK:
 		dbg_snprintf(buf + n, 512 - n, ",st:%u", hdr->u.ret_unlink.status);
 		break;
+	case USBIP_CMD_UNLINK_BATCH:
+		dbg_snprintf(buf + n, 512 - n, ",unlinkseq:%u-%u,flags:%x", hdr->u.cmd_unlink_batch.seqnum_first,
+			hdr->u.cmd_unlink_batch.seqnum_last, hdr->u.cmd_unlink_batch.flags);
+		break;
 	default:
 		break;
 	}
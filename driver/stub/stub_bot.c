@@ -0,0 +1,176 @@
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "stub_bot.h"
+
+#define CBW_SIGNATURE	0x43425355
+#define CSW_SIGNATURE	0x53425355
+
+static ULONG
+get_le32(const UCHAR *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((ULONG)p[3] << 24);
+}
+
+static ULONG
+get_be32(const UCHAR *p)
+{
+	return ((ULONG)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+put_le32(UCHAR *p, ULONG v)
+{
+	p[0] = (UCHAR)v;
+	p[1] = (UCHAR)(v >> 8);
+	p[2] = (UCHAR)(v >> 16);
+	p[3] = (UCHAR)(v >> 24);
+}
+
+BOOLEAN
+bot_parse_cbw(const UCHAR *buf, ULONG len, bot_cbw_t *cbw)
+{
+	if (len != BOT_CBW_LEN || get_le32(buf) != CBW_SIGNATURE)
+		return FALSE;
+	cbw->len_cb = buf[14] & 0x1f;
+	if (cbw->len_cb == 0 || cbw->len_cb > 16)
+		return FALSE;
+	cbw->tag = get_le32(buf + 4);
+	cbw->len_data = get_le32(buf + 8);
+	cbw->is_in = (buf[12] & 0x80) ? TRUE : FALSE;
+	cbw->lun = buf[13] & 0x0f;
+	memcpy(cbw->cb, buf + 15, 16);
+	return TRUE;
+}
+
+void
+bot_build_csw(UCHAR *buf, ULONG tag, ULONG residue, UCHAR status)
+{
+	put_le32(buf, CSW_SIGNATURE);
+	put_le32(buf + 4, tag);
+	put_le32(buf + 8, residue);
+	buf[12] = status;
+}
+
+UCHAR
+bot_parse_csw(const UCHAR *buf, ULONG len, ULONG tag, ULONG *presidue)
+{
+	if (len != BOT_CSW_LEN || get_le32(buf) != CSW_SIGNATURE || get_le32(buf + 4) != tag || buf[12] > BOT_CSW_PHASE_ERROR)
+		return BOT_CSW_PHASE_ERROR;
+	*presidue = get_le32(buf + 8);
+	return buf[12];
+}
+
+BOOLEAN
+bot_is_read_only(const bot_cbw_t *cbw)
+{
+	switch (cbw->cb[0]) {
+	case 0x00:	/* TEST UNIT READY */
+	case 0x03:	/* REQUEST SENSE */
+	case 0x08:	/* READ(6) */
+	case 0x12:	/* INQUIRY */
+	case 0x1a:	/* MODE SENSE(6) */
+	case 0x1e:	/* PREVENT ALLOW MEDIUM REMOVAL */
+	case 0x23:	/* READ FORMAT CAPACITIES */
+	case 0x25:	/* READ CAPACITY(10) */
+	case 0x28:	/* READ(10) */
+	case 0x2f:	/* VERIFY(10) */
+	case 0x35:	/* SYNCHRONIZE CACHE(10) */
+	case 0x43:	/* READ TOC */
+	case 0x46:	/* GET CONFIGURATION */
+	case 0x4a:	/* GET EVENT STATUS NOTIFICATION */
+	case 0x51:	/* READ DISC INFORMATION */
+	case 0x5a:	/* MODE SENSE(10) */
+	case 0x88:	/* READ(16) */
+	case 0x9e:	/* READ CAPACITY(16) */
+	case 0xa0:	/* REPORT LUNS */
+	case 0xa8:	/* READ(12) */
+		return TRUE;
+	default:
+		/* START STOP UNIT may eject a medium, and unknown ones may do anything */
+		return FALSE;
+	}
+}
+
+BOOLEAN
+bot_get_read10(const bot_cbw_t *cbw, ULONG *plba, ULONG *pn_blocks)
+{
+	if (cbw->cb[0] != 0x28 || cbw->len_cb < 10 || !cbw->is_in)
+		return FALSE;
+	*plba = get_be32(cbw->cb + 2);
+	*pn_blocks = (cbw->cb[7] << 8) | cbw->cb[8];
+	return *pn_blocks > 0 && cbw->len_data > 0 && cbw->len_data % *pn_blocks == 0;
+}
+
+void
+bot_cache_init(bot_cache_t *cache, UCHAR *buf, ULONG len_buf)
+{
+	memset(cache, 0, sizeof(bot_cache_t));
+	cache->buf = buf;
+	cache->len_buf = len_buf;
+}
+
+void
+bot_cache_invalidate(bot_cache_t *cache)
+{
+	ULONG	i;
+
+	for (i = 0; i < BOT_CACHE_MAX_ENTRIES; i++)
+		cache->entries[i].valid = FALSE;
+	cache->offset_next = 0;
+}
+
+const UCHAR *
+bot_cache_lookup(bot_cache_t *cache, UCHAR lun, ULONG lba, ULONG n_blocks, ULONG len)
+{
+	ULONG	i;
+
+	for (i = 0; i < BOT_CACHE_MAX_ENTRIES; i++) {
+		bot_cache_entry_t	*entry = cache->entries + i;
+
+		if (!entry->valid || entry->lun != lun || lba < entry->lba ||
+		    (ULONGLONG)lba + n_blocks > (ULONGLONG)entry->lba + entry->n_blocks)
+			continue;
+		if ((ULONGLONG)n_blocks * entry->len_block != len)
+			continue;
+		cache->n_hits++;
+		return cache->buf + entry->offset + (lba - entry->lba) * entry->len_block;
+	}
+	cache->n_misses++;
+	return NULL;
+}
+
+void
+bot_cache_store(bot_cache_t *cache, UCHAR lun, ULONG lba, ULONG n_blocks, const UCHAR *data, ULONG len)
+{
+	bot_cache_entry_t	*entry;
+	ULONG	offset, i;
+
+	if (len == 0 || len > cache->len_buf || n_blocks == 0 || len % n_blocks != 0)
+		return;
+	offset = cache->offset_next;
+	if (offset + len > cache->len_buf)
+		offset = 0;
+
+	for (i = 0; i < BOT_CACHE_MAX_ENTRIES; i++) {
+		entry = cache->entries + i;
+		if (!entry->valid)
+			continue;
+		/* an entry overwritten in the buffer, or of the same blocks which may be older */
+		if ((entry->offset < offset + len && offset < entry->offset + entry->n_blocks * entry->len_block) ||
+		    (entry->lun == lun && entry->lba < lba + n_blocks && lba < entry->lba + entry->n_blocks))
+			entry->valid = FALSE;
+	}
+
+	entry = cache->entries + cache->idx_next;
+	cache->idx_next = (cache->idx_next + 1) % BOT_CACHE_MAX_ENTRIES;
+	memcpy(cache->buf + offset, data, len);
+	entry->lun = lun;
+	entry->lba = lba;
+	entry->n_blocks = n_blocks;
+	entry->len_block = len / n_blocks;
+	entry->offset = offset;
+	entry->valid = TRUE;
+	cache->offset_next = offset + len;
+}
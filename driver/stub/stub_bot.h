@@ -0,0 +1,86 @@
+#pragma once
+
+#ifdef _NTDDK_
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
+
+/*
+ * Bulk-Only Transport of a mass storage and a cache of READ(10) data
+ *
+ * This knows nothing of urbs, so that usbip-emul runs the same code against an emulated storage.
+ */
+
+#define BOT_CBW_LEN	31
+#define BOT_CSW_LEN	13
+
+/* class request of Bulk-Only Mass Storage Reset */
+#define BOT_REQUEST_RESET	0xff
+
+#define BOT_CSW_PASSED		0
+#define BOT_CSW_FAILED		1
+#define BOT_CSW_PHASE_ERROR	2
+
+/* interface triple of a bulk-only mass storage */
+#define BOT_IS_INTERFACE(class, subclass, protocol)	((class) == 0x08 && (protocol) == 0x50)
+
+typedef struct {
+	ULONG	tag;
+	ULONG	len_data;
+	BOOLEAN	is_in;
+	UCHAR	lun;
+	UCHAR	len_cb;
+	UCHAR	cb[16];
+} bot_cbw_t;
+
+BOOLEAN
+bot_parse_cbw(const UCHAR *buf, ULONG len, bot_cbw_t *cbw);
+void
+bot_build_csw(UCHAR *buf, ULONG tag, ULONG residue, UCHAR status);
+/* a status of a CSW for a tag, or BOT_CSW_PHASE_ERROR if it is invalid */
+UCHAR
+bot_parse_csw(const UCHAR *buf, ULONG len, ULONG tag, ULONG *presidue);
+
+/* TRUE if a command never changes the data of a medium */
+BOOLEAN
+bot_is_read_only(const bot_cbw_t *cbw);
+/* TRUE if a command is READ(10), which a cache may serve */
+BOOLEAN
+bot_get_read10(const bot_cbw_t *cbw, ULONG *plba, ULONG *pn_blocks);
+
+#define BOT_CACHE_MAX_ENTRIES	32
+
+typedef struct {
+	UCHAR	lun;
+	ULONG	lba;
+	ULONG	n_blocks;
+	ULONG	len_block;
+	/* data is at offset of a buffer */
+	ULONG	offset;
+	BOOLEAN	valid;
+} bot_cache_entry_t;
+
+/*
+ * Data of recent READ(10)'s in a ring buffer given by a caller. A newer one overwrites older ones
+ * which overlap it in the buffer. A read of blocks within an entry is served from it.
+ */
+typedef struct {
+	UCHAR	*buf;
+	ULONG	len_buf;
+	/* offset where a next entry goes */
+	ULONG	offset_next;
+	ULONG	idx_next;
+	bot_cache_entry_t	entries[BOT_CACHE_MAX_ENTRIES];
+	ULONG	n_hits, n_misses;
+} bot_cache_t;
+
+void
+bot_cache_init(bot_cache_t *cache, UCHAR *buf, ULONG len_buf);
+void
+bot_cache_invalidate(bot_cache_t *cache);
+/* data of len bytes, or NULL if blocks are not cached as a whole */
+const UCHAR *
+bot_cache_lookup(bot_cache_t *cache, UCHAR lun, ULONG lba, ULONG n_blocks, ULONG len);
+void
+bot_cache_store(bot_cache_t *cache, UCHAR lun, ULONG lba, ULONG n_blocks, const UCHAR *data, ULONG len);
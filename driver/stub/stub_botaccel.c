@@ -0,0 +1,694 @@
+#include "stub_driver.h"
+#include "stub_dbg.h"
+#include "stub_res.h"
+#include "stub_reg.h"
+#include "stub_devconf.h"
+#include "stub_bot.h"
+#include "stub_botaccel.h"
+#include "usbd_helper.h"
+
+#include <usbdlib.h>
+
+/*
+ * Acceleration of a bulk-only mass storage
+ *
+ * A command of Bulk-Only Transport takes a CBW, an optional data stage and a CSW, each of which
+ * is a CMD_SUBMIT sent by a client only after the previous one has returned. A remote storage thus
+ * waits for a network round trip and a device latency per stage. Instead, when a CBW is sent to an
+ * interface of a bulk-only mass storage, its data stage of IN and its CSW are submitted at once
+ * together with the CBW. Their results are held for next bulk IN CMD_SUBMITs of the interface,
+ * or a CMD_SUBMIT arriving while a stage is in flight waits for it. A request gets data of a
+ * stage in order as a device would have sent, so a client may split a stage into requests.
+ *
+ * A data stage longer than BotAccelLen, which enables acceleration, is left to a client.
+ * Then only an OUT data stage or no data stage gets its CSW submitted ahead.
+ *
+ * With BotCacheLen, data of a READ(10) with a passed CSW is cached, and a later READ(10) of cached
+ * blocks is completed without a device: a CBW is replied at once, and a data stage and a CSW are
+ * made from a cache. A cache is invalidated by a command which may write a medium, by a failed CSW
+ * such as a unit attention of a medium change, and by a reset.
+ *
+ * Stages left by a client are cancelled by a next CBW. An accelerator is stopped like an interrupt poll,
+ * and by a class reset of an interface. Requests waiting for it are protected by lock_stub_res.
+ */
+
+#define BOT_STAGE_DATA	0
+#define BOT_STAGE_CSW	1
+#define BOT_N_STAGES	2
+
+typedef struct {
+	struct bot_accel	*accel;
+	PIRP	irp;
+	PUCHAR	buf;
+	ULONG	len;
+	ULONG	len_actual;
+	/* data handed over to requests so far */
+	ULONG	len_served;
+	USBD_STATUS	usbd_status;
+	/* a stage is a part of a current command */
+	BOOLEAN	used;
+	BOOLEAN	in_flight;
+	BOOLEAN	done;
+	struct _URB_BULK_OR_INTERRUPT_TRANSFER	urb;
+} bot_stage_t;
+
+typedef struct bot_accel {
+	usbip_stub_dev_t	*devstub;
+	int	intf_num;
+	USBD_PIPE_HANDLE	hPipe_out, hPipe_in;
+	UCHAR	epaddr_in;
+	ULONG	len_max;
+
+	bot_cbw_t	cbw;
+	/* a stage which a next request is served by */
+	ULONG	idx_stage;
+	/* a current command is READ(10) whose data may be cached */
+	BOOLEAN	cacheable;
+	ULONG	lba, n_blocks;
+
+	ULONG	n_in_flight;
+	BOOLEAN	stopping;
+	KEVENT	event_stopped;
+
+	bot_cache_t	cache;
+	PUCHAR	cache_buf;
+
+	ULONG	n_cmds;
+	ULONG	n_accelerated;
+	ULONG	n_aborted;
+
+	LIST_ENTRY	list;
+	bot_stage_t	stages[BOT_N_STAGES];
+} bot_accel_t;
+
+static void
+free_bot_accel(bot_accel_t *accel)
+{
+	int	i;
+
+	for (i = 0; i < BOT_N_STAGES; i++) {
+		if (accel->stages[i].irp != NULL)
+			IoFreeIrp(accel->stages[i].irp);
+		if (accel->stages[i].buf != NULL)
+			ExFreePoolWithTag(accel->stages[i].buf, USBIP_STUB_POOL_TAG);
+	}
+	if (accel->cache_buf != NULL)
+		ExFreePoolWithTag(accel->cache_buf, USBIP_STUB_POOL_TAG);
+	ExFreePoolWithTag(accel, USBIP_STUB_POOL_TAG);
+}
+
+static PUSBD_PIPE_INFORMATION
+get_info_pipe_bulk_in(PUSBD_INTERFACE_INFORMATION info_intf)
+{
+	ULONG	i;
+
+	for (i = 0; i < info_intf->NumberOfPipes; i++) {
+		PUSBD_PIPE_INFORMATION	info_pipe = info_intf->Pipes + i;
+
+		if (info_pipe->PipeType == UsbdPipeTypeBulk && USB_ENDPOINT_DIRECTION_IN(info_pipe->EndpointAddress))
+			return info_pipe;
+	}
+	return NULL;
+}
+
+static bot_accel_t *
+create_bot_accel(usbip_stub_dev_t *devstub, PUSBD_INTERFACE_INFORMATION info_intf, PUSBD_PIPE_INFORMATION info_pipe_out)
+{
+	PUSBD_PIPE_INFORMATION	info_pipe_in;
+	bot_accel_t	*accel;
+	int	i;
+
+	info_pipe_in = get_info_pipe_bulk_in(info_intf);
+	if (info_pipe_in == NULL)
+		return NULL;
+
+	accel = ExAllocatePoolWithTag(NonPagedPool, sizeof(bot_accel_t), USBIP_STUB_POOL_TAG);
+	if (accel == NULL) {
+		DBGE(DBG_GENERAL, "create_bot_accel: out of memory\n");
+		return NULL;
+	}
+	RtlZeroMemory(accel, sizeof(bot_accel_t));
+
+	accel->devstub = devstub;
+	accel->intf_num = info_intf->InterfaceNumber;
+	accel->hPipe_out = info_pipe_out->PipeHandle;
+	accel->hPipe_in = info_pipe_in->PipeHandle;
+	accel->epaddr_in = info_pipe_in->EndpointAddress;
+	accel->len_max = stub_params.bot_accel_len;
+	if (info_pipe_in->MaximumTransferSize != 0 && info_pipe_in->MaximumTransferSize < accel->len_max)
+		accel->len_max = info_pipe_in->MaximumTransferSize;
+	accel->idx_stage = BOT_N_STAGES;
+	/* signaled while no stage is in flight */
+	KeInitializeEvent(&accel->event_stopped, NotificationEvent, TRUE);
+	InitializeListHead(&accel->list);
+
+	for (i = 0; i < BOT_N_STAGES; i++) {
+		accel->stages[i].accel = accel;
+		accel->stages[i].irp = IoAllocateIrp(devstub->self->StackSize + 1, FALSE);
+		if (accel->stages[i].irp == NULL) {
+			DBGE(DBG_GENERAL, "create_bot_accel: out of memory: irp\n");
+			free_bot_accel(accel);
+			return NULL;
+		}
+	}
+
+	if (stub_params.bot_cache_len > 0) {
+		accel->cache_buf = ExAllocatePoolWithTag(NonPagedPool, stub_params.bot_cache_len, USBIP_STUB_POOL_TAG);
+		if (accel->cache_buf == NULL)
+			DBGW(DBG_GENERAL, "create_bot_accel: out of memory: no cache\n");
+	}
+	bot_cache_init(&accel->cache, accel->cache_buf, accel->cache_buf != NULL ? stub_params.bot_cache_len : 0);
+	return accel;
+}
+
+static bot_accel_t *
+find_bot_accel(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe)
+{
+	PLIST_ENTRY	le;
+
+	for (le = devstub->bot_accels.Flink; le != &devstub->bot_accels; le = le->Flink) {
+		bot_accel_t	*accel = CONTAINING_RECORD(le, bot_accel_t, list);
+		if (accel->hPipe_out == hPipe || accel->hPipe_in == hPipe)
+			return accel;
+	}
+	return NULL;
+}
+
+/* must be called with lock_stub_res held */
+static void
+advance_bot_stage(bot_accel_t *accel)
+{
+	do {
+		accel->idx_stage++;
+	} while (accel->idx_stage < BOT_N_STAGES && !accel->stages[accel->idx_stage].used);
+}
+
+/* must be called with lock_stub_res held. No stage should be in flight. */
+static void
+reset_bot_stages(bot_accel_t *accel)
+{
+	int	i;
+
+	for (i = 0; i < BOT_N_STAGES; i++) {
+		bot_stage_t	*stage = accel->stages + i;
+
+		if (stage->buf != NULL) {
+			ExFreePoolWithTag(stage->buf, USBIP_STUB_POOL_TAG);
+			stage->buf = NULL;
+		}
+		stage->used = FALSE;
+		stage->done = FALSE;
+	}
+	accel->idx_stage = BOT_N_STAGES;
+	accel->cacheable = FALSE;
+}
+
+/*
+ * must be called with lock_stub_res held.
+ * A request of len_req gets data of a current stage from where a previous request has left.
+ * Its data length is of a request until here.
+ */
+static void
+fill_bot_res(bot_accel_t *accel, stub_res_t *sres)
+{
+	bot_stage_t	*stage = accel->stages + accel->idx_stage;
+	ULONG	len_req = (ULONG)sres->data_len;
+	ULONG	len = 0;
+
+	if (USBD_ERROR(stage->usbd_status)) {
+		sres->header.u.ret_submit.status = to_usbip_status(stage->usbd_status);
+		stage->len_served = stage->len_actual;
+	}
+	else {
+		len = stage->len_actual - stage->len_served;
+		if (len > len_req)
+			len = len_req;
+		if (len == stage->len_actual && !(accel->cacheable && accel->idx_stage == BOT_STAGE_DATA)) {
+			/* a whole stage goes as it is unless it is to be cached */
+			sres->data = stage->buf;
+			stage->buf = NULL;
+		}
+		else if (len > 0) {
+			sres->data = ExAllocatePoolWithTag(NonPagedPool, len, USBIP_STUB_POOL_TAG);
+			if (sres->data == NULL) {
+				DBGE(DBG_GENERAL, "fill_bot_res: out of memory\n");
+				sres->header.u.ret_submit.status = -1;
+				len = 0;
+			}
+			else {
+				RtlCopyMemory(sres->data, stage->buf + stage->len_served, len);
+			}
+		}
+		if (sres->data != NULL)
+			stage->len_served += len;
+	}
+	sres->data_len = len;
+	sres->header.u.ret_submit.actual_length = len;
+
+	if (stage->len_served == stage->len_actual)
+		advance_bot_stage(accel);
+}
+
+/* must be called with lock_stub_res held, which will be released on return */
+static void
+serve_bot_reqs(usbip_stub_dev_t *devstub, bot_accel_t *accel, KIRQL oldirql)
+{
+	LIST_ENTRY	head_served;
+	PLIST_ENTRY	le;
+
+	InitializeListHead(&head_served);
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (sres->bot != accel)
+			continue;
+		/* requests are served in order */
+		if (accel->idx_stage >= BOT_N_STAGES || !accel->stages[accel->idx_stage].done)
+			break;
+		RemoveEntryList(&sres->list);
+		fill_bot_res(accel, sres);
+		sres->bot = NULL;
+		InsertTailList(&head_served, &sres->list);
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_served)) {
+		le = RemoveHeadList(&head_served);
+		reply_stub_req(devstub, CONTAINING_RECORD(le, stub_res_t, list));
+	}
+}
+
+/* must be called with lock_stub_res held, which will be released on return */
+static void
+flush_bot_reqs(usbip_stub_dev_t *devstub, bot_accel_t *accel, BOOLEAN reply, KIRQL oldirql)
+{
+	LIST_ENTRY	head_flushed;
+	PLIST_ENTRY	le;
+
+	InitializeListHead(&head_flushed);
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (sres->bot != accel)
+			continue;
+		RemoveEntryList(&sres->list);
+		sres->bot = NULL;
+		InsertTailList(&head_flushed, &sres->list);
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_flushed)) {
+		stub_res_t	*sres = CONTAINING_RECORD(RemoveHeadList(&head_flushed), stub_res_t, list);
+
+		if (reply) {
+			sres->header.u.ret_submit.status = -1;
+			sres->header.u.ret_submit.actual_length = 0;
+			sres->data_len = 0;
+			reply_stub_req(devstub, sres);
+		}
+		else {
+			free_stub_res(sres);
+		}
+	}
+}
+
+/*
+ * must be called with lock_stub_res held.
+ * TRUE is returned if a stage is prepared, which a caller should submit by submit_bot_stage()
+ * after releasing the lock.
+ */
+static BOOLEAN
+prepare_bot_stage(bot_accel_t *accel, bot_stage_t *stage, ULONG len)
+{
+	IO_STACK_LOCATION	*irpstack;
+
+	if (accel->stopping)
+		return FALSE;
+
+	stage->buf = ExAllocatePoolWithTag(NonPagedPool, len, USBIP_STUB_POOL_TAG);
+	if (stage->buf == NULL) {
+		DBGE(DBG_GENERAL, "prepare_bot_stage: out of memory\n");
+		return FALSE;
+	}
+	stage->len = len;
+	stage->len_actual = 0;
+	stage->len_served = 0;
+	stage->usbd_status = USBD_STATUS_SUCCESS;
+	stage->used = TRUE;
+	stage->done = FALSE;
+	stage->in_flight = TRUE;
+	accel->n_in_flight++;
+	KeClearEvent(&accel->event_stopped);
+
+	UsbBuildInterruptOrBulkTransferRequest((PURB)&stage->urb, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER), accel->hPipe_in,
+		stage->buf, NULL, len, USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK, NULL);
+
+	/* irp is reused here so that stopping can cancel it before it is submitted */
+	IoReuseIrp(stage->irp, STATUS_SUCCESS);
+
+	irpstack = IoGetNextIrpStackLocation(stage->irp);
+	irpstack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irpstack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irpstack->Parameters.Others.Argument1 = &stage->urb;
+	irpstack->Parameters.Others.Argument2 = NULL;
+	irpstack->DeviceObject = accel->devstub->self;
+	return TRUE;
+}
+
+static NTSTATUS done_bot_stage(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx);
+
+static void
+submit_bot_stage(bot_stage_t *stage)
+{
+	DBGI(DBG_READWRITE, "submit_bot_stage: ep:%02x, len:%u\n", stage->accel->epaddr_in, stage->len);
+
+	IoSetCompletionRoutine(stage->irp, done_bot_stage, stage, TRUE, TRUE, TRUE);
+	IoCallDriver(stage->accel->devstub->next_stack_dev, stage->irp);
+}
+
+/* must be called with lock_stub_res held when a CSW stage is done */
+static void
+finish_bot_cmd(bot_accel_t *accel)
+{
+	bot_stage_t	*data = accel->stages + BOT_STAGE_DATA;
+	bot_stage_t	*csw = accel->stages + BOT_STAGE_CSW;
+	ULONG	residue = 0;
+	UCHAR	status;
+
+	if (accel->cache.buf == NULL)
+		return;
+
+	if (USBD_ERROR(csw->usbd_status) || csw->buf == NULL)
+		status = BOT_CSW_PHASE_ERROR;
+	else
+		status = bot_parse_csw(csw->buf, csw->len_actual, accel->cbw.tag, &residue);
+	if (status != BOT_CSW_PASSED) {
+		bot_cache_invalidate(&accel->cache);
+		return;
+	}
+	if (accel->cacheable && data->used && data->done && data->buf != NULL && !USBD_ERROR(data->usbd_status) &&
+	    residue == 0 && data->len_actual == accel->cbw.len_data)
+		bot_cache_store(&accel->cache, accel->cbw.lun, accel->lba, accel->n_blocks, data->buf, data->len_actual);
+}
+
+static NTSTATUS
+done_bot_stage(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
+{
+	bot_stage_t	*stage = (bot_stage_t *)ctx;
+	bot_accel_t	*accel = stage->accel;
+	usbip_stub_dev_t	*devstub = accel->devstub;
+	KIRQL	oldirql;
+
+	UNREFERENCED_PARAMETER(devobj);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+
+	stage->in_flight = FALSE;
+	stage->done = TRUE;
+	if (NT_SUCCESS(irp->IoStatus.Status)) {
+		stage->len_actual = stage->urb.TransferBufferLength;
+	}
+	else {
+		stage->usbd_status = USBD_ERROR(stage->urb.Hdr.Status) ? stage->urb.Hdr.Status : USBD_STATUS_INTERNAL_HC_ERROR;
+		if (irp->IoStatus.Status != STATUS_CANCELLED) {
+			DBGW(DBG_GENERAL, "done_bot_stage: ep:%02x: %s, usbd_status:%s\n", accel->epaddr_in,
+				dbg_ntstatus(irp->IoStatus.Status), dbg_usbd_status(stage->urb.Hdr.Status));
+		}
+	}
+	if (stage == accel->stages + BOT_STAGE_CSW)
+		finish_bot_cmd(accel);
+
+	if (--accel->n_in_flight == 0)
+		KeSetEvent(&accel->event_stopped, IO_NO_INCREMENT, FALSE);
+	serve_bot_reqs(devstub, accel, oldirql);
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/* Stages of a previous command, which a client has not taken, are cancelled and discarded */
+static void
+abort_bot_stages(usbip_stub_dev_t *devstub, bot_accel_t *accel)
+{
+	KIRQL	oldirql;
+	int	i;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	if (accel->idx_stage >= BOT_N_STAGES && accel->n_in_flight == 0) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		return;
+	}
+	accel->n_aborted++;
+	if (accel->n_in_flight > 0) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+		for (i = 0; i < BOT_N_STAGES; i++)
+			IoCancelIrp(accel->stages[i].irp);
+		KeWaitForSingleObject(&accel->event_stopped, Executive, KernelMode, FALSE, NULL);
+
+		KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	}
+	reset_bot_stages(accel);
+	flush_bot_reqs(devstub, accel, TRUE, oldirql);
+}
+
+static void
+stop_bot_accel_list(usbip_stub_dev_t *devstub, PLIST_ENTRY head_stop, BOOLEAN reply)
+{
+	while (!IsListEmpty(head_stop)) {
+		bot_accel_t	*accel;
+		KIRQL	oldirql;
+		int	i;
+
+		accel = CONTAINING_RECORD(RemoveHeadList(head_stop), bot_accel_t, list);
+
+		DBGI(DBG_GENERAL, "stop_bot_accel: intf:%d, commands:%u, accelerated:%u, aborted:%u, cache hits:%u, misses:%u\n",
+			accel->intf_num, accel->n_cmds, accel->n_accelerated, accel->n_aborted,
+			accel->cache.n_hits, accel->cache.n_misses);
+
+		/* irps are owned by an accelerator and not freed until here */
+		for (i = 0; i < BOT_N_STAGES; i++)
+			IoCancelIrp(accel->stages[i].irp);
+		KeWaitForSingleObject(&accel->event_stopped, Executive, KernelMode, FALSE, NULL);
+
+		KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+		flush_bot_reqs(devstub, accel, reply, oldirql);
+
+		free_bot_accel(accel);
+	}
+}
+
+static void
+stop_bot_accels_of(usbip_stub_dev_t *devstub, int intf_num, USBD_PIPE_HANDLE hPipe, BOOLEAN reply)
+{
+	LIST_ENTRY	head_stop;
+	PLIST_ENTRY	le;
+	KIRQL	oldirql;
+
+	InitializeListHead(&head_stop);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	for (le = devstub->bot_accels.Flink; le != &devstub->bot_accels;) {
+		bot_accel_t	*accel = CONTAINING_RECORD(le, bot_accel_t, list);
+
+		le = le->Flink;
+		if (hPipe != NULL ? (accel->hPipe_out == hPipe || accel->hPipe_in == hPipe) :
+		    (intf_num < 0 || accel->intf_num == intf_num)) {
+			accel->stopping = TRUE;
+			RemoveEntryList(&accel->list);
+			InsertTailList(&head_stop, &accel->list);
+		}
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	stop_bot_accel_list(devstub, &head_stop, reply);
+}
+
+/* A class reset of an interface also comes here, and it drops a cache */
+void
+stop_bot_accels(usbip_stub_dev_t *devstub, int intf_num, BOOLEAN reply)
+{
+	stop_bot_accels_of(devstub, intf_num, NULL, reply);
+}
+
+/* Resetting a pipe requires no urb in flight */
+void
+stop_bot_accel_pipe(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe)
+{
+	stop_bot_accels_of(devstub, -1, hPipe, TRUE);
+}
+
+/* must be called with lock_stub_res held */
+static BOOLEAN
+fill_bot_stages_cached(bot_accel_t *accel, const UCHAR *data)
+{
+	bot_stage_t	*stage_data = accel->stages + BOT_STAGE_DATA;
+	bot_stage_t	*stage_csw = accel->stages + BOT_STAGE_CSW;
+
+	stage_data->buf = ExAllocatePoolWithTag(NonPagedPool, accel->cbw.len_data, USBIP_STUB_POOL_TAG);
+	stage_csw->buf = ExAllocatePoolWithTag(NonPagedPool, BOT_CSW_LEN, USBIP_STUB_POOL_TAG);
+	if (stage_data->buf == NULL || stage_csw->buf == NULL) {
+		DBGE(DBG_GENERAL, "fill_bot_stages_cached: out of memory\n");
+		reset_bot_stages(accel);
+		return FALSE;
+	}
+	RtlCopyMemory(stage_data->buf, data, accel->cbw.len_data);
+	stage_data->len = stage_data->len_actual = accel->cbw.len_data;
+	bot_build_csw(stage_csw->buf, accel->cbw.tag, 0, BOT_CSW_PASSED);
+	stage_csw->len = stage_csw->len_actual = BOT_CSW_LEN;
+
+	stage_data->len_served = stage_csw->len_served = 0;
+	stage_data->usbd_status = stage_csw->usbd_status = USBD_STATUS_SUCCESS;
+	stage_data->used = stage_csw->used = TRUE;
+	stage_data->done = stage_csw->done = TRUE;
+	accel->idx_stage = BOT_STAGE_DATA;
+	accel->cacheable = FALSE;
+	return TRUE;
+}
+
+static BOOLEAN
+submit_bot_cbw(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
+{
+	PUSBD_INTERFACE_INFORMATION	info_intf;
+	bot_accel_t	*accel;
+	bot_cbw_t	cbw;
+	BOOLEAN	submit_data = FALSE, submit_csw = FALSE;
+	KIRQL	oldirql;
+
+	if (!bot_parse_cbw((const UCHAR *)(hdr + 1), (ULONG)hdr->u.cmd_submit.transfer_buffer_length, &cbw))
+		return FALSE;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	accel = find_bot_accel(devstub, info_pipe->PipeHandle);
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	if (accel == NULL) {
+		info_intf = get_info_intf_of_pipe(devstub->devconf, info_pipe->PipeHandle);
+		if (info_intf == NULL || !BOT_IS_INTERFACE(info_intf->Class, info_intf->SubClass, info_intf->Protocol))
+			return FALSE;
+		accel = create_bot_accel(devstub, info_intf, info_pipe);
+		if (accel == NULL)
+			return FALSE;
+		DBGI(DBG_GENERAL, "create_bot_accel: intf:%d, max len:%u, cache:%u\n", accel->intf_num, accel->len_max,
+			accel->cache.len_buf);
+
+		/* CMD_SUBMITs are processed by a single thread, so nobody else adds one for the interface */
+		KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+		InsertTailList(&devstub->bot_accels, &accel->list);
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+	}
+	if (accel->hPipe_out != info_pipe->PipeHandle)
+		return FALSE;
+
+	abort_bot_stages(devstub, accel);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+
+	accel->cbw = cbw;
+	accel->n_cmds++;
+	if (!bot_is_read_only(&cbw))
+		bot_cache_invalidate(&accel->cache);
+	accel->cacheable = accel->cache.buf != NULL && bot_get_read10(&cbw, &accel->lba, &accel->n_blocks);
+
+	if (accel->cacheable) {
+		const UCHAR	*data;
+
+		data = bot_cache_lookup(&accel->cache, cbw.lun, accel->lba, accel->n_blocks, cbw.len_data);
+		if (data != NULL && fill_bot_stages_cached(accel, data)) {
+			stub_res_t	*sres;
+
+			KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+			/* a CBW is taken by an accelerator as if a device has received it */
+			sres = create_stub_res(USBIP_RET_SUBMIT, hdr->base.seqnum, 0, NULL, 0, 0, FALSE);
+			if (sres == NULL) {
+				reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+				return TRUE;
+			}
+			sres->header.u.ret_submit.actual_length = BOT_CBW_LEN;
+			reply_stub_req(devstub, sres);
+			return TRUE;
+		}
+	}
+
+	if (cbw.is_in && cbw.len_data > 0) {
+		if (cbw.len_data <= accel->len_max) {
+			submit_data = prepare_bot_stage(accel, accel->stages + BOT_STAGE_DATA, cbw.len_data);
+			if (submit_data)
+				submit_csw = prepare_bot_stage(accel, accel->stages + BOT_STAGE_CSW, BOT_CSW_LEN);
+		}
+	}
+	else {
+		submit_csw = prepare_bot_stage(accel, accel->stages + BOT_STAGE_CSW, BOT_CSW_LEN);
+	}
+	if (submit_data || submit_csw) {
+		accel->idx_stage = submit_data ? BOT_STAGE_DATA : BOT_STAGE_CSW;
+		accel->n_accelerated++;
+	}
+	else {
+		accel->cacheable = FALSE;
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	/* A CSW is not submitted without a data stage ahead of it. A client reads them both by itself then. */
+	if (submit_data)
+		submit_bot_stage(accel->stages + BOT_STAGE_DATA);
+	if (submit_csw)
+		submit_bot_stage(accel->stages + BOT_STAGE_CSW);
+
+	/* a CBW itself goes to a device by a caller */
+	return FALSE;
+}
+
+static BOOLEAN
+submit_bot_in_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
+{
+	bot_accel_t	*accel;
+	stub_res_t	*sres;
+	KIRQL	oldirql;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	accel = find_bot_accel(devstub, info_pipe->PipeHandle);
+	if (accel == NULL || accel->hPipe_in != info_pipe->PipeHandle || accel->idx_stage >= BOT_N_STAGES) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		return FALSE;
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	/* data length is of a request until it is filled */
+	sres = create_stub_res(USBIP_RET_SUBMIT, hdr->base.seqnum, 0, NULL, (int)hdr->u.cmd_submit.transfer_buffer_length, 0, FALSE);
+	if (sres == NULL) {
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+		return TRUE;
+	}
+	sres->hPipe = accel->hPipe_in;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	if (find_bot_accel(devstub, info_pipe->PipeHandle) != accel || accel->idx_stage >= BOT_N_STAGES) {
+		/* stopped or all stages have been taken by requests ahead */
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		free_stub_res(sres);
+		return FALSE;
+	}
+	sres->bot = accel;
+	InsertTailList(&devstub->sres_head_pending, &sres->list);
+	serve_bot_reqs(devstub, accel, oldirql);
+	return TRUE;
+}
+
+/*
+ * A CBW to a bulk-only mass storage submits stages of a command ahead, and a bulk IN request is
+ * served by them. FALSE is returned if a caller should submit an urb by itself.
+ */
+BOOLEAN
+submit_bot_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
+{
+	if (stub_params.bot_accel_len == 0)
+		return FALSE;
+	if (hdr->base.direction)
+		return submit_bot_in_req(devstub, info_pipe, hdr);
+	return submit_bot_cbw(devstub, info_pipe, hdr);
+}
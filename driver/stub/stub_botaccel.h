@@ -0,0 +1,15 @@
+#pragma once
+
+#include "stub_dev.h"
+#include "usbip_proto.h"
+
+struct bot_accel;
+
+BOOLEAN
+submit_bot_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr);
+
+/* intf_num of -1 stops the accelerators of all interfaces */
+void
+stop_bot_accels(usbip_stub_dev_t *devstub, int intf_num, BOOLEAN reply);
+void
+stop_bot_accel_pipe(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe);
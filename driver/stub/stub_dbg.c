@@ -61,6 +61,7 @@ dbg_devstub(usbip_stub_dev_t *devstub)
 static namecode_t	namecodes_stub_ioctl[] = {
 	K_V(IOCTL_USBIP_STUB_GET_DEVINFO)
 	K_V(IOCTL_USBIP_STUB_EXPORT)
+	K_V(IOCTL_USBIP_STUB_GET_CONF_DESC)
 	{0,0}
 };
 
@@ -238,6 +238,9 @@ stub_add_device(PDRIVER_OBJECT drvobj, PDEVICE_OBJECT pdo)
 	init_dev_removal_lock(devstub);
 	InitializeListHead(&devstub->sres_head_pending);
 	InitializeListHead(&devstub->sres_head_done);
+	InitializeListHead(&devstub->iso_streams);
+	InitializeListHead(&devstub->intr_polls);
+	InitializeListHead(&devstub->bot_accels);
 
 	status = IoRegisterDeviceInterface(pdo, (LPGUID)&GUID_DEVINTERFACE_STUB_USBIP, NULL, &devstub->interface_name);
 	if (NT_ERROR(status)) {
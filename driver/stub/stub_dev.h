@@ -41,6 +41,13 @@ typedef struct {
 
 	LIST_ENTRY	sres_head_done;
 	LIST_ENTRY	sres_head_pending;
+
+	/* iso streams which are protected by lock_stub_res */
+	LIST_ENTRY	iso_streams;
+	/* interrupt polls which are protected by lock_stub_res */
+	LIST_ENTRY	intr_polls;
+	/* bulk-only mass storage accelerators which are protected by lock_stub_res */
+	LIST_ENTRY	bot_accels;
 } usbip_stub_dev_t;
 
 void init_dev_removal_lock(usbip_stub_dev_t *devstub);
@@ -144,6 +144,40 @@ get_intf_info_pipe(PUSBD_INTERFACE_INFORMATION info_intf, UCHAR epaddr)
 	return NULL;
 }
 
+/* returns -1 if hPipe is not of the current configuration */
+PUSBD_INTERFACE_INFORMATION
+get_info_intf_of_pipe(devconf_t *devconf, USBD_PIPE_HANDLE hPipe)
+{
+	int	i;
+	ULONG	j;
+
+	if (devconf == NULL)
+		return NULL;
+
+	for (i = 0; i < devconf->bNumInterfaces; i++) {
+		PUSBD_INTERFACE_INFORMATION	info_intf = devconf->infos_intf[i];
+
+		if (info_intf == NULL)
+			continue;
+		for (j = 0; j < info_intf->NumberOfPipes; j++) {
+			if (info_intf->Pipes[j].PipeHandle == hPipe)
+				return info_intf;
+		}
+	}
+	return NULL;
+}
+
+int
+get_intf_num(devconf_t *devconf, USBD_PIPE_HANDLE hPipe)
+{
+	PUSBD_INTERFACE_INFORMATION	info_intf;
+
+	info_intf = get_info_intf_of_pipe(devconf, hPipe);
+	if (info_intf == NULL)
+		return -1;
+	return info_intf->InterfaceNumber;
+}
+
 USHORT
 get_info_intf_size(devconf_t *devconf, UCHAR intf_num, USHORT alt_setting)
 {
@@ -21,6 +21,8 @@ void update_devconf(devconf_t *devconf, PUSBD_INTERFACE_INFORMATION info_intf);
 
 USHORT get_info_intf_size(devconf_t *devconf, UCHAR intf_num, USHORT alt_setting);
 PUSBD_PIPE_INFORMATION get_info_pipe(devconf_t *devconf, UCHAR epaddr);
+PUSBD_INTERFACE_INFORMATION get_info_intf_of_pipe(devconf_t *devconf, USBD_PIPE_HANDLE hPipe);
+int get_intf_num(devconf_t *devconf, USBD_PIPE_HANDLE hPipe);
 
 #ifdef DBG
 const char *dbg_info_intf(PUSBD_INTERFACE_INFORMATION info_intf);
@@ -19,6 +19,9 @@
 #include "stub_driver.h"
 #include "stub_dbg.h"
 #include "stub_irp.h"
+#include "stub_isoch.h"
+#include "stub_intr.h"
+#include "stub_botaccel.h"
 
 NTSTATUS stub_dispatch_pnp(usbip_stub_dev_t *devstub, IRP *irp);
 NTSTATUS stub_dispatch_power(usbip_stub_dev_t *devstub, IRP *irp);
@@ -50,6 +53,12 @@ stub_dispatch(PDEVICE_OBJECT devobj, IRP *irp)
 		return stub_dispatch_read(devstub, irp);
 	case IRP_MJ_WRITE:
 		return stub_dispatch_write(devstub, irp);
+	case IRP_MJ_CLEANUP:
+		/* nobody will consume streamed packets or polled reports */
+		stop_iso_streams(devstub, -1, FALSE);
+		stop_intr_polls(devstub, -1, FALSE);
+		stop_bot_accels(devstub, -1, FALSE);
+		return pass_irp_down(devstub, irp, NULL, NULL);
 	default:
 		return pass_irp_down(devstub, irp, NULL, NULL);
 	}
@@ -19,6 +19,7 @@
 #include "stub_driver.h"
 #include "stub_dbg.h"
 #include "stub_dev.h"
+#include "stub_reg.h"
 
 NTSTATUS stub_add_device(PDRIVER_OBJECT drvobj, PDEVICE_OBJECT pdo);
 NTSTATUS stub_dispatch(PDEVICE_OBJECT devobj, IRP *irp);
@@ -36,10 +37,10 @@ DriverEntry(DRIVER_OBJECT *drvobj, UNICODE_STRING *regpath)
 {
 	int i;
 
-	UNREFERENCED_PARAMETER(regpath);
-
 	DBGI(DBG_DISPATCH, "DriverEntry: Enter\n");
 
+	reg_get_params(regpath);
+
 	/* initialize the driver object's dispatch table */
 	for (i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++) {
 		drvobj->MajorFunction[i] = stub_dispatch;
@@ -0,0 +1,537 @@
+#include "stub_driver.h"
+#include "stub_dbg.h"
+#include "stub_res.h"
+#include "stub_reg.h"
+#include "stub_intr.h"
+#include "usbd_helper.h"
+
+#include <usbdlib.h>
+
+/*
+ * Pre-polling mode of an interrupt IN endpoint
+ *
+ * A client sends a next CMD_SUBMIT only after a report arrives, which makes an interrupt endpoint
+ * wait for a network round trip between reports. Instead, a poll keeps urbs continuously submitted
+ * to the endpoint and buffers reports of completed ones. A CMD_SUBMIT is served from the buffer at
+ * once, or by the next report if the buffer is empty. If nobody consumes reports, the oldest ones
+ * are dropped, so that a client never gets reports older than the buffer holds.
+ *
+ * A poll is created on the first interrupt IN CMD_SUBMIT of an endpoint when IntrPollUrbs is non-zero.
+ * Its urbs are of the length of that CMD_SUBMIT, which a class driver keeps the same. A CMD_SUBMIT of
+ * another length restarts the poll. A failed urb, e.g. of a stall or a cancellation by the stack, is
+ * buffered as a report with its status and the poll stops resubmitting. It is started again by
+ * a CMD_SUBMIT after the failure is consumed. A poll is stopped when a pipe is reset,
+ * the configuration or the interface is changed, a handle is closed, or the device is removed.
+ * Buffered reports and requests waiting for them are protected by lock_stub_res.
+ */
+
+#define MAX_INTR_POLL_URBS	16
+#define MAX_INTR_POLL_REPORTS	256
+/* 3 transactions of 1024 bytes in a microframe of a high-bandwidth endpoint */
+#define MAX_INTR_POLL_LEN	3072
+
+typedef struct {
+	ULONG	len;
+	USBD_STATUS	status;
+} intr_report_t;
+
+typedef struct {
+	struct intr_poll	*poll;
+	PIRP	irp;
+	PUCHAR	buf;
+	struct _URB_BULK_OR_INTERRUPT_TRANSFER	urb;
+} intr_poll_urb_t;
+
+typedef struct intr_poll {
+	usbip_stub_dev_t	*devstub;
+	USBD_PIPE_HANDLE	hPipe;
+	UCHAR	epaddr;
+	int	intf_num;
+	ULONG	len_urb;
+
+	/* buffered reports */
+	PUCHAR		reports_data;
+	intr_report_t	*reports;
+	ULONG		n_reports_max;
+	ULONG		idx_head;
+	ULONG		n_reports;
+	ULONG		n_reports_dropped;
+
+	BOOLEAN	stopping;
+	/* some urb has failed and poll is not continued */
+	BOOLEAN	broken;
+	LONG	n_urbs_active;
+	KEVENT	event_stopped;
+
+	LIST_ENTRY	list;
+
+	ULONG	n_urbs;
+	intr_poll_urb_t	urbs[1];
+} intr_poll_t;
+
+static ULONG
+get_intr_poll_n_urbs(void)
+{
+	return stub_params.intr_poll_urbs > MAX_INTR_POLL_URBS ? MAX_INTR_POLL_URBS : stub_params.intr_poll_urbs;
+}
+
+static ULONG
+get_intr_poll_n_reports(void)
+{
+	if (stub_params.intr_poll_reports == 0)
+		return 1;
+	return stub_params.intr_poll_reports > MAX_INTR_POLL_REPORTS ? MAX_INTR_POLL_REPORTS : stub_params.intr_poll_reports;
+}
+
+static void
+free_intr_poll(intr_poll_t *poll)
+{
+	ULONG	i;
+
+	for (i = 0; i < poll->n_urbs; i++) {
+		intr_poll_urb_t	*purb = poll->urbs + i;
+
+		if (purb->irp != NULL)
+			IoFreeIrp(purb->irp);
+		if (purb->buf != NULL)
+			ExFreePoolWithTag(purb->buf, USBIP_STUB_POOL_TAG);
+	}
+	if (poll->reports != NULL)
+		ExFreePoolWithTag(poll->reports, USBIP_STUB_POOL_TAG);
+	if (poll->reports_data != NULL)
+		ExFreePoolWithTag(poll->reports_data, USBIP_STUB_POOL_TAG);
+	ExFreePoolWithTag(poll, USBIP_STUB_POOL_TAG);
+}
+
+static intr_poll_t *
+create_intr_poll(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, ULONG len_urb)
+{
+	intr_poll_t	*poll;
+	ULONG	n_urbs, i;
+
+	n_urbs = get_intr_poll_n_urbs();
+
+	poll = ExAllocatePoolWithTag(NonPagedPool, sizeof(intr_poll_t) + sizeof(intr_poll_urb_t) * (n_urbs - 1), USBIP_STUB_POOL_TAG);
+	if (poll == NULL) {
+		DBGE(DBG_GENERAL, "create_intr_poll: out of memory\n");
+		return NULL;
+	}
+	RtlZeroMemory(poll, sizeof(intr_poll_t) + sizeof(intr_poll_urb_t) * (n_urbs - 1));
+
+	poll->devstub = devstub;
+	poll->hPipe = info_pipe->PipeHandle;
+	poll->epaddr = info_pipe->EndpointAddress;
+	poll->intf_num = get_intf_num(devstub->devconf, info_pipe->PipeHandle);
+	poll->len_urb = len_urb;
+	poll->n_urbs = n_urbs;
+	poll->n_reports_max = get_intr_poll_n_reports();
+	KeInitializeEvent(&poll->event_stopped, NotificationEvent, FALSE);
+	InitializeListHead(&poll->list);
+
+	poll->reports = ExAllocatePoolWithTag(NonPagedPool, sizeof(intr_report_t) * poll->n_reports_max, USBIP_STUB_POOL_TAG);
+	poll->reports_data = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)len_urb * poll->n_reports_max, USBIP_STUB_POOL_TAG);
+	if (poll->reports == NULL || poll->reports_data == NULL) {
+		DBGE(DBG_GENERAL, "create_intr_poll: out of memory: report buffer\n");
+		free_intr_poll(poll);
+		return NULL;
+	}
+
+	for (i = 0; i < n_urbs; i++) {
+		intr_poll_urb_t	*purb = poll->urbs + i;
+
+		purb->poll = poll;
+		purb->irp = IoAllocateIrp(devstub->self->StackSize + 1, FALSE);
+		purb->buf = ExAllocatePoolWithTag(NonPagedPool, len_urb, USBIP_STUB_POOL_TAG);
+		if (purb->irp == NULL || purb->buf == NULL) {
+			DBGE(DBG_GENERAL, "create_intr_poll: out of memory: urb\n");
+			free_intr_poll(poll);
+			return NULL;
+		}
+	}
+
+	return poll;
+}
+
+static intr_poll_t *
+find_intr_poll(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe)
+{
+	PLIST_ENTRY	le;
+
+	for (le = devstub->intr_polls.Flink; le != &devstub->intr_polls; le = le->Flink) {
+		intr_poll_t	*poll = CONTAINING_RECORD(le, intr_poll_t, list);
+		if (poll->hPipe == hPipe)
+			return poll;
+	}
+	return NULL;
+}
+
+/* must be called with lock_stub_res held */
+static void
+fill_intr_poll_res(intr_poll_t *poll, stub_res_t *sres)
+{
+	intr_report_t	*report = poll->reports + poll->idx_head;
+	ULONG	len;
+
+	if (report->status != USBD_STATUS_SUCCESS) {
+		sres->header.u.ret_submit.status = to_usbip_status(report->status);
+		len = 0;
+	}
+	else {
+		/* a request is of the length of the urbs of a poll. see submit_intr_poll_req() */
+		len = report->len;
+		RtlCopyMemory(sres->data, poll->reports_data + poll->idx_head * poll->len_urb, len);
+	}
+	sres->data_len = len;
+	sres->header.u.ret_submit.actual_length = len;
+
+	poll->idx_head = (poll->idx_head + 1) % poll->n_reports_max;
+	poll->n_reports--;
+}
+
+/* must be called with lock_stub_res held, which will be released on return */
+static void
+serve_intr_poll_reqs(usbip_stub_dev_t *devstub, intr_poll_t *poll, KIRQL oldirql)
+{
+	LIST_ENTRY	head_served;
+	PLIST_ENTRY	le;
+
+	InitializeListHead(&head_served);
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending && poll->n_reports > 0;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (sres->poll != poll)
+			continue;
+		/* requests are served in order */
+		RemoveEntryList(&sres->list);
+		fill_intr_poll_res(poll, sres);
+		sres->poll = NULL;
+		InsertTailList(&head_served, &sres->list);
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_served)) {
+		le = RemoveHeadList(&head_served);
+		reply_stub_req(devstub, CONTAINING_RECORD(le, stub_res_t, list));
+	}
+}
+
+/* must be called with lock_stub_res held, which will be released on return */
+static void
+flush_intr_poll_reqs(usbip_stub_dev_t *devstub, intr_poll_t *poll, BOOLEAN reply, KIRQL oldirql)
+{
+	LIST_ENTRY	head_flushed;
+	PLIST_ENTRY	le;
+
+	InitializeListHead(&head_flushed);
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (sres->poll != poll)
+			continue;
+		RemoveEntryList(&sres->list);
+		sres->poll = NULL;
+		InsertTailList(&head_flushed, &sres->list);
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_flushed)) {
+		stub_res_t	*sres;
+
+		le = RemoveHeadList(&head_flushed);
+		sres = CONTAINING_RECORD(le, stub_res_t, list);
+		if (reply) {
+			sres->header.u.ret_submit.status = -1;
+			sres->header.u.ret_submit.actual_length = 0;
+			sres->data_len = 0;
+			reply_stub_req(devstub, sres);
+		}
+		else {
+			free_stub_res(sres);
+		}
+	}
+}
+
+/* must be called with lock_stub_res held */
+static void
+save_intr_poll_report(intr_poll_t *poll, intr_poll_urb_t *purb, USBD_STATUS status)
+{
+	ULONG	idx, len;
+
+	if (poll->n_reports == poll->n_reports_max) {
+		/* nobody has consumed reports. drop the oldest one. */
+		poll->idx_head = (poll->idx_head + 1) % poll->n_reports_max;
+		poll->n_reports--;
+		poll->n_reports_dropped++;
+	}
+	idx = (poll->idx_head + poll->n_reports) % poll->n_reports_max;
+	len = purb->urb.TransferBufferLength <= poll->len_urb ? purb->urb.TransferBufferLength : poll->len_urb;
+	poll->reports[idx].len = len;
+	poll->reports[idx].status = status;
+	RtlCopyMemory(poll->reports_data + idx * poll->len_urb, purb->buf, len);
+	poll->n_reports++;
+}
+
+static NTSTATUS done_intr_poll_urb(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx);
+
+/*
+ * must be called with lock_stub_res held.
+ * irp is reused here so that stopping can cancel it before it is submitted by submit_intr_poll_urb().
+ */
+static void
+prepare_intr_poll_urb(intr_poll_urb_t *purb)
+{
+	intr_poll_t	*poll = purb->poll;
+	IO_STACK_LOCATION	*irpstack;
+
+	UsbBuildInterruptOrBulkTransferRequest((PURB)&purb->urb, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER), poll->hPipe,
+		purb->buf, NULL, poll->len_urb, USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK, NULL);
+
+	IoReuseIrp(purb->irp, STATUS_SUCCESS);
+
+	irpstack = IoGetNextIrpStackLocation(purb->irp);
+	irpstack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irpstack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irpstack->Parameters.Others.Argument1 = &purb->urb;
+	irpstack->Parameters.Others.Argument2 = NULL;
+	irpstack->DeviceObject = poll->devstub->self;
+
+	IoSetCompletionRoutine(purb->irp, done_intr_poll_urb, purb, TRUE, TRUE, TRUE);
+}
+
+static void
+submit_intr_poll_urb(intr_poll_urb_t *purb)
+{
+	IoCallDriver(purb->poll->devstub->next_stack_dev, purb->irp);
+}
+
+static NTSTATUS
+done_intr_poll_urb(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
+{
+	intr_poll_urb_t	*purb = (intr_poll_urb_t *)ctx;
+	intr_poll_t	*poll = purb->poll;
+	usbip_stub_dev_t	*devstub = poll->devstub;
+	KIRQL	oldirql;
+
+	UNREFERENCED_PARAMETER(devobj);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+
+	if (poll->stopping) {
+		if (InterlockedDecrement(&poll->n_urbs_active) == 0)
+			KeSetEvent(&poll->event_stopped, IO_NO_INCREMENT, FALSE);
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+
+	if (!NT_SUCCESS(irp->IoStatus.Status)) {
+		DBGW(DBG_GENERAL, "done_intr_poll_urb: ep:%02x: poll broken: %s, usbd_status:%s\n", poll->epaddr,
+			dbg_ntstatus(irp->IoStatus.Status), dbg_usbd_status(purb->urb.Hdr.Status));
+		/*
+		 * a client should see the failure to recover an endpoint. An urb cancelled by the stack,
+		 * e.g. on a surprise removal, may not have got a failed usbd status.
+		 */
+		if (!poll->broken) {
+			USBD_STATUS	status = purb->urb.Hdr.Status;
+
+			poll->broken = TRUE;
+			if (USBD_SUCCESS(status))
+				status = USBD_STATUS_CANCELED;
+			save_intr_poll_report(poll, purb, status);
+		}
+		if (InterlockedDecrement(&poll->n_urbs_active) == 0)
+			KeSetEvent(&poll->event_stopped, IO_NO_INCREMENT, FALSE);
+		serve_intr_poll_reqs(devstub, poll, oldirql);
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+
+	save_intr_poll_report(poll, purb, USBD_STATUS_SUCCESS);
+	if (poll->broken) {
+		/* no urb is resubmitted after a failure */
+		if (InterlockedDecrement(&poll->n_urbs_active) == 0)
+			KeSetEvent(&poll->event_stopped, IO_NO_INCREMENT, FALSE);
+		serve_intr_poll_reqs(devstub, poll, oldirql);
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+	/* stopping has been checked above without releasing the lock */
+	prepare_intr_poll_urb(purb);
+	serve_intr_poll_reqs(devstub, poll, oldirql);
+
+	submit_intr_poll_urb(purb);
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static void
+stop_intr_poll_list(usbip_stub_dev_t *devstub, PLIST_ENTRY head_stop, BOOLEAN reply)
+{
+	while (!IsListEmpty(head_stop)) {
+		intr_poll_t	*poll;
+		KIRQL	oldirql;
+		ULONG	i;
+
+		poll = CONTAINING_RECORD(RemoveHeadList(head_stop), intr_poll_t, list);
+
+		DBGI(DBG_GENERAL, "stop_intr_poll: ep:%02x, dropped reports:%u\n", poll->epaddr, poll->n_reports_dropped);
+
+		/* urb irps are owned by poll and not freed until here */
+		for (i = 0; i < poll->n_urbs; i++)
+			IoCancelIrp(poll->urbs[i].irp);
+		KeWaitForSingleObject(&poll->event_stopped, Executive, KernelMode, FALSE, NULL);
+
+		KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+		flush_intr_poll_reqs(devstub, poll, reply, oldirql);
+
+		free_intr_poll(poll);
+	}
+}
+
+static void
+stop_intr_polls_of(usbip_stub_dev_t *devstub, int intf_num, USBD_PIPE_HANDLE hPipe, BOOLEAN reply)
+{
+	LIST_ENTRY	head_stop;
+	PLIST_ENTRY	le;
+	KIRQL	oldirql;
+
+	InitializeListHead(&head_stop);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	for (le = devstub->intr_polls.Flink; le != &devstub->intr_polls;) {
+		intr_poll_t	*poll = CONTAINING_RECORD(le, intr_poll_t, list);
+
+		le = le->Flink;
+		if (hPipe != NULL ? poll->hPipe == hPipe: (intf_num < 0 || poll->intf_num == intf_num)) {
+			poll->stopping = TRUE;
+			RemoveEntryList(&poll->list);
+			InsertTailList(&head_stop, &poll->list);
+		}
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	stop_intr_poll_list(devstub, &head_stop, reply);
+}
+
+void
+stop_intr_polls(usbip_stub_dev_t *devstub, int intf_num, BOOLEAN reply)
+{
+	stop_intr_polls_of(devstub, intf_num, NULL, reply);
+}
+
+/* Resetting a pipe requires no urb in flight */
+void
+stop_intr_poll_pipe(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe)
+{
+	stop_intr_polls_of(devstub, -1, hPipe, TRUE);
+}
+
+static intr_poll_t *
+start_intr_poll(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, ULONG len_urb)
+{
+	intr_poll_t	*poll;
+	KIRQL	oldirql;
+	ULONG	n_urbs, i;
+
+	poll = create_intr_poll(devstub, info_pipe, len_urb);
+	if (poll == NULL)
+		return NULL;
+
+	DBGI(DBG_GENERAL, "start_intr_poll: ep:%02x, urbs:%u, reports:%u, urb len:%u\n",
+		poll->epaddr, poll->n_urbs, poll->n_reports_max, poll->len_urb);
+
+	n_urbs = poll->n_urbs;
+	poll->n_urbs_active = (LONG)n_urbs;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	InsertTailList(&devstub->intr_polls, &poll->list);
+	for (i = 0; i < n_urbs; i++)
+		prepare_intr_poll_urb(poll->urbs + i);
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	/* a poll stopped meanwhile is not freed until all of its urbs complete */
+	for (i = 0; i < n_urbs; i++)
+		submit_intr_poll_urb(poll->urbs + i);
+	return poll;
+}
+
+/*
+ * A request is served from a poll of the endpoint, which is started if not exists.
+ * FALSE is returned if polling is not applicable. Then a caller should submit an urb by itself.
+ */
+BOOLEAN
+submit_intr_poll_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
+{
+	intr_poll_t	*poll;
+	stub_res_t	*sres;
+	PVOID	data;
+	ULONG	datalen;
+	KIRQL	oldirql;
+
+	if (stub_params.intr_poll_urbs == 0 || !hdr->base.direction)
+		return FALSE;
+
+	datalen = (ULONG)hdr->u.cmd_submit.transfer_buffer_length;
+	if (datalen == 0 || datalen > MAX_INTR_POLL_LEN)
+		return FALSE;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	poll = find_intr_poll(devstub, info_pipe->PipeHandle);
+	if (poll != NULL && ((poll->broken && poll->n_reports == 0) || poll->len_urb != datalen)) {
+		LIST_ENTRY	head_stop;
+
+		/*
+		 * restart a broken poll whose failure has been consumed, or a poll of another length.
+		 * A report of another length would be truncated or cut short, unlike a real transfer.
+		 */
+		InitializeListHead(&head_stop);
+		poll->stopping = TRUE;
+		RemoveEntryList(&poll->list);
+		InsertTailList(&head_stop, &poll->list);
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+		stop_intr_poll_list(devstub, &head_stop, TRUE);
+		poll = NULL;
+	}
+	else {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+	}
+
+	if (poll == NULL) {
+		poll = start_intr_poll(devstub, info_pipe, datalen);
+		if (poll == NULL)
+			return FALSE;
+	}
+
+	data = ExAllocatePoolWithTag(NonPagedPool, datalen, USBIP_STUB_POOL_TAG);
+	if (data == NULL) {
+		DBGE(DBG_GENERAL, "submit_intr_poll_req: out of memory\n");
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+		return TRUE;
+	}
+
+	sres = create_stub_res(USBIP_RET_SUBMIT, hdr->base.seqnum, 0, data, datalen, 0, FALSE);
+	if (sres == NULL) {
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+		return TRUE;
+	}
+
+	sres->hPipe = info_pipe->PipeHandle;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	if (find_intr_poll(devstub, info_pipe->PipeHandle) != poll) {
+		/* a poll has been stopped by another thread, e.g. of a cleanup or a removal */
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		sres->header.u.ret_submit.status = -1;
+		sres->header.u.ret_submit.actual_length = 0;
+		sres->data_len = 0;
+		reply_stub_req(devstub, sres);
+		return TRUE;
+	}
+	sres->poll = poll;
+	InsertTailList(&devstub->sres_head_pending, &sres->list);
+	serve_intr_poll_reqs(devstub, poll, oldirql);
+
+	return TRUE;
+}
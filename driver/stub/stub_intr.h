@@ -0,0 +1,15 @@
+#pragma once
+
+#include "stub_dev.h"
+#include "usbip_proto.h"
+
+struct intr_poll;
+
+BOOLEAN
+submit_intr_poll_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr);
+
+/* intf_num of -1 stops the polls of all interfaces */
+void
+stop_intr_polls(usbip_stub_dev_t *devstub, int intf_num, BOOLEAN reply);
+void
+stop_intr_poll_pipe(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe);
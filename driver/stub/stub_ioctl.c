@@ -26,27 +26,6 @@
 #include "stub_usbd.h"
 #include "stub_devconf.h"
 
-static UCHAR
-get_speed_from_bcdUSB(USHORT bcdUSB)
-{
-	switch (bcdUSB) {
-	case 0x0100:
-		return USB_SPEED_LOW;
-	case 0x0110:
-		return USB_SPEED_FULL;
-	case 0x0200:
-		return USB_SPEED_HIGH;
-	case 0x0250:
-		return USB_SPEED_WIRELESS;
-	case 0x0300:
-		return USB_SPEED_SUPER;
-	case 0x0310:
-		return USB_SPEED_SUPER_PLUS;
-	default:
-		return USB_SPEED_UNKNOWN;
-	}
-}
-
 static NTSTATUS
 process_get_devinfo(usbip_stub_dev_t *devstub, IRP *irp)
 {
@@ -85,6 +64,45 @@ process_get_devinfo(usbip_stub_dev_t *devstub, IRP *irp)
 	return status;
 }
 
+static NTSTATUS
+process_get_conf_desc(usbip_stub_dev_t *devstub, IRP *irp)
+{
+	PIO_STACK_LOCATION	irpStack;
+	PUSB_CONFIGURATION_DESCRIPTOR	dsc_conf;
+	ULONG	outlen;
+	NTSTATUS	status = STATUS_SUCCESS;
+
+	irpStack = IoGetCurrentIrpStackLocation(irp);
+
+	outlen = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	irp->IoStatus.Information = 0;
+	dsc_conf = (PUSB_CONFIGURATION_DESCRIPTOR)irp->AssociatedIrp.SystemBuffer;
+	if (outlen < sizeof(USB_CONFIGURATION_DESCRIPTOR))
+		status = STATUS_INVALID_PARAMETER;
+	else if (devstub->devconf != NULL) {
+		ULONG	len = devstub->devconf->dsc_conf->wTotalLength;
+
+		/* A caller can find out the whole length from wTotalLength of a partial descriptor */
+		if (len > outlen)
+			len = outlen;
+		RtlCopyMemory(dsc_conf, devstub->devconf->dsc_conf, len);
+		irp->IoStatus.Information = len;
+	}
+	else {
+		/* not yet configured. The first configuration will be selected by default. */
+		ULONG	len = outlen > 0xffff ? 0xffff : outlen;
+
+		if (get_usb_desc(devstub, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, dsc_conf, &len))
+			irp->IoStatus.Information = len;
+		else
+			status = STATUS_UNSUCCESSFUL;
+	}
+
+	irp->IoStatus.Status = status;
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+	return status;
+}
+
 static NTSTATUS
 process_export(usbip_stub_dev_t *devstub, IRP *irp)
 {
@@ -116,6 +134,8 @@ stub_dispatch_ioctl(usbip_stub_dev_t *devstub, IRP *irp)
 		return process_get_devinfo(devstub, irp);
 	case IOCTL_USBIP_STUB_EXPORT:
 		return process_export(devstub, irp);
+	case IOCTL_USBIP_STUB_GET_CONF_DESC:
+		return process_get_conf_desc(devstub, irp);
 	default:
 		return pass_irp_down(devstub, irp, NULL, NULL);
 	}
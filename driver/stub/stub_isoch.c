@@ -0,0 +1,614 @@
+#include "stub_driver.h"
+#include "stub_dbg.h"
+#include "stub_res.h"
+#include "stub_reg.h"
+#include "stub_isoch.h"
+#include "stub_usbd.h"
+#include "usbd_helper.h"
+
+#include <usbdlib.h>
+
+/*
+ * Streaming mode of an isochronous IN endpoint
+ *
+ * Instead of submitting an iso urb per CMD_SUBMIT, a stream keeps a ring of pre-allocated iso urbs
+ * continuously submitted to the controller. Packets of completed urbs are buffered and a CMD_SUBMIT
+ * is served from the buffer as soon as it holds enough packets. Thus a late CMD_SUBMIT from a client
+ * does not leave a gap in frames. If nobody consumes packets, the oldest ones are overwritten.
+ *
+ * A stream is created on the first iso IN CMD_SUBMIT of an endpoint when IsoStreamUrbs is non-zero.
+ * It is stopped when the configuration or the interface is changed, a handle is closed, or the device
+ * is removed. Buffered packets and requests waiting for them are protected by lock_stub_res.
+ */
+
+#define MAX_ISO_STREAM_URBS	64
+#define MIN_ISO_STREAM_PACKETS	8
+#define MAX_ISO_STREAM_PACKETS	248
+
+typedef struct {
+	ULONG	len;
+	USBD_STATUS	status;
+	ULONG	frame;
+} iso_pkt_t;
+
+typedef struct {
+	struct iso_stream	*stream;
+	PIRP	irp;
+	PURB	purb;
+	PUCHAR	buf;
+} iso_stream_urb_t;
+
+typedef struct iso_stream {
+	usbip_stub_dev_t	*devstub;
+	USBD_PIPE_HANDLE	hPipe;
+	UCHAR	epaddr;
+	int	intf_num;
+	ULONG	len_pkt;
+	ULONG	n_pkts_urb;
+	/* period of a packet in microframes, which gives a frame of each packet */
+	ULONG	n_uframes_pkt;
+
+	/* buffered packets */
+	PUCHAR		pkts_data;
+	iso_pkt_t	*pkts;
+	ULONG		n_pkts_max;
+	ULONG		idx_head;
+	ULONG		n_pkts;
+	ULONG		n_pkts_dropped;
+
+	BOOLEAN	stopping;
+	/* some urb has failed and stream cannot be continued */
+	BOOLEAN	broken;
+	LONG	n_urbs_active;
+	KEVENT	event_stopped;
+
+	LIST_ENTRY	list;
+
+	ULONG	n_urbs;
+	iso_stream_urb_t	urbs[1];
+} iso_stream_t;
+
+static ULONG
+get_iso_pkt_len(PUSBD_PIPE_INFORMATION info_pipe)
+{
+	USHORT	mps = info_pipe->MaximumPacketSize;
+
+	/* high-bandwidth endpoint has additional transactions per microframe in bits 12..11 */
+	return (mps & 0x7ff) * (((mps >> 11) & 0x3) + 1);
+}
+
+/* must be called at PASSIVE_LEVEL because a device descriptor is read for speed */
+static ULONG
+get_iso_n_uframes_pkt(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe)
+{
+	USB_DEVICE_DESCRIPTOR	desc;
+	UCHAR	interval = info_pipe->Interval;
+	ULONG	n_uframes;
+
+	/* bInterval of an iso endpoint is an exponent of its period */
+	if (interval < 1)
+		interval = 1;
+	if (interval > 16)
+		interval = 16;
+	n_uframes = 1UL << (interval - 1);
+
+	/* full speed period is in frames */
+	if (!get_usb_device_desc(devstub, &desc) || get_speed_from_bcdUSB(desc.bcdUSB) < USB_SPEED_HIGH)
+		n_uframes *= 8;
+	return n_uframes;
+}
+
+static ULONG
+get_iso_stream_n_urbs(void)
+{
+	return stub_params.iso_stream_urbs > MAX_ISO_STREAM_URBS ? MAX_ISO_STREAM_URBS : stub_params.iso_stream_urbs;
+}
+
+static ULONG
+get_iso_stream_n_pkts_urb(void)
+{
+	ULONG	n_pkts_urb = stub_params.iso_stream_packets;
+
+	/* high speed requires the number of packets to be a multiple of 8 */
+	n_pkts_urb -= n_pkts_urb % MIN_ISO_STREAM_PACKETS;
+	if (n_pkts_urb < MIN_ISO_STREAM_PACKETS)
+		n_pkts_urb = MIN_ISO_STREAM_PACKETS;
+	if (n_pkts_urb > MAX_ISO_STREAM_PACKETS)
+		n_pkts_urb = MAX_ISO_STREAM_PACKETS;
+	return n_pkts_urb;
+}
+
+static void
+free_iso_stream(iso_stream_t *stream)
+{
+	ULONG	i;
+
+	for (i = 0; i < stream->n_urbs; i++) {
+		iso_stream_urb_t	*surb = stream->urbs + i;
+
+		if (surb->irp != NULL)
+			IoFreeIrp(surb->irp);
+		if (surb->purb != NULL)
+			USBD_UrbFree(stream->devstub->hUSBD, surb->purb);
+		if (surb->buf != NULL)
+			ExFreePoolWithTag(surb->buf, USBIP_STUB_POOL_TAG);
+	}
+	if (stream->pkts != NULL)
+		ExFreePoolWithTag(stream->pkts, USBIP_STUB_POOL_TAG);
+	if (stream->pkts_data != NULL)
+		ExFreePoolWithTag(stream->pkts_data, USBIP_STUB_POOL_TAG);
+	ExFreePoolWithTag(stream, USBIP_STUB_POOL_TAG);
+}
+
+static iso_stream_t *
+create_iso_stream(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe)
+{
+	iso_stream_t	*stream;
+	ULONG	n_urbs, n_pkts_urb, len_pkt, i;
+
+	len_pkt = get_iso_pkt_len(info_pipe);
+	if (len_pkt == 0)
+		return NULL;
+
+	n_urbs = get_iso_stream_n_urbs();
+	n_pkts_urb = get_iso_stream_n_pkts_urb();
+
+	stream = ExAllocatePoolWithTag(NonPagedPool, sizeof(iso_stream_t) + sizeof(iso_stream_urb_t) * (n_urbs - 1), USBIP_STUB_POOL_TAG);
+	if (stream == NULL) {
+		DBGE(DBG_GENERAL, "create_iso_stream: out of memory\n");
+		return NULL;
+	}
+	RtlZeroMemory(stream, sizeof(iso_stream_t) + sizeof(iso_stream_urb_t) * (n_urbs - 1));
+
+	stream->devstub = devstub;
+	stream->hPipe = info_pipe->PipeHandle;
+	stream->epaddr = info_pipe->EndpointAddress;
+	stream->intf_num = get_intf_num(devstub->devconf, info_pipe->PipeHandle);
+	stream->len_pkt = len_pkt;
+	stream->n_pkts_urb = n_pkts_urb;
+	stream->n_uframes_pkt = get_iso_n_uframes_pkt(devstub, info_pipe);
+	stream->n_urbs = n_urbs;
+	/* twice of packets in flight can be buffered. see submit_iso_stream_req() */
+	stream->n_pkts_max = n_urbs * n_pkts_urb * 2;
+	KeInitializeEvent(&stream->event_stopped, NotificationEvent, FALSE);
+	InitializeListHead(&stream->list);
+
+	stream->pkts = ExAllocatePoolWithTag(NonPagedPool, sizeof(iso_pkt_t) * stream->n_pkts_max, USBIP_STUB_POOL_TAG);
+	stream->pkts_data = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)len_pkt * stream->n_pkts_max, USBIP_STUB_POOL_TAG);
+	if (stream->pkts == NULL || stream->pkts_data == NULL) {
+		DBGE(DBG_GENERAL, "create_iso_stream: out of memory: packet buffer\n");
+		free_iso_stream(stream);
+		return NULL;
+	}
+
+	for (i = 0; i < n_urbs; i++) {
+		iso_stream_urb_t	*surb = stream->urbs + i;
+
+		surb->stream = stream;
+		surb->irp = IoAllocateIrp(devstub->self->StackSize + 1, FALSE);
+		surb->buf = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)len_pkt * n_pkts_urb, USBIP_STUB_POOL_TAG);
+		if (surb->irp == NULL || surb->buf == NULL ||
+			NT_ERROR(USBD_IsochUrbAllocate(devstub->hUSBD, n_pkts_urb, &surb->purb))) {
+			DBGE(DBG_GENERAL, "create_iso_stream: out of memory: urb\n");
+			free_iso_stream(stream);
+			return NULL;
+		}
+	}
+
+	return stream;
+}
+
+static iso_stream_t *
+find_iso_stream(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe)
+{
+	PLIST_ENTRY	le;
+
+	for (le = devstub->iso_streams.Flink; le != &devstub->iso_streams; le = le->Flink) {
+		iso_stream_t	*stream = CONTAINING_RECORD(le, iso_stream_t, list);
+		if (stream->hPipe == hPipe)
+			return stream;
+	}
+	return NULL;
+}
+
+/* must be called with lock_stub_res held */
+static void
+fill_iso_stream_res(iso_stream_t *stream, stub_res_t *sres)
+{
+	struct usbip_iso_packet_descriptor	*iso_descs;
+	ULONG	n_pkts, offset = 0, n_errs = 0, i;
+	int	iso_descs_len;
+
+	n_pkts = sres->header.u.ret_submit.number_of_packets;
+	iso_descs_len = sizeof(struct usbip_iso_packet_descriptor) * n_pkts;
+	/* iso descriptors of CMD_SUBMIT are placed after requested data length */
+	iso_descs = (struct usbip_iso_packet_descriptor *)((char *)sres->data + sres->data_len);
+
+	sres->header.u.ret_submit.start_frame = stream->pkts[stream->idx_head].frame;
+	for (i = 0; i < n_pkts; i++) {
+		iso_pkt_t	*pkt = stream->pkts + stream->idx_head;
+		ULONG	len;
+
+		len = pkt->len;
+		if (len > (ULONG)iso_descs[i].length)
+			len = iso_descs[i].length;
+		/* usbip expects iso data to be packed */
+		RtlCopyMemory((char *)sres->data + offset, stream->pkts_data + stream->idx_head * stream->len_pkt, len);
+		iso_descs[i].actual_length = len;
+		iso_descs[i].status = to_usbip_status(pkt->status);
+		if (iso_descs[i].status != 0)
+			n_errs++;
+		offset += len;
+
+		stream->idx_head = (stream->idx_head + 1) % stream->n_pkts_max;
+		stream->n_pkts--;
+	}
+
+	RtlMoveMemory((char *)sres->data + offset, iso_descs, iso_descs_len);
+	sres->data_len = offset + iso_descs_len;
+	sres->header.u.ret_submit.actual_length = offset;
+	sres->header.u.ret_submit.error_count = n_errs;
+}
+
+/* must be called with lock_stub_res held, which will be released on return */
+static void
+serve_iso_stream_reqs(usbip_stub_dev_t *devstub, iso_stream_t *stream, KIRQL oldirql)
+{
+	LIST_ENTRY	head_served;
+	PLIST_ENTRY	le;
+
+	InitializeListHead(&head_served);
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (sres->stream != stream)
+			continue;
+		/* requests are served in order */
+		if (stream->n_pkts < (ULONG)sres->header.u.ret_submit.number_of_packets)
+			break;
+		RemoveEntryList(&sres->list);
+		fill_iso_stream_res(stream, sres);
+		sres->stream = NULL;
+		InsertTailList(&head_served, &sres->list);
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_served)) {
+		le = RemoveHeadList(&head_served);
+		reply_stub_req(devstub, CONTAINING_RECORD(le, stub_res_t, list));
+	}
+}
+
+/* must be called with lock_stub_res held, which will be released on return */
+static void
+flush_iso_stream_reqs(usbip_stub_dev_t *devstub, iso_stream_t *stream, BOOLEAN reply, KIRQL oldirql)
+{
+	LIST_ENTRY	head_flushed;
+	PLIST_ENTRY	le;
+
+	InitializeListHead(&head_flushed);
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (sres->stream != stream)
+			continue;
+		RemoveEntryList(&sres->list);
+		sres->stream = NULL;
+		InsertTailList(&head_flushed, &sres->list);
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_flushed)) {
+		stub_res_t	*sres;
+
+		le = RemoveHeadList(&head_flushed);
+		sres = CONTAINING_RECORD(le, stub_res_t, list);
+		if (reply) {
+			sres->header.u.ret_submit.status = -1;
+			sres->header.u.ret_submit.actual_length = 0;
+			sres->header.u.ret_submit.number_of_packets = 0;
+			sres->data_len = 0;
+			reply_stub_req(devstub, sres);
+		}
+		else {
+			free_stub_res(sres);
+		}
+	}
+}
+
+/* must be called with lock_stub_res held */
+static void
+save_iso_stream_pkts(iso_stream_t *stream, struct _URB_ISOCH_TRANSFER *purb_iso, PUCHAR buf)
+{
+	ULONG	i;
+
+	for (i = 0; i < purb_iso->NumberOfPackets; i++) {
+		USBD_ISO_PACKET_DESCRIPTOR	*usbd_iso_desc = purb_iso->IsoPacket + i;
+		ULONG	idx;
+
+		if (stream->n_pkts == stream->n_pkts_max) {
+			/* nobody has consumed packets. overwrite the oldest one. */
+			stream->idx_head = (stream->idx_head + 1) % stream->n_pkts_max;
+			stream->n_pkts--;
+			stream->n_pkts_dropped++;
+		}
+		idx = (stream->idx_head + stream->n_pkts) % stream->n_pkts_max;
+		stream->pkts[idx].len = usbd_iso_desc->Length <= stream->len_pkt ? usbd_iso_desc->Length : stream->len_pkt;
+		stream->pkts[idx].status = usbd_iso_desc->Status;
+		/* StartFrame is a frame of the first packet */
+		stream->pkts[idx].frame = purb_iso->StartFrame + i * stream->n_uframes_pkt / 8;
+		RtlCopyMemory(stream->pkts_data + idx * stream->len_pkt, buf + usbd_iso_desc->Offset, stream->pkts[idx].len);
+		stream->n_pkts++;
+	}
+}
+
+static NTSTATUS done_iso_stream_urb(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx);
+
+/*
+ * must be called with lock_stub_res held.
+ * irp is reused here so that stopping can cancel it before it is submitted by submit_iso_stream_urb().
+ */
+static void
+prepare_iso_stream_urb(iso_stream_urb_t *surb)
+{
+	iso_stream_t	*stream = surb->stream;
+	struct _URB_ISOCH_TRANSFER	*purb_iso = &surb->purb->UrbIsochronousTransfer;
+	IO_STACK_LOCATION	*irpstack;
+	ULONG	i;
+
+	purb_iso->Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
+	purb_iso->Hdr.Length = (USHORT)GET_ISO_URB_SIZE(stream->n_pkts_urb);
+	purb_iso->PipeHandle = stream->hPipe;
+	purb_iso->TransferFlags = USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK | USBD_START_ISO_TRANSFER_ASAP;
+	purb_iso->TransferBuffer = surb->buf;
+	purb_iso->TransferBufferMDL = NULL;
+	purb_iso->TransferBufferLength = stream->len_pkt * stream->n_pkts_urb;
+	purb_iso->NumberOfPackets = stream->n_pkts_urb;
+	purb_iso->StartFrame = 0;
+	purb_iso->ErrorCount = 0;
+	for (i = 0; i < stream->n_pkts_urb; i++) {
+		purb_iso->IsoPacket[i].Offset = i * stream->len_pkt;
+		purb_iso->IsoPacket[i].Length = 0;
+		purb_iso->IsoPacket[i].Status = USBD_STATUS_SUCCESS;
+	}
+
+	IoReuseIrp(surb->irp, STATUS_SUCCESS);
+
+	irpstack = IoGetNextIrpStackLocation(surb->irp);
+	irpstack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irpstack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irpstack->Parameters.Others.Argument1 = surb->purb;
+	irpstack->Parameters.Others.Argument2 = NULL;
+	irpstack->DeviceObject = stream->devstub->self;
+
+	IoSetCompletionRoutine(surb->irp, done_iso_stream_urb, surb, TRUE, TRUE, TRUE);
+}
+
+static void
+submit_iso_stream_urb(iso_stream_urb_t *surb)
+{
+	IoCallDriver(surb->stream->devstub->next_stack_dev, surb->irp);
+}
+
+static NTSTATUS
+done_iso_stream_urb(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
+{
+	iso_stream_urb_t	*surb = (iso_stream_urb_t *)ctx;
+	iso_stream_t	*stream = surb->stream;
+	usbip_stub_dev_t	*devstub = stream->devstub;
+	KIRQL	oldirql;
+
+	UNREFERENCED_PARAMETER(devobj);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+
+	if (stream->stopping) {
+		if (InterlockedDecrement(&stream->n_urbs_active) == 0)
+			KeSetEvent(&stream->event_stopped, IO_NO_INCREMENT, FALSE);
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+
+	if (!NT_SUCCESS(irp->IoStatus.Status)) {
+		DBGW(DBG_GENERAL, "done_iso_stream_urb: ep:%02x: stream broken: %s, usbd_status:%s\n", stream->epaddr,
+			dbg_ntstatus(irp->IoStatus.Status), dbg_usbd_status(surb->purb->UrbHeader.Status));
+		stream->broken = TRUE;
+		if (InterlockedDecrement(&stream->n_urbs_active) == 0) {
+			KeSetEvent(&stream->event_stopped, IO_NO_INCREMENT, FALSE);
+			flush_iso_stream_reqs(devstub, stream, TRUE, oldirql);
+		}
+		else {
+			KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		}
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+
+	save_iso_stream_pkts(stream, &surb->purb->UrbIsochronousTransfer, surb->buf);
+	if (stream->broken) {
+		/* no urb is resubmitted after a failure so that a next request restarts a stream */
+		if (InterlockedDecrement(&stream->n_urbs_active) == 0) {
+			serve_iso_stream_reqs(devstub, stream, oldirql);
+			/* requests which buffered packets cannot serve are failed */
+			KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+			KeSetEvent(&stream->event_stopped, IO_NO_INCREMENT, FALSE);
+			flush_iso_stream_reqs(devstub, stream, TRUE, oldirql);
+		}
+		else {
+			serve_iso_stream_reqs(devstub, stream, oldirql);
+		}
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+	/* stopping has been checked above without releasing the lock */
+	prepare_iso_stream_urb(surb);
+	serve_iso_stream_reqs(devstub, stream, oldirql);
+
+	submit_iso_stream_urb(surb);
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static void
+stop_iso_stream_list(usbip_stub_dev_t *devstub, PLIST_ENTRY head_stop, BOOLEAN reply)
+{
+	while (!IsListEmpty(head_stop)) {
+		iso_stream_t	*stream;
+		KIRQL	oldirql;
+		ULONG	i;
+
+		stream = CONTAINING_RECORD(RemoveHeadList(head_stop), iso_stream_t, list);
+
+		DBGI(DBG_GENERAL, "stop_iso_stream: ep:%02x, dropped packets:%u\n", stream->epaddr, stream->n_pkts_dropped);
+
+		/* urb irps are owned by stream and not freed until here */
+		for (i = 0; i < stream->n_urbs; i++)
+			IoCancelIrp(stream->urbs[i].irp);
+		KeWaitForSingleObject(&stream->event_stopped, Executive, KernelMode, FALSE, NULL);
+
+		KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+		flush_iso_stream_reqs(devstub, stream, reply, oldirql);
+
+		free_iso_stream(stream);
+	}
+}
+
+void
+stop_iso_streams(usbip_stub_dev_t *devstub, int intf_num, BOOLEAN reply)
+{
+	LIST_ENTRY	head_stop;
+	PLIST_ENTRY	le;
+	KIRQL	oldirql;
+
+	InitializeListHead(&head_stop);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	for (le = devstub->iso_streams.Flink; le != &devstub->iso_streams;) {
+		iso_stream_t	*stream = CONTAINING_RECORD(le, iso_stream_t, list);
+
+		le = le->Flink;
+		if (intf_num < 0 || stream->intf_num == intf_num) {
+			stream->stopping = TRUE;
+			RemoveEntryList(&stream->list);
+			InsertTailList(&head_stop, &stream->list);
+		}
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	stop_iso_stream_list(devstub, &head_stop, reply);
+}
+
+static iso_stream_t *
+start_iso_stream(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe)
+{
+	iso_stream_t	*stream;
+	KIRQL	oldirql;
+	ULONG	n_urbs, i;
+
+	stream = create_iso_stream(devstub, info_pipe);
+	if (stream == NULL)
+		return NULL;
+
+	DBGI(DBG_GENERAL, "start_iso_stream: ep:%02x, urbs:%u, packets:%u, packet len:%u\n",
+		stream->epaddr, stream->n_urbs, stream->n_pkts_urb, stream->len_pkt);
+
+	n_urbs = stream->n_urbs;
+	stream->n_urbs_active = (LONG)n_urbs;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	InsertTailList(&devstub->iso_streams, &stream->list);
+	for (i = 0; i < n_urbs; i++)
+		prepare_iso_stream_urb(stream->urbs + i);
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	/* a stream stopped meanwhile is not freed until all of its urbs complete */
+	for (i = 0; i < n_urbs; i++)
+		submit_iso_stream_urb(stream->urbs + i);
+	return stream;
+}
+
+/*
+ * A request is served from a stream of the endpoint, which is started if not exists.
+ * FALSE is returned if streaming is not applicable. Then a caller should submit an iso urb by itself.
+ */
+BOOLEAN
+submit_iso_stream_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
+{
+	iso_stream_t	*stream;
+	stub_res_t	*sres;
+	struct usbip_iso_packet_descriptor	*iso_descs;
+	PVOID	data;
+	ULONG	n_pkts, datalen;
+	int	iso_descs_len;
+	KIRQL	oldirql;
+
+	if (stub_params.iso_stream_urbs == 0 || !hdr->base.direction)
+		return FALSE;
+
+	/* A request should fit in the packet buffer of a stream */
+	n_pkts = hdr->u.cmd_submit.number_of_packets;
+	if (n_pkts == 0 || n_pkts > get_iso_stream_n_urbs() * get_iso_stream_n_pkts_urb() * 2)
+		return FALSE;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	stream = find_iso_stream(devstub, info_pipe->PipeHandle);
+	if (stream != NULL && stream->broken && stream->n_urbs_active == 0) {
+		LIST_ENTRY	head_stop;
+
+		/* restart a broken stream */
+		InitializeListHead(&head_stop);
+		RemoveEntryList(&stream->list);
+		InsertTailList(&head_stop, &stream->list);
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+		stop_iso_stream_list(devstub, &head_stop, TRUE);
+		stream = NULL;
+	}
+	else {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+	}
+
+	if (stream == NULL) {
+		stream = start_iso_stream(devstub, info_pipe);
+		if (stream == NULL)
+			return FALSE;
+	}
+
+	iso_descs_len = sizeof(struct usbip_iso_packet_descriptor) * n_pkts;
+	iso_descs = (struct usbip_iso_packet_descriptor *)(hdr + 1);
+	datalen = get_iso_descs_len(n_pkts, iso_descs, FALSE);
+	data = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)datalen + iso_descs_len, USBIP_STUB_POOL_TAG);
+	if (data == NULL) {
+		DBGE(DBG_GENERAL, "submit_iso_stream_req: out of memory\n");
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+		return TRUE;
+	}
+	RtlCopyMemory((char *)data + datalen, iso_descs, iso_descs_len);
+
+	sres = create_stub_res(USBIP_RET_SUBMIT, hdr->base.seqnum, 0, data, datalen, n_pkts, FALSE);
+	if (sres == NULL) {
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+		return TRUE;
+	}
+
+	sres->hPipe = info_pipe->PipeHandle;
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	if (find_iso_stream(devstub, info_pipe->PipeHandle) != stream) {
+		/* a stream has been stopped by another thread, e.g. of a cleanup or a removal */
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		sres->header.u.ret_submit.status = -1;
+		sres->header.u.ret_submit.actual_length = 0;
+		sres->header.u.ret_submit.number_of_packets = 0;
+		sres->data_len = 0;
+		reply_stub_req(devstub, sres);
+		return TRUE;
+	}
+	sres->stream = stream;
+	InsertTailList(&devstub->sres_head_pending, &sres->list);
+	serve_iso_stream_reqs(devstub, stream, oldirql);
+
+	return TRUE;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "stub_dev.h"
+#include "usbip_proto.h"
+
+struct iso_stream;
+
+BOOLEAN
+submit_iso_stream_req(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr);
+
+/* intf_num of -1 stops the streams of all interfaces */
+void
+stop_iso_streams(usbip_stub_dev_t *devstub, int intf_num, BOOLEAN reply);
@@ -19,6 +19,9 @@
 #include "stub_driver.h"
 #include "stub_dbg.h"
 #include "stub_irp.h"
+#include "stub_isoch.h"
+#include "stub_intr.h"
+#include "stub_botaccel.h"
 
 static NTSTATUS
 on_start_complete(DEVICE_OBJECT *devobj, IRP *irp, void *context)
@@ -81,6 +84,10 @@ stub_dispatch_pnp(usbip_stub_dev_t *devstub, IRP *irp)
 
 		devstub->is_started = FALSE;
 
+		stop_iso_streams(devstub, -1, FALSE);
+		stop_intr_polls(devstub, -1, FALSE);
+		stop_bot_accels(devstub, -1, FALSE);
+
 		/* wait until all outstanding requests are finished */
 		unlock_wait_dev_removal(devstub);
 
@@ -102,6 +109,10 @@ stub_dispatch_pnp(usbip_stub_dev_t *devstub, IRP *irp)
 	case IRP_MN_SURPRISE_REMOVAL:
 		devstub->is_started = FALSE;
 
+		stop_iso_streams(devstub, -1, FALSE);
+		stop_intr_polls(devstub, -1, FALSE);
+		stop_bot_accels(devstub, -1, FALSE);
+
 		disable_interface(devstub);
 		status = STATUS_SUCCESS;
 		break;
@@ -1,6 +1,39 @@
 #include "stub_driver.h"
 
 #include "stub_dbg.h"
+#include "stub_reg.h"
+
+stub_params_t	stub_params = {
+	256 * 1024,	/* bulk_split_size */
+	4,		/* bulk_split_depth */
+	1,		/* bulk_split_depth_in */
+	0,		/* iso_stream_urbs */
+	32,		/* iso_stream_packets */
+	0,		/* intr_poll_urbs */
+	16,		/* intr_poll_reports */
+	0,		/* bot_accel_len */
+	0		/* bot_cache_len */
+};
+
+typedef struct {
+	PWSTR	name;
+	ULONG	*pval;
+} reg_param_t;
+
+static reg_param_t	reg_params[] = {
+	{ L"BulkSplitSize", &stub_params.bulk_split_size },
+	{ L"BulkSplitDepth", &stub_params.bulk_split_depth },
+	{ L"BulkSplitDepthIn", &stub_params.bulk_split_depth_in },
+	{ L"IsoStreamUrbs", &stub_params.iso_stream_urbs },
+	{ L"IsoStreamPackets", &stub_params.iso_stream_packets },
+	{ L"IntrPollUrbs", &stub_params.intr_poll_urbs },
+	{ L"IntrPollReports", &stub_params.intr_poll_reports },
+	{ L"BotAccelLen", &stub_params.bot_accel_len },
+	{ L"BotCacheLen", &stub_params.bot_cache_len },
+	{ NULL, NULL }
+};
+
+#define N_REG_PARAMS	(sizeof(reg_params) / sizeof(reg_param_t) - 1)
 
 static char *
 reg_get_property(PDEVICE_OBJECT pdo, int property)
@@ -229,3 +262,52 @@ reg_get_id_compat(PDEVICE_OBJECT pdo)
 {
 	return reg_get_property(pdo, DevicePropertyCompatibleIDs);
 }
+
+void
+reg_get_params(PUNICODE_STRING regpath)
+{
+	RTL_QUERY_REGISTRY_TABLE	*table;
+	UNICODE_STRING	path;
+	int	i;
+	NTSTATUS	status;
+
+	path.MaximumLength = regpath->Length + sizeof(L"\\Parameters");
+	path.Length = 0;
+	path.Buffer = ExAllocatePoolWithTag(PagedPool, path.MaximumLength, USBIP_STUB_POOL_TAG);
+	if (path.Buffer == NULL) {
+		DBGE(DBG_GENERAL, "reg_get_params: out of memory\n");
+		return;
+	}
+	table = ExAllocatePoolWithTag(PagedPool, sizeof(RTL_QUERY_REGISTRY_TABLE) * (N_REG_PARAMS + 1), USBIP_STUB_POOL_TAG);
+	if (table == NULL) {
+		DBGE(DBG_GENERAL, "reg_get_params: out of memory\n");
+		ExFreePoolWithTag(path.Buffer, USBIP_STUB_POOL_TAG);
+		return;
+	}
+
+	RtlCopyUnicodeString(&path, regpath);
+	RtlAppendUnicodeToString(&path, L"\\Parameters");
+	/* RtlQueryRegistryValues requires a null-terminated path */
+	path.Buffer[path.Length / sizeof(WCHAR)] = L'\0';
+
+	RtlZeroMemory(table, sizeof(RTL_QUERY_REGISTRY_TABLE) * (N_REG_PARAMS + 1));
+	for (i = 0; reg_params[i].name != NULL; i++) {
+		table[i].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+		table[i].Name = reg_params[i].name;
+		table[i].EntryContext = reg_params[i].pval;
+		table[i].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD;
+		table[i].DefaultData = reg_params[i].pval;
+		table[i].DefaultLength = sizeof(ULONG);
+	}
+
+	/* A missing key or value just leaves the built-in default */
+	status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL, path.Buffer, table, NULL, NULL);
+	if (NT_ERROR(status))
+		DBGW(DBG_GENERAL, "reg_get_params: failed to query parameters: %s\n", dbg_ntstatus(status));
+
+	ExFreePoolWithTag(table, USBIP_STUB_POOL_TAG);
+	ExFreePoolWithTag(path.Buffer, USBIP_STUB_POOL_TAG);
+
+	for (i = 0; reg_params[i].name != NULL; i++)
+		DBGI(DBG_GENERAL, "reg_get_params: %S: %u\n", reg_params[i].name, *reg_params[i].pval);
+}
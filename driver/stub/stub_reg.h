@@ -7,4 +7,31 @@ reg_get_id_hw(PDEVICE_OBJECT pdo);
 char *
 reg_get_id_compat(PDEVICE_OBJECT pdo);
 BOOLEAN
-reg_get_properties(usbip_stub_dev_t *devstub);
\ No newline at end of file
+reg_get_properties(usbip_stub_dev_t *devstub);
+
+/* driver-wide tunables which are read from the Parameters subkey of the service key */
+typedef struct {
+	/* bulk transfers larger than this are split into multiple urbs. 0 disables splitting */
+	ULONG	bulk_split_size;
+	/* maximum number of split urbs which are submitted concurrently for an OUT transfer */
+	ULONG	bulk_split_depth;
+	/* same as above for an IN transfer */
+	ULONG	bulk_split_depth_in;
+	/* number of iso urbs kept submitted for a streaming iso IN endpoint. 0 disables streaming */
+	ULONG	iso_stream_urbs;
+	/* number of packets per streaming iso urb */
+	ULONG	iso_stream_packets;
+	/* number of interrupt urbs kept submitted for an interrupt IN endpoint. 0 disables pre-polling */
+	ULONG	intr_poll_urbs;
+	/* number of reports buffered by an interrupt poll, beyond which the oldest one is dropped */
+	ULONG	intr_poll_reports;
+	/* maximum length of a data stage of a bulk-only mass storage submitted with a CBW. 0 disables acceleration */
+	ULONG	bot_accel_len;
+	/* size of a READ(10) cache of a bulk-only mass storage interface. 0 disables caching */
+	ULONG	bot_cache_len;
+} stub_params_t;
+
+extern stub_params_t	stub_params;
+
+void
+reg_get_params(PUNICODE_STRING regpath);
@@ -3,6 +3,7 @@
 #include "usbip_proto.h"
 #include "stub_res.h"
 #include "stub_dbg.h"
+#include "stub_split.h"
 #include "pdu.h"
 
 #ifdef DBG
@@ -61,6 +62,11 @@ create_stub_res(unsigned int cmd, unsigned long seqnum, int err, PVOID data, int
 
 	RtlZeroMemory(&sres->header, sizeof(struct usbip_header));
 	sres->irp = NULL;
+	sres->split = NULL;
+	sres->stream = NULL;
+	sres->poll = NULL;
+	sres->bot = NULL;
+	sres->hPipe = NULL;
 	sres->header.base.command = cmd;
 	sres->header.base.seqnum = seqnum;
 	sres->data = data;
@@ -205,7 +211,22 @@ cancel_pending_stub_res(usbip_stub_dev_t *devstub, unsigned int seqnum)
 		sres = CONTAINING_RECORD(le, stub_res_t, list);
 		if (sres->header.base.seqnum == seqnum) {
 			PIRP	irp = sres->irp;
+			struct bulk_split	*split = sres->split;
+
+			if (sres->stream != NULL || sres->poll != NULL || sres->bot != NULL) {
+				/* no irp is involved for a result waiting for streamed packets, polled reports or accelerated stages */
+				RemoveEntryList(&sres->list);
+				KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+				free_stub_res(sres);
+				return TRUE;
+			}
+
+			/* split should be alive until cancellation is done */
+			if (split != NULL)
+				ref_bulk_split(split);
 			KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+			if (split != NULL)
+				return cancel_bulk_split(split);
 			return IoCancelIrp(irp);
 		}
 	}
@@ -214,6 +235,140 @@ cancel_pending_stub_res(usbip_stub_dev_t *devstub, unsigned int seqnum)
 	return FALSE;
 }
 
+typedef struct {
+	PIRP	irp;
+	struct bulk_split	*split;
+} sres_cancel_t;
+
+static BOOLEAN
+is_sres_in_batch(stub_res_t *sres, unsigned int seqnum_first, unsigned int seqnum_last, const USBD_PIPE_HANDLE *hPipes, int n_pipes)
+{
+	int	i;
+
+	if (!USBIP_UNLINK_BATCH_HAS(seqnum_first, seqnum_last, sres->header.base.seqnum))
+		return FALSE;
+	if (hPipes == NULL)
+		return TRUE;
+	for (i = 0; i < n_pipes; i++) {
+		if (sres->hPipe == hPipes[i])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Results of a batch are cancelled one by one in order of seqnum, which needs no memory.
+ * Every pass looks for the next seqnum, so this is only a fallback of a failed allocation.
+ */
+static ULONG
+cancel_pending_stub_res_each(usbip_stub_dev_t *devstub, unsigned int seqnum_first, unsigned int seqnum_last,
+	const USBD_PIPE_HANDLE *hPipes, int n_pipes)
+{
+	ULONG	n_cancelled = 0;
+	UINT32	offset_next = 0;
+
+	for (;;) {
+		KIRQL	oldirql;
+		PLIST_ENTRY	le;
+		unsigned int	seqnum = 0;
+		UINT32	offset_min = 0;
+		BOOLEAN	found = FALSE;
+
+		KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+		for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending; le = le->Flink) {
+			stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+			UINT32	offset = (UINT32)(sres->header.base.seqnum - seqnum_first);
+
+			if (!is_sres_in_batch(sres, seqnum_first, seqnum_last, hPipes, n_pipes) || offset < offset_next)
+				continue;
+			if (!found || offset < offset_min) {
+				found = TRUE;
+				offset_min = offset;
+				seqnum = sres->header.base.seqnum;
+			}
+		}
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+		if (!found)
+			break;
+		if (cancel_pending_stub_res(devstub, seqnum))
+			n_cancelled++;
+		/* offset_next would wrap around */
+		if (offset_min == (UINT32)(seqnum_last - seqnum_first))
+			break;
+		offset_next = offset_min + 1;
+	}
+	return n_cancelled;
+}
+
+/*
+ * Pending results from seqnum_first to seqnum_last are cancelled in a single pass.
+ * If hPipes is not NULL, only results of those n_pipes pipes are cancelled.
+ * Like cancel_pending_stub_res(), irps are cancelled after lock_stub_res is released.
+ * vhci has already completed irps of a batch, so results are cancelled one by one if memory is short.
+ * Returns the number of cancelled results.
+ */
+ULONG
+cancel_pending_stub_res_batch(usbip_stub_dev_t *devstub, unsigned int seqnum_first, unsigned int seqnum_last,
+	const USBD_PIPE_HANDLE *hPipes, int n_pipes)
+{
+	KIRQL	oldirql;
+	PLIST_ENTRY	le;
+	LIST_ENTRY	head_streamed;
+	sres_cancel_t	*cancels;
+	ULONG	n_pendings = 0, n_cancels = 0, n_cancelled = 0, i;
+
+	InitializeListHead(&head_streamed);
+
+	KeAcquireSpinLock(&devstub->lock_stub_res, &oldirql);
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending; le = le->Flink)
+		n_pendings++;
+	if (n_pendings == 0) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		return 0;
+	}
+	cancels = ExAllocatePoolWithTag(NonPagedPool, sizeof(sres_cancel_t) * n_pendings, USBIP_STUB_POOL_TAG);
+	if (cancels == NULL) {
+		KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+		DBGW(DBG_GENERAL, "cancel_pending_stub_res_batch: out of memory: cancelled one by one\n");
+		return cancel_pending_stub_res_each(devstub, seqnum_first, seqnum_last, hPipes, n_pipes);
+	}
+
+	for (le = devstub->sres_head_pending.Flink; le != &devstub->sres_head_pending;) {
+		stub_res_t	*sres = CONTAINING_RECORD(le, stub_res_t, list);
+
+		le = le->Flink;
+		if (!is_sres_in_batch(sres, seqnum_first, seqnum_last, hPipes, n_pipes))
+			continue;
+
+		if (sres->stream != NULL || sres->poll != NULL || sres->bot != NULL) {
+			/* no irp is involved for a result waiting for streamed packets, polled reports or accelerated stages */
+			RemoveEntryList(&sres->list);
+			InsertTailList(&head_streamed, &sres->list);
+			continue;
+		}
+		cancels[n_cancels].irp = sres->irp;
+		cancels[n_cancels].split = sres->split;
+		/* split should be alive until cancellation is done */
+		if (sres->split != NULL)
+			ref_bulk_split(sres->split);
+		n_cancels++;
+	}
+	KeReleaseSpinLock(&devstub->lock_stub_res, oldirql);
+
+	while (!IsListEmpty(&head_streamed)) {
+		free_stub_res(CONTAINING_RECORD(RemoveHeadList(&head_streamed), stub_res_t, list));
+		n_cancelled++;
+	}
+	for (i = 0; i < n_cancels; i++) {
+		if (cancels[i].split != NULL ? cancel_bulk_split(cancels[i].split): IoCancelIrp(cancels[i].irp))
+			n_cancelled++;
+	}
+	ExFreePoolWithTag(cancels, USBIP_STUB_POOL_TAG);
+
+	return n_cancelled;
+}
+
 static VOID
 on_irp_read_cancelled(PDEVICE_OBJECT devobj, PIRP irp_read)
 {
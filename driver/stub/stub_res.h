@@ -3,8 +3,22 @@
 #include "stub_dev.h"
 #include "usbip_proto.h"
 
+struct bulk_split;
+struct iso_stream;
+struct intr_poll;
+struct bot_accel;
+
 typedef struct stub_res {
 	PIRP	irp;
+	/* non-NULL if a result is served by split urbs instead of irp */
+	struct bulk_split	*split;
+	/* non-NULL if a result waits for packets of an iso stream */
+	struct iso_stream	*stream;
+	/* non-NULL if a result waits for a report of an interrupt poll */
+	struct intr_poll	*poll;
+	struct bot_accel	*bot;
+	/* a pipe of a data transfer, or NULL for a control transfer */
+	USBD_PIPE_HANDLE	hPipe;
 	struct usbip_header	header;
 	PVOID	data;
 	int	data_len;
@@ -22,6 +36,8 @@ void free_stub_res(stub_res_t *sres);
 void add_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres, PIRP irp);
 void del_pending_stub_res(usbip_stub_dev_t *devstub, stub_res_t *sres);
 BOOLEAN cancel_pending_stub_res(usbip_stub_dev_t *devstub, unsigned int seqnum);
+ULONG cancel_pending_stub_res_batch(usbip_stub_dev_t *devstub, unsigned int seqnum_first, unsigned int seqnum_last,
+	const USBD_PIPE_HANDLE *hPipes, int n_pipes);
 
 NTSTATUS collect_done_stub_res(usbip_stub_dev_t *devstub, PIRP irp_read);
 
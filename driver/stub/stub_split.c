@@ -0,0 +1,408 @@
+#include "stub_driver.h"
+#include "stub_dbg.h"
+#include "stub_res.h"
+#include "stub_reg.h"
+#include "stub_split.h"
+#include "usbd_helper.h"
+
+#include <usbdlib.h>
+
+/*
+ * A large bulk transfer is divided into chunks whose length is a multiple of the max packet size.
+ * Up to n_slots chunks are in flight at a time and the slot of a completed chunk is reused for
+ * the next one. Only a single thread submits at a time, so USBD always receives chunks in order.
+ *
+ * A short or failed chunk terminates the transfer. Chunks behind it are cancelled and a single
+ * RET_SUBMIT covers the data up to the terminating chunk. A controller does not stop a queued urb
+ * at a short packet of its predecessor, so a chunk behind a short one may consume data of the next
+ * transfer. That is why IN transfers are submitted one chunk at a time unless configured otherwise.
+ */
+
+#define MAX_SPLIT_SLOTS	32
+
+typedef struct {
+	struct bulk_split	*split;
+	PIRP	irp;
+	ULONG	idx;
+	BOOLEAN	in_flight;
+	struct _URB_BULK_OR_INTERRUPT_TRANSFER	urb;
+} bulk_split_slot_t;
+
+typedef struct bulk_split {
+	usbip_stub_dev_t	*devstub;
+	stub_res_t	*sres;
+	USBD_PIPE_HANDLE	hPipe;
+	BOOLEAN		is_in;
+	PUCHAR		data;
+	ULONG		datalen;
+	ULONG		len_chunk;
+	ULONG		n_chunks;
+	/* next chunk to submit */
+	ULONG		idx_next;
+	/* chunk which terminated the transfer and its actual length. idx_end is n_chunks until terminated */
+	ULONG		idx_end;
+	ULONG		len_end;
+	USBD_STATUS	usbd_status;
+	BOOLEAN		cancelled;
+	BOOLEAN		submitting;
+	BOOLEAN		finished;
+	ULONG		n_in_flight;
+	LONG		refcnt;
+	KSPIN_LOCK	lock;
+	ULONG		n_slots;
+	bulk_split_slot_t	slots[1];
+} bulk_split_t;
+
+static void submit_chunks(bulk_split_t *split, KIRQL oldirql);
+
+ULONG
+get_bulk_split_len(PUSBD_PIPE_INFORMATION info_pipe)
+{
+	ULONG	len;
+
+	if (info_pipe->PipeType != UsbdPipeTypeBulk || stub_params.bulk_split_size == 0 || info_pipe->MaximumPacketSize == 0)
+		return 0;
+
+	len = stub_params.bulk_split_size;
+	if (info_pipe->MaximumTransferSize != 0 && info_pipe->MaximumTransferSize < len)
+		len = info_pipe->MaximumTransferSize;
+	len -= len % info_pipe->MaximumPacketSize;
+	if (len == 0)
+		len = info_pipe->MaximumPacketSize;
+	return len;
+}
+
+void
+ref_bulk_split(bulk_split_t *split)
+{
+	InterlockedIncrement(&split->refcnt);
+}
+
+static void
+unref_bulk_split(bulk_split_t *split)
+{
+	ULONG	i;
+
+	if (InterlockedDecrement(&split->refcnt) > 0)
+		return;
+
+	for (i = 0; i < split->n_slots; i++) {
+		if (split->slots[i].irp != NULL)
+			IoFreeIrp(split->slots[i].irp);
+	}
+	if (!split->is_in && split->data != NULL)
+		ExFreePoolWithTag(split->data, USBIP_STUB_POOL_TAG);
+	ExFreePoolWithTag(split, USBIP_STUB_POOL_TAG);
+}
+
+static BOOLEAN
+is_split_terminated(bulk_split_t *split)
+{
+	return split->cancelled || split->idx_end < split->n_chunks;
+}
+
+/* must be called with lock held. returns TRUE only once, to a caller who should finish the transfer */
+static BOOLEAN
+check_split_finished(bulk_split_t *split)
+{
+	if (split->finished || split->n_in_flight > 0 || split->submitting)
+		return FALSE;
+	if (!is_split_terminated(split) && split->idx_next < split->n_chunks)
+		return FALSE;
+	split->finished = TRUE;
+	return TRUE;
+}
+
+static void
+finish_split(bulk_split_t *split)
+{
+	usbip_stub_dev_t	*devstub = split->devstub;
+	stub_res_t	*sres = split->sres;
+
+	del_pending_stub_res(devstub, sres);
+
+	if (split->cancelled) {
+		DBGI(DBG_GENERAL, "finish_split: cancelled: seq:%u\n", sres->header.base.seqnum);
+		free_stub_res(sres);
+	}
+	else {
+		ULONG	actual_len;
+
+		actual_len = split->idx_end * split->len_chunk + split->len_end;
+		DBGI(DBG_GENERAL, "finish_split: seq:%u, chunks:%u/%u, actual:%u, usbd_status:%s\n", sres->header.base.seqnum,
+			split->idx_end + 1, split->n_chunks, actual_len, dbg_usbd_status(split->usbd_status));
+
+		if (USBD_ERROR(split->usbd_status))
+			sres->header.u.ret_submit.status = to_usbip_status(split->usbd_status);
+		if (split->is_in)
+			sres->data_len = actual_len;
+		sres->header.u.ret_submit.actual_length = actual_len;
+		reply_stub_req(devstub, sres);
+	}
+
+	/* drop the reference of the transfer itself */
+	unref_bulk_split(split);
+}
+
+static void
+cancel_chunks(bulk_split_t *split, ULONG idx_from)
+{
+	ULONG	mask = 0, i;
+	KIRQL	oldirql;
+
+	KeAcquireSpinLock(&split->lock, &oldirql);
+	for (i = 0; i < split->n_slots; i++) {
+		if (split->slots[i].in_flight && split->slots[i].idx >= idx_from)
+			mask |= (1 << i);
+	}
+	KeReleaseSpinLock(&split->lock, oldirql);
+
+	/* irps are not freed until the last reference of split is gone */
+	for (i = 0; i < split->n_slots; i++) {
+		if (mask & (1 << i))
+			IoCancelIrp(split->slots[i].irp);
+	}
+}
+
+static NTSTATUS
+done_split_chunk(PDEVICE_OBJECT devobj, PIRP irp, PVOID ctx)
+{
+	bulk_split_slot_t	*slot = (bulk_split_slot_t *)ctx;
+	bulk_split_t	*split = slot->split;
+	KIRQL	oldirql;
+	BOOLEAN	terminated_now = FALSE;
+
+	UNREFERENCED_PARAMETER(devobj);
+
+	KeAcquireSpinLock(&split->lock, &oldirql);
+
+	slot->in_flight = FALSE;
+	split->n_in_flight--;
+
+	if (!split->cancelled && slot->idx < split->idx_end) {
+		if (!NT_SUCCESS(irp->IoStatus.Status)) {
+			split->idx_end = slot->idx;
+			split->len_end = 0;
+			split->usbd_status = slot->urb.Hdr.Status;
+			terminated_now = TRUE;
+		}
+		else if (slot->idx == split->n_chunks - 1 || slot->urb.TransferBufferLength < split->len_chunk) {
+			split->idx_end = slot->idx;
+			split->len_end = slot->urb.TransferBufferLength;
+			terminated_now = split->n_in_flight > 0;
+		}
+	}
+
+	if (check_split_finished(split)) {
+		KeReleaseSpinLock(&split->lock, oldirql);
+		finish_split(split);
+	}
+	else if (terminated_now) {
+		ULONG	idx_from = split->idx_end + 1;
+
+		KeReleaseSpinLock(&split->lock, oldirql);
+		cancel_chunks(split, idx_from);
+	}
+	else {
+		submit_chunks(split, oldirql);
+	}
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static void
+submit_chunk(bulk_split_t *split, bulk_split_slot_t *slot)
+{
+	IO_STACK_LOCATION	*irpstack;
+	ULONG	offset, len, flags;
+
+	offset = slot->idx * split->len_chunk;
+	len = split->datalen - offset;
+	if (len > split->len_chunk)
+		len = split->len_chunk;
+
+	/* short packets are detected by length. A chunk without USBD_SHORT_TRANSFER_OK may halt the pipe. */
+	flags = USBD_SHORT_TRANSFER_OK;
+	if (split->is_in)
+		flags |= USBD_TRANSFER_DIRECTION_IN;
+	UsbBuildInterruptOrBulkTransferRequest((PURB)&slot->urb, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER), split->hPipe,
+		split->data + offset, NULL, len, flags, NULL);
+
+	IoReuseIrp(slot->irp, STATUS_SUCCESS);
+
+	irpstack = IoGetNextIrpStackLocation(slot->irp);
+	irpstack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irpstack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irpstack->Parameters.Others.Argument1 = &slot->urb;
+	irpstack->Parameters.Others.Argument2 = NULL;
+	irpstack->DeviceObject = split->devstub->self;
+
+	IoSetCompletionRoutine(slot->irp, done_split_chunk, slot, TRUE, TRUE, TRUE);
+
+	IoCallDriver(split->devstub->next_stack_dev, slot->irp);
+}
+
+static bulk_split_slot_t *
+get_free_slot(bulk_split_t *split)
+{
+	ULONG	i;
+
+	for (i = 0; i < split->n_slots; i++) {
+		if (!split->slots[i].in_flight)
+			return split->slots + i;
+	}
+	return NULL;
+}
+
+/* must be called with lock held, which will be released on return */
+static void
+submit_chunks(bulk_split_t *split, KIRQL oldirql)
+{
+	if (split->submitting) {
+		/* A submitting thread will pick up a slot freed by a completion */
+		KeReleaseSpinLock(&split->lock, oldirql);
+		return;
+	}
+
+	/* Completions of chunks may finish the transfer while submitting */
+	ref_bulk_split(split);
+	split->submitting = TRUE;
+
+	while (!is_split_terminated(split) && split->idx_next < split->n_chunks) {
+		bulk_split_slot_t	*slot;
+
+		slot = get_free_slot(split);
+		if (slot == NULL)
+			break;
+		slot->idx = split->idx_next++;
+		slot->in_flight = TRUE;
+		split->n_in_flight++;
+
+		KeReleaseSpinLock(&split->lock, oldirql);
+		submit_chunk(split, slot);
+		KeAcquireSpinLock(&split->lock, &oldirql);
+	}
+
+	split->submitting = FALSE;
+	if (check_split_finished(split)) {
+		KeReleaseSpinLock(&split->lock, oldirql);
+		finish_split(split);
+	}
+	else {
+		KeReleaseSpinLock(&split->lock, oldirql);
+	}
+	unref_bulk_split(split);
+}
+
+static bulk_split_t *
+create_bulk_split(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, PVOID data, ULONG datalen, ULONG len_chunk, BOOLEAN is_in)
+{
+	bulk_split_t	*split;
+	ULONG	n_chunks, n_slots, i;
+
+	n_chunks = (datalen + len_chunk - 1) / len_chunk;
+	n_slots = is_in ? stub_params.bulk_split_depth_in : stub_params.bulk_split_depth;
+	if (n_slots == 0)
+		n_slots = 1;
+	if (n_slots > MAX_SPLIT_SLOTS)
+		n_slots = MAX_SPLIT_SLOTS;
+	if (n_slots > n_chunks)
+		n_slots = n_chunks;
+
+	split = ExAllocatePoolWithTag(NonPagedPool, sizeof(bulk_split_t) + sizeof(bulk_split_slot_t) * (n_slots - 1), USBIP_STUB_POOL_TAG);
+	if (split == NULL) {
+		DBGE(DBG_GENERAL, "create_bulk_split: out of memory\n");
+		return NULL;
+	}
+	RtlZeroMemory(split, sizeof(bulk_split_t) + sizeof(bulk_split_slot_t) * (n_slots - 1));
+
+	split->devstub = devstub;
+	split->hPipe = hPipe;
+	split->is_in = is_in;
+	split->datalen = datalen;
+	split->len_chunk = len_chunk;
+	split->n_chunks = n_chunks;
+	split->idx_end = n_chunks;
+	split->usbd_status = USBD_STATUS_SUCCESS;
+	split->refcnt = 1;
+	split->n_slots = n_slots;
+	KeInitializeSpinLock(&split->lock);
+
+	for (i = 0; i < n_slots; i++) {
+		split->slots[i].split = split;
+		split->slots[i].irp = IoAllocateIrp(devstub->self->StackSize + 1, FALSE);
+		if (split->slots[i].irp == NULL) {
+			DBGE(DBG_GENERAL, "create_bulk_split: IoAllocateIrp: out of memory\n");
+			unref_bulk_split(split);
+			return NULL;
+		}
+	}
+
+	if (is_in) {
+		split->data = data;
+	}
+	else {
+		/* OUT data resides in a write irp, which will be completed before chunks are done */
+		split->data = ExAllocatePoolWithTag(NonPagedPool, datalen, USBIP_STUB_POOL_TAG);
+		if (split->data == NULL) {
+			DBGE(DBG_GENERAL, "create_bulk_split: out of memory: data\n");
+			unref_bulk_split(split);
+			return NULL;
+		}
+		RtlCopyMemory(split->data, data, datalen);
+	}
+	return split;
+}
+
+NTSTATUS
+submit_bulk_split_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, unsigned long seqnum, PVOID data, ULONG datalen,
+	ULONG len_chunk, BOOLEAN is_in)
+{
+	bulk_split_t	*split;
+	stub_res_t	*sres;
+	KIRQL	oldirql;
+
+	split = create_bulk_split(devstub, hPipe, data, datalen, len_chunk, is_in);
+	if (split == NULL)
+		return STATUS_NO_MEMORY;
+
+	/* IN data is handed over to sres only on success, since a caller releases it on failure */
+	sres = create_stub_res(USBIP_RET_SUBMIT, seqnum, 0, NULL, 0, 0, FALSE);
+	if (sres == NULL) {
+		unref_bulk_split(split);
+		return STATUS_UNSUCCESSFUL;
+	}
+	if (is_in) {
+		sres->data = data;
+		sres->data_len = datalen;
+	}
+	sres->split = split;
+	sres->hPipe = hPipe;
+	split->sres = sres;
+
+	DBGI(DBG_GENERAL, "submit_bulk_split_transfer: seq:%u, len:%u, chunk:%u, chunks:%u, slots:%u\n",
+		seqnum, datalen, len_chunk, split->n_chunks, split->n_slots);
+
+	add_pending_stub_res(devstub, sres, NULL);
+
+	KeAcquireSpinLock(&split->lock, &oldirql);
+	submit_chunks(split, oldirql);
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN
+cancel_bulk_split(bulk_split_t *split)
+{
+	KIRQL	oldirql;
+
+	KeAcquireSpinLock(&split->lock, &oldirql);
+	split->cancelled = TRUE;
+	KeReleaseSpinLock(&split->lock, oldirql);
+
+	cancel_chunks(split, 0);
+
+	/* drop the reference taken by cancel_pending_stub_res() or cancel_pending_stub_res_batch() */
+	unref_bulk_split(split);
+	return TRUE;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "stub_dev.h"
+
+struct bulk_split;
+
+ULONG
+get_bulk_split_len(PUSBD_PIPE_INFORMATION info_pipe);
+
+NTSTATUS
+submit_bulk_split_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, unsigned long seqnum, PVOID data, ULONG datalen,
+	ULONG len_chunk, BOOLEAN is_in);
+
+void ref_bulk_split(struct bulk_split *split);
+BOOLEAN cancel_bulk_split(struct bulk_split *split);
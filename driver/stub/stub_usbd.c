@@ -174,6 +174,27 @@ get_usb_device_desc(usbip_stub_dev_t* devstub, PUSB_DEVICE_DESCRIPTOR pdesc)
 	return get_usb_desc(devstub, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, pdesc, &len);
 }
 
+UCHAR
+get_speed_from_bcdUSB(USHORT bcdUSB)
+{
+	switch (bcdUSB) {
+	case 0x0100:
+		return USB_SPEED_LOW;
+	case 0x0110:
+		return USB_SPEED_FULL;
+	case 0x0200:
+		return USB_SPEED_HIGH;
+	case 0x0250:
+		return USB_SPEED_WIRELESS;
+	case 0x0300:
+		return USB_SPEED_SUPER;
+	case 0x0310:
+		return USB_SPEED_SUPER_PLUS;
+	default:
+		return USB_SPEED_UNKNOWN;
+	}
+}
+
 static INT
 find_usb_dsc_conf(usbip_stub_dev_t *devstub, UCHAR bVal, PUSB_CONFIGURATION_DESCRIPTOR dsc_conf)
 {
@@ -424,6 +445,7 @@ submit_bulk_intr_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, uns
 		ExFreePoolWithTag(purb, USBIP_STUB_POOL_TAG);
 		return STATUS_UNSUCCESSFUL;
 	}
+	sres->hPipe = hPipe;
 	return call_usbd_nb(devstub, purb, done_bulk_intr_transfer, sres);
 }
 
@@ -521,6 +543,7 @@ submit_iso_transfer(usbip_stub_dev_t *devstub, USBD_PIPE_HANDLE hPipe, unsigned
 		USBD_UrbFree(devstub->hUSBD, purb);
 		return STATUS_UNSUCCESSFUL;
 	}
+	sres->hPipe = hPipe;
 	return call_usbd_nb(devstub, purb, done_iso_transfer, sres);
 }
 
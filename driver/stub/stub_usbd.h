@@ -7,6 +7,7 @@
 
 BOOLEAN get_usb_status(usbip_stub_dev_t *devstub, USHORT op, USHORT idx, PVOID buff, PUCHAR plen);
 BOOLEAN get_usb_device_desc(usbip_stub_dev_t *devstub, PUSB_DEVICE_DESCRIPTOR pdesc);
+UCHAR get_speed_from_bcdUSB(USHORT bcdUSB);
 BOOLEAN get_usb_desc(usbip_stub_dev_t *devstub, UCHAR descType, UCHAR idx, USHORT idLang, PVOID buff, ULONG *pbufflen);
 
 BOOLEAN select_usb_conf(usbip_stub_dev_t *devstub, USHORT idx);
@@ -24,6 +24,11 @@
 #include "stub_cspkt.h"
 #include "stub_usbd.h"
 #include "stub_res.h"
+#include "stub_split.h"
+#include "stub_isoch.h"
+#include "stub_intr.h"
+#include "stub_bot.h"
+#include "stub_botaccel.h"
 #include "pdu.h"
 
 #define HDR_IS_CONTROL_TRANSFER(hdr)	((hdr)->base.ep == 0)
@@ -103,6 +108,9 @@ process_get_desc(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t *cs
 static void
 process_select_conf(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t *csp)
 {
+	stop_iso_streams(devstub, -1, TRUE);
+	stop_intr_polls(devstub, -1, TRUE);
+	stop_bot_accels(devstub, -1, TRUE);
 	if (select_usb_conf(devstub, csp->wValue.W))
 		reply_stub_req_hdr(devstub, USBIP_RET_SUBMIT, seqnum);
 	else
@@ -112,6 +120,9 @@ process_select_conf(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t
 static void
 process_select_intf(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_cspkt_t *csp)
 {
+	stop_iso_streams(devstub, csp->wIndex.W, TRUE);
+	stop_intr_polls(devstub, csp->wIndex.W, TRUE);
+	stop_bot_accels(devstub, csp->wIndex.W, TRUE);
 	if (select_usb_intf(devstub, (UCHAR)csp->wIndex.W, csp->wValue.W))
 		reply_stub_req_hdr(devstub, USBIP_RET_SUBMIT, seqnum);
 	else
@@ -136,6 +147,7 @@ process_standard_request(usbip_stub_dev_t *devstub, unsigned int seqnum, usb_csp
 		break;
 	default:
 		DBGE(DBG_READWRITE, "not supported standard request\n");
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, seqnum, -1);
 		break;
 	}
 }
@@ -173,6 +185,10 @@ process_class_vendor_request(usbip_stub_dev_t *devstub, usb_cspkt_t *csp, struct
 		break;
 	}
 
+	/* Bulk-Only Mass Storage Reset discards commands in progress */
+	if (!vendorreq && csp->bmRequestType.Recipient == BMREQUEST_TO_INTERFACE && csp->bRequest == BOT_REQUEST_RESET)
+		stop_bot_accels(devstub, csp->wIndex.W, TRUE);
+
 	reservedBits = csp->bmRequestType.Reserved;
 	seqnum = hdr->base.seqnum;
 	res = submit_class_vendor_req(devstub, is_in, cmd, reservedBits, csp->bRequest, csp->wValue.W, csp->wIndex.W, data, &datalen);
@@ -208,7 +224,8 @@ process_control_transfer(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 		process_class_vendor_request(devstub, csp, hdr, TRUE);
 		break;
 	default:
-		DBGE(DBG_READWRITE, "invalid request type:", dbg_cspkt_reqtype(reqType));
+		DBGE(DBG_READWRITE, "invalid request type: %s\n", dbg_cspkt_reqtype(reqType));
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
 		break;
 	}
 }
@@ -217,12 +234,17 @@ static void
 process_bulk_intr_transfer(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe, struct usbip_header *hdr)
 {
 	PVOID	data;
-	ULONG	datalen;
+	ULONG	datalen, len_chunk;
 	BOOLEAN	is_in;
 	NTSTATUS	status;
 
 	DBGI(DBG_READWRITE, "bulk_intr_transfer: seq:%u, ep:%s\n", hdr->base.seqnum, dbg_info_pipe(info_pipe));
 
+	if (info_pipe->PipeType == UsbdPipeTypeInterrupt && submit_intr_poll_req(devstub, info_pipe, hdr))
+		return;
+	if (info_pipe->PipeType == UsbdPipeTypeBulk && submit_bot_req(devstub, info_pipe, hdr))
+		return;
+
 	datalen = (ULONG)hdr->u.cmd_submit.transfer_buffer_length;
 	is_in = hdr->base.direction ? TRUE : FALSE;
 	if (is_in) {
@@ -237,7 +259,11 @@ process_bulk_intr_transfer(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION inf
 		data = (PVOID)(hdr + 1);
 	}
 
-	status = submit_bulk_intr_transfer(devstub, info_pipe->PipeHandle, hdr->base.seqnum, data, datalen, is_in);
+	len_chunk = get_bulk_split_len(info_pipe);
+	if (len_chunk > 0 && datalen > len_chunk)
+		status = submit_bulk_split_transfer(devstub, info_pipe->PipeHandle, hdr->base.seqnum, data, datalen, len_chunk, is_in);
+	else
+		status = submit_bulk_intr_transfer(devstub, info_pipe->PipeHandle, hdr->base.seqnum, data, datalen, is_in);
 	if (NT_ERROR(status)) {
 		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
 		if (is_in)
@@ -258,6 +284,9 @@ process_iso_transfer(usbip_stub_dev_t *devstub, PUSBD_PIPE_INFORMATION info_pipe
 
 	DBGI(DBG_READWRITE, "iso_transfer: seq:%u, ep:%s\n", hdr->base.seqnum, dbg_info_pipe(info_pipe));
 
+	if (submit_iso_stream_req(devstub, info_pipe, hdr))
+		return;
+
 	is_in = hdr->base.direction ? TRUE : FALSE;
 	usbd_flags = to_usbd_flags(hdr->u.cmd_submit.transfer_flags);
 	n_pkts = hdr->u.cmd_submit.number_of_packets;
@@ -325,6 +354,7 @@ process_data_transfer(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 		break;
 	default:
 		DBGE(DBG_READWRITE, "not supported transfer type\n");
+		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
 		break;
 	}
 }
@@ -345,17 +375,18 @@ process_reset_pipe(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 
 	DBGI(DBG_READWRITE, "reset pipe: pipeHandle = %p\n", info_pipe->PipeHandle);
 
+	stop_intr_poll_pipe(devstub, info_pipe->PipeHandle);
+	stop_bot_accel_pipe(devstub, info_pipe->PipeHandle);
+
 	if (NT_SUCCESS(reset_pipe(devstub, info_pipe->PipeHandle)))
 		reply_stub_req_data(devstub, hdr->base.seqnum, NULL, 0, FALSE);
 	else
 		reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -8);
 }
 
-static NTSTATUS
-process_cmd_submit(usbip_stub_dev_t *devstub, PIRP irp, struct usbip_header *hdr)
+static void
+process_cmd_submit(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 {
-	PIO_STACK_LOCATION	irpstack;
-
 	if (HDR_IS_CONTROL_TRANSFER(hdr)) {
 		process_control_transfer(devstub, hdr);
 	}
@@ -368,21 +399,11 @@ process_cmd_submit(usbip_stub_dev_t *devstub, PIRP irp, struct usbip_header *hdr
 			process_data_transfer(devstub, hdr);
 		}
 	}
-
-	irpstack = IoGetCurrentIrpStackLocation(irp);
-
-	irp->IoStatus.Information = irpstack->Parameters.Write.Length;
-	irp->IoStatus.Status = STATUS_SUCCESS;
-	IoCompleteRequest(irp, IO_NO_INCREMENT);
-
-	return STATUS_SUCCESS;
 }
 
-static NTSTATUS
-process_cmd_unlink(usbip_stub_dev_t *devstub, PIRP irp, struct usbip_header *hdr)
+static void
+process_cmd_unlink(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
 {
-	PIO_STACK_LOCATION	irpstack;
-
 	DBGI(DBG_READWRITE, "process_cmd_unlink: enter\n");
 
 	if (cancel_pending_stub_res(devstub, hdr->u.cmd_unlink.seqnum)) {
@@ -391,50 +412,146 @@ process_cmd_unlink(usbip_stub_dev_t *devstub, PIRP irp, struct usbip_header *hdr
 	else {
 		reply_stub_req_err(devstub, USBIP_RET_UNLINK, hdr->base.seqnum, -1);
 	}
+}
 
-	irpstack = IoGetCurrentIrpStackLocation(irp);
+static void
+process_cmd_unlink_batch(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
+{
+	struct usbip_header_cmd_unlink_batch	*batch = &hdr->u.cmd_unlink_batch;
+	USBD_PIPE_HANDLE	hPipes[2];
+	int	n_pipes = 0;
+	ULONG	n_cancelled;
 
-	irp->IoStatus.Information = irpstack->Parameters.Write.Length;
-	irp->IoStatus.Status = STATUS_SUCCESS;
-	IoCompleteRequest(irp, IO_NO_INCREMENT);
+	DBGI(DBG_READWRITE, "process_cmd_unlink_batch: enter\n");
 
-	return STATUS_SUCCESS;
-}
+	if (batch->flags & USBIP_UNLINK_BATCH_EP) {
+		if (hdr->base.ep == 0) {
+			/* control transfers have no pipe */
+			hPipes[n_pipes++] = NULL;
+		}
+		else {
+			PUSBD_PIPE_INFORMATION	info_pipe;
+
+			/* an endpoint number may be used in both directions */
+			info_pipe = get_info_pipe(devstub->devconf, (UCHAR)(hdr->base.ep | USB_ENDPOINT_DIRECTION_MASK));
+			if (info_pipe != NULL)
+				hPipes[n_pipes++] = info_pipe->PipeHandle;
+			info_pipe = get_info_pipe(devstub->devconf, (UCHAR)hdr->base.ep);
+			if (info_pipe != NULL)
+				hPipes[n_pipes++] = info_pipe->PipeHandle;
+		}
+		n_cancelled = n_pipes > 0 ? cancel_pending_stub_res_batch(devstub, batch->seqnum_first, batch->seqnum_last, hPipes, n_pipes): 0;
+	}
+	else {
+		n_cancelled = cancel_pending_stub_res_batch(devstub, batch->seqnum_first, batch->seqnum_last, NULL, 0);
+	}
 
-static struct usbip_header *
-get_usbip_hdr_from_write_irp(PIRP irp)
-{
-	PIO_STACK_LOCATION	irpstack;
-	ULONG	len;
+	DBGI(DBG_READWRITE, "process_cmd_unlink_batch: %u cancelled\n", n_cancelled);
 
-	irpstack = IoGetCurrentIrpStackLocation(irp);
-	len = irpstack->Parameters.Write.Length;
-	if (len < sizeof(struct usbip_header)) {
-		return NULL;
+	if (n_cancelled > 0) {
+		reply_stub_req_hdr(devstub, USBIP_RET_UNLINK, hdr->base.seqnum);
+	}
+	else {
+		reply_stub_req_err(devstub, USBIP_RET_UNLINK, hdr->base.seqnum, -1);
 	}
-	return (struct usbip_header *)irp->AssociatedIrp.SystemBuffer;
 }
 
-NTSTATUS
-stub_dispatch_write(usbip_stub_dev_t *devstub, IRP *irp)
+/*
+ * Get the whole length of a PDU including its header.
+ * FALSE is returned if the header has a bogus length, which makes it impossible
+ * to locate a next PDU in the same write buffer.
+ */
+static BOOLEAN
+get_pdu_len(struct usbip_header *hdr, ULONG *plen)
 {
-	struct usbip_header	*hdr;
+	ULONG	len_data = 0;
 
-	hdr = get_usbip_hdr_from_write_irp(irp);
-	if (hdr == NULL) {
-		DBGE(DBG_READWRITE, "small write irp\n");
-		return STATUS_INVALID_PARAMETER;
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		if (hdr->u.cmd_submit.transfer_buffer_length < 0 || hdr->u.cmd_submit.number_of_packets > USBIP_MAX_ISO_PACKETS)
+			return FALSE;
+		if (!hdr->base.direction)
+			len_data = (ULONG)hdr->u.cmd_submit.transfer_buffer_length;
+		if (hdr->u.cmd_submit.number_of_packets > 0)
+			len_data += sizeof(struct usbip_iso_packet_descriptor) * hdr->u.cmd_submit.number_of_packets;
+		break;
+	case USBIP_CMD_UNLINK:
+	case USBIP_CMD_UNLINK_BATCH:
+		break;
+	default:
+		return FALSE;
 	}
+	*plen = sizeof(struct usbip_header) + len_data;
+	return TRUE;
+}
 
+static void
+process_pdu(usbip_stub_dev_t *devstub, struct usbip_header *hdr)
+{
 	DBGI(DBG_GENERAL | DBG_READWRITE, "dispatch_write: hdr: %s\n", dbg_usbip_hdr(hdr));
 
 	switch (hdr->base.command) {
 	case USBIP_CMD_SUBMIT:
-		return process_cmd_submit(devstub, irp, hdr);
+		process_cmd_submit(devstub, hdr);
+		break;
 	case USBIP_CMD_UNLINK:
-		return process_cmd_unlink(devstub, irp, hdr);
+		process_cmd_unlink(devstub, hdr);
+		break;
+	case USBIP_CMD_UNLINK_BATCH:
+		process_cmd_unlink_batch(devstub, hdr);
+		break;
 	default:
-		DBGE(DBG_READWRITE, "invalid command: %s\n", dbg_command(hdr->base.command));
-		return STATUS_INVALID_PARAMETER;
+		/* NOT REACHED: get_pdu_len() filters out an invalid command */
+		break;
 	}
 }
+
+/*
+ * A write irp may carry multiple consecutive PDUs.
+ * All complete PDUs are dispatched in order and the consumed length is returned as irp information.
+ * A trailing partial PDU is left unconsumed. Errors in an individual PDU are reported through
+ * its RET_SUBMIT or RET_UNLINK status instead of failing the whole irp.
+ */
+NTSTATUS
+stub_dispatch_write(usbip_stub_dev_t *devstub, IRP *irp)
+{
+	PIO_STACK_LOCATION	irpstack;
+	char	*buf;
+	ULONG	len, offset = 0;
+	NTSTATUS	status = STATUS_SUCCESS;
+
+	irpstack = IoGetCurrentIrpStackLocation(irp);
+	len = irpstack->Parameters.Write.Length;
+	buf = (char *)irp->AssociatedIrp.SystemBuffer;
+
+	while (len - offset >= sizeof(struct usbip_header)) {
+		struct usbip_header	*hdr = (struct usbip_header *)(buf + offset);
+		ULONG	len_pdu;
+
+		if (!get_pdu_len(hdr, &len_pdu)) {
+			DBGE(DBG_READWRITE, "invalid pdu: %s\n", dbg_usbip_hdr(hdr));
+			if (hdr->base.command == USBIP_CMD_SUBMIT)
+				reply_stub_req_err(devstub, USBIP_RET_SUBMIT, hdr->base.seqnum, -1);
+			/* no way to find a next pdu. Drop the remaining buffer. */
+			offset = len;
+			break;
+		}
+		if (len_pdu > len - offset) {
+			DBGW(DBG_READWRITE, "partial pdu: %u < %u\n", len - offset, len_pdu);
+			break;
+		}
+		process_pdu(devstub, hdr);
+		offset += len_pdu;
+	}
+
+	if (offset == 0) {
+		DBGE(DBG_READWRITE, "small write irp\n");
+		status = STATUS_INVALID_PARAMETER;
+	}
+
+	irp->IoStatus.Information = offset;
+	irp->IoStatus.Status = status;
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+	return status;
+}
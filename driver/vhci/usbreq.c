@@ -3,6 +3,7 @@
 #include "usbip_proto.h"
 #include "usbip_vhci_api.h"
 #include "usbreq.h"
+#include "vhci_reg.h"
 
 extern NTSTATUS
 store_urbr(PIRP irp, struct urb_req *urbr);
@@ -55,26 +56,129 @@ find_sent_urbr(pusbip_vpdo_dev_t vpdo, struct usbip_header *hdr)
 	return NULL;
 }
 
+/*
+ * An urb_req of an endpoint is always sent in order. Across endpoints, a scheduler of
+ * vhci_sched_params decides. Should be called with lock_urbr held.
+ */
 struct urb_req *
 find_pending_urbr(pusbip_vpdo_dev_t vpdo)
 {
 	struct urb_req	*urbr;
+	ULONG	epq;
 
-	if (IsListEmpty(&vpdo->head_urbr_pending))
+	epq = vhci_sched_pick(&vpdo->sched);
+	if (epq == VHCI_N_EPQS)
 		return NULL;
 
-	urbr = CONTAINING_RECORD(vpdo->head_urbr_pending.Flink, struct urb_req, list_state);
+	urbr = CONTAINING_RECORD(vpdo->epqs[epq].head_pending.Flink, struct urb_req, list_state);
 	urbr->seq_num = ++(vpdo->seq_num);
 	RemoveEntryListInit(&urbr->list_state);
 	return urbr;
 }
 
+static PURB
+get_irp_urb(PIRP irp)
+{
+	PIO_STACK_LOCATION	irpstack;
+
+	irpstack = IoGetCurrentIrpStackLocation(irp);
+	if (irpstack->Parameters.DeviceIoControl.IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)
+		return NULL;
+	return irpstack->Parameters.Others.Argument1;
+}
+
+static USBD_PIPE_HANDLE
+get_irp_pipe(PIRP irp)
+{
+	PURB	urb = get_irp_urb(irp);
+
+	if (urb == NULL)
+		return NULL;
+
+	switch (urb->UrbHeader.Function) {
+	case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+		return urb->UrbBulkOrInterruptTransfer.PipeHandle;
+	case URB_FUNCTION_ISOCH_TRANSFER:
+		return urb->UrbIsochronousTransfer.PipeHandle;
+	default:
+		return NULL;
+	}
+}
+
+static ULONG
+get_irp_epq(PIRP irp)
+{
+	USBD_PIPE_HANDLE	hPipe;
+
+	if (irp == NULL)
+		return VHCI_EPQ_UNLINK;
+	hPipe = get_irp_pipe(irp);
+	if (hPipe == NULL)
+		return VHCI_EPQ_CONTROL;
+	return VHCI_EPQ_EP((INT_PTR)hPipe & 0xff);
+}
+
+/* a transfer buffer length which a scheduler weighs */
+static ULONG
+get_urbr_len(struct urb_req *urbr)
+{
+	PURB	urb;
+
+	if (urbr->irp == NULL)
+		return 0;
+	urb = get_irp_urb(urbr->irp);
+	if (urb == NULL)
+		return 0;
+
+	switch (urb->UrbHeader.Function) {
+	case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+		return urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
+	case URB_FUNCTION_ISOCH_TRANSFER:
+		return urb->UrbIsochronousTransfer.TransferBufferLength;
+	case URB_FUNCTION_CONTROL_TRANSFER:
+		return urb->UrbControlTransfer.TransferBufferLength;
+	case URB_FUNCTION_CONTROL_TRANSFER_EX:
+		return urb->UrbControlTransferEx.TransferBufferLength;
+	default:
+		return 0;
+	}
+}
+
+static BOOLEAN
+peek_epq(void *ctx, ULONG epq, ULONG *plen, ULONG *porder)
+{
+	pusbip_vpdo_dev_t	vpdo = (pusbip_vpdo_dev_t)ctx;
+	struct urb_req	*urbr;
+
+	if (IsListEmpty(&vpdo->epqs[epq].head_pending))
+		return FALSE;
+	urbr = CONTAINING_RECORD(vpdo->epqs[epq].head_pending.Flink, struct urb_req, list_state);
+	*plen = get_urbr_len(urbr);
+	*porder = urbr->order;
+	return TRUE;
+}
+
+void
+init_urbr_epqs(pusbip_vpdo_dev_t vpdo)
+{
+	ULONG	i;
+
+	for (i = 0; i < VHCI_N_EPQS; i++) {
+		InitializeListHead(&vpdo->epqs[i].head_all);
+		InitializeListHead(&vpdo->epqs[i].head_pending);
+	}
+	vhci_sched_init(&vpdo->sched, &vhci_sched_params, peek_epq, vpdo);
+	vhci_sched_set_type(&vpdo->sched, VHCI_EPQ_UNLINK, VHCI_SCHED_UNLINK);
+}
+
+/* only the queue of an endpoint which irp is for is looked into */
 static struct urb_req *
 find_urbr_with_irp(pusbip_vpdo_dev_t vpdo, PIRP irp)
 {
+	PLIST_ENTRY	head = &vpdo->epqs[get_irp_epq(irp)].head_all;
 	PLIST_ENTRY	le;
 
-	for (le = vpdo->head_urbr.Flink; le != &vpdo->head_urbr; le = le->Flink) {
+	for (le = head->Flink; le != head; le = le->Flink) {
 		struct urb_req	*urbr;
 
 		urbr = CONTAINING_RECORD(le, struct urb_req, list_all);
@@ -85,14 +189,22 @@ find_urbr_with_irp(pusbip_vpdo_dev_t vpdo, PIRP irp)
 	return NULL;
 }
 
-static void
-submit_urbr_unlink(pusbip_vpdo_dev_t vpdo, unsigned long seq_num_unlink)
+/*
+ * seq_num_unlink_last and ep are for CMD_UNLINK_BATCH, which is used only if a server takes it.
+ * Otherwise, a single seq_num_unlink should be given.
+ */
+void
+submit_urbr_unlink(pusbip_vpdo_dev_t vpdo, unsigned long seq_num_unlink, unsigned long seq_num_unlink_last, int ep)
 {
 	struct urb_req	*urbr_unlink;
 
 	urbr_unlink = create_urbr(vpdo, NULL, seq_num_unlink);
 	if (urbr_unlink != NULL) {
-		NTSTATUS	status = submit_urbr(vpdo, urbr_unlink);
+		NTSTATUS	status;
+
+		urbr_unlink->seq_num_unlink_last = seq_num_unlink_last;
+		urbr_unlink->ep_unlink = ep;
+		status = submit_urbr(vpdo, urbr_unlink);
 		if (NT_ERROR(status)) {
 			DBGI(DBG_GENERAL, "failed to submit unlink urb: %s\n", dbg_urbr(urbr_unlink));
 			free_urbr(urbr_unlink);
@@ -100,10 +212,78 @@ submit_urbr_unlink(pusbip_vpdo_dev_t vpdo, unsigned long seq_num_unlink)
 	}
 }
 
+static int
+get_urbr_ep(struct urb_req *urbr)
+{
+	if (urbr->epq < VHCI_EPQ_EP(0))
+		return 0;
+	return (urbr->epq - VHCI_EPQ_EP(0)) & 0x0f;
+}
+
+static BOOLEAN
+is_urbr_in_unlink(struct urb_req *urbr, unsigned long first, unsigned long last, int ep)
+{
+	if (urbr == NULL || urbr->irp == NULL)
+		return FALSE;
+	if (!USBIP_UNLINK_BATCH_HAS(first, last, urbr->seq_num))
+		return FALSE;
+	return ep < 0 || get_urbr_ep(urbr) == ep;
+}
+
+/* A server may still process an urbr which has been sent. A batch unlink should not cover it. */
+static BOOLEAN
+has_sent_urbr_in_unlink(pusbip_vpdo_dev_t vpdo, unsigned long first, unsigned long last, int ep)
+{
+	PLIST_ENTRY	le;
+
+	if (is_urbr_in_unlink(vpdo->urbr_sent_partial, first, last, ep))
+		return TRUE;
+	for (le = vpdo->head_urbr_sent.Flink; le != &vpdo->head_urbr_sent; le = le->Flink) {
+		struct urb_req	*urbr = CONTAINING_RECORD(le, struct urb_req, list_state);
+
+		if (is_urbr_in_unlink(urbr, first, last, ep))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Cancellations often come in a burst. If an unlink of the same endpoint is still pending,
+ * seq_num is merged into it instead of another unlink. Should be called with lock_urbr held.
+ */
+static BOOLEAN
+merge_urbr_unlink(pusbip_vpdo_dev_t vpdo, unsigned long seq_num, int ep)
+{
+	PLIST_ENTRY	head = &vpdo->epqs[VHCI_EPQ_UNLINK].head_pending;
+	PLIST_ENTRY	le;
+
+	for (le = head->Blink; le != head; le = le->Blink) {
+		struct urb_req	*urbr = CONTAINING_RECORD(le, struct urb_req, list_state);
+		unsigned long	first, last;
+
+		if (urbr->ep_unlink != ep)
+			continue;
+
+		first = urbr->seq_num_unlink;
+		last = urbr->seq_num_unlink_last;
+		if ((long)(seq_num - first) < 0)
+			first = seq_num;
+		else if ((long)(seq_num - last) > 0)
+			last = seq_num;
+		if (has_sent_urbr_in_unlink(vpdo, first, last, ep))
+			return FALSE;
+		urbr->seq_num_unlink = first;
+		urbr->seq_num_unlink_last = last;
+		return TRUE;
+	}
+	return FALSE;
+}
+
 static void
 remove_cancelled_urbr(pusbip_vpdo_dev_t vpdo, PIRP irp)
 {
 	struct urb_req	*urbr;
+	BOOLEAN	merged = FALSE;
 
 	KeAcquireSpinLockAtDpcLevel(&vpdo->lock_urbr);
 
@@ -115,6 +295,8 @@ remove_cancelled_urbr(pusbip_vpdo_dev_t vpdo, PIRP irp)
 			vpdo->urbr_sent_partial = NULL;
 			vpdo->len_sent_partial = 0;
 		}
+		if (vpdo->unlink_batch && urbr->seq_num != 0)
+			merged = merge_urbr_unlink(vpdo, urbr->seq_num, get_urbr_ep(urbr));
 	}
 	else {
 		DBGW(DBG_URB, "no matching urbr\n");
@@ -123,7 +305,9 @@ remove_cancelled_urbr(pusbip_vpdo_dev_t vpdo, PIRP irp)
 	KeReleaseSpinLockFromDpcLevel(&vpdo->lock_urbr);
 
 	if (urbr != NULL) {
-		submit_urbr_unlink(vpdo, urbr->seq_num);
+		/* an urbr which has never been sent needs no unlink */
+		if (!merged && urbr->seq_num != 0)
+			submit_urbr_unlink(vpdo, urbr->seq_num, urbr->seq_num, vpdo->unlink_batch ? get_urbr_ep(urbr): -1);
 
 		DBGI(DBG_GENERAL, "cancelled urb destroyed: %s\n", dbg_urbr(urbr));
 		free_urbr(urbr);
@@ -159,6 +343,9 @@ create_urbr(pusbip_vpdo_dev_t vpdo, PIRP irp, unsigned long seq_num_unlink)
 	urbr->vpdo = vpdo;
 	urbr->irp = irp;
 	urbr->seq_num_unlink = seq_num_unlink;
+	urbr->seq_num_unlink_last = seq_num_unlink;
+	urbr->ep_unlink = -1;
+	urbr->epq = get_irp_epq(irp);
 	InitializeListHead(&urbr->list_all);
 	InitializeListHead(&urbr->list_state);
 	return urbr;
@@ -172,36 +359,27 @@ free_urbr(struct urb_req *urbr)
 	ExFreeToNPagedLookasideList(&g_lookaside, urbr);
 }
 
-BOOLEAN
-is_port_urbr(struct urb_req *urbr, unsigned char epaddr)
+/* returns a pipe handle of a bulk, interrupt or isochronous transfer, or NULL */
+USBD_PIPE_HANDLE
+get_urbr_pipe(struct urb_req *urbr)
 {
-	PIRP	irp = urbr->irp;
-	PURB	urb;
-	PIO_STACK_LOCATION	irpstack;
-	USBD_PIPE_HANDLE	hPipe;
-
-	if (irp == NULL)
-		return FALSE;
-
-	irpstack = IoGetCurrentIrpStackLocation(irp);
-	urb = irpstack->Parameters.Others.Argument1;
-	if (urb == NULL)
-		return FALSE;
-
-	switch (urb->UrbHeader.Function) {
-	case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
-		hPipe = urb->UrbBulkOrInterruptTransfer.PipeHandle;
-		break;
-	case URB_FUNCTION_ISOCH_TRANSFER:
-		hPipe = urb->UrbIsochronousTransfer.PipeHandle;
-		break;
-	default:
-		return FALSE;
-	}
+	if (urbr->irp == NULL)
+		return NULL;
+	return get_irp_pipe(urbr->irp);
+}
 
-	if (PIPE2ADDR(hPipe) == epaddr)
-		return TRUE;
-	return FALSE;
+static void
+insert_urbr_epq(pusbip_vpdo_dev_t vpdo, struct urb_req *urbr, BOOLEAN pending)
+{
+	vhci_epq_t	*epq = vpdo->epqs + urbr->epq;
+
+	/* a pipe type is the same as a queue type of a scheduler */
+	if (urbr->epq >= VHCI_EPQ_EP(0))
+		vhci_sched_set_type(&vpdo->sched, urbr->epq, PIPE2TYPE(get_urbr_pipe(urbr)));
+	urbr->order = vpdo->order_urbr++;
+	if (pending)
+		InsertTailList(&epq->head_pending, &urbr->list_state);
+	InsertTailList(&epq->head_all, &urbr->list_all);
 }
 
 NTSTATUS
@@ -218,8 +396,7 @@ submit_urbr(pusbip_vpdo_dev_t vpdo, struct urb_req *urbr)
 			IoSetCancelRoutine(urbr->irp, cancel_urbr);
 			IoMarkIrpPending(urbr->irp);
 		}
-		InsertTailList(&vpdo->head_urbr_pending, &urbr->list_state);
-		InsertTailList(&vpdo->head_urbr, &urbr->list_all);
+		insert_urbr_epq(vpdo, urbr, TRUE);
 		KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
 		DBGI(DBG_URB, "submit_urbr: urb pending\n");
@@ -247,7 +424,7 @@ submit_urbr(pusbip_vpdo_dev_t vpdo, struct urb_req *urbr)
 			InsertTailList(&vpdo->head_urbr_sent, &urbr->list_state);
 		}
 
-		InsertTailList(&vpdo->head_urbr, &urbr->list_all);
+		insert_urbr_epq(vpdo, urbr, FALSE);
 
 		read_irp = vpdo->pending_read_irp;
 		vpdo->pending_read_irp = NULL;
@@ -17,6 +17,14 @@ struct urb_req {
 	PIRP	irp;
 	KEVENT	*event;
 	unsigned long	seq_num, seq_num_unlink;
+	/* CMD_UNLINK_BATCH up to seq_num_unlink_last if it differs from seq_num_unlink */
+	unsigned long	seq_num_unlink_last;
+	/* endpoint number which CMD_UNLINK_BATCH is limited to, or -1 */
+	int	ep_unlink;
+	/* index of an endpoint queue of vpdo */
+	ULONG	epq;
+	/* order of submission across endpoints */
+	ULONG	order;
 	LIST_ENTRY	list_all;
 	LIST_ENTRY	list_state;
 };
@@ -26,6 +34,9 @@ struct urb_req {
 extern void
 build_setup_packet(usb_cspkt_t *csp, unsigned char direct_in, unsigned char type, unsigned char recip, unsigned char request);
 
+extern void
+init_urbr_epqs(pusbip_vpdo_dev_t vpdo);
+
 extern NTSTATUS
 submit_urbr(pusbip_vpdo_dev_t vpdo, struct urb_req *urbr);
 
@@ -35,5 +46,8 @@ create_urbr(pusbip_vpdo_dev_t vpdo, PIRP irp, unsigned long seq_num_unlink);
 extern void
 free_urbr(struct urb_req *urbr);
 
-extern BOOLEAN
-is_port_urbr(struct urb_req *urbr, unsigned char epaddr);
+extern void
+submit_urbr_unlink(pusbip_vpdo_dev_t vpdo, unsigned long seq_num_unlink, unsigned long seq_num_unlink_last, int ep);
+
+extern USBD_PIPE_HANDLE
+get_urbr_pipe(struct urb_req *urbr);
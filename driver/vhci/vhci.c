@@ -5,6 +5,8 @@
 #include "globals.h"
 #include "usbreq.h"
 #include "vhci_pnp.h"
+#include "vhci_port.h"
+#include "vhci_reg.h"
 
 //
 // Global Debug Level
@@ -104,6 +106,7 @@ vhci_cleanup(__in PDEVICE_OBJECT devobj, __in PIRP irp)
 	pusbip_vhub_dev_t	vhub;
 	pusbip_vpdo_dev_t	vpdo;
 	pdev_common_t		devcom;
+	ULONG			port_alloc;
 
 	PAGED_CODE();
 
@@ -131,6 +134,10 @@ vhci_cleanup(__in PDEVICE_OBJECT devobj, __in PIRP irp)
 		return status;
 	}
 	irpstack = IoGetCurrentIrpStackLocation(irp);
+	// a port allocated without a plugin
+	port_alloc = (ULONG)(ULONG_PTR)InterlockedExchangePointer(&irpstack->FileObject->FsContext2, NULL);
+	if (port_alloc != 0)
+		vhci_release_port(vhub, port_alloc);
 	vpdo = irpstack->FileObject->FsContext;
 	if (vpdo) {
 		vpdo->fo = NULL;
@@ -207,6 +214,8 @@ DriverEntry(__in PDRIVER_OBJECT drvobj, __in PUNICODE_STRING RegistryPath)
 
 	RtlCopyUnicodeString(&Globals.RegistryPath, RegistryPath);
 
+	reg_get_params(RegistryPath);
+
 	// Set entry points into the driver
 	drvobj->MajorFunction[IRP_MJ_CREATE] = vhci_create;
 	drvobj->MajorFunction[IRP_MJ_CLEANUP] = vhci_cleanup;
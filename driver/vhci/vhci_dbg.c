@@ -13,6 +13,8 @@ static namecode_t	namecodes_vhci_ioctl[] = {
 	K_V(IOCTL_USBIP_VHCI_UNPLUG_HARDWARE)
 	K_V(IOCTL_USBIP_VHCI_EJECT_HARDWARE)
 	K_V(IOCTL_USBIP_VHCI_GET_PORTS_STATUS)
+	K_V(IOCTL_USBIP_VHCI_ALLOC_PORT)
+	K_V(IOCTL_USBIP_VHCI_GET_FRAME_STATS)
 	K_V(IOCTL_INTERNAL_USB_CYCLE_PORT)
 	K_V(IOCTL_INTERNAL_USB_ENABLE_PORT)
 	K_V(IOCTL_INTERNAL_USB_GET_BUS_INFO)
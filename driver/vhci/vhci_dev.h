@@ -4,6 +4,9 @@
 #include <wmilib.h>	// required for WMILIB_CONTEXT
 
 #include "vhci_devconf.h"
+#include "usbip_vhci_api.h"
+#include "vhci_frame.h"
+#include "vhci_sched.h"
 
 #define DEVOBJ_FROM_VPDO(vpdo)	((vpdo)->common.Self)
 
@@ -49,6 +52,7 @@ typedef struct {
 } dev_common_t, *pdev_common_t;
 
 struct urb_req;
+struct _usbip_vpdo_dev;
 
 // The device extension of the vhub.  From whence vpdo's are born.
 typedef struct
@@ -66,6 +70,12 @@ typedef struct
 	// the number of current vpdo's
 	ULONG		n_vpdos;
 
+	// claimed ports, a bit per port from port 1
+	LONG		port_bits[USBIP_VHCI_MAX_PORTS / 32];
+
+	// vpdo's holding a port, indexed by port - 1 and protected by Mutex
+	struct _usbip_vpdo_dev	*vpdos[USBIP_VHCI_MAX_PORTS];
+
 	// A synchronization for access to the device extension.
 	FAST_MUTEX		Mutex;
 
@@ -80,6 +90,9 @@ typedef struct
 	// This event is set when the Outstanding IO count goes to 1.
 	KEVENT		StopEvent;
 
+	// This event is set when unplugged vpdo's have been reported missing to the PnP manager.
+	KEVENT		ReportedMissingEvent;
+
 	// The name returned from IoRegisterDeviceInterface,
 	// which is used as a handle for IoSetDeviceInterfaceState.
 	UNICODE_STRING	InterfaceName;
@@ -90,9 +103,25 @@ typedef struct
 	USBIP_BUS_WMI_STD_DATA	StdUSBIPBusData;
 } usbip_vhub_dev_t, *pusbip_vhub_dev_t;
 
+// urb_req's are queued per endpoint. Unlink urb_req's have their own queue.
+#define VHCI_EPQ_UNLINK		0
+// control transfers and requests without a pipe
+#define VHCI_EPQ_CONTROL	1
+// 16 OUT endpoints and then 16 IN endpoints by an endpoint address
+#define VHCI_EPQ_EP(epaddr)	(2 + ((epaddr) & 0x0f) + (((epaddr) & 0x80) ? 16: 0))
+// a queue of a scheduler is an endpoint queue
+#define VHCI_N_EPQS		VHCI_SCHED_N_QUEUES
+
+typedef struct {
+	// all urb_req's of an endpoint. This list will be used for clear or cancellation.
+	LIST_ENTRY	head_all;
+	// pending urb_req's which are not transferred yet
+	LIST_ENTRY	head_pending;
+} vhci_epq_t;
+
 // The device extension for the vpdo.
 // That's of the USBIP device which this bus driver enumerates.
-typedef struct
+typedef struct _usbip_vpdo_dev
 {
 	dev_common_t	common;
 
@@ -121,7 +150,8 @@ typedef struct
 	BOOLEAN		Present;
 	BOOLEAN		ReportedMissing;
 	UCHAR	speed;
-	UCHAR	unused; /* 4 bytes alignment */
+	// a server takes CMD_UNLINK_BATCH
+	BOOLEAN	unlink_batch;
 
 	// Used to track the intefaces handed out to other drivers.
 	// If this value is non-zero, we fail query-remove.
@@ -132,10 +162,12 @@ typedef struct
 	struct urb_req	*urbr_sent_partial;
 	// a partially transferred length of urbr_sent_partial
 	ULONG	len_sent_partial;
-	// all urb_req's. This list will be used for clear or cancellation.
-	LIST_ENTRY	head_urbr;
-	// pending urb_req's which are not transferred yet
-	LIST_ENTRY	head_urbr_pending;
+	// urb_req's of each endpoint
+	vhci_epq_t	epqs[VHCI_N_EPQS];
+	// which endpoint queue is served next
+	vhci_sched_t	sched;
+	// order of submission of the next urb_req
+	ULONG	order_urbr;
 	// urb_req's which had been sent and have waited for response
 	LIST_ENTRY	head_urbr_sent;
 	KSPIN_LOCK	lock_urbr;
@@ -146,6 +178,8 @@ typedef struct
 	KTIMER	timer;
 	KDPC	dpc;
 	UNICODE_STRING	usb_dev_interface;
+	// frame numbers of isochronous transfers
+	vhci_frame_clock_t	frame_clock;
 
 	//
 	// In order to reduce the complexity of the driver, I chose not
@@ -0,0 +1,164 @@
+#include "vhci.h"
+
+#include "usbip_proto.h"
+#include "vhci_frame.h"
+
+/*
+ * Frame clock
+ *
+ * A local frame is counted from the interrupt time at a plugin, so that it never goes backwards
+ * and never depends on a server. offset maps a local frame to a remote one. It is set by the first
+ * isochronous RET_SUBMIT, where the frame after its last packet is taken as the frame at which
+ * it arrives, and then follows later ones smoothly. A sample too far from offset, which happens
+ * when a server restarts its schedule, sets offset again.
+ */
+
+/* offset and samples are fixed point of 1/FRAME_FRAC frames */
+#define FRAME_FRAC		16
+/* a sample is regarded as a jump of a remote schedule if its skew is over this */
+#define FRAME_RESYNC_SKEW	(16 * FRAME_FRAC)
+/* offset approaches a sample by 1/FRAME_SMOOTH of its skew */
+#define FRAME_SMOOTH		8
+
+/* start_frame of a server is of microframes for high speed or faster */
+#define IS_MICROFRAME(speed)	((speed) >= USB_SPEED_HIGH && (speed) != USB_SPEED_WIRELESS)
+
+/* wraps diff into [-wrap / 2, wrap / 2) */
+static LONG
+wrap_diff(LONG diff, LONG wrap)
+{
+	diff %= wrap;
+	if (diff < -wrap / 2)
+		diff += wrap;
+	else if (diff >= wrap / 2)
+		diff -= wrap;
+	return diff;
+}
+
+/* rounds a fixed point value to frames */
+static LONG
+to_frames(LONG frac)
+{
+	if (frac >= 0)
+		return (frac + FRAME_FRAC / 2) / FRAME_FRAC;
+	return -((-frac + FRAME_FRAC / 2) / FRAME_FRAC);
+}
+
+static ULONG
+remote_frame(UCHAR speed, ULONG start_frame)
+{
+	if (IS_MICROFRAME(speed))
+		start_frame >>= 3;
+	return start_frame % VHCI_FRAME_WRAP;
+}
+
+static LONG
+get_offset(vhci_frame_clock_t *clock)
+{
+	KIRQL	oldirql;
+	LONG	offset;
+
+	KeAcquireSpinLock(&clock->lock, &oldirql);
+	offset = clock->offset;
+	KeReleaseSpinLock(&clock->lock, oldirql);
+	return offset;
+}
+
+void
+vhci_frame_init(vhci_frame_clock_t *clock)
+{
+	RtlZeroMemory(clock, sizeof(*clock));
+	KeInitializeSpinLock(&clock->lock);
+	clock->base_time = KeQueryInterruptTime();
+}
+
+ULONG
+vhci_frame_current(vhci_frame_clock_t *clock)
+{
+	/* interrupt time is of 100 ns */
+	return (ULONG)((KeQueryInterruptTime() - clock->base_time) / 10000);
+}
+
+ULONG
+vhci_frame_to_remote(vhci_frame_clock_t *clock, UCHAR speed, ULONG frame)
+{
+	KIRQL	oldirql;
+	LONG	offset;
+	ULONG	remote;
+
+	KeAcquireSpinLock(&clock->lock, &oldirql);
+	if ((LONG)(frame - vhci_frame_current(clock)) < 0)
+		clock->n_late++;
+	offset = clock->offset;
+	KeReleaseSpinLock(&clock->lock, oldirql);
+
+	remote = (frame + (ULONG)to_frames(offset)) % VHCI_FRAME_WRAP;
+	if (IS_MICROFRAME(speed))
+		remote <<= 3;
+	return remote;
+}
+
+ULONG
+vhci_frame_from_remote(vhci_frame_clock_t *clock, UCHAR speed, ULONG start_frame)
+{
+	ULONG	now, local;
+
+	now = vhci_frame_current(clock);
+	local = remote_frame(speed, start_frame) - (ULONG)to_frames(get_offset(clock));
+	/* a local frame nearest to now among ones which wrap to the same remote frame */
+	return now + wrap_diff((LONG)((local - now) % VHCI_FRAME_WRAP), VHCI_FRAME_WRAP);
+}
+
+void
+vhci_frame_sync(vhci_frame_clock_t *clock, UCHAR speed, ULONG start_frame, ULONG n_packets)
+{
+	KIRQL	oldirql;
+	ULONG	now;
+	LONG	sample, skew;
+
+	/* 1/FRAME_FRAC ms is 625 of 100 ns */
+	now = (ULONG)((KeQueryInterruptTime() - clock->base_time) / (10000 / FRAME_FRAC));
+	sample = (LONG)(remote_frame(speed, start_frame + n_packets) * FRAME_FRAC - now);
+	sample = wrap_diff(sample, VHCI_FRAME_WRAP * FRAME_FRAC);
+
+	KeAcquireSpinLock(&clock->lock, &oldirql);
+	clock->n_samples++;
+	if (!clock->synced) {
+		clock->offset = sample;
+		clock->synced = TRUE;
+	}
+	else {
+		skew = wrap_diff(sample - clock->offset, VHCI_FRAME_WRAP * FRAME_FRAC);
+		if (skew > FRAME_RESYNC_SKEW || skew < -FRAME_RESYNC_SKEW) {
+			clock->offset = sample;
+			clock->n_resyncs++;
+		}
+		else {
+			ULONG	skew_us = (ULONG)(skew < 0 ? -skew: skew) * 1000 / FRAME_FRAC;
+
+			clock->offset = wrap_diff(clock->offset + skew / FRAME_SMOOTH, VHCI_FRAME_WRAP * FRAME_FRAC);
+			clock->skew_sum += skew_us;
+			if (clock->skew_max < skew_us)
+				clock->skew_max = skew_us;
+		}
+	}
+	KeReleaseSpinLock(&clock->lock, oldirql);
+}
+
+void
+vhci_frame_get_stats(vhci_frame_clock_t *clock, ioctl_usbip_vhci_frame_stats *stats)
+{
+	KIRQL	oldirql;
+
+	stats->frame = vhci_frame_current(clock);
+
+	KeAcquireSpinLock(&clock->lock, &oldirql);
+	stats->offset = clock->offset;
+	stats->synced = clock->synced;
+	stats->n_samples = clock->n_samples;
+	stats->n_resyncs = clock->n_resyncs;
+	stats->n_late = clock->n_late;
+	stats->skew_max = clock->skew_max;
+	stats->skew_sum = clock->skew_sum;
+	KeReleaseSpinLock(&clock->lock, oldirql);
+}
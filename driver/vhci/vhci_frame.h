@@ -0,0 +1,49 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "usbip_vhci_api.h"
+
+/*
+ * A frame clock of a vpdo counts 1 ms frames, which USBD uses as a frame number of all speeds.
+ * It follows start frames returned by a server, which are frames of full speed and microframes
+ * of high speed, modulo VHCI_FRAME_WRAP frames.
+ */
+#define VHCI_FRAME_WRAP		1024
+
+typedef struct {
+	/* interrupt time of frame 0 */
+	ULONGLONG	base_time;
+	KSPIN_LOCK	lock;
+	BOOLEAN		synced;
+	/* remote frame minus local frame, in 1/16 frames */
+	LONG		offset;
+	ULONG		n_samples;
+	ULONG		n_resyncs;
+	ULONG		n_late;
+	/* skew of a sample from offset, in usec */
+	ULONG		skew_max;
+	ULONGLONG	skew_sum;
+} vhci_frame_clock_t;
+
+void
+vhci_frame_init(vhci_frame_clock_t *clock);
+
+ULONG
+vhci_frame_current(vhci_frame_clock_t *clock);
+
+/* start_frame of CMD_SUBMIT for an explicit StartFrame */
+ULONG
+vhci_frame_to_remote(vhci_frame_clock_t *clock, UCHAR speed, ULONG frame);
+
+/* StartFrame for start_frame of RET_SUBMIT */
+ULONG
+vhci_frame_from_remote(vhci_frame_clock_t *clock, UCHAR speed, ULONG start_frame);
+
+/* feeds start_frame of an isochronous RET_SUBMIT of n_packets, which has just arrived */
+void
+vhci_frame_sync(vhci_frame_clock_t *clock, UCHAR speed, ULONG start_frame, ULONG n_packets);
+
+/* fills stats other than port */
+void
+vhci_frame_get_stats(vhci_frame_clock_t *clock, ioctl_usbip_vhci_frame_stats *stats);
@@ -8,18 +8,33 @@
 extern PAGEABLE NTSTATUS
 vhci_plugin_dev(ioctl_usbip_vhci_plugin *plugin, pusbip_vhub_dev_t vhub, PFILE_OBJECT fo);
 
+extern PAGEABLE NTSTATUS
+vhci_alloc_port(ioctl_usbip_vhci_alloc_port *alloc, pusbip_vhub_dev_t vhub, PFILE_OBJECT fo, ULONG *info);
+
 extern PAGEABLE NTSTATUS
 vhci_get_ports_status(ioctl_usbip_vhci_get_ports_status *st, pusbip_vhub_dev_t vhub, ULONG *info);
 
+extern PAGEABLE NTSTATUS
+vhci_get_frame_stats(ioctl_usbip_vhci_frame_stats *stats, pusbip_vhub_dev_t vhub, ULONG *info);
+
 extern PAGEABLE NTSTATUS
 vhci_eject_device(PUSBIP_VHCI_EJECT_HARDWARE Eject, pusbip_vhub_dev_t vhub);
 
+/*
+ * URBs of an aborted pipe are completed locally, and ones which have been sent are unlinked.
+ * If a server takes CMD_UNLINK_BATCH, a single unlink of their seqnum range on the endpoint
+ * is sent.
+ */
 NTSTATUS
 vhci_ioctl_abort_pipe(pusbip_vpdo_dev_t vpdo, USBD_PIPE_HANDLE hPipe)
 {
 	KIRQL		oldirql;
 	PLIST_ENTRY	le;
+	LIST_ENTRY	head_aborted;
+	unsigned long	first = 0, last = 0;
+	BOOLEAN		sent = FALSE;
 	unsigned char	epaddr;
+	int	i;
 
 	if (!hPipe) {
 		DBGI(DBG_IOCTL, "vhci_ioctl_abort_pipe: empty pipe handle\n");
@@ -30,32 +45,59 @@ vhci_ioctl_abort_pipe(pusbip_vpdo_dev_t vpdo, USBD_PIPE_HANDLE hPipe)
 
 	DBGI(DBG_IOCTL, "vhci_ioctl_abort_pipe: EP: %02x\n", epaddr);
 
+	InitializeListHead(&head_aborted);
+
 	KeAcquireSpinLock(&vpdo->lock_urbr, &oldirql);
 
-	// remove all URBRs of the aborted pipe
-	for (le = vpdo->head_urbr.Flink; le != &vpdo->head_urbr;) {
-		struct urb_req	*urbr_local = CONTAINING_RECORD(le, struct urb_req, list_all);
-		le = le->Flink;
+	// remove all URBRs of the aborted pipe, which are only in queues of its endpoint number
+	for (i = 0; i < 2; i++) {
+		PLIST_ENTRY	head = &vpdo->epqs[VHCI_EPQ_EP(epaddr | (i ? 0x80: 0))].head_all;
+
+		for (le = head->Flink; le != head;) {
+			struct urb_req	*urbr_local = CONTAINING_RECORD(le, struct urb_req, list_all);
+			le = le->Flink;
+
+			// An irp whose cancel routine is running is left to the routine
+			if (IoSetCancelRoutine(urbr_local->irp, NULL) == NULL)
+				continue;
+
+			DBGI(DBG_IOCTL, "aborted urbr removed: %s\n", dbg_urbr(urbr_local));
+
+			RemoveEntryListInit(&urbr_local->list_state);
+			RemoveEntryListInit(&urbr_local->list_all);
+			if (vpdo->urbr_sent_partial == urbr_local) {
+				vpdo->urbr_sent_partial = NULL;
+				vpdo->len_sent_partial = 0;
+			}
+			if (urbr_local->seq_num != 0) {
+				if (!sent || (long)(urbr_local->seq_num - first) < 0)
+					first = urbr_local->seq_num;
+				if (!sent || (long)(urbr_local->seq_num - last) > 0)
+					last = urbr_local->seq_num;
+				sent = TRUE;
+			}
+			InsertTailList(&head_aborted, &urbr_local->list_all);
+		}
+	}
+
+	KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
-		if (!is_port_urbr(urbr_local, epaddr))
-			continue;
+	if (vpdo->unlink_batch && sent)
+		submit_urbr_unlink(vpdo, first, last, epaddr);
 
-		DBGI(DBG_IOCTL, "aborted urbr removed: %s\n", dbg_urbr(urbr_local));
+	while (!IsListEmpty(&head_aborted)) {
+		struct urb_req	*urbr_local = CONTAINING_RECORD(RemoveHeadList(&head_aborted), struct urb_req, list_all);
+		PIRP	irp = urbr_local->irp;
 
-		if (urbr_local->irp) {
-			PIRP	irp = urbr_local->irp;
+		InitializeListHead(&urbr_local->list_all);
+		if (!vpdo->unlink_batch && urbr_local->seq_num != 0)
+			submit_urbr_unlink(vpdo, urbr_local->seq_num, urbr_local->seq_num, -1);
 
-			IoSetCancelRoutine(irp, NULL);
-			irp->IoStatus.Status = STATUS_CANCELLED;
-			IoCompleteRequest(irp, IO_NO_INCREMENT);
-		}
-		RemoveEntryListInit(&urbr_local->list_state);
-		RemoveEntryListInit(&urbr_local->list_all);
+		irp->IoStatus.Status = STATUS_CANCELLED;
+		IoCompleteRequest(irp, IO_NO_INCREMENT);
 		free_urbr(urbr_local);
 	}
 
-	KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
-
 	return STATUS_SUCCESS;
 }
 
@@ -63,9 +105,8 @@ static NTSTATUS
 process_urb_get_frame(pusbip_vpdo_dev_t vpdo, PURB urb)
 {
 	struct _URB_GET_CURRENT_FRAME_NUMBER	*urb_get = &urb->UrbGetCurrentFrameNumber;
-	UNREFERENCED_PARAMETER(vpdo);
 
-	urb_get->FrameNumber = 0;
+	urb_get->FrameNumber = vhci_frame_current(&vpdo->frame_clock);
 	return STATUS_SUCCESS;
 }
 
@@ -250,11 +291,21 @@ vhci_ioctl(__in PDEVICE_OBJECT devobj, __in PIRP Irp)
 			status = vhci_plugin_dev((ioctl_usbip_vhci_plugin *)buffer, vhub, irpStack->FileObject);
 		}
 		break;
+	case IOCTL_USBIP_VHCI_ALLOC_PORT:
+		if (sizeof(ioctl_usbip_vhci_alloc_port) == outlen) {
+			status = vhci_alloc_port((ioctl_usbip_vhci_alloc_port *)buffer, vhub, irpStack->FileObject, &info);
+		}
+		break;
 	case IOCTL_USBIP_VHCI_GET_PORTS_STATUS:
 		if (sizeof(ioctl_usbip_vhci_get_ports_status) == outlen) {
 			status = vhci_get_ports_status((ioctl_usbip_vhci_get_ports_status *)buffer, vhub, &info);
 		}
 		break;
+	case IOCTL_USBIP_VHCI_GET_FRAME_STATS:
+		if (sizeof(ioctl_usbip_vhci_frame_stats) == inlen && sizeof(ioctl_usbip_vhci_frame_stats) == outlen) {
+			status = vhci_get_frame_stats((ioctl_usbip_vhci_frame_stats *)buffer, vhub, &info);
+		}
+		break;
 	case IOCTL_USBIP_VHCI_UNPLUG_HARDWARE:
 		if (sizeof(ioctl_usbip_vhci_unplug) == inlen) {
 			status = vhci_unplug_dev(((ioctl_usbip_vhci_unplug *)buffer)->addr, vhub);
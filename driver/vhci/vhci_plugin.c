@@ -3,6 +3,7 @@
 #include <wdmsec.h> // for IoCreateDeviceSecure
 
 #include "vhci_dev.h"
+#include "vhci_port.h"
 #include "usbip_vhci_api.h"
 
 // This guid is used in IoCreateDeviceSecure call to create vpdos. The idea is to
@@ -19,33 +20,58 @@ DEFINE_GUID(GUID_SD_USBIP_VHCI_VPDO,
 extern PAGEABLE void
 vhci_init_vpdo(pusbip_vpdo_dev_t vpdo);
 
+PAGEABLE NTSTATUS
+vhci_alloc_port(ioctl_usbip_vhci_alloc_port *alloc, pusbip_vhub_dev_t vhub, PFILE_OBJECT fo, ULONG *info)
+{
+	ULONG	port;
+
+	PAGED_CODE();
+
+	if (fo->FsContext != NULL)
+		return STATUS_INVALID_PARAMETER;
+
+	port = vhci_claim_port(vhub);
+	if (port == 0) {
+		DBGW(DBG_IOCTL, "no free port\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	// a handle holds a single port until a plugin
+	if (InterlockedCompareExchangePointer(&fo->FsContext2, (PVOID)(ULONG_PTR)port, NULL) != NULL) {
+		vhci_release_port(vhub, port);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	DBGI(DBG_IOCTL, "port allocated: %u\n", port);
+	alloc->port = port;
+	*info = sizeof(*alloc);
+	return STATUS_SUCCESS;
+}
+
 PAGEABLE NTSTATUS
 vhci_plugin_dev(ioctl_usbip_vhci_plugin *plugin, pusbip_vhub_dev_t vhub, PFILE_OBJECT fo)
 {
 	PDEVICE_OBJECT		devobj;
 	pusbip_vpdo_dev_t	vpdo, devpdo_old;
-	PLIST_ENTRY	entry;
+	ULONG	port, port_alloc;
 	NTSTATUS	status;
 
 	PAGED_CODE();
 
-	DBGI(DBG_IOCTL, "Plugin vpdo: port: %hhd, vendor:product: %04hx:%04hx\n", plugin->port, plugin->vendor, plugin->product);
-
-	if (plugin->port <= 0)
-		return STATUS_INVALID_PARAMETER;
-
-	ExAcquireFastMutex(&vhub->Mutex);
+	DBGI(DBG_IOCTL, "Plugin vpdo: port: %u, vendor:product: %04hx:%04hx\n", plugin->port, plugin->vendor, plugin->product);
 
-	for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
-		vpdo = CONTAINING_RECORD(entry, usbip_vpdo_dev_t, Link);
-		if ((ULONG)plugin->port == vpdo->port &&
-			vpdo->common.DevicePnPState != SurpriseRemovePending) {
-			ExReleaseFastMutex(&vhub->Mutex);
+	port_alloc = (ULONG)(ULONG_PTR)InterlockedExchangePointer(&fo->FsContext2, NULL);
+	port = plugin->port;
+	if (port == 0 || port == port_alloc) {
+		port = port_alloc;
+		if (port == 0)
+			return STATUS_INVALID_PARAMETER;
+	}
+	else {
+		vhci_release_port(vhub, port_alloc);
+		// An explicit port is taken unless another handle or vpdo holds it
+		if (!vhci_claim_port_at(vhub, port))
 			return STATUS_INVALID_PARAMETER;
-		}
 	}
-
-	ExReleaseFastMutex(&vhub->Mutex);
 
 	// Create the vpdo
 	DBGI(DBG_PNP, "vhub->NextLowerDriver = 0x%p\n", vhub->NextLowerDriver);
@@ -65,6 +91,7 @@ vhci_plugin_dev(ioctl_usbip_vhci_plugin *plugin, pusbip_vhub_dev_t vhub, PFILE_O
 		FALSE, &SDDL_DEVOBJ_SYS_ALL_ADM_RWX_WORLD_RWX_RES_RWX, // allow normal users to access the devices
 		(LPCGUID)&GUID_SD_USBIP_VHCI_VPDO, &devobj);
 	if (!NT_SUCCESS(status)) {
+		vhci_release_port(vhub, port);
 		return status;
 	}
 
@@ -88,13 +115,17 @@ vhci_plugin_dev(ioctl_usbip_vhci_plugin *plugin, pusbip_vhub_dev_t vhub, PFILE_O
 	devpdo_old = (pusbip_vpdo_dev_t)InterlockedCompareExchangePointer(&(fo->FsContext), vpdo, 0);
 	if (devpdo_old) {
 		DBGI(DBG_GENERAL, "you can't plugin again");
+		if (vpdo->winstid != NULL)
+			ExFreePoolWithTag(vpdo->winstid, USBIP_VHCI_POOL_TAG);
 		IoDeleteDevice(devobj);
+		vhci_release_port(vhub, port);
 		return STATUS_INVALID_PARAMETER;
 	}
-	vpdo->port = plugin->port;
+	vpdo->port = port;
 	vpdo->fo = fo;
 	vpdo->devid = plugin->devid;
 	vpdo->speed = plugin->speed;
+	vpdo->unlink_batch = (plugin->flags & USBIP_VHCI_PLUGIN_UNLINK_BATCH) ? TRUE: FALSE;
 
 	vpdo->common.is_vhub = FALSE;
 	vpdo->common.Self = devobj;
@@ -2,12 +2,16 @@
 
 #include "usbip_vhci_api.h"
 #include "vhci_pnp.h"
+#include "vhci_port.h"
 #include "usbreq.h"
 
 #define INITIALIZE_PNP_STATE(_Data_)    \
         (_Data_)->common.DevicePnPState =  NotStarted;\
         (_Data_)->common.PreviousPnPState = NotStarted;
 
+/* how long an unplug waits for the PnP manager to query relations, in ms */
+#define VHCI_UNPLUG_REPORT_TIMEOUT	1000
+
 extern PAGEABLE NTSTATUS
 vhci_pnp_vpdo(PDEVICE_OBJECT devobj, PIRP Irp, PIO_STACK_LOCATION IrpStack, pusbip_vpdo_dev_t vpdo);
 
@@ -74,6 +78,9 @@ vhci_add_device(__in PDRIVER_OBJECT drvobj, __in PDEVICE_OBJECT devobj_lower)
 	// will become 0.
 	KeInitializeEvent(&vhub->StopEvent, SynchronizationEvent, TRUE);
 
+	// This event is set when a relations query has reported unplugged vpdo's missing.
+	KeInitializeEvent(&vhub->ReportedMissingEvent, NotificationEvent, FALSE);
+
 	devobj->Flags |= DO_POWER_PAGABLE|DO_BUFFERED_IO;
 
 	// Tell the Plug & Play system that this device will need a
@@ -272,6 +279,7 @@ vhci_pnp_vhub(PDEVICE_OBJECT devobj, PIRP Irp, PIO_STACK_LOCATION IrpStack, pusb
 	pusbip_vpdo_dev_t	vpdo;
 	PDEVICE_RELATIONS	relations, oldRelations;
 	ULONG			length, prevcount, n_vpdos_cur;
+	BOOLEAN			reported_missing = FALSE;
 	PLIST_ENTRY		entry, listHead, nextEntry;
 	NTSTATUS		status;
 
@@ -433,6 +441,7 @@ vhci_pnp_vhub(PDEVICE_OBJECT devobj, PIRP Irp, PIO_STACK_LOCATION IrpStack, pusb
 		for (entry = listHead->Flink,nextEntry = entry->Flink; entry != listHead; entry = nextEntry,nextEntry = entry->Flink) {
 			vpdo = CONTAINING_RECORD(entry, usbip_vpdo_dev_t, Link);
 			RemoveEntryList (&vpdo->Link);
+			vhci_release_port_vpdo(vhub, vpdo);
 			if (SurpriseRemovePending == vpdo->common.DevicePnPState) {
 				// We will reinitialize the list head so that we
 				// wouldn't barf when we try to delink this vpdo from
@@ -540,8 +549,11 @@ vhci_pnp_vhub(PDEVICE_OBJECT devobj, PIRP Irp, PIO_STACK_LOCATION IrpStack, pusb
 				prevcount++;
 			} else {
 				vpdo->ReportedMissing = TRUE;
+				reported_missing = TRUE;
 			}
 		}
+		if (reported_missing)
+			KeSetEvent(&vhub->ReportedMissingEvent, IO_NO_INCREMENT, FALSE);
 
 		DBGI(DBG_PNP, "# of vpdo's: present: %d, reported: %d\n", vhub->n_vpdos, relations->Count);
 
@@ -632,59 +644,57 @@ complete_pending_read_irp(pusbip_vpdo_dev_t vpdo)
 	}
 }
 
+/*
+ * All urb_req's are detached in one lock hold and then completed without the lock.
+ * A submission or a cancellation after detaching finds no urb_req of a previous list.
+ */
 static void
 complete_pending_irp(pusbip_vpdo_dev_t vpdo)
 {
-	int	count = 0;
+	LIST_ENTRY	head_detached;
 	KIRQL	oldirql;
+	int	count = 0;
+	int	i;
 
-	//FIXME
-	DBGI(DBG_PNP, "finish pending irp\n");
-	KeRaiseIrql(DISPATCH_LEVEL, &oldirql);
-	do {
-		struct urb_req	*urbr;
-		PIRP	irp;
-		KIRQL	oldirql2;
-
-		KeAcquireSpinLockAtDpcLevel(&vpdo->lock_urbr);
-		if (IsListEmpty(&vpdo->head_urbr)) {
-			vpdo->urbr_sent_partial = NULL;
-			vpdo->len_sent_partial = 0;
-			InitializeListHead(&vpdo->head_urbr_sent);
-			InitializeListHead(&vpdo->head_urbr_pending);
+	InitializeListHead(&head_detached);
 
-			KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
-			break;
+	KeAcquireSpinLock(&vpdo->lock_urbr, &oldirql);
+	for (i = 0; i < VHCI_N_EPQS; i++) {
+		PLIST_ENTRY	head = &vpdo->epqs[i].head_all;
+
+		if (!IsListEmpty(head)) {
+			head->Flink->Blink = head_detached.Blink;
+			head->Blink->Flink = &head_detached;
+			head_detached.Blink->Flink = head->Flink;
+			head_detached.Blink = head->Blink;
 		}
+	}
+	init_urbr_epqs(vpdo);
+	vpdo->urbr_sent_partial = NULL;
+	vpdo->len_sent_partial = 0;
+	InitializeListHead(&vpdo->head_urbr_sent);
+	KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
 
-		urbr = CONTAINING_RECORD(vpdo->head_urbr.Flink, struct urb_req, list_all);
-		RemoveEntryListInit(&urbr->list_all);
-		RemoveEntryListInit(&urbr->list_state);
-		/* FIMXE event */
-		irp = urbr->irp;
-
-		if (count > 2) {
-			LARGE_INTEGER	interval;
-
-			KeReleaseSpinLock(&vpdo->lock_urbr, oldirql);
-			DBGI(DBG_PNP, "sleep 50ms, let pnp manager send irp");
-			interval.QuadPart = -500000;
-			KeDelayExecutionThread(KernelMode, FALSE, &interval);
-			KeRaiseIrql(DISPATCH_LEVEL, &oldirql);
-		} else {
-			KeReleaseSpinLock(&vpdo->lock_urbr, DISPATCH_LEVEL);
-		}
+	while (!IsListEmpty(&head_detached)) {
+		struct urb_req	*urbr;
+		PIRP	irp;
 
+		urbr = CONTAINING_RECORD(RemoveHeadList(&head_detached), struct urb_req, list_all);
+		InitializeListHead(&urbr->list_all);
+		/* a state list has been dropped with its head */
+		InitializeListHead(&urbr->list_state);
+		irp = urbr->irp;
 		free_urbr(urbr);
-		if (irp != NULL) {
+
+		/* If a cancel routine has already started, it completes an irp */
+		if (irp != NULL && IoSetCancelRoutine(irp, NULL) != NULL) {
 			irp->IoStatus.Status = STATUS_DEVICE_NOT_CONNECTED;
-			IoSetCancelRoutine(irp, NULL);
-			KeRaiseIrql(DISPATCH_LEVEL, &oldirql2);
 			IoCompleteRequest(irp, IO_NO_INCREMENT);
-			KeLowerIrql(oldirql2);
 		}
 		count++;
-	} while (1);
+	}
+
+	DBGI(DBG_PNP, "pending irp finished: count: %d\n", count);
 }
 
 PAGEABLE void
@@ -705,10 +715,10 @@ vhci_init_vpdo(pusbip_vpdo_dev_t vpdo)
 	vpdo->common.DevicePowerState = PowerDeviceD3;
 	vpdo->common.SystemPowerState = PowerSystemWorking;
 
-	InitializeListHead(&vpdo->head_urbr);
-	InitializeListHead(&vpdo->head_urbr_pending);
+	init_urbr_epqs(vpdo);
 	InitializeListHead(&vpdo->head_urbr_sent);
 	KeInitializeSpinLock(&vpdo->lock_urbr);
+	vhci_frame_init(&vpdo->frame_clock);
 
 	DEVOBJ_FROM_VPDO(vpdo)->Flags |= DO_POWER_PAGABLE|DO_DIRECT_IO;
 
@@ -716,6 +726,7 @@ vhci_init_vpdo(pusbip_vpdo_dev_t vpdo)
 	ExAcquireFastMutex(&vhub->Mutex);
 	InsertTailList(&vhub->head_vpdo, &vpdo->Link);
 	vhub->n_vpdos++;
+	vhci_set_port_vpdo(vhub, vpdo);
 	ExReleaseFastMutex(&vhub->Mutex);
 	// This should be the last step in initialization.
 	DEVOBJ_FROM_VPDO(vpdo)->Flags &= ~DO_DEVICE_INITIALIZING;
@@ -724,30 +735,45 @@ vhci_init_vpdo(pusbip_vpdo_dev_t vpdo)
 PAGEABLE NTSTATUS
 vhci_get_ports_status(ioctl_usbip_vhci_get_ports_status *st, pusbip_vhub_dev_t vhub, ULONG *info)
 {
-	pusbip_vpdo_dev_t	vpdo;
-	PLIST_ENTRY		entry;
+	ULONG	port;
 
 	PAGED_CODE();
 
 	DBGI(DBG_PNP, "get ports status\n");
 
 	RtlZeroMemory(st, sizeof(*st));
-	ExAcquireFastMutex(&vhub->Mutex);
+	st->n_max_ports = USBIP_VHCI_MAX_PORTS;
 
-	for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
-		vpdo = CONTAINING_RECORD (entry, usbip_vpdo_dev_t, Link);
-		if (vpdo->port > 127 || vpdo->port == 0) {
-			DBGE(DBG_PNP, "strange error");
+	// A claimed port is used even before a plugin
+	for (port = 1; port <= USBIP_VHCI_MAX_PORTS; port++) {
+		if (vhub->port_bits[(port - 1) / 32] & (1 << ((port - 1) % 32))) {
+			st->port_status[port] = 1;
+			st->max_used_port = (unsigned short)port;
 		}
-		if (st->u.max_used_port < (char)vpdo->port)
-			st->u.max_used_port = (char)vpdo->port;
-		st->u.port_status[vpdo->port] = 1;
 	}
-	ExReleaseFastMutex(&vhub->Mutex);
 	*info = sizeof(*st);
 	return STATUS_SUCCESS;
 }
 
+PAGEABLE NTSTATUS
+vhci_get_frame_stats(ioctl_usbip_vhci_frame_stats *stats, pusbip_vhub_dev_t vhub, ULONG *info)
+{
+	pusbip_vpdo_dev_t	vpdo;
+	NTSTATUS	status = STATUS_NO_SUCH_DEVICE;
+
+	PAGED_CODE();
+
+	ExAcquireFastMutex(&vhub->Mutex);
+	vpdo = vhci_find_vpdo(vhub, stats->port);
+	if (vpdo != NULL) {
+		vhci_frame_get_stats(&vpdo->frame_clock, stats);
+		*info = sizeof(*stats);
+		status = STATUS_SUCCESS;
+	}
+	ExReleaseFastMutex(&vhub->Mutex);
+	return status;
+}
+
 PAGEABLE NTSTATUS
 vhci_unplug_dev(ULONG port, pusbip_vhub_dev_t vhub)
 {
@@ -757,7 +783,7 @@ vhci_unplug_dev(ULONG port, pusbip_vhub_dev_t vhub)
 
 	PAGED_CODE();
 
-	if (port > 127)
+	if (port > USBIP_VHCI_MAX_PORTS)
 		return STATUS_INVALID_PARAMETER;
 
 	all = (0 == port);
@@ -777,27 +803,43 @@ vhci_unplug_dev(ULONG port, pusbip_vhub_dev_t vhub)
 		return STATUS_NO_SUCH_DEVICE;
 	}
 
-	for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
-		vpdo = CONTAINING_RECORD(entry, usbip_vpdo_dev_t, Link);
+	// A relations query after this reports unplugged devices missing
+	KeClearEvent(&vhub->ReportedMissingEvent);
 
-		DBGI(DBG_PNP, "found device: port: %d\n", vpdo->port);
+	if (all) {
+		for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
+			vpdo = CONTAINING_RECORD(entry, usbip_vpdo_dev_t, Link);
 
-		if (all || port == vpdo->port) {
 			DBGI(DBG_PNP, "Plugging out: port: %u\n", vpdo->port);
 			vpdo->Present = FALSE;
 			complete_pending_read_irp(vpdo);
 			found = 1;
-			if (!all) {
-				break;
-			}
+		}
+	}
+	else {
+		vpdo = vhci_find_vpdo(vhub, port);
+		if (vpdo != NULL) {
+			DBGI(DBG_PNP, "Plugging out: port: %u\n", vpdo->port);
+			vpdo->Present = FALSE;
+			complete_pending_read_irp(vpdo);
+			found = 1;
 		}
 	}
 
 	ExReleaseFastMutex(&vhub->Mutex);
 
 	if (found) {
+		LARGE_INTEGER	timeout;
+
 		IoInvalidateDeviceRelations(vhub->UnderlyingPDO, BusRelations);
 
+		// Let the PnP manager learn of missing devices before failing their irps,
+		// so that upper drivers see a removal rather than errors to recover from.
+		timeout.QuadPart = -10000LL * VHCI_UNPLUG_REPORT_TIMEOUT;
+		if (KeWaitForSingleObject(&vhub->ReportedMissingEvent, Executive, KernelMode, FALSE, &timeout) == STATUS_TIMEOUT) {
+			DBGW(DBG_PNP, "missing devices not reported in %d ms\n", VHCI_UNPLUG_REPORT_TIMEOUT);
+		}
+
 		ExAcquireFastMutex(&vhub->Mutex);
 
 		for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
@@ -844,19 +886,21 @@ vhci_eject_device(PUSBIP_VHCI_EJECT_HARDWARE Eject, pusbip_vhub_dev_t vhub)
 		return STATUS_NO_SUCH_DEVICE;
 	}
 
-	// Scan the list to find matching vpdo's
-	for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
-		vpdo = CONTAINING_RECORD(entry, usbip_vpdo_dev_t, Link);
-
-		DBGI(DBG_PNP, "found device: %u\n", vpdo->port);
+	if (ejectAll) {
+		for (entry = vhub->head_vpdo.Flink; entry != &vhub->head_vpdo; entry = entry->Flink) {
+			vpdo = CONTAINING_RECORD(entry, usbip_vpdo_dev_t, Link);
 
-		if (ejectAll || Eject->port == vpdo->port) {
 			DBGI(DBG_PNP, "Ejected: %u\n", vpdo->port);
 			found = TRUE;
 			IoRequestDeviceEject(vpdo->common.Self);
-			if (!ejectAll) {
-				break;
-			}
+		}
+	}
+	else {
+		vpdo = vhci_find_vpdo(vhub, Eject->port);
+		if (vpdo != NULL) {
+			DBGI(DBG_PNP, "Ejected: %u\n", vpdo->port);
+			found = TRUE;
+			IoRequestDeviceEject(vpdo->common.Self);
 		}
 	}
 	ExReleaseFastMutex(&vhub->Mutex);
@@ -0,0 +1,77 @@
+#include "vhci.h"
+
+#include "usbip_vhci_api.h"
+#include "vhci_port.h"
+
+/*
+ * Port allocation
+ *
+ * A port is a bit of vhub->port_bits, which is claimed atomically, so that concurrent attaches
+ * never get the same port. A port is held by a handle from IOCTL_USBIP_VHCI_ALLOC_PORT until
+ * a plugin over it, and then by a vpdo until it is surprise removed or removed.
+ * A claim scans USBIP_VHCI_MAX_PORTS / 32 words at most, and vhub->vpdos maps a port to its vpdo.
+ */
+
+#define PORT_WORD(port)	(((port) - 1) / 32)
+#define PORT_BIT(port)	(((port) - 1) % 32)
+
+ULONG
+vhci_claim_port(pusbip_vhub_dev_t vhub)
+{
+	int	i;
+
+	/* a lower port is preferred */
+	for (i = 0; i < USBIP_VHCI_MAX_PORTS / 32; i++) {
+		LONG	bits;
+
+		while ((bits = *(volatile LONG *)&vhub->port_bits[i]) != -1) {
+			ULONG	bit;
+
+			_BitScanForward(&bit, ~(ULONG)bits);
+			if (!InterlockedBitTestAndSet(&vhub->port_bits[i], (LONG)bit))
+				return i * 32 + bit + 1;
+		}
+	}
+	return 0;
+}
+
+BOOLEAN
+vhci_claim_port_at(pusbip_vhub_dev_t vhub, ULONG port)
+{
+	if (port == 0 || port > USBIP_VHCI_MAX_PORTS)
+		return FALSE;
+	return !InterlockedBitTestAndSet(&vhub->port_bits[PORT_WORD(port)], PORT_BIT(port));
+}
+
+void
+vhci_release_port(pusbip_vhub_dev_t vhub, ULONG port)
+{
+	if (port == 0 || port > USBIP_VHCI_MAX_PORTS)
+		return;
+	InterlockedBitTestAndReset(&vhub->port_bits[PORT_WORD(port)], PORT_BIT(port));
+}
+
+void
+vhci_set_port_vpdo(pusbip_vhub_dev_t vhub, pusbip_vpdo_dev_t vpdo)
+{
+	vhub->vpdos[vpdo->port - 1] = vpdo;
+}
+
+void
+vhci_release_port_vpdo(pusbip_vhub_dev_t vhub, pusbip_vpdo_dev_t vpdo)
+{
+	if (vpdo->port == 0 || vpdo->port > USBIP_VHCI_MAX_PORTS)
+		return;
+	if (vhub->vpdos[vpdo->port - 1] != vpdo)
+		return;
+	vhub->vpdos[vpdo->port - 1] = NULL;
+	vhci_release_port(vhub, vpdo->port);
+}
+
+pusbip_vpdo_dev_t
+vhci_find_vpdo(pusbip_vhub_dev_t vhub, ULONG port)
+{
+	if (port == 0 || port > USBIP_VHCI_MAX_PORTS)
+		return NULL;
+	return vhub->vpdos[port - 1];
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "basetype.h"
+#include "vhci_dev.h"
+
+/* returns a claimed port, or 0 if all ports are used */
+ULONG
+vhci_claim_port(pusbip_vhub_dev_t vhub);
+
+BOOLEAN
+vhci_claim_port_at(pusbip_vhub_dev_t vhub, ULONG port);
+
+void
+vhci_release_port(pusbip_vhub_dev_t vhub, ULONG port);
+
+/* Functions below should be called with vhub->Mutex held */
+
+void
+vhci_set_port_vpdo(pusbip_vhub_dev_t vhub, pusbip_vpdo_dev_t vpdo);
+
+/* releases a port of vpdo if vpdo still holds it */
+void
+vhci_release_port_vpdo(pusbip_vhub_dev_t vhub, pusbip_vpdo_dev_t vpdo);
+
+pusbip_vpdo_dev_t
+vhci_find_vpdo(pusbip_vhub_dev_t vhub, ULONG port);
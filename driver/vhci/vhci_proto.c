@@ -46,3 +46,17 @@ set_cmd_unlink_usbip_header(struct usbip_header *h, unsigned long seqnum, unsign
 	h->base.ep = 0;
 	h->u.cmd_unlink.seqnum = seqnum_unlink;
 }
+
+void
+set_cmd_unlink_batch_usbip_header(struct usbip_header *h, unsigned long seqnum, unsigned int devid,
+				  unsigned long seqnum_first, unsigned long seqnum_last, int ep)
+{
+	h->base.command = USBIP_CMD_UNLINK_BATCH;
+	h->base.seqnum = seqnum;
+	h->base.devid = devid;
+	h->base.direction = USBIP_DIR_OUT;
+	h->base.ep = ep < 0 ? 0: ep;
+	h->u.cmd_unlink_batch.seqnum_first = seqnum_first;
+	h->u.cmd_unlink_batch.seqnum_last = seqnum_last;
+	h->u.cmd_unlink_batch.flags = ep < 0 ? 0: USBIP_UNLINK_BATCH_EP;
+}
@@ -17,6 +17,10 @@ vhci_ioctl_abort_pipe(pusbip_vpdo_dev_t vpdo, USBD_PIPE_HANDLE hPipe);
 extern void
 set_cmd_unlink_usbip_header(struct usbip_header *h, unsigned long seqnum, unsigned int devid, unsigned long seqnum_unlink);
 
+extern void
+set_cmd_unlink_batch_usbip_header(struct usbip_header *h, unsigned long seqnum, unsigned int devid,
+				  unsigned long seqnum_first, unsigned long seqnum_last, int ep);
+
 static struct usbip_header *
 get_usbip_hdr_from_read_irp(PIRP irp)
 {
@@ -503,7 +507,10 @@ store_urb_iso(PIRP irp, PURB urb, struct urb_req *urbr)
 	set_cmd_submit_usbip_header(hdr, urbr->seq_num, urbr->vpdo->devid,
 				    in, urb_iso->PipeHandle, urb_iso->TransferFlags | USBD_SHORT_TRANSFER_OK,
 				    urb_iso->TransferBufferLength);
-	hdr->u.cmd_submit.start_frame = urb_iso->StartFrame;
+	if (urb_iso->TransferFlags & USBD_START_ISO_TRANSFER_ASAP)
+		hdr->u.cmd_submit.start_frame = 0;
+	else
+		hdr->u.cmd_submit.start_frame = vhci_frame_to_remote(&urbr->vpdo->frame_clock, urbr->vpdo->speed, urb_iso->StartFrame);
 	hdr->u.cmd_submit.number_of_packets = urb_iso->NumberOfPackets;
 
 	irp->IoStatus.Information = sizeof(struct usbip_header);
@@ -699,7 +706,11 @@ store_cancelled_urbr(PIRP irp, struct urb_req *urbr)
 	if (hdr == NULL)
 		return STATUS_INVALID_PARAMETER;
 
-	set_cmd_unlink_usbip_header(hdr, urbr->seq_num, urbr->vpdo->devid, urbr->seq_num_unlink);
+	if (urbr->seq_num_unlink_last != urbr->seq_num_unlink)
+		set_cmd_unlink_batch_usbip_header(hdr, urbr->seq_num, urbr->vpdo->devid,
+						  urbr->seq_num_unlink, urbr->seq_num_unlink_last, urbr->ep_unlink);
+	else
+		set_cmd_unlink_usbip_header(hdr, urbr->seq_num, urbr->vpdo->devid, urbr->seq_num_unlink);
 
 	irp->IoStatus.Information = sizeof(struct usbip_header);
 	return STATUS_SUCCESS;
@@ -0,0 +1,80 @@
+#include "vhci.h"
+
+#include "vhci_reg.h"
+
+vhci_sched_params_t	vhci_sched_params = {
+	VHCI_SCHED_FIFO,	/* policy */
+	64 * 1024,		/* bulk_quantum */
+	{ 8, 8, 1, 8, 0 }	/* weights of control, iso, bulk, interrupt and unlink */
+};
+
+typedef struct {
+	PWSTR	name;
+	ULONG	*pval;
+} reg_param_t;
+
+static reg_param_t	reg_params[] = {
+	{ L"SchedPolicy", &vhci_sched_params.policy },
+	{ L"SchedBulkQuantum", &vhci_sched_params.bulk_quantum },
+	{ L"SchedWeightControl", &vhci_sched_params.weights[VHCI_SCHED_CONTROL] },
+	{ L"SchedWeightIso", &vhci_sched_params.weights[VHCI_SCHED_ISO] },
+	{ L"SchedWeightBulk", &vhci_sched_params.weights[VHCI_SCHED_BULK] },
+	{ L"SchedWeightIntr", &vhci_sched_params.weights[VHCI_SCHED_INTR] },
+	{ NULL, NULL }
+};
+
+#define N_REG_PARAMS	(sizeof(reg_params) / sizeof(reg_param_t) - 1)
+
+void
+reg_get_params(PUNICODE_STRING regpath)
+{
+	RTL_QUERY_REGISTRY_TABLE	*table;
+	UNICODE_STRING	path;
+	int	i;
+	NTSTATUS	status;
+
+	path.MaximumLength = regpath->Length + sizeof(L"\\Parameters");
+	path.Length = 0;
+	path.Buffer = ExAllocatePoolWithTag(PagedPool, path.MaximumLength, USBIP_VHCI_POOL_TAG);
+	if (path.Buffer == NULL) {
+		DBGE(DBG_GENERAL, "reg_get_params: out of memory\n");
+		return;
+	}
+	table = ExAllocatePoolWithTag(PagedPool, sizeof(RTL_QUERY_REGISTRY_TABLE) * (N_REG_PARAMS + 1), USBIP_VHCI_POOL_TAG);
+	if (table == NULL) {
+		DBGE(DBG_GENERAL, "reg_get_params: out of memory\n");
+		ExFreePoolWithTag(path.Buffer, USBIP_VHCI_POOL_TAG);
+		return;
+	}
+
+	RtlCopyUnicodeString(&path, regpath);
+	RtlAppendUnicodeToString(&path, L"\\Parameters");
+	/* RtlQueryRegistryValues requires a null-terminated path */
+	path.Buffer[path.Length / sizeof(WCHAR)] = L'\0';
+
+	RtlZeroMemory(table, sizeof(RTL_QUERY_REGISTRY_TABLE) * (N_REG_PARAMS + 1));
+	for (i = 0; reg_params[i].name != NULL; i++) {
+		table[i].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+		table[i].Name = reg_params[i].name;
+		table[i].EntryContext = reg_params[i].pval;
+		table[i].DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD;
+		table[i].DefaultData = reg_params[i].pval;
+		table[i].DefaultLength = sizeof(ULONG);
+	}
+
+	/* A missing key or value just leaves the built-in default */
+	status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL, path.Buffer, table, NULL, NULL);
+	if (NT_ERROR(status))
+		DBGW(DBG_GENERAL, "reg_get_params: failed to query parameters: %s\n", dbg_ntstatus(status));
+
+	ExFreePoolWithTag(table, USBIP_VHCI_POOL_TAG);
+	ExFreePoolWithTag(path.Buffer, USBIP_VHCI_POOL_TAG);
+
+	if (vhci_sched_params.policy >= VHCI_N_SCHED_POLICIES) {
+		DBGW(DBG_GENERAL, "reg_get_params: unknown scheduler policy: %u\n", vhci_sched_params.policy);
+		vhci_sched_params.policy = VHCI_SCHED_FIFO;
+	}
+
+	for (i = 0; reg_params[i].name != NULL; i++)
+		DBGI(DBG_GENERAL, "reg_get_params: %S: %u\n", reg_params[i].name, *reg_params[i].pval);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "vhci_sched.h"
+
+/* scheduler of every vpdo, which is read from the Parameters subkey of the service key */
+extern vhci_sched_params_t	vhci_sched_params;
+
+void
+reg_get_params(PUNICODE_STRING regpath);
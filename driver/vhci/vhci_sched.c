@@ -0,0 +1,228 @@
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#endif
+
+#include "vhci_sched.h"
+
+/* an urb_req costs its header besides its transfer buffer, so that no urb_req is free */
+#define SCHED_HDR_LEN	48
+/* virtual time of WFQ is of 1/WFQ_UNIT bytes for a weight of 1 */
+#define WFQ_UNIT	64
+
+const char	*vhci_sched_policy_names[VHCI_N_SCHED_POLICIES] = { "fifo", "priority", "wfq" };
+
+/* a lower rank is served first in a priority policy */
+static const int	priority_ranks[VHCI_SCHED_N_TYPES] = {
+	0,	/* control */
+	1,	/* iso */
+	3,	/* bulk */
+	2,	/* interrupt */
+	-1	/* unlink */
+};
+
+static ULONG
+get_cost(ULONG len)
+{
+	return len + SCHED_HDR_LEN;
+}
+
+static BOOLEAN
+peek_queue(vhci_sched_t *sched, ULONG queue, ULONG *plen, ULONG *porder)
+{
+	ULONG	len, order;
+
+	if (plen == NULL)
+		plen = &len;
+	if (porder == NULL)
+		porder = &order;
+	if (sched->peek(sched->ctx, queue, plen, porder))
+		return TRUE;
+	/* a queue which has gone empty starts over */
+	sched->queues[queue].deficit = 0;
+	return FALSE;
+}
+
+static ULONG
+pick_unlink(vhci_sched_t *sched)
+{
+	ULONG	q;
+
+	for (q = 0; q < VHCI_SCHED_N_QUEUES; q++) {
+		if (sched->queues[q].type == VHCI_SCHED_UNLINK && peek_queue(sched, q, NULL, NULL))
+			return q;
+	}
+	return VHCI_SCHED_N_QUEUES;
+}
+
+static ULONG
+pick_fifo(vhci_sched_t *sched)
+{
+	ULONG	q, best = VHCI_SCHED_N_QUEUES;
+	ULONG	order, order_best = 0;
+
+	for (q = 0; q < VHCI_SCHED_N_QUEUES; q++) {
+		if (sched->queues[q].type == VHCI_SCHED_UNLINK || !peek_queue(sched, q, NULL, &order))
+			continue;
+		if (best == VHCI_SCHED_N_QUEUES || (LONG)(order - order_best) < 0) {
+			best = q;
+			order_best = order;
+		}
+	}
+	return best;
+}
+
+/*
+ * Deficit round robin among bulk queues. A queue in its turn goes on while its deficit
+ * covers its head, and then the next one gets bulk_quantum bytes more.
+ */
+static ULONG
+pick_bulk(vhci_sched_t *sched)
+{
+	ULONG	quantum = sched->params->bulk_quantum;
+	ULONG	q, i, len;
+	vhci_sched_queue_t	*queue;
+
+	q = sched->bulk_served;
+	queue = sched->queues + q;
+	if (quantum > 0 && queue->type == VHCI_SCHED_BULK && peek_queue(sched, q, &len, NULL) &&
+	    queue->deficit >= get_cost(len)) {
+		queue->deficit -= get_cost(len);
+		return q;
+	}
+
+	while (TRUE) {
+		LONGLONG	needed_min = -1;
+
+		for (i = 1; i <= VHCI_SCHED_N_QUEUES; i++) {
+			q = (sched->bulk_served + i) % VHCI_SCHED_N_QUEUES;
+			queue = sched->queues + q;
+			if (queue->type != VHCI_SCHED_BULK || !peek_queue(sched, q, &len, NULL))
+				continue;
+			if (quantum == 0) {
+				sched->bulk_served = q;
+				return q;
+			}
+			queue->deficit += quantum;
+			if (queue->deficit >= get_cost(len)) {
+				queue->deficit -= get_cost(len);
+				sched->bulk_served = q;
+				return q;
+			}
+			if (needed_min < 0 || get_cost(len) - queue->deficit < needed_min)
+				needed_min = get_cost(len) - queue->deficit;
+		}
+		if (needed_min < 0)
+			return VHCI_SCHED_N_QUEUES;
+
+		/* Rounds in which no head is covered yet are skipped at once */
+		for (q = 0; q < VHCI_SCHED_N_QUEUES; q++) {
+			queue = sched->queues + q;
+			if (queue->type == VHCI_SCHED_BULK && peek_queue(sched, q, NULL, NULL))
+				queue->deficit += (needed_min - 1) / quantum * quantum;
+		}
+	}
+}
+
+static ULONG
+pick_priority(vhci_sched_t *sched)
+{
+	ULONG	q, i, best = VHCI_SCHED_N_QUEUES;
+	int	rank_best = 0;
+
+	for (i = 1; i <= VHCI_SCHED_N_QUEUES; i++) {
+		int	rank;
+
+		q = (sched->served + i) % VHCI_SCHED_N_QUEUES;
+		rank = priority_ranks[sched->queues[q].type];
+		if (rank < 0 || (best != VHCI_SCHED_N_QUEUES && rank >= rank_best))
+			continue;
+		if (!peek_queue(sched, q, NULL, NULL))
+			continue;
+		best = q;
+		rank_best = rank;
+	}
+	if (best != VHCI_SCHED_N_QUEUES && sched->queues[best].type == VHCI_SCHED_BULK)
+		return pick_bulk(sched);
+	return best;
+}
+
+/* start-time fair queuing, where a queue with the earliest virtual start time goes next */
+static ULONG
+pick_wfq(vhci_sched_t *sched)
+{
+	ULONG	q, i, best = VHCI_SCHED_N_QUEUES;
+	ULONG	len, len_best = 0, weight;
+	ULONGLONG	start, start_best = 0;
+
+	for (i = 1; i <= VHCI_SCHED_N_QUEUES; i++) {
+		q = (sched->served + i) % VHCI_SCHED_N_QUEUES;
+		if (sched->queues[q].type == VHCI_SCHED_UNLINK || !peek_queue(sched, q, &len, NULL))
+			continue;
+		start = sched->queues[q].finish > sched->vtime ? sched->queues[q].finish: sched->vtime;
+		if (best == VHCI_SCHED_N_QUEUES || start < start_best) {
+			best = q;
+			start_best = start;
+			len_best = len;
+		}
+	}
+	if (best == VHCI_SCHED_N_QUEUES)
+		return best;
+
+	weight = sched->params->weights[sched->queues[best].type];
+	if (weight == 0)
+		weight = 1;
+	sched->vtime = start_best;
+	sched->queues[best].finish = start_best + (ULONGLONG)get_cost(len_best) * WFQ_UNIT / weight;
+	return best;
+}
+
+void
+vhci_sched_init(vhci_sched_t *sched, const vhci_sched_params_t *params, vhci_sched_peek_t peek, void *ctx)
+{
+	ULONG	q;
+
+	sched->params = params;
+	sched->peek = peek;
+	sched->ctx = ctx;
+	for (q = 0; q < VHCI_SCHED_N_QUEUES; q++) {
+		sched->queues[q].type = VHCI_SCHED_CONTROL;
+		sched->queues[q].deficit = 0;
+		sched->queues[q].finish = 0;
+	}
+	sched->served = 0;
+	sched->bulk_served = 0;
+	sched->vtime = 0;
+}
+
+void
+vhci_sched_set_type(vhci_sched_t *sched, ULONG queue, UCHAR type)
+{
+	if (queue < VHCI_SCHED_N_QUEUES && type < VHCI_SCHED_N_TYPES)
+		sched->queues[queue].type = type;
+}
+
+ULONG
+vhci_sched_pick(vhci_sched_t *sched)
+{
+	ULONG	q;
+
+	q = pick_unlink(sched);
+	if (q != VHCI_SCHED_N_QUEUES)
+		return q;
+
+	switch (sched->params->policy) {
+	case VHCI_SCHED_FIFO:
+		q = pick_fifo(sched);
+		break;
+	case VHCI_SCHED_WFQ:
+		q = pick_wfq(sched);
+		break;
+	case VHCI_SCHED_PRIORITY:
+	default:
+		q = pick_priority(sched);
+		break;
+	}
+	if (q != VHCI_SCHED_N_QUEUES)
+		sched->served = q;
+	return q;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifdef _NTDDK_
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
+
+/*
+ * Scheduler of pending urb_req's
+ *
+ * A read irp carries a single urb_req, so that an urb_req waits for all ones sent before it.
+ * A scheduler decides which endpoint queue is served next. Order within a queue is never changed.
+ * It knows nothing of urb_req's, so that usbip-bench runs the same code over an emulated device.
+ * Unlinks are always served first whatever policy is taken.
+ */
+
+/* an unlink queue, a control queue and 32 endpoints */
+#define VHCI_SCHED_N_QUEUES	34
+
+/* types of a queue, which are the same as USBD_PIPE_TYPE except an unlink */
+#define VHCI_SCHED_CONTROL	0
+#define VHCI_SCHED_ISO		1
+#define VHCI_SCHED_BULK		2
+#define VHCI_SCHED_INTR		3
+#define VHCI_SCHED_UNLINK	4
+#define VHCI_SCHED_N_TYPES	5
+
+/* FIFO is the default. The others are opted in by SchedPolicy. */
+typedef enum {
+	/* in order of submission across endpoints */
+	VHCI_SCHED_FIFO,
+	/* strict priority by type: control, iso, interrupt and then bulk. Bulk queues share bulk_quantum */
+	VHCI_SCHED_PRIORITY,
+	/* weighted fair queuing by endpoint, of which weight is given by type */
+	VHCI_SCHED_WFQ,
+	VHCI_N_SCHED_POLICIES
+} vhci_sched_policy_t;
+
+typedef struct {
+	ULONG	policy;
+	/* bytes which a bulk queue may send in its turn. 0 means a single urb_req. */
+	ULONG	bulk_quantum;
+	/* weights of WFQ by a queue type. Unlink is not used. */
+	ULONG	weights[VHCI_SCHED_N_TYPES];
+} vhci_sched_params_t;
+
+typedef struct {
+	UCHAR	type;
+	/* bytes left of a turn of a bulk queue */
+	LONGLONG	deficit;
+	/* virtual time when a WFQ queue finishes its last urb_req */
+	ULONGLONG	finish;
+} vhci_sched_queue_t;
+
+/*
+ * Length and order of submission of the head of a queue. FALSE if a queue is empty.
+ * A length is of a transfer buffer, which a scheduler weighs with a header.
+ */
+typedef BOOLEAN (*vhci_sched_peek_t)(void *ctx, ULONG queue, ULONG *plen, ULONG *porder);
+
+typedef struct {
+	const vhci_sched_params_t	*params;
+	vhci_sched_peek_t	peek;
+	void	*ctx;
+	vhci_sched_queue_t	queues[VHCI_SCHED_N_QUEUES];
+	/* a queue served last, from which a turn goes round */
+	ULONG	served;
+	/* a bulk queue in its turn */
+	ULONG	bulk_served;
+	/* virtual time of WFQ */
+	ULONGLONG	vtime;
+} vhci_sched_t;
+
+extern const char	*vhci_sched_policy_names[VHCI_N_SCHED_POLICIES];
+
+void
+vhci_sched_init(vhci_sched_t *sched, const vhci_sched_params_t *params, vhci_sched_peek_t peek, void *ctx);
+
+/* type is one of VHCI_SCHED_XXX. Every queue is of control at first. */
+void
+vhci_sched_set_type(vhci_sched_t *sched, ULONG queue, UCHAR type);
+
+/* returns a queue whose head should be sent next, or VHCI_SCHED_N_QUEUES if all are empty */
+ULONG
+vhci_sched_pick(vhci_sched_t *sched);
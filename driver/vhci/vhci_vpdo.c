@@ -6,6 +6,7 @@
 
 #include "usbip_vhci_api.h"
 #include "vhci_pnp.h"
+#include "vhci_port.h"
 #include "usbip_proto.h"
 
 // IRP_MN_DEVICE_ENUMERATED is included by default since Windows 7.
@@ -514,11 +515,11 @@ SubmitIsoOutUrb(IN PVOID context, IN PURB urb)
 static NTSTATUS USB_BUSIFFN
 QueryBusTime(IN PVOID context, IN OUT PULONG currentusbframe)
 {
-	UNREFERENCED_PARAMETER(context);
-	UNREFERENCED_PARAMETER(currentusbframe);
+	pusbip_vpdo_dev_t	vpdo = context;
 
-	DBGI(DBG_GENERAL, "QueryBusTime called\n");
-	return STATUS_UNSUCCESSFUL;
+	*currentusbframe = vhci_frame_current(&vpdo->frame_clock);
+	DBGI(DBG_GENERAL, "QueryBusTime called: %lu\n", *currentusbframe);
+	return STATUS_SUCCESS;
 }
 
 static VOID USB_BUSIFFN
@@ -685,6 +686,13 @@ vhci_pnp_vpdo(PDEVICE_OBJECT devobj, PIRP Irp, PIO_STACK_LOCATION IrpStack, pusb
 		// resources. Let's just mark that it happened and we will do
 		// the cleanup later in IRP_MN_REMOVE_DEVICE.
 		SET_NEW_PNP_STATE(vpdo, SurpriseRemovePending);
+		// A port can be plugged again while a surprise removed vpdo waits for its removal.
+		if (vpdo->vhub) {
+			pusbip_vhub_dev_t	vhub = vpdo->vhub;
+			ExAcquireFastMutex(&vhub->Mutex);
+			vhci_release_port_vpdo(vhub, vpdo);
+			ExReleaseFastMutex(&vhub->Mutex);
+		}
 		status = STATUS_SUCCESS;
 		break;
 	case IRP_MN_REMOVE_DEVICE:
@@ -705,6 +713,7 @@ vhci_pnp_vpdo(PDEVICE_OBJECT devobj, PIRP Irp, PIO_STACK_LOCATION IrpStack, pusb
 				ExAcquireFastMutex(&vhub->Mutex);
 				RemoveEntryList(&vpdo->Link);
 				vhub->n_vpdos--;
+				vhci_release_port_vpdo(vhub, vpdo);
 				ExReleaseFastMutex(&vhub->Mutex);
 			}
 
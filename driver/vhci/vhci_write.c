@@ -256,6 +256,17 @@ store_urb_data(PURB urb, struct usbip_header *hdr)
 	return status;
 }
 
+static void
+post_iso_transfer(pusbip_vpdo_dev_t vpdo, PURB urb, struct usbip_header *hdr)
+{
+	struct _URB_ISOCH_TRANSFER	*urb_iso = &urb->UrbIsochronousTransfer;
+
+	vhci_frame_sync(&vpdo->frame_clock, vpdo->speed, hdr->u.ret_submit.start_frame, hdr->u.ret_submit.number_of_packets);
+	/* StartFrame is given back only for ASAP */
+	if (urb_iso->TransferFlags & USBD_START_ISO_TRANSFER_ASAP)
+		urb_iso->StartFrame = vhci_frame_from_remote(&vpdo->frame_clock, vpdo->speed, hdr->u.ret_submit.start_frame);
+}
+
 static NTSTATUS
 process_urb_res_submit(pusbip_vpdo_dev_t vpdo, PURB urb, struct usbip_header *hdr)
 {
@@ -282,6 +293,9 @@ process_urb_res_submit(pusbip_vpdo_dev_t vpdo, PURB urb, struct usbip_header *hd
 		case URB_FUNCTION_SELECT_INTERFACE:
 			status = post_select_interface(vpdo, urb);
 			break;
+		case URB_FUNCTION_ISOCH_TRANSFER:
+			post_iso_transfer(vpdo, urb, hdr);
+			break;
 		default:
 			break;
 		}
@@ -14,6 +14,10 @@
  *    (client to server)
  *  - RET_UNLINK transfers the result of CMD_UNLINK.
  *    (server to client)
+ *  - CMD_UNLINK_BATCH unlinks pending USB requests in a seqnum range at once, which is
+ *    replied with a single RET_UNLINK. It is sent only to a server which has honored
+ *    USBIP_IMPORT_EXT_UNLINK_BATCH.
+ *    (client to server)
  *
  * Note: The below request formats are based on the USB subsystem of Linux. Its
  * details will be defined when other implementations come.
@@ -26,6 +30,7 @@ struct usbip_header_basic {
 #define USBIP_CMD_UNLINK	0x0002
 #define USBIP_RET_SUBMIT	0x0003
 #define USBIP_RET_UNLINK	0x0004
+#define USBIP_CMD_UNLINK_BATCH	0x0005
 #define USBIP_RESET_DEV		0xFFFF
 	UINT32	command;
 
@@ -89,6 +94,23 @@ struct usbip_header_cmd_unlink {
 	UINT32	seqnum; /* URB's seqnum which will be unlinked */
 };
 
+/*
+* An additional header for a CMD_UNLINK_BATCH packet.
+* Like CMD_UNLINK, an unlinked URB has no RET_SUBMIT.
+*/
+struct usbip_header_cmd_unlink_batch {
+	/* URBs from seqnum_first to seqnum_last inclusive will be unlinked */
+	UINT32	seqnum_first;
+	UINT32	seqnum_last;
+	/* only URBs of an endpoint number of usbip_header_basic in either direction */
+#define USBIP_UNLINK_BATCH_EP	0x00000001
+	UINT32	flags;
+};
+
+/* TRUE if seqnum is in a range of CMD_UNLINK_BATCH, which may wrap around */
+#define USBIP_UNLINK_BATCH_HAS(first, last, seqnum)	\
+	((UINT32)((seqnum) - (first)) <= (UINT32)((last) - (first)))
+
 /*
 * An additional header for a RET_UNLINK packet.
 */
@@ -96,6 +118,9 @@ struct usbip_header_ret_unlink {
 	INT32	status;
 };
 
+/* the maximum number of iso descriptors which a single CMD_SUBMIT can carry */
+#define USBIP_MAX_ISO_PACKETS	1024
+
 /* the same as usb_iso_packet_descriptor but packed for pdu */
 struct usbip_iso_packet_descriptor {
 	UINT32	offset;
@@ -114,6 +139,7 @@ struct usbip_header {
 		struct usbip_header_cmd_submit	cmd_submit;
 		struct usbip_header_ret_submit	ret_submit;
 		struct usbip_header_cmd_unlink	cmd_unlink;
+		struct usbip_header_cmd_unlink_batch	cmd_unlink_batch;
 		struct usbip_header_ret_unlink	ret_unlink;
 	} u;
 };
@@ -16,6 +16,8 @@ DEFINE_GUID(GUID_DEVINTERFACE_STUB_USBIP,
 
 #define IOCTL_USBIP_STUB_GET_DEVINFO	USBIP_STUB_IOCTL(0x0)
 #define IOCTL_USBIP_STUB_EXPORT		USBIP_STUB_IOCTL(0x1)
+/* output is a configuration descriptor including all of its interfaces and endpoints */
+#define IOCTL_USBIP_STUB_GET_CONF_DESC	USBIP_STUB_IOCTL(0x2)
 
 #pragma pack(push,1)
 
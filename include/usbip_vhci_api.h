@@ -54,6 +54,13 @@ DEFINE_GUID(USBIP_NOTIFY_DEVICE_ARRIVAL_EVENT,
 #define IOCTL_USBIP_VHCI_UNPLUG_HARDWARE	USBIP_VHCI_IOCTL(0x1)
 #define IOCTL_USBIP_VHCI_EJECT_HARDWARE		USBIP_VHCI_IOCTL(0x2)
 #define IOCTL_USBIP_VHCI_GET_PORTS_STATUS	USBIP_VHCI_IOCTL(0x3)
+/* claims a free port for a following plugin over the same handle */
+#define IOCTL_USBIP_VHCI_ALLOC_PORT		USBIP_VHCI_IOCTL(0x4)
+/* frame clock of a port, which follows start frames of isochronous transfers */
+#define IOCTL_USBIP_VHCI_GET_FRAME_STATS	USBIP_VHCI_IOCTL(0x5)
+
+/* ports are numbered from 1 to USBIP_VHCI_MAX_PORTS. Port 0 of unplug means all ports. */
+#define USBIP_VHCI_MAX_PORTS	1024
 
 #define MAX_VHCI_INSTANCE_ID	16
 
@@ -72,25 +79,53 @@ typedef struct _ioctl_usbip_vhci_plugin
 	unsigned char	subclass;
 	unsigned char	protocol;
 
-	signed char	port;
+	/* a port claimed by IOCTL_USBIP_VHCI_ALLOC_PORT, or any other free port */
+	unsigned int	port;
+
+	/* a server takes CMD_UNLINK_BATCH */
+#define USBIP_VHCI_PLUGIN_UNLINK_BATCH	0x00000001
+	unsigned int	flags;
 
 	wchar_t		winstid[MAX_VHCI_INSTANCE_ID + 1];
 } ioctl_usbip_vhci_plugin;
 
 typedef struct _ioctl_usbip_vhci_get_ports_status
 {
-	union {
-		signed char max_used_port; /* then it can not be bigger than 127 */
-		unsigned char port_status[128];
-		/* 128 bytes */
-	} u;
+	unsigned short	max_used_port;
+	unsigned short	n_max_ports;
+	/* non-zero if a port is used. port_status[0] is not used. */
+	unsigned char	port_status[USBIP_VHCI_MAX_PORTS + 1];
 } ioctl_usbip_vhci_get_ports_status;
 
-typedef struct _ioctl_usbip_vhci_unplug
+typedef struct _ioctl_usbip_vhci_alloc_port
 {
-	signed char addr;
-	char unused[3];
+	unsigned int	port;
+} ioctl_usbip_vhci_alloc_port;
 
+typedef struct _ioctl_usbip_vhci_frame_stats
+{
+	/* in: port of a device */
+	unsigned int	port;
+
+	/* current frame in ms */
+	unsigned int	frame;
+	/* remote frame minus local frame, in 1/16 frames. Valid only if synced. */
+	int		offset;
+	unsigned int	synced;
+	/* isochronous RET_SUBMITs which the clock followed */
+	unsigned int	n_samples;
+	/* samples too far from the clock, which set it again */
+	unsigned int	n_resyncs;
+	/* explicit start frames which had already passed at a submit */
+	unsigned int	n_late;
+	/* skew of samples from the clock, in usec */
+	unsigned int	skew_max;
+	unsigned long long	skew_sum;
+} ioctl_usbip_vhci_frame_stats;
+
+typedef struct _ioctl_usbip_vhci_unplug
+{
+	unsigned int	addr;
 } ioctl_usbip_vhci_unplug;
 
 typedef struct _USBIP_VHCI_EJECT_HARDWARE
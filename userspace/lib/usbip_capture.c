@@ -0,0 +1,543 @@
+#include "usbip_windows.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "usbip_common.h"
+#include "list.h"
+#include "usbip_stats.h"
+#include "usbip_capture.h"
+
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+/* ring slots per forwarder, which should be a power of 2 */
+#define N_CAPTURE_SLOTS		4096
+/* seqnum table for finding an endpoint of RET_SUBMIT */
+#define N_CAPTURE_PENDINGS	2048
+/* period of the writer when rings are idle */
+#define CAPTURE_FLUSH_INTERVAL	100	/* msec */
+
+#define EINPROGRESS	115
+#define ECONNRESET	104
+
+#pragma pack(push,1)
+
+/* struct usbmon_packet of linux with mmapped extension. Everything is in host byte order. */
+typedef struct {
+	uint64_t	id;
+	uint8_t		type;		/* 'S': submission, 'C': completion */
+	uint8_t		xfer_type;	/* 0: iso, 1: interrupt, 2: control, 3: bulk */
+	uint8_t		epnum;		/* 0x80 is set for IN */
+	uint8_t		devnum;
+	uint16_t	busnum;
+	char		flag_setup;	/* 0 if setup is valid */
+	char		flag_data;	/* 0 if data is captured */
+	int64_t		ts_sec;
+	int32_t		ts_usec;
+	int32_t		status;
+	uint32_t	length;
+	uint32_t	len_cap;
+	union {
+		uint8_t	setup[8];
+		struct {
+			int32_t	error_count;
+			int32_t	numdesc;
+		} iso;
+	} s;
+	int32_t		interval;
+	int32_t		start_frame;
+	uint32_t	xfer_flags;
+	uint32_t	ndesc;
+} usbmon_packet_t;
+
+#pragma pack(pop)
+
+typedef struct {
+	unsigned long	seqnum;
+	BOOL	used;
+	BOOL	is_unlink;
+	unsigned long	seqnum_unlinked;
+	/* CMD_UNLINK_BATCH unlinks up to seqnum_unlinked_last on ep_unlinked, or any endpoint if -1 */
+	unsigned long	seqnum_unlinked_last;
+	int	ep_unlinked;
+	uint8_t	epnum, xfer_type, devnum;
+	uint16_t	busnum;
+} capture_pending_t;
+
+struct usbip_capture_ring {
+	usbip_capture_t	*cap;
+	char	*slots;
+	unsigned	slot_size;
+	/* head is advanced only by a forwarder and tail only by the writer */
+	volatile ULONG	head, tail;
+	volatile BOOL	closed;
+	ULONG	n_dropped;
+	/* private to the forwarder */
+	capture_pending_t	pendings[N_CAPTURE_PENDINGS];
+	struct list_head	list;
+};
+
+struct usbip_capture {
+	FILE	*fp;
+	unsigned	snaplen;
+	SRWLOCK	lock;
+	struct list_head	rings;
+	HANDLE	hthread;
+	HANDLE	hevt_stop;
+};
+
+/* usbip transfer type to usbmon one */
+static const uint8_t	usbmon_xfer_types[USBIP_XFER_TYPES] = { 2, 3, 1, 0 };
+
+static usbmon_packet_t *
+get_slot(usbip_capture_ring_t *ring, ULONG idx)
+{
+	return (usbmon_packet_t *)(ring->slots + (size_t)(idx % N_CAPTURE_SLOTS) * ring->slot_size);
+}
+
+static void
+set_timestamp(usbmon_packet_t *mon)
+{
+	FILETIME	ft;
+	ULONGLONG	usecs;
+
+	GetSystemTimePreciseAsFileTime(&ft);
+	/* FILETIME is 100 nsec since 1601-01-01 */
+	usecs = (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10 - 11644473600000000ULL;
+	mon->ts_sec = (int64_t)(usecs / 1000000);
+	mon->ts_usec = (int32_t)(usecs % 1000000);
+}
+
+static capture_pending_t *
+get_pending(usbip_capture_ring_t *ring, unsigned long seqnum)
+{
+	return ring->pendings + (seqnum % N_CAPTURE_PENDINGS);
+}
+
+/* NULL is returned if a ring is full */
+static usbmon_packet_t *
+alloc_record(usbip_capture_ring_t *ring)
+{
+	usbmon_packet_t	*mon;
+
+	if (ring->head - ring->tail >= N_CAPTURE_SLOTS) {
+		ring->n_dropped++;
+		return NULL;
+	}
+	mon = get_slot(ring, ring->head);
+	memset(mon, 0, sizeof(usbmon_packet_t));
+	set_timestamp(mon);
+	return mon;
+}
+
+static void
+commit_record(usbip_capture_ring_t *ring, usbmon_packet_t *mon, const void *data, unsigned len_data)
+{
+	if (len_data > 0) {
+		mon->len_cap = len_data > ring->cap->snaplen ? ring->cap->snaplen: len_data;
+		memcpy(mon + 1, data, mon->len_cap);
+	}
+	else {
+		mon->flag_data = (mon->epnum & 0x80) ? '<': '>';
+	}
+	/* a record should be visible before head moves */
+	MemoryBarrier();
+	ring->head++;
+}
+
+static void
+fill_from_pending(usbmon_packet_t *mon, capture_pending_t *pending)
+{
+	mon->epnum = pending->epnum;
+	mon->xfer_type = pending->xfer_type;
+	mon->devnum = pending->devnum;
+	mon->busnum = pending->busnum;
+}
+
+static void
+capture_cmd_submit(usbip_capture_ring_t *ring, struct usbip_header *hdr, unsigned len_data)
+{
+	usbmon_packet_t	*mon;
+	capture_pending_t	*pending;
+
+	pending = get_pending(ring, hdr->base.seqnum);
+	pending->seqnum = hdr->base.seqnum;
+	pending->used = TRUE;
+	pending->is_unlink = FALSE;
+	pending->epnum = (uint8_t)((hdr->base.ep & 0x7f) | (hdr->base.direction ? 0x80: 0));
+	pending->xfer_type = usbmon_xfer_types[usbip_stats_xfer_type(hdr)];
+	pending->devnum = (uint8_t)(hdr->base.devid & 0xff);
+	pending->busnum = (uint16_t)(hdr->base.devid >> 16);
+
+	mon = alloc_record(ring);
+	if (mon == NULL)
+		return;
+	mon->id = hdr->base.seqnum;
+	mon->type = 'S';
+	fill_from_pending(mon, pending);
+	mon->status = -EINPROGRESS;
+	mon->length = hdr->u.cmd_submit.transfer_buffer_length;
+	mon->interval = hdr->u.cmd_submit.interval;
+	mon->start_frame = hdr->u.cmd_submit.start_frame;
+	mon->xfer_flags = hdr->u.cmd_submit.transfer_flags;
+	if (pending->xfer_type == 2) {
+		memcpy(mon->s.setup, hdr->u.cmd_submit.setup, 8);
+	}
+	else {
+		mon->flag_setup = '-';
+		/* iso descriptors are not captured. numdesc just shows the number of packets. */
+		if (pending->xfer_type == 0)
+			mon->s.iso.numdesc = hdr->u.cmd_submit.number_of_packets;
+	}
+	commit_record(ring, mon, hdr + 1, len_data);
+}
+
+static void
+capture_ret_submit(usbip_capture_ring_t *ring, struct usbip_header *hdr, unsigned len_data)
+{
+	usbmon_packet_t	*mon;
+	capture_pending_t	*pending;
+
+	mon = alloc_record(ring);
+	if (mon == NULL)
+		return;
+	mon->id = hdr->base.seqnum;
+	mon->type = 'C';
+	pending = get_pending(ring, hdr->base.seqnum);
+	if (pending->used && !pending->is_unlink && pending->seqnum == hdr->base.seqnum) {
+		fill_from_pending(mon, pending);
+		pending->used = FALSE;
+	}
+	mon->flag_setup = '-';
+	mon->status = hdr->u.ret_submit.status;
+	mon->length = hdr->u.ret_submit.actual_length;
+	mon->start_frame = hdr->u.ret_submit.start_frame;
+	if (mon->xfer_type == 0) {
+		mon->s.iso.error_count = hdr->u.ret_submit.error_count;
+		mon->s.iso.numdesc = hdr->u.ret_submit.number_of_packets;
+	}
+	commit_record(ring, mon, hdr + 1, len_data);
+}
+
+static void
+capture_cmd_unlink(usbip_capture_ring_t *ring, struct usbip_header *hdr)
+{
+	capture_pending_t	*pending;
+
+	pending = get_pending(ring, hdr->base.seqnum);
+	pending->seqnum = hdr->base.seqnum;
+	pending->used = TRUE;
+	pending->is_unlink = TRUE;
+	if (hdr->base.command == USBIP_CMD_UNLINK) {
+		pending->seqnum_unlinked = hdr->u.cmd_unlink.seqnum;
+		pending->seqnum_unlinked_last = pending->seqnum_unlinked;
+		pending->ep_unlinked = -1;
+	}
+	else {
+		pending->seqnum_unlinked = hdr->u.cmd_unlink_batch.seqnum_first;
+		pending->seqnum_unlinked_last = hdr->u.cmd_unlink_batch.seqnum_last;
+		pending->ep_unlinked = (hdr->u.cmd_unlink_batch.flags & USBIP_UNLINK_BATCH_EP) ? (int)hdr->base.ep: -1;
+	}
+}
+
+static void
+capture_unlinked(usbip_capture_ring_t *ring, capture_pending_t *unlinked)
+{
+	usbmon_packet_t	*mon;
+
+	unlinked->used = FALSE;
+
+	mon = alloc_record(ring);
+	if (mon == NULL)
+		return;
+	mon->id = unlinked->seqnum;
+	mon->type = 'C';
+	fill_from_pending(mon, unlinked);
+	mon->flag_setup = '-';
+	mon->status = -ECONNRESET;
+	commit_record(ring, mon, NULL, 0);
+}
+
+/*
+ * usbmon has no unlink event. Like linux, an unlinked URB completes with -ECONNRESET.
+ * If the URB has already completed, its RET_SUBMIT has been captured before RET_UNLINK.
+ */
+static void
+capture_ret_unlink(usbip_capture_ring_t *ring, struct usbip_header *hdr)
+{
+	capture_pending_t	*pending, *unlinked;
+	int	i;
+
+	pending = get_pending(ring, hdr->base.seqnum);
+	if (!pending->used || !pending->is_unlink || pending->seqnum != hdr->base.seqnum)
+		return;
+	pending->used = FALSE;
+
+	if (pending->seqnum_unlinked_last != pending->seqnum_unlinked) {
+		/* a batch may cover more seqnums than pendings */
+		for (i = 0; i < N_CAPTURE_PENDINGS; i++) {
+			unlinked = ring->pendings + i;
+			if (!unlinked->used || unlinked->is_unlink)
+				continue;
+			if (!USBIP_UNLINK_BATCH_HAS(pending->seqnum_unlinked, pending->seqnum_unlinked_last, unlinked->seqnum))
+				continue;
+			if (pending->ep_unlinked >= 0 && (unlinked->epnum & 0x7f) != pending->ep_unlinked)
+				continue;
+			capture_unlinked(ring, unlinked);
+		}
+		return;
+	}
+
+	unlinked = get_pending(ring, pending->seqnum_unlinked);
+	if (!unlinked->used || unlinked->is_unlink || unlinked->seqnum != pending->seqnum_unlinked)
+		return;
+	capture_unlinked(ring, unlinked);
+}
+
+void
+usbip_capture_pdu(usbip_capture_ring_t *ring, struct usbip_header *hdr, unsigned len_data)
+{
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		capture_cmd_submit(ring, hdr, len_data);
+		break;
+	case USBIP_RET_SUBMIT:
+		capture_ret_submit(ring, hdr, len_data);
+		break;
+	case USBIP_CMD_UNLINK:
+	case USBIP_CMD_UNLINK_BATCH:
+		capture_cmd_unlink(ring, hdr);
+		break;
+	case USBIP_RET_UNLINK:
+		capture_ret_unlink(ring, hdr);
+		break;
+	default:
+		break;
+	}
+}
+
+static BOOL
+write_block(FILE *fp, uint32_t type, const void *body, uint32_t len_body, const void *data, uint32_t len_data)
+{
+	static const char	zeros[4];
+	uint32_t	len_pad = (4 - len_data % 4) % 4;
+	uint32_t	len_block = 12 + len_body + len_data + len_pad;
+
+	if (fwrite(&type, 4, 1, fp) != 1 || fwrite(&len_block, 4, 1, fp) != 1)
+		return FALSE;
+	if (len_body > 0 && fwrite(body, len_body, 1, fp) != 1)
+		return FALSE;
+	if (len_data > 0 && fwrite(data, len_data, 1, fp) != 1)
+		return FALSE;
+	if (len_pad > 0 && fwrite(zeros, len_pad, 1, fp) != 1)
+		return FALSE;
+	return fwrite(&len_block, 4, 1, fp) == 1;
+}
+
+static BOOL
+write_headers(FILE *fp, unsigned snaplen)
+{
+	struct {
+		uint32_t	magic;
+		uint16_t	major, minor;
+		int64_t		len_section;
+	} shb = { 0x1a2b3c4d, 1, 0, -1 };
+	struct {
+		uint16_t	linktype, reserved;
+		uint32_t	snaplen;
+	} idb = { LINKTYPE_USB_LINUX_MMAPPED, 0, 0 };
+
+	idb.snaplen = (uint32_t)(sizeof(usbmon_packet_t) + snaplen);
+	/* section header block and interface description block */
+	if (!write_block(fp, 0x0a0d0d0a, &shb, sizeof(shb), NULL, 0))
+		return FALSE;
+	return write_block(fp, 0x00000001, &idb, sizeof(idb), NULL, 0);
+}
+
+static void
+write_record(FILE *fp, usbmon_packet_t *mon)
+{
+	struct {
+		uint32_t	if_id;
+		uint32_t	ts_high, ts_low;
+		uint32_t	len_cap, len_orig;
+	} epb;
+	uint64_t	ts;
+
+	/* default timestamp resolution of pcapng is microsecond */
+	ts = (uint64_t)mon->ts_sec * 1000000 + mon->ts_usec;
+	epb.if_id = 0;
+	epb.ts_high = (uint32_t)(ts >> 32);
+	epb.ts_low = (uint32_t)ts;
+	epb.len_cap = (uint32_t)sizeof(usbmon_packet_t) + mon->len_cap;
+	epb.len_orig = (uint32_t)sizeof(usbmon_packet_t) + (mon->flag_data == 0 ? mon->length: 0);
+	/* enhanced packet block */
+	write_block(fp, 0x00000006, &epb, sizeof(epb), mon, epb.len_cap);
+}
+
+static BOOL
+drain_ring(usbip_capture_t *cap, usbip_capture_ring_t *ring)
+{
+	ULONG	head = ring->head;
+	BOOL	drained = FALSE;
+
+	/* records up to head should be read after head */
+	MemoryBarrier();
+	while (ring->tail != head) {
+		write_record(cap->fp, get_slot(ring, ring->tail));
+		MemoryBarrier();
+		ring->tail++;
+		drained = TRUE;
+	}
+	return drained;
+}
+
+static void
+free_ring(usbip_capture_ring_t *ring)
+{
+	if (ring->n_dropped > 0)
+		info("capture: %lu records dropped", ring->n_dropped);
+	list_del(&ring->list);
+	free(ring->slots);
+	free(ring);
+}
+
+static BOOL
+drain_rings(usbip_capture_t *cap)
+{
+	struct list_head	*p, *n;
+	BOOL	drained = FALSE;
+
+	AcquireSRWLockExclusive(&cap->lock);
+	list_for_each_safe(p, n, &cap->rings) {
+		usbip_capture_ring_t	*ring = list_entry(p, usbip_capture_ring_t, list);
+		BOOL	closed = ring->closed;
+
+		/* closed is read first. A forwarder puts nothing after closing its ring. */
+		MemoryBarrier();
+		if (drain_ring(cap, ring))
+			drained = TRUE;
+		if (closed)
+			free_ring(ring);
+	}
+	ReleaseSRWLockExclusive(&cap->lock);
+
+	if (drained)
+		fflush(cap->fp);
+	return drained;
+}
+
+static DWORD WINAPI
+capture_writer(LPVOID ctx)
+{
+	usbip_capture_t	*cap = (usbip_capture_t *)ctx;
+
+	while (TRUE) {
+		if (drain_rings(cap))
+			continue;
+		if (WaitForSingleObject(cap->hevt_stop, CAPTURE_FLUSH_INTERVAL) == WAIT_OBJECT_0)
+			break;
+	}
+	drain_rings(cap);
+	return 0;
+}
+
+usbip_capture_t *
+usbip_capture_open(const char *path, unsigned snaplen)
+{
+	usbip_capture_t	*cap;
+
+	cap = (usbip_capture_t *)malloc(sizeof(usbip_capture_t));
+	if (cap == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	if (fopen_s(&cap->fp, path, "wb") != 0) {
+		err("%s: cannot open: %s", __FUNCTION__, path);
+		free(cap);
+		return NULL;
+	}
+	cap->snaplen = snaplen;
+	InitializeSRWLock(&cap->lock);
+	INIT_LIST_HEAD(&cap->rings);
+
+	if (!write_headers(cap->fp, snaplen)) {
+		err("%s: failed to write: %s", __FUNCTION__, path);
+		goto err_out;
+	}
+	cap->hevt_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (cap->hevt_stop == NULL) {
+		err("%s: failed to create event: err: %lx", __FUNCTION__, GetLastError());
+		goto err_out;
+	}
+	cap->hthread = CreateThread(NULL, 0, capture_writer, cap, 0, NULL);
+	if (cap->hthread == NULL) {
+		err("%s: failed to create thread: err: %lx", __FUNCTION__, GetLastError());
+		CloseHandle(cap->hevt_stop);
+		goto err_out;
+	}
+	info("capturing PDUs into %s", path);
+	return cap;
+err_out:
+	fclose(cap->fp);
+	free(cap);
+	return NULL;
+}
+
+void
+usbip_capture_close(usbip_capture_t *cap)
+{
+	if (cap == NULL)
+		return;
+
+	SetEvent(cap->hevt_stop);
+	WaitForSingleObject(cap->hthread, INFINITE);
+	CloseHandle(cap->hthread);
+	CloseHandle(cap->hevt_stop);
+
+	/*
+	 * Closed rings have been freed by the writer. A ring of a forwarder still running
+	 * is left alone, because the forwarder may put a record into it at any time.
+	 */
+	fclose(cap->fp);
+	free(cap);
+}
+
+usbip_capture_ring_t *
+usbip_capture_add_ring(usbip_capture_t *cap)
+{
+	usbip_capture_ring_t	*ring;
+
+	if (cap == NULL)
+		return NULL;
+
+	ring = (usbip_capture_ring_t *)calloc(1, sizeof(usbip_capture_ring_t));
+	if (ring == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	ring->slot_size = (unsigned)((sizeof(usbmon_packet_t) + cap->snaplen + 7) & ~7);
+	ring->slots = (char *)malloc((size_t)ring->slot_size * N_CAPTURE_SLOTS);
+	if (ring->slots == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		free(ring);
+		return NULL;
+	}
+	ring->cap = cap;
+
+	AcquireSRWLockExclusive(&cap->lock);
+	list_add(&ring->list, cap->rings.prev);
+	ReleaseSRWLockExclusive(&cap->lock);
+	return ring;
+}
+
+void
+usbip_capture_del_ring(usbip_capture_ring_t *ring)
+{
+	if (ring == NULL)
+		return;
+	/* the writer frees a closed ring after draining it */
+	MemoryBarrier();
+	ring->closed = TRUE;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <windows.h>
+
+#include "usbip_proto.h"
+
+/*
+ * PDU capture into a pcapng file of LINKTYPE_USB_LINUX_MMAPPED, which Wireshark reads as usbmon.
+ *
+ * Each forwarder owns a ring, into which only the forwarding thread puts records.
+ * A single writer thread per capture file drains all rings in the background.
+ * A record is dropped if its ring is full, which never blocks forwarding.
+ */
+
+#define USBIP_CAPTURE_SNAPLEN	256
+
+typedef struct usbip_capture	usbip_capture_t;
+typedef struct usbip_capture_ring	usbip_capture_ring_t;
+
+usbip_capture_t *usbip_capture_open(const char *path, unsigned snaplen);
+void usbip_capture_close(usbip_capture_t *cap);
+
+usbip_capture_ring_t *usbip_capture_add_ring(usbip_capture_t *cap);
+/* remaining records are flushed by the writer later */
+void usbip_capture_del_ring(usbip_capture_ring_t *ring);
+
+/* hdr should be in host byte order and followed by len_data bytes of transfer data */
+void usbip_capture_pdu(usbip_capture_ring_t *ring, struct usbip_header *hdr, unsigned len_data);
@@ -112,6 +112,35 @@ void dump_usb_device(struct usbip_usb_device *udev)
 	DBG_UDEV_INTEGER(devnum);
 }
 
+/*
+ * Collect class triples of interfaces from a configuration descriptor.
+ * Only the default alternate setting of each interface is counted.
+ */
+int usbip_get_conf_interfaces(const unsigned char *dsc_conf, unsigned len, struct usbip_usb_interface *uinfs, int n_max)
+{
+	unsigned	offset;
+	int	n_uinfs = 0;
+
+	if (len < 9 || dsc_conf[1] != 2)
+		return 0;
+
+	for (offset = dsc_conf[0]; offset + 9 <= len && n_uinfs < n_max; offset += dsc_conf[offset]) {
+		const unsigned char	*dsc = dsc_conf + offset;
+
+		if (dsc[0] < 2)
+			break;
+		/* interface descriptor with bAlternateSetting 0 */
+		if (dsc[1] != 4 || dsc[0] < 9 || dsc[3] != 0)
+			continue;
+		uinfs[n_uinfs].bInterfaceClass = dsc[5];
+		uinfs[n_uinfs].bInterfaceSubClass = dsc[6];
+		uinfs[n_uinfs].bInterfaceProtocol = dsc[7];
+		uinfs[n_uinfs].padding = 0;
+		n_uinfs++;
+	}
+	return n_uinfs;
+}
+
 int usbip_names_init(void)
 {
 	char	*fpath_db, *fpath_mod;
@@ -114,6 +114,8 @@ struct usbip_usb_device {
 void dump_usb_interface(struct usbip_usb_interface *);
 void dump_usb_device(struct usbip_usb_device *);
 
+int usbip_get_conf_interfaces(const unsigned char *dsc_conf, unsigned len, struct usbip_usb_interface *uinfs, int n_max);
+
 const char *usbip_speed_string(int num);
 const char *usbip_status_string(int32_t status);
 
@@ -1,10 +1,15 @@
 #include "usbip_windows.h"
 
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 
 #include "usbip_proto.h"
 #include "usbip_network.h"
+#include "usbip_stats.h"
+#include "usbip_capture.h"
+#include "usbip_forward.h"
+#include "list.h"
 
 #define BUFREAD_P(devbuf)	((devbuf)->offp - (devbuf)->offhdr)
 #define BUFREADMAX_P(devbuf)	((devbuf)->bufmaxp - (devbuf)->offp)
@@ -21,136 +26,24 @@ typedef struct _devbuf {
 	BOOL	in_reading;
 	/* step 1: reading header, 2: reading data */
 	int	step_reading;
+	/* a peer device can accept multiple PDUs in a single write */
+	BOOL	batch_write;
+	/* the number of read PDUs which have not been written yet to a peer */
+	int	n_batched;
 	HANDLE	hdev;
 	char	*bufp, *bufc;	/* bufp: producer, bufc: consumer */
 	DWORD	offhdr;		/* header offset for producer */
 	DWORD	offp, offc;	/* offp: producer offset, offc: consumer offset */
 	DWORD	bufmaxp, bufmaxc;
 	struct _devbuf	*peer;
+	/* shared by both directions, which run on the same thread */
+	usbip_stats_t	*stats;
+	usbip_capture_ring_t	*capring;
+	/* NULL unless a session is resumable */
+	usbip_journal_t	*journal;
 	OVERLAPPED	ovs[2];
 } devbuf_t;
 
-#ifdef DEBUG_PDU
-#undef USING_STDOUT
-
-static void
-dbg_to_file(char *fmt, ...)
-{
-	FILE	*fp;
-	va_list ap;
-
-#ifdef USING_STDOUT
-	fp = stdout;
-#else
-	if (fopen_s(&fp, "debug_pdu.log", "a+") != 0)
-		return;
-#endif
-	va_start(ap, fmt);
-	vfprintf(fp, fmt, ap);
-	va_end(ap);
-#ifndef USING_STDOUT
-	fclose(fp);
-#endif
-}
-
-static const char *
-dbg_usbip_hdr_cmd(unsigned int cmd)
-{
-	switch (cmd) {
-	case USBIP_CMD_SUBMIT:
-		return "CMD_SUBMIT";
-	case USBIP_RET_SUBMIT:
-		return "RET_SUBMIT";
-	case USBIP_CMD_UNLINK:
-		return "CMD_UNLINK";
-	case USBIP_RET_UNLINK:
-		return "RET_UNLINK";
-	default:
-		return "UNKNOWN";
-	}
-}
-
-static void
-dump_iso_pkts(struct usbip_header *hdr)
-{
-	struct usbip_iso_packet_descriptor	*iso_desc;
-	int	n_pkts;
-	int	i;
-
-	switch (hdr->base.command) {
-	case USBIP_CMD_SUBMIT:
-		n_pkts = hdr->u.cmd_submit.number_of_packets;
-		if (hdr->base.direction)
-			iso_desc = (struct usbip_iso_packet_descriptor *)(hdr + 1);
-		else
-			iso_desc = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + hdr->u.cmd_submit.transfer_buffer_length);
-		break;
-	case USBIP_RET_SUBMIT:
-		n_pkts = hdr->u.ret_submit.number_of_packets;
-		iso_desc = (struct usbip_iso_packet_descriptor *)((char *)(hdr + 1) + hdr->u.ret_submit.actual_length);
-		break;
-	default:
-		return;
-	}
-
-	for (i = 0; i < n_pkts; i++) {
-		dbg_to_file("  o:%d,l:%d,al:%d,st:%d\n", iso_desc->offset, iso_desc->length, iso_desc->actual_length, iso_desc->status);
-		iso_desc++;
-	}
-}
-
-static void
-dump_usbip_header(struct usbip_header *hdr)
-{
-	dbg_to_file("DUMP: %s,seq:%u,devid:%x,dir:%s,ep:%x\n",
-		dbg_usbip_hdr_cmd(hdr->base.command), hdr->base.seqnum, hdr->base.devid, hdr->base.direction ? "in": "out", hdr->base.ep);
-
-	switch (hdr->base.command) {
-	case USBIP_CMD_SUBMIT:
-		dbg_to_file("  flags:%x,len:%x,sf:%x,#p:%x,intv:%x\n",
-			hdr->u.cmd_submit.transfer_flags,
-			hdr->u.cmd_submit.transfer_buffer_length,
-			hdr->u.cmd_submit.start_frame,
-			hdr->u.cmd_submit.number_of_packets,
-			hdr->u.cmd_submit.interval);
-		dbg_to_file("  setup: %02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx\n",
-			hdr->u.cmd_submit.setup[0], hdr->u.cmd_submit.setup[1], hdr->u.cmd_submit.setup[2],
-			hdr->u.cmd_submit.setup[3], hdr->u.cmd_submit.setup[4], hdr->u.cmd_submit.setup[5],
-			hdr->u.cmd_submit.setup[6], hdr->u.cmd_submit.setup[7]);
-		dump_iso_pkts(hdr);
-		break;
-	case USBIP_CMD_UNLINK:
-		dbg_to_file("  seq:%x\n", hdr->u.cmd_unlink.seqnum);
-		break;
-	case USBIP_RET_SUBMIT:
-		dbg_to_file("  st:%d,al:%d,sf:%d,#p:%d,ec:%d\n",
-			hdr->u.ret_submit.status,
-			hdr->u.ret_submit.actual_length,
-			hdr->u.ret_submit.start_frame,
-			hdr->u.cmd_submit.number_of_packets,
-			hdr->u.ret_submit.error_count);
-		dump_iso_pkts(hdr);
-		break;
-	case USBIP_RET_UNLINK:
-		dbg_to_file(" st:%d\n", hdr->u.ret_unlink.status);
-		break;
-	default:
-		/* NOT REACHED */
-		break;
-	}
-	dbg_to_file("DUMP DONE-------\n");
-}
-
-#define DBGF(fmt, ...)		dbg_to_file(fmt, ## __VA_ARGS__)
-#define DBG_USBIP_HEADER(hdr)	dump_usbip_header(hdr)
-
-#else
-
-#define DBGF(fmt, ...)
-#define DBG_USBIP_HEADER(hdr)
-
-#endif
-
 static void
 swap_usbip_header_base_endian(struct usbip_header_basic *base)
 {
@@ -187,6 +80,14 @@ swap_cmd_unlink_endian(struct usbip_header_cmd_unlink *pdu)
 	pdu->seqnum = ntohl(pdu->seqnum);
 }
 
+static void
+swap_cmd_unlink_batch_endian(struct usbip_header_cmd_unlink_batch *pdu)
+{
+	pdu->seqnum_first = ntohl(pdu->seqnum_first);
+	pdu->seqnum_last = ntohl(pdu->seqnum_last);
+	pdu->flags = ntohl(pdu->flags);
+}
+
 static void
 swap_ret_unlink_endian(struct usbip_header_ret_unlink *pdu)
 {
@@ -209,6 +110,9 @@ swap_usbip_header_cmd(unsigned int cmd, struct usbip_header *hdr)
 	case USBIP_RET_UNLINK:
 		swap_ret_unlink_endian(&hdr->u.ret_unlink);
 		break;
+	case USBIP_CMD_UNLINK_BATCH:
+		swap_cmd_unlink_batch_endian(&hdr->u.cmd_unlink_batch);
+		break;
 	default:
 		/* NOTREACHED */
 		err("unknown command in pdu header: %d", cmd);
@@ -252,7 +156,7 @@ swap_iso_descs_endian(char *buf, int num)
 static long out_q_seqnum_array[OUT_Q_LEN];
 
 static BOOL
-record_outq_seqnum(unsigned long seqnum)
+record_outq_seqnum(long *outq, unsigned long seqnum)
 {
 	int	i;
 
@@ -262,44 +166,45 @@ record_outq_seqnum(unsigned long seqnum)
 		/* record_outq_seqnum can be called multiple times.
 		 * seqnum should be checked if it was already marked.
 		 */
-		if (out_q_seqnum_array[i] == seqnum)
+		if (outq[i] == seqnum)
 			return TRUE;
-		if (out_q_seqnum_array[i])
+		if (outq[i])
 			continue;
 		found_empty_slot = i;
 		for (; i < OUT_Q_LEN; i++) {
-			if (out_q_seqnum_array[i] == seqnum)
+			if (outq[i] == seqnum)
 				return TRUE;
 		}
-		out_q_seqnum_array[found_empty_slot] = seqnum;
+		outq[found_empty_slot] = seqnum;
 		return TRUE;
 	}
 	return FALSE;
 }
 
 static BOOL
-is_outq_seqnum(unsigned long seqnum)
+is_outq_seqnum(long *outq, unsigned long seqnum)
 {
 	int	i;
 
 	for (i = 0; i < OUT_Q_LEN; i++) {
-		if (out_q_seqnum_array[i] != seqnum)
+		if (outq[i] != seqnum)
 			continue;
-		out_q_seqnum_array[i] = 0;
+		outq[i] = 0;
 		return TRUE;
 	}
 	return FALSE;
 }
 
+/* outq records seqnums of OUT transfers, whose replies have no data */
 static int
-get_xfer_len(BOOL is_req, struct usbip_header *hdr)
+get_xfer_len(BOOL is_req, struct usbip_header *hdr, long *outq)
 {
 	if (is_req) {
-		if (hdr->base.command == USBIP_CMD_UNLINK)
+		if (hdr->base.command == USBIP_CMD_UNLINK || hdr->base.command == USBIP_CMD_UNLINK_BATCH)
 			return 0;
 		if (hdr->base.direction)
 			return 0;
-		if (!record_outq_seqnum(hdr->base.seqnum)) {
+		if (!record_outq_seqnum(outq, hdr->base.seqnum)) {
 			err("failed to record. out queue full");
 		}
 		return hdr->u.cmd_submit.transfer_buffer_length;
@@ -307,7 +212,7 @@ get_xfer_len(BOOL is_req, struct usbip_header *hdr)
 	else {
 		if (hdr->base.command == USBIP_RET_UNLINK)
 			return 0;
-		if (is_outq_seqnum(hdr->base.seqnum))
+		if (is_outq_seqnum(outq, hdr->base.seqnum))
 			return 0;
 		return hdr->u.ret_submit.actual_length;
 	}
@@ -317,7 +222,7 @@ static int
 get_iso_len(BOOL is_req, struct usbip_header *hdr)
 {
 	if (is_req) {
-		if (hdr->base.command == USBIP_CMD_UNLINK)
+		if (hdr->base.command == USBIP_CMD_UNLINK || hdr->base.command == USBIP_CMD_UNLINK_BATCH)
 			return 0;
 		return hdr->u.cmd_submit.number_of_packets * sizeof(struct usbip_iso_packet_descriptor);
 	}
@@ -341,7 +246,7 @@ setup_rw_overlapped(devbuf_t *buff)
 }
 
 static BOOL
-init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, HANDLE hdev)
+init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, HANDLE hdev, usbip_stats_t *stats, usbip_capture_ring_t *capring)
 {
 	buff->bufp = (char *)malloc(1024);
 	if (buff->bufp == NULL)
@@ -353,12 +258,17 @@ init_devbuf(devbuf_t *buff, const char *desc, BOOL is_req, BOOL swap_req, HANDLE
 	buff->in_reading = FALSE;
 	buff->invalid = FALSE;
 	buff->step_reading = 0;
+	buff->batch_write = FALSE;
+	buff->n_batched = 0;
 	buff->offhdr = 0;
 	buff->offp = 0;
 	buff->offc = 0;
 	buff->bufmaxp = 1024;
 	buff->bufmaxc = 0;
 	buff->hdev = hdev;
+	buff->stats = stats;
+	buff->capring = capring;
+	buff->journal = NULL;
 	if (!setup_rw_overlapped(buff)) {
 		free(buff->bufp);
 		return FALSE;
@@ -388,6 +298,8 @@ read_completion(DWORD errcode, DWORD nread, LPOVERLAPPED lpOverlapped)
 	rbuff->in_reading = FALSE;
 }
 
+static BOOL write_devbuf(devbuf_t *wbuff, devbuf_t *rbuff);
+
 static BOOL
 read_devbuf(devbuf_t *rbuff, DWORD nreq)
 {
@@ -411,6 +323,17 @@ read_devbuf(devbuf_t *rbuff, DWORD nreq)
 		else {
 			DWORD	nexist = BUFREAD_P(rbuff);
 
+			/*
+			 * PDUs held for a batch are handed over before a producer leaves a consumer's buffer,
+			 * whose end no longer advances. Otherwise, they would wait for a PDU after the next one.
+			 */
+			if (rbuff->n_batched > 0) {
+				rbuff->n_batched = 0;
+				if (!write_devbuf(rbuff->peer, rbuff)) {
+					rbuff->peer->invalid = TRUE;
+					return FALSE;
+				}
+			}
 			bufnew = (char *)malloc(nreq + nexist);
 			if (bufnew == NULL) {
 				err("%s: failed to allocate buffer: %s", __FUNCTION__, rbuff->desc);
@@ -425,6 +348,8 @@ read_devbuf(devbuf_t *rbuff, DWORD nreq)
 			rbuff->offp = nexist;
 			rbuff->bufmaxp = nreq + nexist;
 		}
+		if (rbuff->stats != NULL)
+			usbip_stats_buf(rbuff->stats, rbuff->is_req, rbuff->bufmaxp);
 	}
 
 	if (!ReadFileEx(rbuff->hdev, BUFCUR_P(rbuff), nreq, &rbuff->ovs[0], read_completion)) {
@@ -476,7 +401,7 @@ write_devbuf(devbuf_t *wbuff, devbuf_t *rbuff)
 static int
 read_dev(devbuf_t *rbuff, BOOL swap_req_write)
 {
-	struct usbip_header	*hdr;
+	struct usbip_header	*hdr, hdr_host;
 	unsigned long	xfer_len, iso_len, len_data;
 
 	if (BUFREAD_P(rbuff) < sizeof(struct usbip_header)) {
@@ -493,7 +418,7 @@ read_dev(devbuf_t *rbuff, BOOL swap_req_write)
 		rbuff->step_reading = 2;
 	}
 
-	xfer_len = get_xfer_len(rbuff->is_req, hdr);
+	xfer_len = get_xfer_len(rbuff->is_req, hdr, out_q_seqnum_array);
 	iso_len = get_iso_len(rbuff->is_req, hdr);
 
 	len_data = xfer_len + iso_len;
@@ -506,15 +431,26 @@ read_dev(devbuf_t *rbuff, BOOL swap_req_write)
 	}
 
 	if (rbuff->swap_req && iso_len > 0)
-		swap_iso_descs_endian(rbuff->bufp + sizeof(struct usbip_header) + xfer_len, hdr->u.ret_submit.number_of_packets);
+		swap_iso_descs_endian((char *)(hdr + 1) + xfer_len, hdr->u.ret_submit.number_of_packets);
 
-	DBG_USBIP_HEADER(hdr);
+	if (rbuff->stats != NULL) {
+		if (rbuff->is_req)
+			usbip_stats_req(rbuff->stats, hdr);
+		else
+			usbip_stats_rep(rbuff->stats, hdr);
+	}
+	if (rbuff->capring != NULL)
+		usbip_capture_pdu(rbuff->capring, hdr, xfer_len);
+	if (rbuff->journal != NULL)
+		hdr_host = *hdr;
 
 	if (swap_req_write) {
 		if (iso_len > 0)
-			swap_iso_descs_endian(rbuff->bufp + sizeof(struct usbip_header) + xfer_len, hdr->u.ret_submit.number_of_packets);
+			swap_iso_descs_endian((char *)(hdr + 1) + xfer_len, hdr->u.ret_submit.number_of_packets);
 		swap_usbip_header_endian(hdr, FALSE);
 	}
+	if (rbuff->journal != NULL)
+		usbip_journal_pdu(rbuff->journal, rbuff->is_req, &hdr_host, (const char *)hdr, (unsigned)(sizeof(struct usbip_header) + len_data));
 
 	rbuff->offhdr += (sizeof(struct usbip_header) + len_data);
 	if (rbuff->bufp == rbuff->bufc)
@@ -524,6 +460,25 @@ read_dev(devbuf_t *rbuff, BOOL swap_req_write)
 	return 1;
 }
 
+/* maximum number of PDUs which are collected into a single write */
+#define MAX_BATCH_PDUS	32
+
+/*
+ * Check if a next PDU header has already arrived at a socket.
+ * If so, it's better to keep reading and hand over PDUs to a peer at once.
+ */
+static BOOL
+is_next_pdu_ready(devbuf_t *rbuff)
+{
+	u_long	len_avail;
+
+	if (rbuff->n_batched >= MAX_BATCH_PDUS)
+		return FALSE;
+	if (ioctlsocket((SOCKET)rbuff->hdev, FIONREAD, &len_avail) != 0)
+		return FALSE;
+	return len_avail >= sizeof(struct usbip_header) ? TRUE: FALSE;
+}
+
 static BOOL
 read_write_dev(devbuf_t *rbuff, devbuf_t *wbuff)
 {
@@ -531,12 +486,66 @@ read_write_dev(devbuf_t *rbuff, devbuf_t *wbuff)
 
 	if (rbuff->in_reading)
 		return TRUE;
-	if ((res = read_dev(rbuff, wbuff->swap_req)) < 0)
+	if ((res = read_dev(rbuff, wbuff->swap_req)) < 0) {
+		rbuff->invalid = TRUE;
 		return FALSE;
+	}
 	if (res == 0)
 		return TRUE;
 
-	return write_devbuf(wbuff, rbuff);
+	if (wbuff->batch_write && is_next_pdu_ready(rbuff)) {
+		rbuff->n_batched++;
+		return TRUE;
+	}
+	rbuff->n_batched = 0;
+	if (!write_devbuf(wbuff, rbuff)) {
+		wbuff->invalid = TRUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * A socket is replaced with a new one of a resumed session. PDUs which have been read from a
+ * device for a broken socket are dropped, since a journal will send them again if needed.
+ * A partially read PDU from a broken socket is dropped, too.
+ */
+static BOOL
+resume_sock(devbuf_t *buff_sock, devbuf_t *buff_dev, usbip_resume_t *resume)
+{
+	SOCKET	sockfd;
+
+	while (buff_sock->in_reading) {
+		CancelIoEx(buff_sock->hdev, &buff_sock->ovs[0]);
+		SleepEx(500, TRUE);
+	}
+	/* a write completion routine should not run on reset buffers */
+	CancelIoEx(buff_sock->hdev, &buff_sock->ovs[1]);
+	SleepEx(100, TRUE);
+
+	buff_sock->offp = buff_sock->offhdr;
+	buff_sock->step_reading = 0;
+	if (buff_sock->n_batched > 0) {
+		buff_sock->n_batched = 0;
+		if (!write_devbuf(buff_dev, buff_sock))
+			return FALSE;
+	}
+
+	if (buff_dev->bufp != buff_dev->bufc) {
+		free(buff_dev->bufc);
+		buff_dev->bufc = buff_dev->bufp;
+	}
+	buff_dev->offc = buff_dev->offhdr;
+	buff_dev->bufmaxc = buff_dev->offhdr;
+	buff_dev->n_batched = 0;
+
+	sockfd = resume->reconnect(resume->ctx, resume->journal);
+	if (sockfd == INVALID_SOCKET)
+		return FALSE;
+	buff_sock->hdev = (HANDLE)sockfd;
+	buff_sock->invalid = FALSE;
+	resume->abandoned = FALSE;
+	return TRUE;
 }
 
 static volatile BOOL	interrupted;
@@ -548,9 +557,11 @@ signalhandler(int signal)
 }
 
 void
-usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound)
+usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound, usbip_stats_t *stats, usbip_capture_ring_t *capring,
+	      usbip_resume_t *resume)
 {
 	devbuf_t	buff_src, buff_dst;
+	devbuf_t	*buff_sock, *buff_dev;
 	const char	*desc_src, *desc_dst;
 	BOOL	is_req_src;
 	BOOL	swap_req_src, swap_req_dst;
@@ -569,11 +580,11 @@ usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound)
 		swap_req_src = FALSE;
 		swap_req_dst = TRUE;
 	}
-	if (!init_devbuf(&buff_src, desc_src, TRUE, swap_req_src, hdev_src)) {
+	if (!init_devbuf(&buff_src, desc_src, TRUE, swap_req_src, hdev_src, stats, capring)) {
 		err("%s: failed to initialize %s buffer", __FUNCTION__, desc_src);
 		return;
 	}
-	if (!init_devbuf(&buff_dst, desc_dst, FALSE, swap_req_dst, hdev_dst)) {
+	if (!init_devbuf(&buff_dst, desc_dst, FALSE, swap_req_dst, hdev_dst, stats, capring)) {
 		err("%s: failed to initialize %s buffer", __FUNCTION__, desc_dst);
 		cleanup_devbuf(&buff_src);
 		return;
@@ -581,17 +592,29 @@ usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound)
 
 	buff_src.peer = &buff_dst;
 	buff_dst.peer = &buff_src;
+	buff_sock = inbound ? &buff_src: &buff_dst;
+	buff_dev = inbound ? &buff_dst: &buff_src;
+
+	/* stub accepts consecutive PDUs in a single write */
+	if (inbound)
+		buff_dst.batch_write = TRUE;
+	if (resume != NULL) {
+		buff_src.journal = resume->journal;
+		buff_dst.journal = resume->journal;
+	}
 
 	signal(SIGINT, signalhandler);
 
 	while (!interrupted) {
-		if (!read_write_dev(&buff_src, &buff_dst))
-			break;
-		if (!read_write_dev(&buff_dst, &buff_src))
-			break;
+		BOOL	ok;
 
-		if (buff_src.invalid || buff_dst.invalid)
-			break;
+		ok = read_write_dev(&buff_src, &buff_dst) && read_write_dev(&buff_dst, &buff_src);
+		if (!ok || buff_src.invalid || buff_dst.invalid || (resume != NULL && resume->abandoned)) {
+			/* A broken device cannot be resumed */
+			if (resume == NULL || buff_dev->invalid || !resume_sock(buff_sock, buff_dev, resume))
+				break;
+			continue;
+		}
 		if (buff_src.in_reading && buff_dst.in_reading)
 			SleepEx(500, TRUE);
 	}
@@ -604,14 +627,515 @@ usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound)
 	/* If there's no asynchronous read pending, CancelIo seems to be blocked. */
 	/* in_reading should be checked as cleared to guarantee that an IO completion routine has been called */
 	while (buff_src.in_reading) {
-		CancelIoEx(hdev_src, &buff_src.ovs[0]);
+		CancelIoEx(buff_src.hdev, &buff_src.ovs[0]);
 		SleepEx(500, TRUE);
 	}
 	while (buff_dst.in_reading) {
-		CancelIoEx(hdev_dst, &buff_dst.ovs[0]);
+		CancelIoEx(buff_dst.hdev, &buff_dst.ovs[0]);
 		SleepEx(500, TRUE);
 	}
 
 	cleanup_devbuf(&buff_src);
 	cleanup_devbuf(&buff_dst);
-}
\ No newline at end of file
+}
+
+/*
+ * Multiplexed forwarding
+ *
+ * PDUs of devices share a socket and are told apart by devid. Each device has a queue of
+ * PDUs toward the socket, and a socket write takes a PDU from each queue in turn, so that a
+ * device with large bulk transfers cannot starve others. A full queue stops reading from its
+ * source, which pushes back to a peer through TCP.
+ */
+
+/* PDUs queued for a device or a socket before its source is read again */
+#define MUX_MAX_QUEUED	16
+/* a socket write collects PDUs up to this size */
+#define MUX_MAX_WRITE	(64 * 1024)
+
+typedef struct {
+	struct list_head	list;
+	DWORD	len;
+	DWORD	len_xfer;
+	struct usbip_header	hdr;
+	/* followed by data and iso packet descriptors */
+} mux_pdu_t;
+
+#define MUX_PDU_SIZE(len)	(offsetof(mux_pdu_t, hdr) + (len))
+
+typedef struct {
+	HANDLE	hdev;
+	OVERLAPPED	ov;
+	BOOL	pending, failed;
+	mux_pdu_t	*pdu;
+	DWORD	off, len_need;
+	BOOL	hdr_parsed;
+	/* a device of a PDU being read from a socket */
+	struct _mux_dev	*dev;
+} mux_reader_t;
+
+typedef struct {
+	HANDLE	hdev;
+	OVERLAPPED	ov;
+	BOOL	pending, failed;
+	char	*buf;
+	DWORD	len, off, len_max;
+} mux_writer_t;
+
+typedef struct _mux_dev {
+	usbip_mux_dev_t	*info;
+	mux_reader_t	rd;
+	mux_writer_t	wr;
+	/* PDUs read from a device toward a socket */
+	struct list_head	q_sock;
+	int	n_q_sock;
+	/* PDUs read from a socket toward a device */
+	struct list_head	q_dev;
+	int	n_q_dev;
+	long	outq[OUT_Q_LEN];
+	BOOL	dead;
+} mux_dev_t;
+
+typedef struct {
+	BOOL	inbound;
+	mux_reader_t	rd;
+	mux_writer_t	wr;
+	mux_dev_t	*devs;
+	int	n_devs, n_alive;
+	/* a device whose PDU is taken first by a next socket write */
+	int	idx_rr;
+} mux_t;
+
+static VOID CALLBACK
+mux_read_completion(DWORD errcode, DWORD nread, LPOVERLAPPED lpOverlapped)
+{
+	mux_reader_t	*rd = (mux_reader_t *)lpOverlapped->hEvent;
+
+	if (errcode != 0 || nread == 0)
+		rd->failed = TRUE;
+	else
+		rd->off += nread;
+	rd->pending = FALSE;
+}
+
+static VOID CALLBACK
+mux_write_completion(DWORD errcode, DWORD nwrite, LPOVERLAPPED lpOverlapped)
+{
+	mux_writer_t	*wr = (mux_writer_t *)lpOverlapped->hEvent;
+
+	if (errcode != 0 || nwrite == 0)
+		wr->failed = TRUE;
+	else
+		wr->off += nwrite;
+	wr->pending = FALSE;
+}
+
+static mux_dev_t *
+find_mux_dev(mux_t *mux, unsigned int devid)
+{
+	int	i;
+
+	for (i = 0; i < mux->n_devs; i++) {
+		if (mux->devs[i].info->devid == devid)
+			return mux->devs + i;
+	}
+	return NULL;
+}
+
+static void
+free_pdus(struct list_head *head)
+{
+	struct list_head	*p, *n;
+
+	list_for_each_safe(p, n, head) {
+		list_del(p);
+		free(list_entry(p, mux_pdu_t, list));
+	}
+}
+
+static void
+kill_mux_dev(mux_t *mux, mux_dev_t *dev)
+{
+	if (dev->dead)
+		return;
+	info("%s: devid %x: stopped", __FUNCTION__, dev->info->devid);
+	dev->dead = TRUE;
+	mux->n_alive--;
+	if (dev->rd.pending)
+		CancelIoEx(dev->rd.hdev, &dev->rd.ov);
+	if (dev->wr.pending)
+		CancelIoEx(dev->wr.hdev, &dev->wr.ov);
+	free_pdus(&dev->q_sock);
+	free_pdus(&dev->q_dev);
+	dev->n_q_sock = 0;
+	dev->n_q_dev = 0;
+}
+
+/* header or data of a PDU has been read. Returns a whole PDU or NULL. */
+static mux_pdu_t *
+parse_mux_pdu(mux_t *mux, mux_reader_t *rd, BOOL is_sock)
+{
+	mux_pdu_t	*pdu = rd->pdu;
+	BOOL	is_req = is_sock ? mux->inbound: !mux->inbound;
+	DWORD	len_iso;
+
+	if (!rd->hdr_parsed) {
+		mux_pdu_t	*pdu_new;
+
+		if (is_sock) {
+			swap_usbip_header_endian(&pdu->hdr, TRUE);
+			rd->dev = find_mux_dev(mux, pdu->hdr.base.devid);
+			if (rd->dev == NULL) {
+				err("%s: unknown devid: %x", __FUNCTION__, pdu->hdr.base.devid);
+				rd->failed = TRUE;
+				return NULL;
+			}
+		}
+		pdu->len_xfer = get_xfer_len(is_req, &pdu->hdr, rd->dev->outq);
+		len_iso = get_iso_len(is_req, &pdu->hdr);
+		rd->len_need += pdu->len_xfer + len_iso;
+		rd->hdr_parsed = TRUE;
+		if (rd->off < rd->len_need) {
+			pdu_new = (mux_pdu_t *)realloc(pdu, MUX_PDU_SIZE(rd->len_need));
+			if (pdu_new == NULL) {
+				err("%s: out of memory", __FUNCTION__);
+				rd->failed = TRUE;
+				return NULL;
+			}
+			rd->pdu = pdu_new;
+			return NULL;
+		}
+	}
+
+	len_iso = rd->len_need - sizeof(struct usbip_header) - pdu->len_xfer;
+	if (is_sock && len_iso > 0)
+		swap_iso_descs_endian((char *)(&pdu->hdr + 1) + pdu->len_xfer, len_iso / sizeof(struct usbip_iso_packet_descriptor));
+	pdu->len = rd->len_need;
+	rd->pdu = NULL;
+	return pdu;
+}
+
+/* Returns a PDU if one has been read completely. Otherwise, a read is started if needed. */
+static mux_pdu_t *
+read_mux_pdu(mux_t *mux, mux_reader_t *rd, BOOL is_sock)
+{
+	if (rd->pending || rd->failed)
+		return NULL;
+	if (rd->pdu == NULL) {
+		rd->pdu = (mux_pdu_t *)malloc(MUX_PDU_SIZE(sizeof(struct usbip_header)));
+		if (rd->pdu == NULL) {
+			err("%s: out of memory", __FUNCTION__);
+			rd->failed = TRUE;
+			return NULL;
+		}
+		rd->off = 0;
+		rd->len_need = sizeof(struct usbip_header);
+		rd->hdr_parsed = FALSE;
+	}
+	if (rd->off == rd->len_need) {
+		mux_pdu_t	*pdu = parse_mux_pdu(mux, rd, is_sock);
+
+		if (pdu != NULL || rd->failed)
+			return pdu;
+	}
+	if (!ReadFileEx(rd->hdev, (char *)&rd->pdu->hdr + rd->off, rd->len_need - rd->off, &rd->ov, mux_read_completion)) {
+		dbg("%s: failed to read: err: 0x%lx", __FUNCTION__, GetLastError());
+		rd->failed = TRUE;
+		return NULL;
+	}
+	rd->pending = TRUE;
+	return NULL;
+}
+
+static void
+account_mux_pdu(mux_dev_t *dev, mux_pdu_t *pdu, BOOL is_req)
+{
+	if (dev->info->stats != NULL) {
+		if (is_req)
+			usbip_stats_req(dev->info->stats, &pdu->hdr);
+		else
+			usbip_stats_rep(dev->info->stats, &pdu->hdr);
+	}
+	if (dev->info->capring != NULL)
+		usbip_capture_pdu(dev->info->capring, &pdu->hdr, pdu->len_xfer);
+}
+
+static BOOL
+is_mux_dev_queue_full(mux_t *mux)
+{
+	int	i;
+
+	for (i = 0; i < mux->n_devs; i++) {
+		if (!mux->devs[i].dead && mux->devs[i].n_q_dev >= MUX_MAX_QUEUED)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static BOOL
+read_mux_sock(mux_t *mux)
+{
+	mux_pdu_t	*pdu;
+	mux_dev_t	*dev;
+
+	/* a PDU being read is not blocked */
+	if (mux->rd.pdu == NULL && is_mux_dev_queue_full(mux))
+		return FALSE;
+	pdu = read_mux_pdu(mux, &mux->rd, TRUE);
+	if (pdu == NULL)
+		return FALSE;
+	dev = mux->rd.dev;
+	if (dev->dead) {
+		free(pdu);
+		return TRUE;
+	}
+	account_mux_pdu(dev, pdu, mux->inbound);
+	list_add(&pdu->list, dev->q_dev.prev);
+	dev->n_q_dev++;
+	return TRUE;
+}
+
+static BOOL
+read_mux_dev(mux_t *mux, mux_dev_t *dev)
+{
+	mux_pdu_t	*pdu;
+
+	if (dev->dead)
+		return FALSE;
+	if (dev->n_q_sock >= MUX_MAX_QUEUED && dev->rd.pdu == NULL)
+		return FALSE;
+	pdu = read_mux_pdu(mux, &dev->rd, FALSE);
+	if (dev->rd.failed) {
+		kill_mux_dev(mux, dev);
+		return TRUE;
+	}
+	if (pdu == NULL)
+		return FALSE;
+	/* a socket carries the devid of an imported device, whatever a driver has set */
+	pdu->hdr.base.devid = dev->info->devid;
+	account_mux_pdu(dev, pdu, !mux->inbound);
+	list_add(&pdu->list, dev->q_sock.prev);
+	dev->n_q_sock++;
+	return TRUE;
+}
+
+static BOOL
+reserve_mux_writer(mux_writer_t *wr, DWORD len)
+{
+	char	*buf;
+
+	if (wr->len + len <= wr->len_max)
+		return TRUE;
+	buf = (char *)realloc(wr->buf, wr->len + len);
+	if (buf == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return FALSE;
+	}
+	wr->buf = buf;
+	wr->len_max = wr->len + len;
+	return TRUE;
+}
+
+static BOOL
+start_mux_write(mux_writer_t *wr)
+{
+	if (!WriteFileEx(wr->hdev, wr->buf + wr->off, wr->len - wr->off, &wr->ov, mux_write_completion)) {
+		dbg("%s: failed to write: err: 0x%lx", __FUNCTION__, GetLastError());
+		wr->failed = TRUE;
+		return FALSE;
+	}
+	wr->pending = TRUE;
+	return TRUE;
+}
+
+/* appends a PDU to a write buffer in network byte order */
+static BOOL
+gather_mux_pdu(mux_writer_t *wr, mux_pdu_t *pdu)
+{
+	struct usbip_header	*hdr;
+	DWORD	len_iso;
+
+	if (!reserve_mux_writer(wr, pdu->len))
+		return FALSE;
+	hdr = (struct usbip_header *)(wr->buf + wr->len);
+	memcpy(hdr, &pdu->hdr, pdu->len);
+	len_iso = pdu->len - sizeof(struct usbip_header) - pdu->len_xfer;
+	if (len_iso > 0)
+		swap_iso_descs_endian((char *)(hdr + 1) + pdu->len_xfer, len_iso / sizeof(struct usbip_iso_packet_descriptor));
+	swap_usbip_header_endian(hdr, FALSE);
+	wr->len += pdu->len;
+	return TRUE;
+}
+
+static BOOL
+write_mux_sock(mux_t *mux)
+{
+	mux_writer_t	*wr = &mux->wr;
+	BOOL	taken = TRUE;
+	int	i;
+
+	if (wr->pending || wr->failed)
+		return FALSE;
+	if (wr->off < wr->len) {
+		/* the rest of a partial write */
+		start_mux_write(wr);
+		return FALSE;
+	}
+
+	wr->len = 0;
+	wr->off = 0;
+	/* a PDU of each device in turn */
+	while (taken && wr->len < MUX_MAX_WRITE) {
+		taken = FALSE;
+		for (i = 0; i < mux->n_devs && wr->len < MUX_MAX_WRITE; i++) {
+			mux_dev_t	*dev = mux->devs + (mux->idx_rr + i) % mux->n_devs;
+			mux_pdu_t	*pdu;
+
+			if (dev->n_q_sock == 0)
+				continue;
+			pdu = list_entry(dev->q_sock.next, mux_pdu_t, list);
+			if (!gather_mux_pdu(wr, pdu)) {
+				wr->failed = TRUE;
+				return FALSE;
+			}
+			list_del(&pdu->list);
+			free(pdu);
+			dev->n_q_sock--;
+			taken = TRUE;
+		}
+		mux->idx_rr = (mux->idx_rr + 1) % mux->n_devs;
+	}
+	if (wr->len == 0)
+		return FALSE;
+	start_mux_write(wr);
+	return TRUE;
+}
+
+static BOOL
+write_mux_dev(mux_t *mux, mux_dev_t *dev)
+{
+	mux_writer_t	*wr = &dev->wr;
+
+	if (dev->dead || wr->pending)
+		return FALSE;
+	if (wr->failed) {
+		kill_mux_dev(mux, dev);
+		return TRUE;
+	}
+	if (wr->off < wr->len) {
+		if (!start_mux_write(wr))
+			kill_mux_dev(mux, dev);
+		return FALSE;
+	}
+
+	wr->len = 0;
+	wr->off = 0;
+	while (dev->n_q_dev > 0) {
+		mux_pdu_t	*pdu = list_entry(dev->q_dev.next, mux_pdu_t, list);
+
+		/* stub accepts consecutive PDUs in a single write, but vhci does not */
+		if (wr->len > 0 && (!mux->inbound || wr->len + pdu->len > MUX_MAX_WRITE))
+			break;
+		if (!reserve_mux_writer(wr, pdu->len)) {
+			kill_mux_dev(mux, dev);
+			return TRUE;
+		}
+		memcpy(wr->buf + wr->len, &pdu->hdr, pdu->len);
+		wr->len += pdu->len;
+		list_del(&pdu->list);
+		free(pdu);
+		dev->n_q_dev--;
+	}
+	if (wr->len == 0)
+		return FALSE;
+	if (!start_mux_write(wr))
+		kill_mux_dev(mux, dev);
+	return TRUE;
+}
+
+static void
+init_mux_io(HANDLE hdev, mux_reader_t *rd, mux_writer_t *wr)
+{
+	memset(rd, 0, sizeof(*rd));
+	memset(wr, 0, sizeof(*wr));
+	rd->hdev = hdev;
+	rd->ov.hEvent = (HANDLE)rd;
+	wr->hdev = hdev;
+	wr->ov.hEvent = (HANDLE)wr;
+}
+
+/* in_reading of usbip_forward() applies here: completion routines should run before buffers are freed */
+static void
+cancel_mux_io(mux_reader_t *rd, mux_writer_t *wr)
+{
+	while (rd->pending || wr->pending) {
+		if (rd->pending)
+			CancelIoEx(rd->hdev, &rd->ov);
+		if (wr->pending)
+			CancelIoEx(wr->hdev, &wr->ov);
+		SleepEx(500, TRUE);
+	}
+	free(rd->pdu);
+	free(wr->buf);
+}
+
+void
+usbip_forward_mux(SOCKET sockfd, usbip_mux_dev_t *devs, int n_devs, BOOL inbound)
+{
+	mux_t	mux;
+	int	i;
+
+	memset(&mux, 0, sizeof(mux));
+	mux.devs = (mux_dev_t *)calloc(n_devs, sizeof(mux_dev_t));
+	if (mux.devs == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return;
+	}
+	mux.inbound = inbound;
+	mux.n_devs = n_devs;
+	mux.n_alive = n_devs;
+	init_mux_io((HANDLE)sockfd, &mux.rd, &mux.wr);
+	for (i = 0; i < n_devs; i++) {
+		mux_dev_t	*dev = mux.devs + i;
+
+		dev->info = devs + i;
+		init_mux_io(devs[i].hdev, &dev->rd, &dev->wr);
+		dev->rd.dev = dev;
+		INIT_LIST_HEAD(&dev->q_sock);
+		INIT_LIST_HEAD(&dev->q_dev);
+	}
+
+	signal(SIGINT, signalhandler);
+
+	while (!interrupted && mux.n_alive > 0) {
+		BOOL	progress = FALSE;
+
+		if (read_mux_sock(&mux))
+			progress = TRUE;
+		for (i = 0; i < n_devs; i++) {
+			if (read_mux_dev(&mux, mux.devs + i))
+				progress = TRUE;
+			if (write_mux_dev(&mux, mux.devs + i))
+				progress = TRUE;
+		}
+		if (write_mux_sock(&mux))
+			progress = TRUE;
+
+		if (mux.rd.failed || mux.wr.failed)
+			break;
+		if (!progress)
+			SleepEx(500, TRUE);
+	}
+
+	if (interrupted) {
+		info("CTRL-C received\n");
+	}
+
+	cancel_mux_io(&mux.rd, &mux.wr);
+	for (i = 0; i < n_devs; i++) {
+		cancel_mux_io(&mux.devs[i].rd, &mux.devs[i].wr);
+		free_pdus(&mux.devs[i].q_sock);
+		free_pdus(&mux.devs[i].q_dev);
+	}
+	free(mux.devs);
+}
@@ -1,5 +1,26 @@
-#pragma
+#pragma once
 
 #include <winsock2.h>
 
-void usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound);
\ No newline at end of file
+#include "usbip_stats.h"
+#include "usbip_capture.h"
+#include "usbip_resume.h"
+
+/* stats, capring and resume may be NULL. A resumable session goes on over a new socket. */
+void usbip_forward(HANDLE hdev_src, HANDLE hdev_dst, BOOL inbound, usbip_stats_t *stats, usbip_capture_ring_t *capring,
+		   usbip_resume_t *resume);
+
+/* the most devices multiplexed over a connection */
+#define USBIP_MUX_MAX_DEVS	32
+
+typedef struct {
+	/* busnum << 16 | devnum of an imported device */
+	unsigned int	devid;
+	HANDLE	hdev;
+	/* may be NULL */
+	usbip_stats_t	*stats;
+	usbip_capture_ring_t	*capring;
+} usbip_mux_dev_t;
+
+/* forwards PDUs of devices over a socket, which are told apart by devid */
+void usbip_forward_mux(SOCKET sockfd, usbip_mux_dev_t *devs, int n_devs, BOOL inbound);
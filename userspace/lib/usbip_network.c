@@ -4,6 +4,7 @@
  */
 
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 
 #include "usbip_common.h"
 #include "usbip_network.h"
@@ -79,6 +80,34 @@ void usbip_net_pack_usb_interface(int pack, struct usbip_usb_interface *udev)
 	/* uint8_t members need nothing */
 }
 
+void usbip_net_set_import_ext(char *busid, uint32_t flags)
+{
+	struct usbip_import_ext	ext;
+	size_t	offset = USBIP_BUS_ID_SIZE - sizeof(ext);
+
+	/* busid string must not overlap the extension */
+	if (strnlen(busid, USBIP_BUS_ID_SIZE) >= offset)
+		return;
+
+	ext.magic = htonl(USBIP_IMPORT_EXT_MAGIC);
+	ext.flags = htonl(flags);
+	memcpy(busid + offset, &ext, sizeof(ext));
+}
+
+uint32_t usbip_net_get_import_ext(const char *busid)
+{
+	struct usbip_import_ext	ext;
+	size_t	offset = USBIP_BUS_ID_SIZE - sizeof(ext);
+
+	if (strnlen(busid, USBIP_BUS_ID_SIZE) >= offset)
+		return 0;
+
+	memcpy(&ext, busid + offset, sizeof(ext));
+	if (ntohl(ext.magic) != USBIP_IMPORT_EXT_MAGIC)
+		return 0;
+	return ntohl(ext.flags);
+}
+
 static int usbip_net_xmit(SOCKET sockfd, void *buff, size_t bufflen, int sending)
 {
 	int total = 0;
@@ -227,6 +256,51 @@ int usbip_net_set_v6only(SOCKET sockfd)
 	return ret;
 }
 
+/* timeout of blocking send/recv. 0 means no timeout */
+int usbip_net_set_timeout(SOCKET sockfd, unsigned int msecs)
+{
+	const DWORD val = msecs;
+	int ret;
+
+	ret = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&val, sizeof(val));
+	if (ret < 0) {
+		dbg("setsockopt: SO_RCVTIMEO");
+		return ret;
+	}
+	ret = setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&val, sizeof(val));
+	if (ret < 0)
+		dbg("setsockopt: SO_SNDTIMEO");
+
+	return ret;
+}
+
+/*
+ * A connection is regarded as dead in about secs if a peer does not respond.
+ * Retransmissions are bounded by TCP_MAXRT, and an idle connection is probed by keepalives,
+ * of which Windows sends 10 before giving up.
+ */
+int usbip_net_set_dead_timeout(SOCKET sockfd, unsigned int secs)
+{
+	struct tcp_keepalive	ka;
+	const DWORD	maxrt = secs;
+	DWORD	len;
+	int ret;
+
+	ka.onoff = 1;
+	ka.keepalivetime = secs * 1000 / 2;
+	ka.keepaliveinterval = secs * 1000 / 20;
+	ret = WSAIoctl(sockfd, SIO_KEEPALIVE_VALS, &ka, sizeof(ka), NULL, 0, &len, NULL, NULL);
+	if (ret < 0) {
+		dbg("WSAIoctl: SIO_KEEPALIVE_VALS");
+		return ret;
+	}
+	ret = setsockopt(sockfd, IPPROTO_TCP, TCP_MAXRT, (const char *)&maxrt, sizeof(maxrt));
+	if (ret < 0)
+		dbg("setsockopt: TCP_MAXRT");
+
+	return ret;
+}
+
 /*
  * IPv6 Ready
  */
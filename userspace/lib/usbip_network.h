@@ -70,6 +70,41 @@ struct op_import_reply {
 //	struct usbip_usb_interface uinf[];
 };
 
+/*
+ * Import extension
+ *
+ * A busid string is much shorter than USBIP_BUS_ID_SIZE. A client may put usbip_import_ext
+ * at the tail of busid in a request. Servers without the extension ignore it.
+ * A server echoes the extension in busid of op_import_reply with the flags it has honored,
+ * and extra data for each honored flag follows op_import_reply in flag bit order.
+ * A status of op_common cannot be used here since peers reject any status other than ST_OK.
+ */
+#define USBIP_IMPORT_EXT_MAGIC		0x75697865	/* "uixe" */
+
+/* op_import_reply is followed by uint32_t length and a full configuration descriptor */
+#define USBIP_IMPORT_EXT_CONF_DESC	0x00000001
+/*
+ * A connection carries PDUs of multiple devices, which are told apart by devid of
+ * usbip_header_basic, busnum << 16 | devnum of an imported device. No extra data follows.
+ * Once a reply has echoed it, a client sends more OP_REQ_IMPORT's with it on the same connection.
+ * A failed one gets a status other than ST_OK without closing a connection.
+ * A request of an empty busid ends importing without a reply, and then PDUs follow.
+ */
+#define USBIP_IMPORT_EXT_MUX		0x00000002
+/*
+ * op_import_reply is followed by uint32_t session token. When a connection breaks, a client
+ * resumes a session over a new connection with OP_REQ_RESUME instead of importing again.
+ * It is not honored together with USBIP_IMPORT_EXT_MUX.
+ */
+#define USBIP_IMPORT_EXT_RESUME		0x00000004
+/* A server takes CMD_UNLINK_BATCH. No extra data follows. */
+#define USBIP_IMPORT_EXT_UNLINK_BATCH	0x00000008
+
+struct usbip_import_ext {
+	uint32_t magic;
+	uint32_t flags;
+};
+
 #define PACK_OP_IMPORT_REQUEST(pack, request)  do {\
 } while (0)
 
@@ -77,6 +112,38 @@ struct op_import_reply {
 	usbip_net_pack_usb_device(pack, &(reply)->udev);\
 } while (0)
 
+/* ---------------------------------------------------------------------- */
+/* Resume a session of an imported device over a new connection. */
+#define OP_RESUME	0x08
+#define OP_REQ_RESUME	(OP_REQUEST | OP_RESUME)
+#define OP_REP_RESUME	(OP_REPLY   | OP_RESUME)
+
+/* the most seqnums which a client can be waiting for */
+#define USBIP_RESUME_MAX_SEQNUMS	4096
+
+/* followed by uint32_t seqnums of CMDs which have no RET yet */
+struct op_resume_request {
+	uint32_t token;
+	uint32_t n_seqnums;
+};
+
+/*
+ * followed by uint32_t seqnums of CMDs which a server has never received, and a client
+ * sends them again. Then RETs of the others, which may have been lost, are sent again.
+ */
+struct op_resume_reply {
+	uint32_t n_seqnums;
+};
+
+#define PACK_OP_RESUME_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->token);\
+	usbip_net_pack_uint32_t(pack, &(request)->n_seqnums);\
+} while (0)
+
+#define PACK_OP_RESUME_REPLY(pack, reply)  do {\
+	usbip_net_pack_uint32_t(pack, &(reply)->n_seqnums);\
+} while (0)
+
 /* ---------------------------------------------------------------------- */
 /* Export a USB device to a remote host. */
 #define OP_EXPORT	0x06
@@ -170,6 +237,8 @@ void usbip_net_pack_uint32_t(int pack, uint32_t *num);
 void usbip_net_pack_uint16_t(int pack, uint16_t *num);
 void usbip_net_pack_usb_device(int pack, struct usbip_usb_device *udev);
 void usbip_net_pack_usb_interface(int pack, struct usbip_usb_interface *uinf);
+void usbip_net_set_import_ext(char *busid, uint32_t flags);
+uint32_t usbip_net_get_import_ext(const char *busid);
 
 int usbip_net_recv(SOCKET sockfd, void *buff, size_t bufflen);
 int usbip_net_send(SOCKET sockfd, void *buff, size_t bufflen);
@@ -179,6 +248,8 @@ int usbip_net_set_reuseaddr(SOCKET sockfd);
 int usbip_net_set_nodelay(SOCKET sockfd);
 int usbip_net_set_keepalive(SOCKET sockfd);
 int usbip_net_set_v6only(SOCKET sockfd);
+int usbip_net_set_timeout(SOCKET sockfd, unsigned int msecs);
+int usbip_net_set_dead_timeout(SOCKET sockfd, unsigned int secs);
 SOCKET usbip_net_tcp_connect(const char *hostname, const char *port);
 
 #endif /* __USBIP_NETWORK_H */
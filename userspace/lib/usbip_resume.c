@@ -0,0 +1,416 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_network.h"
+#include "list.h"
+#include "usbip_resume.h"
+
+/* completed CMDs which a server remembers, and bytes of their RETs kept for resending */
+#define MAX_DONE_ENTRIES	4096
+#define MAX_RETAINED_BYTES	(4 * 1024 * 1024)
+
+#define ECONNRESET	104
+
+/* a handshake should not wait forever on a new connection which is broken again */
+#define RESUME_HANDSHAKE_TIMEOUT	10000	/* msec */
+
+typedef struct {
+	struct list_head	list;
+	unsigned long	seqnum;
+	BOOL	is_unlink;
+	/* seqnum of an URB which CMD_UNLINK unlinks */
+	unsigned long	seqnum_unlink;
+	/* CMD_UNLINK_BATCH unlinks up to seqnum_unlink_last on ep_unlink, or any endpoint if -1 */
+	unsigned long	seqnum_unlink_last;
+	int	ep_unlink;
+	unsigned int	devid, direction, ep;
+	/* a wire format PDU, CMD for a client and RET for a server. NULL if it is not kept. */
+	char	*pdu;
+	unsigned	len;
+} journal_entry_t;
+
+struct usbip_journal {
+	BOOL	client;
+	/* CMDs without their RET yet, oldest first */
+	struct list_head	pendings;
+	int	n_pendings;
+	/* server only: CMDs with their RET, oldest first */
+	struct list_head	dones;
+	int	n_dones;
+	size_t	len_retained;
+	/* server only: the latest seqnum of done entries which have been forgotten */
+	BOOL	forgotten;
+	unsigned long	seqnum_forgotten;
+};
+
+usbip_journal_t *
+usbip_journal_create(BOOL client)
+{
+	usbip_journal_t	*journal;
+
+	journal = (usbip_journal_t *)calloc(1, sizeof(usbip_journal_t));
+	if (journal == NULL)
+		return NULL;
+	journal->client = client;
+	INIT_LIST_HEAD(&journal->pendings);
+	INIT_LIST_HEAD(&journal->dones);
+	return journal;
+}
+
+static void
+free_entry(journal_entry_t *entry)
+{
+	list_del(&entry->list);
+	free(entry->pdu);
+	free(entry);
+}
+
+void
+usbip_journal_free(usbip_journal_t *journal)
+{
+	struct list_head	*p, *n;
+
+	if (journal == NULL)
+		return;
+	list_for_each_safe(p, n, &journal->pendings)
+		free_entry(list_entry(p, journal_entry_t, list));
+	list_for_each_safe(p, n, &journal->dones)
+		free_entry(list_entry(p, journal_entry_t, list));
+	free(journal);
+}
+
+static journal_entry_t *
+find_entry(struct list_head *head, unsigned long seqnum)
+{
+	struct list_head	*p;
+
+	list_for_each(p, head) {
+		journal_entry_t	*entry = list_entry(p, journal_entry_t, list);
+
+		if (entry->seqnum == seqnum)
+			return entry;
+	}
+	return NULL;
+}
+
+static BOOL
+keep_pdu(journal_entry_t *entry, const char *pdu, unsigned len)
+{
+	entry->pdu = (char *)malloc(len);
+	if (entry->pdu == NULL) {
+		err("%s: out of memory: seqnum: %lu", __FUNCTION__, entry->seqnum);
+		return FALSE;
+	}
+	memcpy(entry->pdu, pdu, len);
+	entry->len = len;
+	return TRUE;
+}
+
+static void
+add_pending(usbip_journal_t *journal, const struct usbip_header *hdr, const char *pdu, unsigned len)
+{
+	journal_entry_t	*entry;
+
+	entry = (journal_entry_t *)calloc(1, sizeof(journal_entry_t));
+	if (entry == NULL) {
+		err("%s: out of memory: seqnum: %u", __FUNCTION__, hdr->base.seqnum);
+		return;
+	}
+	entry->seqnum = hdr->base.seqnum;
+	entry->devid = hdr->base.devid;
+	entry->direction = hdr->base.direction;
+	entry->ep = hdr->base.ep;
+	if (hdr->base.command == USBIP_CMD_UNLINK) {
+		entry->is_unlink = TRUE;
+		entry->seqnum_unlink = hdr->u.cmd_unlink.seqnum;
+		entry->seqnum_unlink_last = entry->seqnum_unlink;
+		entry->ep_unlink = -1;
+	}
+	else if (hdr->base.command == USBIP_CMD_UNLINK_BATCH) {
+		entry->is_unlink = TRUE;
+		entry->seqnum_unlink = hdr->u.cmd_unlink_batch.seqnum_first;
+		entry->seqnum_unlink_last = hdr->u.cmd_unlink_batch.seqnum_last;
+		entry->ep_unlink = (hdr->u.cmd_unlink_batch.flags & USBIP_UNLINK_BATCH_EP) ? (int)hdr->base.ep: -1;
+	}
+	/* a server never sends a CMD again */
+	if (journal->client)
+		keep_pdu(entry, pdu, len);
+	list_add(&entry->list, journal->pendings.prev);
+	journal->n_pendings++;
+}
+
+static void
+forget_oldest_done(usbip_journal_t *journal)
+{
+	journal_entry_t	*entry = list_entry(journal->dones.next, journal_entry_t, list);
+
+	if (!journal->forgotten || (long)(entry->seqnum - journal->seqnum_forgotten) > 0)
+		journal->seqnum_forgotten = entry->seqnum;
+	journal->forgotten = TRUE;
+	journal->len_retained -= entry->len;
+	journal->n_dones--;
+	free_entry(entry);
+}
+
+static void
+drop_retained_pdus(usbip_journal_t *journal)
+{
+	struct list_head	*p;
+
+	list_for_each(p, &journal->dones) {
+		journal_entry_t	*entry;
+
+		if (journal->len_retained <= MAX_RETAINED_BYTES)
+			break;
+		entry = list_entry(p, journal_entry_t, list);
+		journal->len_retained -= entry->len;
+		free(entry->pdu);
+		entry->pdu = NULL;
+		entry->len = 0;
+	}
+}
+
+/* A server moves a pending entry into dones, where a RET is kept if any */
+static void
+add_done(usbip_journal_t *journal, journal_entry_t *entry, const char *pdu, unsigned len)
+{
+	list_del(&entry->list);
+	journal->n_pendings--;
+
+	if (pdu != NULL && keep_pdu(entry, pdu, len))
+		journal->len_retained += len;
+	list_add(&entry->list, journal->dones.prev);
+	journal->n_dones++;
+
+	if (journal->n_dones > MAX_DONE_ENTRIES)
+		forget_oldest_done(journal);
+	drop_retained_pdus(journal);
+}
+
+/* completes every pending URB which CMD_UNLINK_BATCH of entry_unlink covers */
+static void
+complete_batch_unlinked(usbip_journal_t *journal, journal_entry_t *entry_unlink)
+{
+	struct list_head	*p, *n;
+
+	list_for_each_safe(p, n, &journal->pendings) {
+		journal_entry_t	*entry = list_entry(p, journal_entry_t, list);
+
+		if (entry->is_unlink)
+			continue;
+		if (!USBIP_UNLINK_BATCH_HAS(entry_unlink->seqnum_unlink, entry_unlink->seqnum_unlink_last, entry->seqnum))
+			continue;
+		if (entry_unlink->ep_unlink >= 0 && entry->ep != (unsigned int)entry_unlink->ep_unlink)
+			continue;
+		if (journal->client) {
+			free_entry(entry);
+			journal->n_pendings--;
+		}
+		else {
+			add_done(journal, entry, NULL, 0);
+		}
+	}
+}
+
+static void
+complete_pending(usbip_journal_t *journal, const struct usbip_header *hdr, const char *pdu, unsigned len)
+{
+	journal_entry_t	*entry, *entry_unlinked = NULL;
+
+	entry = find_entry(&journal->pendings, hdr->base.seqnum);
+	if (entry == NULL)
+		return;
+	/* An unlinked URB has no RET_SUBMIT */
+	if (hdr->base.command == USBIP_RET_UNLINK && entry->is_unlink) {
+		if (entry->seqnum_unlink_last != entry->seqnum_unlink)
+			complete_batch_unlinked(journal, entry);
+		else
+			entry_unlinked = find_entry(&journal->pendings, entry->seqnum_unlink);
+	}
+
+	if (journal->client) {
+		free_entry(entry);
+		journal->n_pendings--;
+		if (entry_unlinked != NULL) {
+			free_entry(entry_unlinked);
+			journal->n_pendings--;
+		}
+	}
+	else {
+		add_done(journal, entry, pdu, len);
+		if (entry_unlinked != NULL)
+			add_done(journal, entry_unlinked, NULL, 0);
+	}
+}
+
+void
+usbip_journal_pdu(usbip_journal_t *journal, BOOL is_req, const struct usbip_header *hdr, const char *pdu, unsigned len)
+{
+	if (is_req)
+		add_pending(journal, hdr, pdu, len);
+	else
+		complete_pending(journal, hdr, pdu, len);
+}
+
+int
+usbip_journal_resume_client(usbip_journal_t *journal, SOCKET sockfd, uint32_t token)
+{
+	struct op_resume_request	req;
+	struct op_resume_reply	rep;
+	uint32_t	*seqnums;
+	uint16_t	code = OP_REP_RESUME;
+	struct list_head	*p;
+	int	n = 0, n_missing;
+	int	i, ret = -1;
+
+	if (journal->n_pendings > USBIP_RESUME_MAX_SEQNUMS) {
+		err("%s: too many pending URBs: %d", __FUNCTION__, journal->n_pendings);
+		return -1;
+	}
+	/* one more for no pending URB */
+	seqnums = (uint32_t *)malloc(sizeof(uint32_t) * (journal->n_pendings + 1));
+	if (seqnums == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return -1;
+	}
+	list_for_each(p, &journal->pendings)
+		seqnums[n++] = htonl(list_entry(p, journal_entry_t, list)->seqnum);
+
+	usbip_net_set_timeout(sockfd, RESUME_HANDSHAKE_TIMEOUT);
+
+	req.token = token;
+	req.n_seqnums = n;
+	PACK_OP_RESUME_REQUEST(1, &req);
+	if (usbip_net_send_op_common(sockfd, OP_REQ_RESUME, 0) < 0 ||
+	    usbip_net_send(sockfd, &req, sizeof(req)) < 0 ||
+	    usbip_net_send(sockfd, seqnums, sizeof(uint32_t) * n) < 0) {
+		dbg("%s: failed to send resume request", __FUNCTION__);
+		goto out;
+	}
+
+	if (usbip_net_recv_op_common(sockfd, &code) < 0) {
+		dbg("%s: session not resumed", __FUNCTION__);
+		goto out;
+	}
+	if (usbip_net_recv(sockfd, &rep, sizeof(rep)) < 0) {
+		dbg("%s: failed to receive resume reply", __FUNCTION__);
+		goto out;
+	}
+	PACK_OP_RESUME_REPLY(0, &rep);
+	n_missing = rep.n_seqnums;
+	if (n_missing > n) {
+		err("%s: invalid number of missing seqnums: %d", __FUNCTION__, n_missing);
+		goto out;
+	}
+	if (usbip_net_recv(sockfd, seqnums, sizeof(uint32_t) * n_missing) < 0) {
+		dbg("%s: failed to receive missing seqnums", __FUNCTION__);
+		goto out;
+	}
+
+	for (i = 0; i < n_missing; i++) {
+		journal_entry_t	*entry;
+
+		entry = find_entry(&journal->pendings, ntohl(seqnums[i]));
+		if (entry == NULL || entry->pdu == NULL) {
+			err("%s: cannot send again: seqnum: %u", __FUNCTION__, ntohl(seqnums[i]));
+			continue;
+		}
+		if (usbip_net_send(sockfd, entry->pdu, entry->len) < 0) {
+			dbg("%s: failed to send again: seqnum: %lu", __FUNCTION__, entry->seqnum);
+			goto out;
+		}
+	}
+	info("session resumed: %d pending, %d sent again", n, n_missing);
+	ret = 0;
+out:
+	usbip_net_set_timeout(sockfd, 0);
+	free(seqnums);
+	return ret;
+}
+
+static int
+send_failed_ret(SOCKET sockfd, journal_entry_t *entry, unsigned long seqnum)
+{
+	struct usbip_header	hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.seqnum = htonl(seqnum);
+	if (entry != NULL) {
+		hdr.base.devid = htonl(entry->devid);
+		hdr.base.direction = htonl(entry->direction);
+		hdr.base.ep = htonl(entry->ep);
+	}
+	if (entry != NULL && entry->is_unlink) {
+		hdr.base.command = htonl(USBIP_RET_UNLINK);
+		hdr.u.ret_unlink.status = htonl(-ECONNRESET);
+	}
+	else {
+		hdr.base.command = htonl(USBIP_RET_SUBMIT);
+		hdr.u.ret_submit.status = htonl(-ECONNRESET);
+	}
+	return usbip_net_send(sockfd, &hdr, sizeof(hdr));
+}
+
+int
+usbip_journal_resume_server(usbip_journal_t *journal, SOCKET sockfd, const uint32_t *seqnums, int n_seqnums)
+{
+	struct op_resume_reply	rep;
+	uint32_t	*missings;
+	int	n_missing = 0, n_failed = 0;
+	int	i, ret = -1;
+
+	missings = (uint32_t *)malloc(sizeof(uint32_t) * (n_seqnums + 1));
+	if (missings == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return -1;
+	}
+	for (i = 0; i < n_seqnums; i++) {
+		/* RET of a CMD in a stub will come */
+		if (find_entry(&journal->pendings, seqnums[i]) != NULL)
+			continue;
+		if (find_entry(&journal->dones, seqnums[i]) != NULL)
+			continue;
+		/* a forgotten one should not be executed twice */
+		if (journal->forgotten && (long)(seqnums[i] - journal->seqnum_forgotten) <= 0)
+			continue;
+		missings[n_missing++] = htonl(seqnums[i]);
+	}
+
+	usbip_net_set_timeout(sockfd, RESUME_HANDSHAKE_TIMEOUT);
+
+	rep.n_seqnums = n_missing;
+	PACK_OP_RESUME_REPLY(1, &rep);
+	if (usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_OK) < 0 ||
+	    usbip_net_send(sockfd, &rep, sizeof(rep)) < 0 ||
+	    usbip_net_send(sockfd, missings, sizeof(uint32_t) * n_missing) < 0) {
+		dbg("%s: failed to send resume reply", __FUNCTION__);
+		goto out;
+	}
+
+	/* RETs which might have been lost, in order of CMDs */
+	for (i = 0; i < n_seqnums; i++) {
+		journal_entry_t	*entry;
+
+		if (find_entry(&journal->pendings, seqnums[i]) != NULL)
+			continue;
+		entry = find_entry(&journal->dones, seqnums[i]);
+		if (entry != NULL && entry->pdu != NULL) {
+			if (usbip_net_send(sockfd, entry->pdu, entry->len) < 0)
+				goto out;
+			continue;
+		}
+		if (entry == NULL && !(journal->forgotten && (long)(seqnums[i] - journal->seqnum_forgotten) <= 0))
+			continue;
+		if (send_failed_ret(sockfd, entry, seqnums[i]) < 0)
+			goto out;
+		n_failed++;
+	}
+	info("session resumed: %d pending, %d missing, %d failed", n_seqnums, n_missing, n_failed);
+	ret = 0;
+out:
+	usbip_net_set_timeout(sockfd, 0);
+	free(missings);
+	return ret;
+}
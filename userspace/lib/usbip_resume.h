@@ -0,0 +1,49 @@
+#pragma once
+
+#include <winsock2.h>
+
+#include "usbip_proto.h"
+
+/*
+ * Session resume
+ *
+ * A resumable session outlives a broken connection, while a vhci port stays plugged and a stub
+ * device stays opened. A journal of each side follows PDUs of a session by seqnum. A client
+ * keeps a copy of every CMD until its RET arrives. A server remembers CMDs in a stub and keeps
+ * copies of recent RETs.
+ * Over a new connection, a client tells seqnums still waiting for their RET. A server sends back
+ * ones it has never received, which a client sends again, and then RETs of the others which
+ * may have been lost on the broken connection. A RET which a server no longer keeps is failed
+ * with -ECONNRESET rather than executed twice.
+ */
+
+/* how long a broken session waits to be resumed */
+#define USBIP_RESUME_TIMEOUT	30	/* sec */
+/* how long a peer can be silent before a connection of a resumable session is regarded as broken */
+#define USBIP_RESUME_DEAD_TIMEOUT	5	/* sec */
+
+typedef struct usbip_journal	usbip_journal_t;
+
+usbip_journal_t *usbip_journal_create(BOOL client);
+void usbip_journal_free(usbip_journal_t *journal);
+
+/* hdr is in host byte order, and pdu of len bytes is a copy of it in wire format */
+void usbip_journal_pdu(usbip_journal_t *journal, BOOL is_req, const struct usbip_header *hdr, const char *pdu, unsigned len);
+
+/* A client sends OP_REQ_RESUME and CMDs which a server has not received */
+int usbip_journal_resume_client(usbip_journal_t *journal, SOCKET sockfd, uint32_t token);
+/* A server replies to OP_REQ_RESUME with outstanding seqnums of a client in host byte order */
+int usbip_journal_resume_server(usbip_journal_t *journal, SOCKET sockfd, const uint32_t *seqnums, int n_seqnums);
+
+/*
+ * A resumable forwarding calls reconnect on its thread when a connection breaks.
+ * reconnect owns sockets of a session. It returns a socket over which a session has been
+ * resumed, or INVALID_SOCKET to end forwarding.
+ */
+typedef struct {
+	usbip_journal_t	*journal;
+	SOCKET	(*reconnect)(void *ctx, usbip_journal_t *journal);
+	void	*ctx;
+	/* set by another thread to give up a connection which still looks alive */
+	volatile BOOL	abandoned;
+} usbip_resume_t;
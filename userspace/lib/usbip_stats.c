@@ -0,0 +1,356 @@
+#include "usbip_windows.h"
+
+#include <stdlib.h>
+
+#include "usbip_common.h"
+#include "usbip_stats.h"
+
+/*
+ * Submit timestamps are kept in a table indexed by the low bits of seqnum.
+ * A vhci issues seqnum's sequentially, so a collision happens only if a URB stays
+ * in flight while USBIP_N_SUBMIT_SLOTS more URBs are submitted. Such an old URB just drops out of latency.
+ */
+
+static const char	*xfer_type_names[] = { "control", "bulk", "interrupt", "isochronous" };
+
+const char *
+usbip_xfer_type_name(int type)
+{
+	if (type < 0 || type >= USBIP_XFER_TYPES)
+		return "unknown";
+	return xfer_type_names[type];
+}
+
+static int
+get_msb(unsigned long long v)
+{
+	int	msb = 0;
+
+	while (v >>= 1)
+		msb++;
+	return msb;
+}
+
+static int
+get_hist_idx(unsigned long long us)
+{
+	int	msb, shift, idx;
+
+	if (us < USBIP_HIST_LINEAR)
+		return (int)us;
+
+	msb = get_msb(us);
+	shift = msb - USBIP_HIST_SUB_BITS;
+	idx = USBIP_HIST_LINEAR + ((msb - USBIP_HIST_SUB_BITS - 1) << USBIP_HIST_SUB_BITS) +
+		(int)((us >> shift) - (1 << USBIP_HIST_SUB_BITS));
+	if (idx >= USBIP_HIST_BUCKETS)
+		idx = USBIP_HIST_BUCKETS - 1;
+	return idx;
+}
+
+unsigned long long
+usbip_hist_bucket_us(int idx)
+{
+	int	group, sub;
+
+	if (idx < USBIP_HIST_LINEAR)
+		return idx;
+	group = (idx - USBIP_HIST_LINEAR) >> USBIP_HIST_SUB_BITS;
+	sub = (idx - USBIP_HIST_LINEAR) & ((1 << USBIP_HIST_SUB_BITS) - 1);
+	return ((unsigned long long)((1 << USBIP_HIST_SUB_BITS) + sub + 1) << (group + 1)) - 1;
+}
+
+unsigned long long
+usbip_hist_percentile_us(const usbip_hist_t *hist, double pct)
+{
+	LONG64	count = hist->count, target, cumulative = 0;
+	int	i;
+
+	if (count == 0)
+		return 0;
+	target = (LONG64)(count * pct / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < USBIP_HIST_BUCKETS; i++) {
+		cumulative += hist->buckets[i];
+		if (cumulative >= target)
+			return usbip_hist_bucket_us(i);
+	}
+	return hist->max_us;
+}
+
+static void
+init_stats(usbip_stats_t *stats)
+{
+	memset(stats, 0, sizeof(usbip_stats_t));
+	stats->size = sizeof(usbip_stats_t);
+	QueryPerformanceFrequency(&stats->freq);
+}
+
+usbip_stats_t *
+usbip_stats_create(void)
+{
+	usbip_stats_t	*stats;
+
+	stats = (usbip_stats_t *)malloc(sizeof(usbip_stats_t));
+	if (stats == NULL)
+		return NULL;
+	init_stats(stats);
+	return stats;
+}
+
+void
+usbip_stats_free(usbip_stats_t *stats)
+{
+	free(stats);
+}
+
+usbip_stats_t *
+usbip_stats_create_shared(const char *name, HANDLE *phmap)
+{
+	usbip_stats_t	*stats;
+	HANDLE	hmap;
+
+	hmap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(usbip_stats_t), name);
+	if (hmap == NULL) {
+		dbg("%s: failed to create mapping: %s: err: %lx", __FUNCTION__, name, GetLastError());
+		return NULL;
+	}
+	stats = (usbip_stats_t *)MapViewOfFile(hmap, FILE_MAP_WRITE, 0, 0, sizeof(usbip_stats_t));
+	if (stats == NULL) {
+		dbg("%s: failed to map: %s: err: %lx", __FUNCTION__, name, GetLastError());
+		CloseHandle(hmap);
+		return NULL;
+	}
+	init_stats(stats);
+	*phmap = hmap;
+	return stats;
+}
+
+const usbip_stats_t *
+usbip_stats_open_shared(const char *name, HANDLE *phmap)
+{
+	const usbip_stats_t	*stats;
+	HANDLE	hmap;
+
+	hmap = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+	if (hmap == NULL)
+		return NULL;
+	stats = (const usbip_stats_t *)MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, sizeof(usbip_stats_t));
+	if (stats == NULL) {
+		CloseHandle(hmap);
+		return NULL;
+	}
+	if (stats->size != sizeof(usbip_stats_t)) {
+		err("%s: stats layout mismatch: %s", __FUNCTION__, name);
+		UnmapViewOfFile(stats);
+		CloseHandle(hmap);
+		return NULL;
+	}
+	*phmap = hmap;
+	return stats;
+}
+
+void
+usbip_stats_close_shared(const usbip_stats_t *stats, HANDLE hmap)
+{
+	if (stats == NULL)
+		return;
+	UnmapViewOfFile(stats);
+	CloseHandle(hmap);
+}
+
+/*
+ * usbip protocol does not carry a transfer type.
+ * Isochronous transfers have packets and only interrupt transfers have a polling interval.
+ */
+int
+usbip_stats_xfer_type(struct usbip_header *hdr)
+{
+	if (hdr->base.ep == 0)
+		return USBIP_XFER_CTRL;
+	if (hdr->u.cmd_submit.number_of_packets > 0)
+		return USBIP_XFER_ISO;
+	if (hdr->u.cmd_submit.interval > 0)
+		return USBIP_XFER_INTR;
+	return USBIP_XFER_BULK;
+}
+
+static void
+add_hist(usbip_hist_t *hist, LONGLONG us)
+{
+	if (us < 0)
+		us = 0;
+	hist->buckets[get_hist_idx(us)]++;
+	hist->sum_us += us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	hist->count++;
+}
+
+static usbip_submit_slot_t *
+get_slot(usbip_stats_t *stats, unsigned long seqnum)
+{
+	return stats->slots + (seqnum % USBIP_N_SUBMIT_SLOTS);
+}
+
+static void
+del_slot(usbip_stats_t *stats, usbip_submit_slot_t *slot)
+{
+	slot->used = FALSE;
+	if (!slot->is_unlink)
+		stats->n_inflight--;
+}
+
+/* a batch unlink may cover more seqnums than slots, so that all slots are looked into */
+static void
+del_batch_unlinked(usbip_stats_t *stats, usbip_submit_slot_t *slot_unlink)
+{
+	int	i;
+
+	for (i = 0; i < USBIP_N_SUBMIT_SLOTS; i++) {
+		usbip_submit_slot_t	*slot = stats->slots + i;
+
+		if (!slot->used || slot->is_unlink)
+			continue;
+		if (!USBIP_UNLINK_BATCH_HAS(slot_unlink->seqnum_unlinked, slot_unlink->seqnum_unlinked_last, slot->seqnum))
+			continue;
+		if (slot_unlink->ep_unlinked >= 0 && (slot->ep_idx & 0xf) != slot_unlink->ep_unlinked)
+			continue;
+		del_slot(stats, slot);
+	}
+}
+
+/* hdr should be in host byte order */
+void
+usbip_stats_req(usbip_stats_t *stats, struct usbip_header *hdr)
+{
+	usbip_submit_slot_t	*slot;
+	LARGE_INTEGER	now;
+	int	type, ep_idx;
+
+	switch (hdr->base.command) {
+	case USBIP_CMD_SUBMIT:
+		type = usbip_stats_xfer_type(hdr);
+		stats->n_cmd_submits[type]++;
+		if (!hdr->base.direction)
+			stats->bytes_out += hdr->u.cmd_submit.transfer_buffer_length;
+		ep_idx = USBIP_STATS_EP_IDX(hdr->base.ep, hdr->base.direction);
+		stats->ep_types[ep_idx] = type + 1;
+
+		slot = get_slot(stats, hdr->base.seqnum);
+		if (slot->used)
+			del_slot(stats, slot);
+		QueryPerformanceCounter(&now);
+		slot->seqnum = hdr->base.seqnum;
+		slot->is_unlink = FALSE;
+		slot->ep_idx = ep_idx;
+		slot->ts = now.QuadPart;
+		slot->used = TRUE;
+		stats->n_inflight++;
+		break;
+	case USBIP_CMD_UNLINK:
+	case USBIP_CMD_UNLINK_BATCH:
+		stats->n_cmd_unlinks++;
+
+		slot = get_slot(stats, hdr->base.seqnum);
+		if (slot->used)
+			del_slot(stats, slot);
+		slot->seqnum = hdr->base.seqnum;
+		slot->is_unlink = TRUE;
+		if (hdr->base.command == USBIP_CMD_UNLINK) {
+			slot->seqnum_unlinked = hdr->u.cmd_unlink.seqnum;
+			slot->seqnum_unlinked_last = slot->seqnum_unlinked;
+			slot->ep_unlinked = -1;
+		}
+		else {
+			slot->seqnum_unlinked = hdr->u.cmd_unlink_batch.seqnum_first;
+			slot->seqnum_unlinked_last = hdr->u.cmd_unlink_batch.seqnum_last;
+			slot->ep_unlinked = (hdr->u.cmd_unlink_batch.flags & USBIP_UNLINK_BATCH_EP) ? (int)hdr->base.ep: -1;
+		}
+		slot->used = TRUE;
+		break;
+	default:
+		break;
+	}
+}
+
+void
+usbip_stats_rep(usbip_stats_t *stats, struct usbip_header *hdr)
+{
+	usbip_submit_slot_t	*slot, *unlinked;
+	LARGE_INTEGER	now;
+
+	switch (hdr->base.command) {
+	case USBIP_RET_SUBMIT:
+		slot = get_slot(stats, hdr->base.seqnum);
+		if (!slot->used || slot->is_unlink || slot->seqnum != hdr->base.seqnum)
+			break;
+		QueryPerformanceCounter(&now);
+		stats->n_ret_submits[stats->ep_types[slot->ep_idx] - 1]++;
+		if (slot->ep_idx & 0x10)
+			stats->bytes_in += hdr->u.ret_submit.actual_length;
+		add_hist(&stats->lat[slot->ep_idx], (now.QuadPart - slot->ts) * 1000000 / stats->freq.QuadPart);
+		del_slot(stats, slot);
+		break;
+	case USBIP_RET_UNLINK:
+		slot = get_slot(stats, hdr->base.seqnum);
+		if (!slot->used || !slot->is_unlink || slot->seqnum != hdr->base.seqnum)
+			break;
+		/*
+		 * A successfully unlinked URB has no RET_SUBMIT.
+		 * Otherwise, its RET_SUBMIT has been sent before RET_UNLINK and the slot is already free.
+		 */
+		if (slot->seqnum_unlinked_last != slot->seqnum_unlinked) {
+			del_batch_unlinked(stats, slot);
+		}
+		else {
+			unlinked = get_slot(stats, slot->seqnum_unlinked);
+			if (unlinked->used && !unlinked->is_unlink && unlinked->seqnum == slot->seqnum_unlinked)
+				del_slot(stats, unlinked);
+		}
+		del_slot(stats, slot);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+usbip_stats_buf(usbip_stats_t *stats, BOOL is_req, DWORD size)
+{
+	if (is_req) {
+		if ((LONG)size > stats->hwm_buf_req)
+			stats->hwm_buf_req = (LONG)size;
+	}
+	else {
+		if ((LONG)size > stats->hwm_buf_rep)
+			stats->hwm_buf_rep = (LONG)size;
+	}
+}
+
+void
+usbip_stats_dump(const usbip_stats_t *stats, FILE *fp)
+{
+	int	i;
+
+	fprintf(fp, "%-12s %12s %12s\n", "type", "cmd_submit", "ret_submit");
+	for (i = 0; i < USBIP_XFER_TYPES; i++)
+		fprintf(fp, "%-12s %12lld %12lld\n", usbip_xfer_type_name(i), stats->n_cmd_submits[i], stats->n_ret_submits[i]);
+	fprintf(fp, "cmd_unlink: %lld, in-flight: %ld\n", stats->n_cmd_unlinks, stats->n_inflight);
+	fprintf(fp, "bytes in: %lld, out: %lld\n", stats->bytes_in, stats->bytes_out);
+	fprintf(fp, "buffer max: request: %ld, reply: %ld\n", stats->hwm_buf_req, stats->hwm_buf_rep);
+
+	fprintf(fp, "%-5s %-12s %10s %10s %10s %10s %10s %10s\n", "ep", "type", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+	for (i = 0; i < USBIP_STATS_EPS; i++) {
+		const usbip_hist_t	*hist = &stats->lat[i];
+
+		if (stats->ep_types[i] == 0 || hist->count == 0)
+			continue;
+		fprintf(fp, "0x%02x  %-12s %10lld %10lld %10llu %10llu %10llu %10lld\n",
+			(i & 0xf) | ((i & 0x10) ? 0x80: 0), usbip_xfer_type_name(stats->ep_types[i] - 1), hist->count,
+			hist->sum_us / hist->count,
+			usbip_hist_percentile_us(hist, 50), usbip_hist_percentile_us(hist, 90),
+			usbip_hist_percentile_us(hist, 99), hist->max_us);
+	}
+}
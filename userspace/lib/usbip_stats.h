@@ -0,0 +1,103 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "usbip_proto.h"
+
+/*
+ * Forwarding statistics
+ *
+ * A stats object is owned by a single forwarding thread, which is the only writer.
+ * Counters are updated without any lock or interlocked operation. A reader such as a metrics
+ * scraper just loads them and may observe a slightly stale value.
+ * usbip_stats_t has no pointer so that it can be placed in a shared memory section.
+ */
+
+/* transfer types guessed from CMD_SUBMIT */
+#define USBIP_XFER_CTRL		0
+#define USBIP_XFER_BULK		1
+#define USBIP_XFER_INTR		2
+#define USBIP_XFER_ISO		3
+#define USBIP_XFER_TYPES	4
+
+/*
+ * HDR style log-linear latency buckets in microseconds.
+ * Values below USBIP_HIST_LINEAR have their own buckets. Above that, every power of 2 range
+ * is split into 2^USBIP_HIST_SUB_BITS buckets, which bounds a relative error to 12.5%.
+ * The last bucket also holds every value beyond 2^(USBIP_HIST_GROUPS + 4) usec, about 2 min.
+ */
+#define USBIP_HIST_SUB_BITS	3
+#define USBIP_HIST_LINEAR	(2 << USBIP_HIST_SUB_BITS)
+#define USBIP_HIST_GROUPS	23
+#define USBIP_HIST_BUCKETS	(USBIP_HIST_LINEAR + (USBIP_HIST_GROUPS << USBIP_HIST_SUB_BITS))
+
+typedef struct {
+	volatile LONG64	buckets[USBIP_HIST_BUCKETS];
+	volatile LONG64	sum_us;
+	volatile LONG64	max_us;
+	volatile LONG64	count;
+} usbip_hist_t;
+
+/* endpoint index: endpoint number, plus 16 for IN direction */
+#define USBIP_STATS_EPS		32
+#define USBIP_STATS_EP_IDX(ep, is_in)	(((ep) & 0xf) | ((is_in) ? 0x10: 0))
+
+#define USBIP_N_SUBMIT_SLOTS	2048
+
+typedef struct {
+	unsigned long	seqnum;
+	BOOL	used;
+	/* CMD_UNLINK slot just remembers which URB it unlinks */
+	BOOL	is_unlink;
+	unsigned long	seqnum_unlinked;
+	/* CMD_UNLINK_BATCH unlinks up to seqnum_unlinked_last on ep_unlinked, or any endpoint if -1 */
+	unsigned long	seqnum_unlinked_last;
+	int	ep_unlinked;
+	int	ep_idx;
+	LONGLONG	ts;
+} usbip_submit_slot_t;
+
+typedef struct {
+	/* for a reader of shared stats to check layout */
+	ULONG	size;
+
+	volatile LONG64	n_cmd_submits[USBIP_XFER_TYPES];
+	volatile LONG64	n_ret_submits[USBIP_XFER_TYPES];
+	volatile LONG64	n_cmd_unlinks;
+	/* bytes_in: device to host, bytes_out: host to device */
+	volatile LONG64	bytes_in, bytes_out;
+	volatile LONG	n_inflight;
+	/* high water marks of forwarder buffers for requests and replies */
+	volatile LONG	hwm_buf_req, hwm_buf_rep;
+
+	/* transfer type of an endpoint plus 1. 0 means never used */
+	volatile LONG	ep_types[USBIP_STATS_EPS];
+	usbip_hist_t	lat[USBIP_STATS_EPS];
+
+	/* private to the forwarding thread: submit timestamps keyed by seqnum */
+	LARGE_INTEGER	freq;
+	usbip_submit_slot_t	slots[USBIP_N_SUBMIT_SLOTS];
+} usbip_stats_t;
+
+usbip_stats_t *usbip_stats_create(void);
+void usbip_stats_free(usbip_stats_t *stats);
+
+/* stats in a named shared memory section, which another process can read */
+#define USBIP_STATS_SHARED_NAME	"Local\\usbip_stats_port%d"
+usbip_stats_t *usbip_stats_create_shared(const char *name, HANDLE *phmap);
+const usbip_stats_t *usbip_stats_open_shared(const char *name, HANDLE *phmap);
+void usbip_stats_close_shared(const usbip_stats_t *stats, HANDLE hmap);
+
+void usbip_stats_req(usbip_stats_t *stats, struct usbip_header *hdr);
+void usbip_stats_rep(usbip_stats_t *stats, struct usbip_header *hdr);
+void usbip_stats_buf(usbip_stats_t *stats, BOOL is_req, DWORD size);
+
+/* hdr should be CMD_SUBMIT */
+int usbip_stats_xfer_type(struct usbip_header *hdr);
+const char *usbip_xfer_type_name(int type);
+/* inclusive upper bound of a latency bucket in microseconds */
+unsigned long long usbip_hist_bucket_us(int idx);
+unsigned long long usbip_hist_percentile_us(const usbip_hist_t *hist, double pct);
+
+void usbip_stats_dump(const usbip_stats_t *stats, FILE *fp);
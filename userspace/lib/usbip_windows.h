@@ -1,4 +1,4 @@
-#pragma
+#pragma once
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -97,6 +97,12 @@ static const struct command cmds[] = {
 		.help  = "Install or reinstall driver for usbip",
 		.usage = usbip_install_usage
 	},
+	{
+		.name  = "stats",
+		.fn    = usbip_stats,
+		.help  = "Show forwarding stats of attached devices",
+		.usage = usbip_stats_usage
+	},
 #if 0 /* Not implemented yet */
 	{
 		.name  = "port",
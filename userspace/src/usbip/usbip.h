@@ -30,6 +30,7 @@ int usbip_list(int argc, char *argv[]);
 int usbip_bind(int argc, char *argv[]);
 int usbip_unbind(int argc, char *argv[]);
 int usbip_install(int argc, char* argv[]);
+int usbip_stats(int argc, char *argv[]);
 
 void usbip_attach_usage(void);
 void usbip_detach_usage(void);
@@ -37,5 +38,6 @@ void usbip_list_usage(void);
 void usbip_bind_usage(void);
 void usbip_unbind_usage(void);
 void usbip_install_usage(void);
+void usbip_stats_usage(void);
 
 #endif /* __USBIP_H */
@@ -18,6 +18,8 @@
 
 #include "usbip_windows.h"
 
+#include <signal.h>
+
 #include "usbip_common.h"
 #include "usbip_network.h"
 #include "usbip_vhci.h"
@@ -27,8 +29,11 @@
 static const char usbip_attach_usage_string[] =
 	"usbip attach <args>\n"
 	"    -r, --remote=<host>    The machine with exported USB devices\n"
-	"    -b, --busid=<busid>    Busid of the device on <host>\n"
-	"    -i, --instid=<instid>  (Optional) Serial number to use as instance ID\n";
+	"    -b, --busid=<busid>    Busid of the device on <host>, which may be repeated with --mux\n"
+	"    -i, --instid=<instid>  (Optional) Serial number to use as instance ID\n"
+	"    -c, --capture=<file>   (Optional) Capture forwarded PDUs into a pcapng file\n"
+	"    -m, --mux              (Optional) Import all busids over a single connection\n"
+	"    -R, --resume           (Optional) Resume a session over a new connection when a connection breaks\n";
 
 void usbip_attach_usage(void)
 {
@@ -45,24 +50,24 @@ import_device(SOCKET sockfd, usbip_wudev_t *wudev, const char *instid, HANDLE *p
 	hdev = usbip_vhci_driver_open();
 	if (hdev == INVALID_HANDLE_VALUE) {
 		err("open vhci driver");
-		return 1;
+		return -1;
 	}
 
-	port = usbip_vhci_get_free_port(hdev);
+	port = usbip_vhci_alloc_port(hdev);
 	if (port <= 0) {
 		err("no free port");
 		usbip_vhci_driver_close(hdev);
-		return 1;
+		return -1;
 	}
 
-	dbg("got free port %d", port);
+	dbg("allocated port %d", port);
 
 	rc = usbip_vhci_attach_device(hdev, port, instid, wudev);
 
 	if (rc < 0) {
 		err("import device");
 		usbip_vhci_driver_close(hdev);
-		return 1;
+		return -1;
 	}
 
 	*phdev = hdev;
@@ -70,12 +75,19 @@ import_device(SOCKET sockfd, usbip_wudev_t *wudev, const char *instid, HANDLE *p
 	return port;
 }
 
-static int query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev, const char *instid)
+/*
+ * Returns a vhci port. pext_flags has import extensions a server has honored.
+ * ptoken has a session token if a server has honored USBIP_IMPORT_EXT_RESUME.
+ */
+static int query_import_device(SOCKET sockfd, const char *busid, uint32_t ext_flags, HANDLE *phdev, const char *instid,
+			       unsigned *pdevid, uint32_t *pext_flags, uint32_t *ptoken)
 {
 	int rc;
 	struct op_import_request request;
 	struct op_import_reply   reply;
 	usbip_wudev_t	wuDev;
+	unsigned char	*dsc_conf = NULL;
+	uint32_t	len_conf = 0;
 	uint16_t code = OP_REP_IMPORT;
 
 	memset(&request, 0, sizeof(request));
@@ -85,30 +97,32 @@ static int query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev,
 	rc = usbip_net_send_op_common(sockfd, OP_REQ_IMPORT, 0);
 	if (rc < 0) {
 		err("send op_common");
-		return 1;
+		return -1;
 	}
 
 	strncpy_s(request.busid, USBIP_BUS_ID_SIZE, busid, sizeof(request.busid));
+	/* A configuration descriptor in a reply saves a round trip for supplementing interface class */
+	usbip_net_set_import_ext(request.busid, ext_flags);
 
 	PACK_OP_IMPORT_REQUEST(0, &request);
 
 	rc = usbip_net_send(sockfd, (void *)&request, sizeof(request));
 	if (rc < 0) {
 		err("send op_import_request");
-		return 1;
+		return -1;
 	}
 
 	/* recieve a reply */
 	rc = usbip_net_recv_op_common(sockfd, &code);
 	if (rc < 0) {
 		err("recv op_common");
-		return 1;
+		return -1;
 	}
 
 	rc = usbip_net_recv(sockfd, (void *)&reply, sizeof(reply));
 	if (rc < 0) {
 		err("recv op_import_reply");
-		return 1;
+		return -1;
 	}
 
 	PACK_OP_IMPORT_REPLY(0, &reply);
@@ -116,61 +130,311 @@ static int query_import_device(SOCKET sockfd, const char *busid, HANDLE *phdev,
 	/* check the reply */
 	if (strncmp(reply.udev.busid, busid, sizeof(reply.udev.busid))) {
 		err("recv different busid %s", reply.udev.busid);
-		return 1;
+		return -1;
 	}
 
-	get_wudev(sockfd, &wuDev, &reply.udev);
+	*pext_flags = usbip_net_get_import_ext(reply.udev.busid);
+	if (*pext_flags & USBIP_IMPORT_EXT_CONF_DESC) {
+		rc = usbip_net_recv(sockfd, &len_conf, sizeof(len_conf));
+		if (rc < 0) {
+			err("recv configuration descriptor length");
+			return -1;
+		}
+		len_conf = ntohl(len_conf);
+		if (len_conf > 0xffff) {
+			err("invalid configuration descriptor length: %u", len_conf);
+			return -1;
+		}
+		dsc_conf = (unsigned char *)malloc(len_conf);
+		if (dsc_conf == NULL) {
+			err("out of memory");
+			return -1;
+		}
+		rc = usbip_net_recv(sockfd, dsc_conf, len_conf);
+		if (rc < 0) {
+			err("recv configuration descriptor");
+			free(dsc_conf);
+			return -1;
+		}
+	}
+	if (*pext_flags & USBIP_IMPORT_EXT_RESUME) {
+		rc = usbip_net_recv(sockfd, ptoken, sizeof(*ptoken));
+		if (rc < 0) {
+			err("recv session token");
+			free(dsc_conf);
+			return -1;
+		}
+		*ptoken = ntohl(*ptoken);
+	}
+
+	/* a multiplexing server takes only import requests until importing ends */
+	get_wudev((*pext_flags & USBIP_IMPORT_EXT_MUX) ? INVALID_SOCKET: sockfd, &wuDev, &reply.udev, dsc_conf, len_conf);
+	free(dsc_conf);
+	*pdevid = wuDev.devid;
+	if (*pext_flags & USBIP_IMPORT_EXT_UNLINK_BATCH)
+		wuDev.plugin_flags |= USBIP_VHCI_PLUGIN_UNLINK_BATCH;
 
 	/* import a device */
 	return import_device(sockfd, &wuDev, instid, phdev);
 }
 
-static int
-attach_device(const char *host, const char *busid, const char *instid)
+static usbip_stats_t	*stats_attached[USBIP_MUX_MAX_DEVS];
+static int	n_stats_attached;
+
+/* Ctrl-Break dumps forwarding stats while attached */
+static void
+signal_handler_dump(int i)
 {
+	int	k;
+
+	for (k = 0; k < n_stats_attached; k++) {
+		if (stats_attached[k] != NULL)
+			usbip_stats_dump(stats_attached[k], stdout);
+	}
+	signal(SIGBREAK, signal_handler_dump);
+}
+
+/* a client reconnects with a backoff until a session expires on a server */
+#define RECONNECT_BACKOFF_MIN	250	/* msec */
+#define RECONNECT_BACKOFF_MAX	2000	/* msec */
+
+typedef struct {
+	const char	*host;
 	SOCKET	sockfd;
+	uint32_t	token;
+} session_t;
+
+static SOCKET
+reconnect_session(void *ctx, usbip_journal_t *journal)
+{
+	session_t	*session = (session_t *)ctx;
+	ULONGLONG	deadline = GetTickCount64() + USBIP_RESUME_TIMEOUT * 1000;
+	DWORD	backoff = RECONNECT_BACKOFF_MIN;
+
+	closesocket(session->sockfd);
+	session->sockfd = INVALID_SOCKET;
+
+	info("connection broken: resuming session");
+
+	/* a vhci port stays plugged while reconnecting */
+	for (;;) {
+		SOCKET	sockfd;
+
+		sockfd = usbip_net_tcp_connect(session->host, usbip_port_string);
+		if (sockfd != INVALID_SOCKET) {
+			if (usbip_journal_resume_client(journal, sockfd, session->token) == 0) {
+				usbip_net_set_dead_timeout(sockfd, USBIP_RESUME_DEAD_TIMEOUT);
+				session->sockfd = sockfd;
+				return sockfd;
+			}
+			closesocket(sockfd);
+		}
+		if (GetTickCount64() + backoff >= deadline)
+			break;
+		Sleep(backoff);
+		backoff = min(backoff * 2, RECONNECT_BACKOFF_MAX);
+	}
+	err("failed to resume session");
+	return INVALID_SOCKET;
+}
+
+static int
+attach_device(const char *host, const char *busid, const char *instid, const char *capture_path, BOOL resumable)
+{
 	int	rhport;
 	HANDLE	hdev = INVALID_HANDLE_VALUE;
-
-	sockfd = usbip_net_tcp_connect(host, usbip_port_string);
-	if (sockfd == INVALID_SOCKET) {
+	unsigned	devid;
+	uint32_t	ext_flags;
+	session_t	session;
+	usbip_resume_t	resume, *presume = NULL;
+	usbip_stats_t	*stats;
+	HANDLE	hmap_stats = NULL;
+	char	name_stats[64];
+	usbip_capture_t	*cap = NULL;
+	usbip_capture_ring_t	*capring;
+
+	session.host = host;
+	session.sockfd = usbip_net_tcp_connect(host, usbip_port_string);
+	if (session.sockfd == INVALID_SOCKET) {
 		err("tcp connect");
 		return 1;
 	}
 
-	rhport = query_import_device(sockfd, busid, &hdev, instid);
+	rhport = query_import_device(session.sockfd, busid, USBIP_IMPORT_EXT_CONF_DESC | USBIP_IMPORT_EXT_UNLINK_BATCH | (resumable ? USBIP_IMPORT_EXT_RESUME: 0),
+				     &hdev, instid, &devid, &ext_flags, &session.token);
 	if (rhport < 0) {
 		err("query");
+		closesocket(session.sockfd);
 		return 1;
 	}
 
-	usbip_forward(hdev, (HANDLE)sockfd, FALSE);
+	/* forwarding goes on without resume */
+	if (resumable && !(ext_flags & USBIP_IMPORT_EXT_RESUME))
+		err("%s: server does not support resume", host);
+	else if (resumable) {
+		memset(&resume, 0, sizeof(resume));
+		resume.journal = usbip_journal_create(TRUE);
+		resume.reconnect = reconnect_session;
+		resume.ctx = &session;
+		if (resume.journal != NULL) {
+			usbip_net_set_dead_timeout(session.sockfd, USBIP_RESUME_DEAD_TIMEOUT);
+			presume = &resume;
+		}
+		else
+			err("failed to create journal: resume disabled");
+	}
+
+	/* "usbip stats" reads them. Forwarding goes on without stats on failure. */
+	snprintf(name_stats, sizeof(name_stats), USBIP_STATS_SHARED_NAME, rhport);
+	stats = usbip_stats_create_shared(name_stats, &hmap_stats);
+	stats_attached[0] = stats;
+	n_stats_attached = 1;
+	signal(SIGBREAK, signal_handler_dump);
+
+	if (capture_path != NULL)
+		cap = usbip_capture_open(capture_path, USBIP_CAPTURE_SNAPLEN);
+
+	capring = usbip_capture_add_ring(cap);
+
+	usbip_forward(hdev, (HANDLE)session.sockfd, FALSE, stats, capring, presume);
+
+	usbip_capture_del_ring(capring);
+	usbip_capture_close(cap);
+	n_stats_attached = 0;
+	usbip_stats_close_shared(stats, hmap_stats);
+	if (presume != NULL)
+		usbip_journal_free(presume->journal);
 
 	usbip_vhci_detach_device(hdev, rhport);
 
 	usbip_vhci_driver_close(hdev);
 
-	closesocket(sockfd);
+	if (session.sockfd != INVALID_SOCKET)
+		closesocket(session.sockfd);
 
 	return 0;
 }
 
+/* A request of an empty busid lets a multiplexing server start forwarding */
+static int
+send_end_of_import(SOCKET sockfd)
+{
+	struct op_import_request	request;
+
+	memset(&request, 0, sizeof(request));
+	usbip_net_set_import_ext(request.busid, USBIP_IMPORT_EXT_MUX);
+	PACK_OP_IMPORT_REQUEST(0, &request);
+
+	if (usbip_net_send_op_common(sockfd, OP_REQ_IMPORT, 0) < 0 ||
+	    usbip_net_send(sockfd, (void *)&request, sizeof(request)) < 0) {
+		err("send end of import");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * All devices are imported over a single connection and their PDUs are told apart by devid.
+ * A device which fails to be imported is skipped.
+ */
+static int
+attach_devices_mux(const char *host, char *busids[], int n_busids, const char *capture_path)
+{
+	SOCKET	sockfd;
+	usbip_mux_dev_t	devs[USBIP_MUX_MAX_DEVS];
+	int	rhports[USBIP_MUX_MAX_DEVS];
+	HANDLE	hmaps_stats[USBIP_MUX_MAX_DEVS];
+	char	name_stats[64];
+	usbip_capture_t	*cap = NULL;
+	int	n_devs = 0;
+	int	ret = 1;
+	int	i;
+
+	sockfd = usbip_net_tcp_connect(host, usbip_port_string);
+	if (sockfd == INVALID_SOCKET) {
+		err("tcp connect");
+		return 1;
+	}
+
+	for (i = 0; i < n_busids; i++) {
+		usbip_mux_dev_t	*dev = devs + n_devs;
+		uint32_t	ext_flags;
+		int	rhport;
+
+		rhport = query_import_device(sockfd, busids[i], USBIP_IMPORT_EXT_CONF_DESC | USBIP_IMPORT_EXT_MUX | USBIP_IMPORT_EXT_UNLINK_BATCH,
+					     &dev->hdev, NULL, &dev->devid, &ext_flags, NULL);
+		if (rhport < 0) {
+			err("failed to import: %s", busids[i]);
+			continue;
+		}
+		if (!(ext_flags & USBIP_IMPORT_EXT_MUX)) {
+			/* an old server has taken the connection for forwarding a single device */
+			err("%s: server does not support multiplexing", host);
+			usbip_vhci_detach_device(dev->hdev, rhport);
+			usbip_vhci_driver_close(dev->hdev);
+			goto out;
+		}
+		rhports[n_devs] = rhport;
+		n_devs++;
+	}
+	if (n_devs == 0 || send_end_of_import(sockfd) < 0)
+		goto out;
+
+	if (capture_path != NULL)
+		cap = usbip_capture_open(capture_path, USBIP_CAPTURE_SNAPLEN);
+
+	for (i = 0; i < n_devs; i++) {
+		snprintf(name_stats, sizeof(name_stats), USBIP_STATS_SHARED_NAME, rhports[i]);
+		devs[i].stats = usbip_stats_create_shared(name_stats, &hmaps_stats[i]);
+		devs[i].capring = usbip_capture_add_ring(cap);
+		stats_attached[i] = devs[i].stats;
+	}
+	n_stats_attached = n_devs;
+	signal(SIGBREAK, signal_handler_dump);
+
+	info("%d devices attached over a connection", n_devs);
+	usbip_forward_mux(sockfd, devs, n_devs, FALSE);
+
+	n_stats_attached = 0;
+	for (i = 0; i < n_devs; i++) {
+		usbip_capture_del_ring(devs[i].capring);
+		usbip_stats_close_shared(devs[i].stats, hmaps_stats[i]);
+	}
+	usbip_capture_close(cap);
+	ret = 0;
+out:
+	for (i = 0; i < n_devs; i++) {
+		usbip_vhci_detach_device(devs[i].hdev, rhports[i]);
+		usbip_vhci_driver_close(devs[i].hdev);
+	}
+	closesocket(sockfd);
+
+	return ret;
+}
+
 int usbip_attach(int argc, char *argv[])
 {
 	static const struct option opts[] = {
 		{ "remote", required_argument, NULL, 'r' },
 		{ "busid", required_argument, NULL, 'b' },
 		{ "instid", optional_argument, NULL, 'i' },
+		{ "capture", required_argument, NULL, 'c' },
+		{ "mux", no_argument, NULL, 'm' },
+		{ "resume", no_argument, NULL, 'R' },
 		{ NULL, 0, NULL, 0 }
 	};
 	char *host = NULL;
-	char *busid = NULL;
+	char *busids[USBIP_MUX_MAX_DEVS];
+	int n_busids = 0;
 	char *instid = NULL;
+	char *capture_path = NULL;
+	BOOL mux = FALSE;
+	BOOL resumable = FALSE;
 	int opt;
 	int ret = -1;
 
 	for (;;) {
-		opt = getopt_long(argc, argv, "r:b:i:", opts, NULL);
+		opt = getopt_long(argc, argv, "r:b:i:c:mR", opts, NULL);
 
 		if (opt == -1)
 			break;
@@ -180,20 +444,49 @@ int usbip_attach(int argc, char *argv[])
 			host = optarg;
 			break;
 		case 'b':
-			busid = optarg;
+			if (n_busids == USBIP_MUX_MAX_DEVS) {
+				err("too many busids: up to %d", USBIP_MUX_MAX_DEVS);
+				goto err_out;
+			}
+			busids[n_busids++] = optarg;
 			break;
 		case 'i':
 			instid = optarg;
 			break;
+		case 'c':
+			capture_path = optarg;
+			break;
+		case 'm':
+			mux = TRUE;
+			break;
+		case 'R':
+			resumable = TRUE;
+			break;
 		default:
 			goto err_out;
 		}
 	}
 
-	if (!host || !busid)
+	if (!host || n_busids == 0)
 		goto err_out;
+	if (!mux && n_busids > 1) {
+		err("multiple busids require --mux");
+		goto err_out;
+	}
+	/* an instance id belongs to a single device */
+	if (mux && instid != NULL) {
+		err("--instid cannot be used with --mux");
+		goto err_out;
+	}
+	if (mux && resumable) {
+		err("--resume cannot be used with --mux");
+		goto err_out;
+	}
 
-	ret = attach_device(host, busid, instid);
+	if (mux)
+		ret = attach_devices_mux(host, busids, n_busids, capture_path);
+	else
+		ret = attach_device(host, busids[0], instid, capture_path, resumable);
 	goto out;
 
 err_out:
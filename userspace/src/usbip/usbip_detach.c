@@ -20,6 +20,7 @@
 
 #include "usbip_common.h"
 #include "usbip_vhci.h"
+#include "usbip_vhci_api.h"
 
 static const char usbip_detach_usage_string[] =
 	"usbip detach <args>\n"
@@ -34,10 +35,10 @@ void usbip_detach_usage(void)
 static int detach_port(const char *portstr)
 {
 	HANDLE hdev;
-	uint8_t portnum;
+	unsigned int portnum;
 	int ret;
 
-	if (sscanf_s(portstr, "%hhu", &portnum) != 1) {
+	if (sscanf_s(portstr, "%u", &portnum) != 1 || portnum > USBIP_VHCI_MAX_PORTS) {
 		err("invalid port %s", portstr);
 		return 1;
 	}
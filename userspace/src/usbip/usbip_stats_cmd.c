@@ -0,0 +1,116 @@
+#include "usbip_windows.h"
+
+#include "usbip_common.h"
+#include "usbip_stats.h"
+#include "usbip_vhci.h"
+
+/* stats are published by each "usbip attach" process while it forwards */
+#define MAX_STATS_PORTS	USBIP_VHCI_MAX_PORTS
+
+static const char usbip_stats_usage_string[] =
+	"usbip stats <args>\n"
+	"    -p, --port=<port>    (Optional) port the device is on\n";
+
+void usbip_stats_usage(void)
+{
+	printf("usage: %s", usbip_stats_usage_string);
+}
+
+/* frame clock of vhci, which only an isochronous device has used */
+static void
+show_frame_stats(HANDLE hdev, int port)
+{
+	ioctl_usbip_vhci_frame_stats	stats;
+
+	if (hdev == INVALID_HANDLE_VALUE || usbip_vhci_get_frame_stats(hdev, port, &stats) < 0)
+		return;
+	if (stats.n_samples == 0 && stats.n_late == 0)
+		return;
+
+	printf("frame: %u, offset: %s%d/16, samples: %u, resyncs: %u, late: %u\n",
+	       stats.frame, stats.synced ? "": "(not synced) ", stats.offset,
+	       stats.n_samples, stats.n_resyncs, stats.n_late);
+	printf("start frame skew: max %u us, avg %llu us\n", stats.skew_max,
+	       stats.n_samples > 0 ? stats.skew_sum / stats.n_samples: 0);
+}
+
+static BOOL
+show_port_stats(HANDLE hdev, int port)
+{
+	const usbip_stats_t	*stats;
+	HANDLE	hmap;
+	char	name[64];
+
+	snprintf(name, sizeof(name), USBIP_STATS_SHARED_NAME, port);
+	stats = usbip_stats_open_shared(name, &hmap);
+	if (stats == NULL)
+		return FALSE;
+
+	printf("port %d:\n", port);
+	usbip_stats_dump(stats, stdout);
+	show_frame_stats(hdev, port);
+	printf("\n");
+	usbip_stats_close_shared(stats, hmap);
+	return TRUE;
+}
+
+static int
+show_stats(const char *portstr)
+{
+	HANDLE	hdev;
+	int	port, n_shown = 0, ret = 0;
+
+	/* stats of a forwarding are shown even if vhci cannot be opened */
+	hdev = usbip_vhci_driver_open();
+
+	if (portstr != NULL) {
+		if (sscanf_s(portstr, "%d", &port) != 1 || port <= 0 || port > MAX_STATS_PORTS) {
+			err("invalid port %s", portstr);
+			ret = 1;
+		}
+		else if (!show_port_stats(hdev, port)) {
+			err("no stats for port %d", port);
+			ret = 1;
+		}
+	}
+	else {
+		for (port = 1; port <= MAX_STATS_PORTS; port++) {
+			if (show_port_stats(hdev, port))
+				n_shown++;
+		}
+		if (n_shown == 0)
+			printf("no attached device\n");
+	}
+
+	if (hdev != INVALID_HANDLE_VALUE)
+		usbip_vhci_driver_close(hdev);
+	return ret;
+}
+
+int usbip_stats(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "port", required_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 }
+	};
+	char	*portstr = NULL;
+	int opt;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "p:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'p':
+			portstr = optarg;
+			break;
+		default:
+			usbip_stats_usage();
+			return -1;
+		}
+	}
+
+	return show_stats(portstr);
+}
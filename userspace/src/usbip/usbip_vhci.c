@@ -70,16 +70,10 @@ usbip_vhci_driver_close(HANDLE hdev)
 }
 
 static int
-usbip_vhci_get_ports_status(HANDLE hdev, char *buf, int l)
+usbip_vhci_get_ports_status(HANDLE hdev, ioctl_usbip_vhci_get_ports_status *st)
 {
-	ioctl_usbip_vhci_get_ports_status	*st;
 	unsigned long len;
 
-	st = (ioctl_usbip_vhci_get_ports_status *)buf;
-
-	if (l != sizeof(ioctl_usbip_vhci_get_ports_status))
-		return -1;
-
 	if (DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_PORTS_STATUS,
 		NULL, 0, st, sizeof(ioctl_usbip_vhci_get_ports_status), &len, NULL)) {
 		if (len == sizeof(ioctl_usbip_vhci_get_ports_status))
@@ -88,19 +82,33 @@ usbip_vhci_get_ports_status(HANDLE hdev, char *buf, int l)
 	return -1;
 }
 
+/* A port is claimed by vhci for a following attach over hdev, so that concurrent attaches never share it */
 int
-usbip_vhci_get_free_port(HANDLE hdev)
+usbip_vhci_alloc_port(HANDLE hdev)
 {
-	char	buf[128];
-	int	i;
+	ioctl_usbip_vhci_alloc_port	alloc;
+	unsigned long	len;
 
-	if (usbip_vhci_get_ports_status(hdev, buf, sizeof(buf)))
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_VHCI_ALLOC_PORT, NULL, 0, &alloc, sizeof(alloc), &len, NULL)) {
+		err("usbip_vhci_alloc_port: DeviceIoControl failed: err: 0x%lx", GetLastError());
 		return -1;
-	for(i = 1;i < sizeof(buf); i++) {
-		if (!buf[i])
-			return i;
 	}
-	return -1;
+	if (len != sizeof(alloc))
+		return -1;
+	return (int)alloc.port;
+}
+
+int
+usbip_vhci_get_frame_stats(HANDLE hdev, int port, ioctl_usbip_vhci_frame_stats *stats)
+{
+	unsigned long	len;
+
+	stats->port = port;
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_FRAME_STATS, stats, sizeof(*stats), stats, sizeof(*stats), &len, NULL))
+		return -1;
+	if (len != sizeof(*stats))
+		return -1;
+	return 0;
 }
 
 int
@@ -120,6 +128,7 @@ usbip_vhci_attach_device(HANDLE hdev, int port, const char *instid, usbip_wudev_
 	plugin.protocol = wudev->bDeviceProtocol;
 
 	plugin.port = port;
+	plugin.flags = wudev->plugin_flags;
 
 	if (instid != NULL)
 		mbstowcs_s(NULL, plugin.winstid, MAX_VHCI_INSTANCE_ID, instid, _TRUNCATE);
@@ -152,25 +161,34 @@ int
 show_port_status(void)
 {
 	HANDLE fd;
+	ioctl_usbip_vhci_get_ports_status	*st;
 	int i;
-	char buf[128];
 
 	fd = usbip_vhci_driver_open();
 	if (INVALID_HANDLE_VALUE == fd) {
 		err("open vhci driver");
 		return -1;
 	}
-	if (usbip_vhci_get_ports_status(fd, buf, sizeof(buf))) {
+	st = (ioctl_usbip_vhci_get_ports_status *)malloc(sizeof(ioctl_usbip_vhci_get_ports_status));
+	if (st == NULL) {
+		err("out of memory");
+		CloseHandle(fd);
+		return -1;
+	}
+	if (usbip_vhci_get_ports_status(fd, st)) {
 		err("get port status");
+		free(st);
+		CloseHandle(fd);
 		return -1;
 	}
-	info("max used port:%d\n", buf[0]);
-	for (i = 1; i <= buf[0]; i++) {
-		if (buf[i])
+	info("max used port:%d\n", st->max_used_port);
+	for (i = 1; i <= st->max_used_port; i++) {
+		if (st->port_status[i])
 			info("port %d: used\n", i);
 		else
 			info("port %d: idle\n", i);
 	}
+	free(st);
 	CloseHandle(fd);
 	return 0;
 }
@@ -4,10 +4,12 @@
 #pragma
 
 #include "usbip_wudev.h"
+#include "usbip_vhci_api.h"
 
 HANDLE usbip_vhci_driver_open(void);
 void usbip_vhci_driver_close(HANDLE hdev);
-int usbip_vhci_get_free_port(HANDLE hdev);
+int usbip_vhci_alloc_port(HANDLE hdev);
+int usbip_vhci_get_frame_stats(HANDLE hdev, int port, ioctl_usbip_vhci_frame_stats *stats);
 int usbip_vhci_attach_device(HANDLE hdev, int port, const char *instid, usbip_wudev_t *wudev);
 int usbip_vhci_detach_device(HANDLE hdev, int port);
 
@@ -55,6 +55,21 @@ fetch_conf_desc(SOCKET sockfd, unsigned devid, char *pdesc, unsigned desc_size)
 	return 0;
 }
 
+static void
+supplement_with_conf_desc(usbip_wudev_t *wudev, const unsigned char *dsc_conf, unsigned len_conf)
+{
+	struct usbip_usb_interface	uinf;
+
+	wudev->bNumInterfaces = dsc_conf[4];
+
+	/* Same as below. The first interface is not always located right after a configuration descriptor. */
+	if (wudev->bNumInterfaces == 1 && usbip_get_conf_interfaces(dsc_conf, len_conf, &uinf, 1) == 1) {
+		wudev->bDeviceClass = uinf.bInterfaceClass;
+		wudev->bDeviceSubClass = uinf.bInterfaceSubClass;
+		wudev->bDeviceProtocol = uinf.bInterfaceProtocol;
+	}
+}
+
 /*
 * Sadly, udev structure from linux does not have an interface descriptor.
 * So we should get interface class number via GET_DESCRIPTOR usb command.
@@ -86,6 +101,7 @@ static void
 setup_wudev_from_udev(usbip_wudev_t *wudev, struct usbip_usb_device *udev)
 {
 	wudev->devid = udev->busnum << 16 | udev->devnum;
+	wudev->plugin_flags = 0;
 
 	wudev->idVendor = udev->idVendor;
 	wudev->idProduct = udev->idProduct;
@@ -100,7 +116,7 @@ setup_wudev_from_udev(usbip_wudev_t *wudev, struct usbip_usb_device *udev)
 }
 
 void
-get_wudev(SOCKET sockfd, usbip_wudev_t *wudev, struct usbip_usb_device *udev)
+get_wudev(SOCKET sockfd, usbip_wudev_t *wudev, struct usbip_usb_device *udev, const unsigned char *dsc_conf, unsigned len_conf)
 {
 	setup_wudev_from_udev(wudev, udev);
 
@@ -110,6 +126,11 @@ get_wudev(SOCKET sockfd, usbip_wudev_t *wudev, struct usbip_usb_device *udev)
 	 * Because windows vhci driver builds a device compatible id with those numbers.
 	 */
 	if (is_zero_class(wudev)) {
-		supplement_with_interface(sockfd, wudev);
+		/* A server with import extension has already sent a configuration descriptor */
+		if (dsc_conf != NULL && len_conf >= 9)
+			supplement_with_conf_desc(wudev, dsc_conf, len_conf);
+		/* no socket is given while a request cannot go on a connection */
+		else if (sockfd != INVALID_SOCKET)
+			supplement_with_interface(sockfd, wudev);
 	}
 }
@@ -17,8 +17,11 @@ typedef struct {
 	uint8_t		bDeviceProtocol;
 
 	uint8_t		bNumInterfaces;
+
+	/* USBIP_VHCI_PLUGIN_XXX from import extensions which a server has honored */
+	uint32_t	plugin_flags;
 } usbip_wudev_t;
 
-extern void get_wudev(SOCKET sockfd, usbip_wudev_t *uwdev, struct usbip_usb_device *udev);
+extern void get_wudev(SOCKET sockfd, usbip_wudev_t *uwdev, struct usbip_usb_device *udev, const unsigned char *dsc_conf, unsigned len_conf);
 
 #endif /* _USBIP_WUDEV_H_ */
@@ -14,6 +14,7 @@
 #include "usbipd.h"
 
 #include "usbip_network.h"
+#include "usbip_capture.h"
 #include "getopt.h"
 #include "usbip_windows.h"
 
@@ -24,6 +25,13 @@
 
 extern SOCKET *get_listen_sockfds(int family);
 extern void accept_request(SOCKET *sockfds, fd_set *pfds);
+extern BOOL init_accept(void);
+extern void cleanup_accept(void);
+extern void init_devlist(void);
+extern void cleanup_devlist(void);
+extern BOOL init_metrics(const char *port);
+extern void cleanup_metrics(void);
+extern void dump_metrics(void);
 
 static const char usbip_version_string[] = PACKAGE_STRING;
 
@@ -42,6 +50,13 @@ static const char usbipd_help_string[] =
 	"	-tPORT, --tcp-port PORT\n"
 	"		Listen on TCP/IP port PORT.\n"
 	"\n"
+	"	-mPORT, --metrics PORT\n"
+	"		Serve Prometheus metrics on 127.0.0.1:PORT.\n"
+	"		Ctrl-Break dumps latency histograms to stdout.\n"
+	"\n"
+	"	-cFILE, --capture FILE\n"
+	"		Capture forwarded PDUs into a pcapng FILE.\n"
+	"\n"
 	"	-h, --help\n"
 	"		Print this help.\n"
 	"\n"
@@ -55,6 +70,11 @@ static enum {
 } cmd = cmd_standalone_mode;
 
 static int	family = AF_UNSPEC;
+static const char	*metrics_port;
+static const char	*capture_path;
+
+/* all forwarders share a single capture file */
+usbip_capture_t	*usbipd_capture;
 
 static void
 usbipd_help(void)
@@ -68,10 +88,19 @@ signal_handler(int i)
 	dbg("received '%d' signal", i);
 }
 
+/* Ctrl-Break dumps forwarding stats collected with --metrics */
+static void
+signal_handler_dump(int i)
+{
+	dump_metrics();
+	signal(SIGBREAK, signal_handler_dump);
+}
+
 static void
 set_signal(void)
 {
 	signal(SIGINT, signal_handler);
+	signal(SIGBREAK, signal_handler_dump);
 }
 
 static int
@@ -106,6 +135,28 @@ do_standalone_mode(void)
 		return 1;
 	}
 
+	if (!init_accept()) {
+		cleanup_socket();
+		return 1;
+	}
+	init_devlist();
+	if (metrics_port != NULL && !init_metrics(metrics_port)) {
+		cleanup_devlist();
+		cleanup_accept();
+		cleanup_socket();
+		return 1;
+	}
+	if (capture_path != NULL) {
+		usbipd_capture = usbip_capture_open(capture_path, USBIP_CAPTURE_SNAPLEN);
+		if (usbipd_capture == NULL) {
+			cleanup_metrics();
+			cleanup_devlist();
+			cleanup_accept();
+			cleanup_socket();
+			return 1;
+		}
+	}
+
 	n_sockfds = setup_fds(sockfds, &fds);
 	while (TRUE) {
 		struct timeval	timeout;
@@ -125,6 +176,10 @@ do_standalone_mode(void)
 	}
 
 	info("shutting down " PROGNAME);
+	usbip_capture_close(usbipd_capture);
+	cleanup_metrics();
+	cleanup_devlist();
+	cleanup_accept();
 	cleanup_socket();
 
 	return 0;
@@ -140,6 +195,8 @@ parse_args(int argc, char *argv[])
 	{ "device",   no_argument,       NULL, 'e' },
 	{ "pid",      optional_argument, NULL, 'P' },
 	{ "tcp-port", required_argument, NULL, 't' },
+	{ "metrics",  required_argument, NULL, 'm' },
+	{ "capture",  required_argument, NULL, 'c' },
 	{ "help",     no_argument,       NULL, 'h' },
 	{ "version",  no_argument,       NULL, 'v' },
 	{ NULL,	      0,                 NULL,  0 }
@@ -149,7 +206,7 @@ parse_args(int argc, char *argv[])
 	for (;;) {
 		int	opt;
 
-		opt = getopt_long(argc, argv, "46Ddt:hv", longopts, NULL);
+		opt = getopt_long(argc, argv, "46Ddt:m:c:hv", longopts, NULL);
 
 		if (opt == -1)
 			break;
@@ -170,6 +227,12 @@ parse_args(int argc, char *argv[])
 		case 't':
 			usbip_setup_port_number(optarg);
 			break;
+		case 'm':
+			metrics_port = optarg;
+			break;
+		case 'c':
+			capture_path = optarg;
+			break;
 		case 'v':
 			cmd = cmd_version;
 			break;
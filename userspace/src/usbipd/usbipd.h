@@ -6,4 +6,5 @@
 #include "usbip_common.h"
 
 extern int recv_request_import(SOCKET sockfd);
+extern int recv_request_resume(SOCKET sockfd);
 extern int recv_request_devlist(SOCKET connfd);
\ No newline at end of file
@@ -5,6 +5,18 @@
 #include "usbip_network.h"
 #include "usbipd_stub.h"
 
+/*
+ * Requests are processed on a private thread pool rather than on the listening thread.
+ * A slow or stalled client can hold a pool thread only until its socket times out.
+ */
+#define MAX_HANDSHAKE_THREADS	16
+#define MAX_PENDING_HANDSHAKES	1024
+#define HANDSHAKE_TIMEOUT	10000	/* msec */
+
+static PTP_POOL	tp_handshake;
+static TP_CALLBACK_ENVIRON	ce_handshake;
+static volatile LONG	n_pending_handshakes;
+
 static void
 recv_pdu(SOCKET connfd, BOOL *pneed_close_sockfd)
 {
@@ -30,6 +42,12 @@ recv_pdu(SOCKET connfd, BOOL *pneed_close_sockfd)
 		if (ret == 0)
 			*pneed_close_sockfd = FALSE;
 		break;
+	case OP_REQ_RESUME:
+		info("%s: received request: %#0x - resume session", __FUNCTION__, code);
+		ret = recv_request_resume(connfd);
+		if (ret == 0)
+			*pneed_close_sockfd = FALSE;
+		break;
 	case OP_REQ_DEVINFO:
 	case OP_REQ_CRYPKEY:
 	default:
@@ -69,19 +87,71 @@ do_accept(SOCKET listenfd)
 	return connfd;
 }
 
+static VOID CALLBACK
+handshake_worker(PTP_CALLBACK_INSTANCE inst, PVOID ctx)
+{
+	SOCKET	connfd = (SOCKET)ctx;
+	BOOL	need_close_sockfd;
+
+	recv_pdu(connfd, &need_close_sockfd);
+	if (need_close_sockfd)
+		closesocket(connfd);
+
+	InterlockedDecrement(&n_pending_handshakes);
+}
+
 static void
 process_request(SOCKET listenfd)
 {
 	SOCKET connfd;
-	BOOL	need_close_sockfd;
 
 	connfd = do_accept(listenfd);
 	if (connfd == INVALID_SOCKET)
 		return;
 
-	recv_pdu(connfd, &need_close_sockfd);
-	if (need_close_sockfd)
-		closesocket(connfd);
+	if (InterlockedIncrement(&n_pending_handshakes) > MAX_PENDING_HANDSHAKES) {
+		err("too many pending requests: connection dropped");
+		goto err_out;
+	}
+
+	/* a reply will be sent by a worker. An import request clears timeout for forwarding. */
+	usbip_net_set_timeout(connfd, HANDSHAKE_TIMEOUT);
+
+	if (!TrySubmitThreadpoolCallback(handshake_worker, (PVOID)connfd, &ce_handshake)) {
+		err("failed to submit a request: err: %lx", GetLastError());
+		goto err_out;
+	}
+	return;
+err_out:
+	InterlockedDecrement(&n_pending_handshakes);
+	closesocket(connfd);
+}
+
+BOOL
+init_accept(void)
+{
+	tp_handshake = CreateThreadpool(NULL);
+	if (tp_handshake == NULL) {
+		err("failed to create thread pool: err: %lx", GetLastError());
+		return FALSE;
+	}
+	SetThreadpoolThreadMaximum(tp_handshake, MAX_HANDSHAKE_THREADS);
+	if (!SetThreadpoolThreadMinimum(tp_handshake, 1)) {
+		err("failed to set thread pool minimum: err: %lx", GetLastError());
+		CloseThreadpool(tp_handshake);
+		return FALSE;
+	}
+
+	InitializeThreadpoolEnvironment(&ce_handshake);
+	SetThreadpoolCallbackPool(&ce_handshake, tp_handshake);
+	return TRUE;
+}
+
+void
+cleanup_accept(void)
+{
+	DestroyThreadpoolEnvironment(&ce_handshake);
+	CloseThreadpool(tp_handshake);
 }
 
 void
@@ -1,27 +1,254 @@
+/* for rand_s() */
+#define _CRT_RAND_S
+
 #include "usbipd.h"
 
+#include <stdlib.h>
+
+#include "list.h"
 #include "usbip_network.h"
 #include "usbipd_stub.h"
 #include "usbip_setupdi.h"
 #include "usbip_forward.h"
 
+extern usbip_stats_t *register_metrics(const char *busid);
+extern void unregister_metrics(usbip_stats_t *stats);
+extern void invalidate_devlist(void);
+extern usbip_capture_t	*usbipd_capture;
+
+/*
+ * A resumable session waits for OP_REQ_RESUME for USBIP_RESUME_TIMEOUT when its connection
+ * breaks, while a stub device stays opened. A handshake worker hands a new connection over
+ * to a forwarder thread. lock_sessions protects the list and connections of sessions.
+ */
+typedef struct {
+	uint32_t	token;
+	BOOL	listed;
+	/* a current connection, which is INVALID_SOCKET while a session is broken */
+	SOCKET	sockfd;
+	/* a connection of OP_REQ_RESUME and outstanding seqnums of a client */
+	SOCKET	sockfd_resumed;
+	uint32_t	*seqnums;
+	int	n_seqnums;
+	HANDLE	hevt_resumed;
+	usbip_resume_t	resume;
+	struct list_head	list;
+} session_t;
+
+static LIST_HEAD(sessions);
+static SRWLOCK	lock_sessions = SRWLOCK_INIT;
+
 typedef struct {
-	HANDLE	hdev;
 	SOCKET	sockfd;
+	/* devices are multiplexed over sockfd */
+	BOOL	mux;
+	int	n_devs;
+	usbip_mux_dev_t	devs[USBIP_MUX_MAX_DEVS];
+	/* NULL unless a client has asked for a resumable session */
+	session_t	*session;
 } forwarder_ctx_t;
 
+static session_t *
+find_session(uint32_t token)
+{
+	struct list_head	*p;
+
+	list_for_each(p, &sessions) {
+		session_t	*session = list_entry(p, session_t, list);
+
+		if (session->token == token)
+			return session;
+	}
+	return NULL;
+}
+
+static void
+unlist_session(session_t *session)
+{
+	AcquireSRWLockExclusive(&lock_sessions);
+	if (session->listed) {
+		list_del(&session->list);
+		session->listed = FALSE;
+	}
+	ReleaseSRWLockExclusive(&lock_sessions);
+}
+
+static void
+free_session(session_t *session)
+{
+	unlist_session(session);
+	if (session->sockfd_resumed != INVALID_SOCKET)
+		closesocket(session->sockfd_resumed);
+	free(session->seqnums);
+	if (session->hevt_resumed != NULL)
+		CloseHandle(session->hevt_resumed);
+	usbip_journal_free(session->resume.journal);
+	free(session);
+}
+
+static SOCKET
+reconnect_session(void *ctx, usbip_journal_t *journal)
+{
+	session_t	*session = (session_t *)ctx;
+	ULONGLONG	deadline = GetTickCount64() + USBIP_RESUME_TIMEOUT * 1000;
+
+	AcquireSRWLockExclusive(&lock_sessions);
+	closesocket(session->sockfd);
+	session->sockfd = INVALID_SOCKET;
+	ReleaseSRWLockExclusive(&lock_sessions);
+
+	info("session %08x: connection broken: waiting to be resumed", session->token);
+
+	for (;;) {
+		ULONGLONG	now = GetTickCount64();
+		SOCKET	sockfd;
+		uint32_t	*seqnums;
+		int	n_seqnums;
+		BOOL	expired = FALSE;
+
+		/* stub reads in progress may complete during a wait */
+		if (now < deadline)
+			WaitForSingleObjectEx(session->hevt_resumed, (DWORD)(deadline - now), TRUE);
+
+		AcquireSRWLockExclusive(&lock_sessions);
+		sockfd = session->sockfd_resumed;
+		seqnums = session->seqnums;
+		n_seqnums = session->n_seqnums;
+		session->sockfd_resumed = INVALID_SOCKET;
+		session->seqnums = NULL;
+		if (sockfd == INVALID_SOCKET && GetTickCount64() >= deadline) {
+			/* no more OP_REQ_RESUME can find a session */
+			list_del(&session->list);
+			session->listed = FALSE;
+			expired = TRUE;
+		}
+		ReleaseSRWLockExclusive(&lock_sessions);
+
+		if (expired) {
+			info("session %08x: not resumed", session->token);
+			return INVALID_SOCKET;
+		}
+		if (sockfd == INVALID_SOCKET)
+			continue;
+
+		if (usbip_journal_resume_server(journal, sockfd, seqnums, n_seqnums) == 0) {
+			free(seqnums);
+			usbip_net_set_nodelay(sockfd);
+			usbip_net_set_dead_timeout(sockfd, USBIP_RESUME_DEAD_TIMEOUT);
+
+			AcquireSRWLockExclusive(&lock_sessions);
+			session->sockfd = sockfd;
+			ReleaseSRWLockExclusive(&lock_sessions);
+			info("session %08x: resumed", session->token);
+			return sockfd;
+		}
+		free(seqnums);
+		closesocket(sockfd);
+	}
+}
+
+static session_t *
+create_session(SOCKET sockfd)
+{
+	session_t	*session;
+
+	session = (session_t *)calloc(1, sizeof(session_t));
+	if (session == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	session->sockfd = sockfd;
+	session->sockfd_resumed = INVALID_SOCKET;
+	session->hevt_resumed = CreateEvent(NULL, FALSE, FALSE, NULL);
+	session->resume.journal = usbip_journal_create(FALSE);
+	if (session->hevt_resumed == NULL || session->resume.journal == NULL) {
+		err("%s: failed to create session", __FUNCTION__);
+		free_session(session);
+		return NULL;
+	}
+	session->resume.reconnect = reconnect_session;
+	session->resume.ctx = session;
+
+	AcquireSRWLockExclusive(&lock_sessions);
+	do {
+		unsigned int	token;
+
+		if (rand_s(&token) != 0) {
+			ReleaseSRWLockExclusive(&lock_sessions);
+			err("%s: failed to generate token", __FUNCTION__);
+			free_session(session);
+			return NULL;
+		}
+		session->token = token;
+	} while (session->token == 0 || find_session(session->token) != NULL);
+	list_add(&session->list, sessions.prev);
+	session->listed = TRUE;
+	ReleaseSRWLockExclusive(&lock_sessions);
+
+	return session;
+}
+
+static BOOL
+add_export_dev(forwarder_ctx_t *pctx, devno_t devno, const char *busid, struct usbip_usb_device *pudev)
+{
+	usbip_mux_dev_t	*dev = pctx->devs + pctx->n_devs;
+
+	dev->hdev = open_stub_dev(devno);
+	if (dev->hdev == INVALID_HANDLE_VALUE) {
+		err("export_device: cannot open devno: %hhu", devno);
+		return FALSE;
+	}
+	/* an exported device disappears from OP_REP_DEVLIST */
+	invalidate_devlist();
+	dev->devid = pudev->busnum << 16 | pudev->devnum;
+	/* NULL unless metrics are enabled */
+	dev->stats = register_metrics(busid);
+	dev->capring = usbip_capture_add_ring(usbipd_capture);
+	pctx->n_devs++;
+	return TRUE;
+}
+
+static void
+free_forwarder_ctx(forwarder_ctx_t *pctx)
+{
+	int	i;
+
+	for (i = 0; i < pctx->n_devs; i++) {
+		CloseHandle(pctx->devs[i].hdev);
+		unregister_metrics(pctx->devs[i].stats);
+		usbip_capture_del_ring(pctx->devs[i].capring);
+	}
+	/* released devices are exportable again */
+	if (pctx->n_devs > 0)
+		invalidate_devlist();
+	if (pctx->session != NULL)
+		free_session(pctx->session);
+	free(pctx);
+}
+
 static VOID
 forwarder_stub(PTP_CALLBACK_INSTANCE inst, PVOID ctx, PTP_WORK work)
 {
 	forwarder_ctx_t	*pctx = (forwarder_ctx_t *)ctx;
+	session_t	*session = pctx->session;
 
 	dbg("stub forwarding started");
 
-	usbip_forward((HANDLE)pctx->sockfd, pctx->hdev, TRUE);
+	if (pctx->mux)
+		usbip_forward_mux(pctx->sockfd, pctx->devs, pctx->n_devs, TRUE);
+	else
+		usbip_forward((HANDLE)pctx->sockfd, pctx->devs[0].hdev, TRUE, pctx->devs[0].stats, pctx->devs[0].capring,
+			      session ? &session->resume: NULL);
 
-	closesocket(pctx->sockfd);
-	CloseHandle(pctx->hdev);
-	free(pctx);
+	if (session != NULL) {
+		/* a resumed session may have another connection */
+		unlist_session(session);
+		if (session->sockfd != INVALID_SOCKET)
+			closesocket(session->sockfd);
+	}
+	else
+		closesocket(pctx->sockfd);
+	free_forwarder_ctx(pctx);
 
 	CloseThreadpoolWork(work);
 
@@ -29,83 +256,244 @@ forwarder_stub(PTP_CALLBACK_INSTANCE inst, PVOID ctx, PTP_WORK work)
 }
 
 static int
-export_device(devno_t devno, SOCKET sockfd)
+export_devices(forwarder_ctx_t *pctx)
 {
 	PTP_WORK	work;
-	forwarder_ctx_t	*pctx;
 
-	pctx = (forwarder_ctx_t *)malloc(sizeof(forwarder_ctx_t));
-	if (pctx == NULL) {
-		err("export_device: out of memory");
-		return -1;
-	}
-	pctx->hdev = open_stub_dev(devno);
-	if (pctx->hdev == INVALID_HANDLE_VALUE) {
-		err("export_device: cannot open devno: %hhu", devno);
-		return -1;
-	}
-	pctx->sockfd = sockfd;
+	/* should set TCP_NODELAY for usbip */
+	usbip_net_set_nodelay(pctx->sockfd);
+	/* handshake timeout should not apply to forwarding */
+	usbip_net_set_timeout(pctx->sockfd, 0);
+	/* a broken connection of a resumable session should be found out soon */
+	if (pctx->session != NULL)
+		usbip_net_set_dead_timeout(pctx->sockfd, USBIP_RESUME_DEAD_TIMEOUT);
 
 	work = CreateThreadpoolWork(forwarder_stub, pctx, NULL);
 	if (work == NULL) {
 		err("export_device: thread pool error: %lx", GetLastError());
-		CloseHandle(pctx->hdev);
-		free(pctx);
+		return -1;
 	}
 	SubmitThreadpoolWork(work);
 	return 0;
 }
 
-int
-recv_request_import(SOCKET sockfd)
+static int
+send_reply_import(SOCKET sockfd, struct usbip_usb_device *pudev, uint32_t ext_flags, unsigned char *dsc_conf, unsigned len_conf,
+		  uint32_t token)
 {
-	struct op_import_request req;
-	struct usbip_usb_device	udev;
-	devno_t	devno;
-	int rc;
+	int	rc;
 
-	memset(&req, 0, sizeof(req));
+	rc = usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_OK);
+	if (rc < 0) {
+		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
+		return -1;
+	}
+
+	if (ext_flags != 0)
+		usbip_net_set_import_ext(pudev->busid, ext_flags);
+	usbip_net_pack_usb_device(1, pudev);
 
-	rc = usbip_net_recv(sockfd, &req, sizeof(req));
+	rc = usbip_net_send(sockfd, pudev, sizeof(*pudev));
 	if (rc < 0) {
-		dbg("usbip_net_recv failed: import request");
+		dbg("usbip_net_send failed: devinfo");
 		return -1;
 	}
-	PACK_OP_IMPORT_REQUEST(0, &req);
 
-	devno = get_devno_from_busid(req.busid);
+	if (ext_flags & USBIP_IMPORT_EXT_CONF_DESC) {
+		uint32_t	len = htonl(len_conf);
+
+		if (usbip_net_send(sockfd, &len, sizeof(len)) < 0 || usbip_net_send(sockfd, dsc_conf, len_conf) < 0) {
+			dbg("usbip_net_send failed: configuration descriptor");
+			return -1;
+		}
+	}
+	if (ext_flags & USBIP_IMPORT_EXT_RESUME) {
+		token = htonl(token);
+		if (usbip_net_send(sockfd, &token, sizeof(token)) < 0) {
+			dbg("usbip_net_send failed: session token");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A stub device of a request is opened and a reply is sent.
+ * Returns 1 if a request is rejected with ST_NA, -1 if a connection cannot go on.
+ */
+static int
+import_device(forwarder_ctx_t *pctx, struct op_import_request *req)
+{
+	struct usbip_usb_device	udev;
+	unsigned char	*dsc_conf = NULL;
+	unsigned	len_conf = 0;
+	uint32_t	ext_flags;
+	devno_t	devno;
+	int	rc;
+
+	devno = get_devno_from_busid(req->busid);
 	if (devno == 0) {
-		err("invalid bus id: %s", req.busid);
+		err("invalid bus id: %s", req->busid);
+		goto err_na;
+	}
+	if (pctx->n_devs == USBIP_MUX_MAX_DEVS) {
+		err("too many devices in a connection: %s", req->busid);
+		goto err_na;
+	}
+
+	/* only supported extensions are honored */
+	ext_flags = usbip_net_get_import_ext(req->busid) & (USBIP_IMPORT_EXT_CONF_DESC | USBIP_IMPORT_EXT_MUX | USBIP_IMPORT_EXT_RESUME |
+								      USBIP_IMPORT_EXT_UNLINK_BATCH);
+	if (ext_flags & USBIP_IMPORT_EXT_MUX)
+		ext_flags &= ~USBIP_IMPORT_EXT_RESUME;
+
+	/* A stub device cannot be queried once it is opened exclusively for forwarding */
+	if (!build_udev(devno, &udev, (ext_flags & USBIP_IMPORT_EXT_CONF_DESC) ? &dsc_conf: NULL, &len_conf))
+		goto err_na;
+	if (dsc_conf == NULL)
+		ext_flags &= ~USBIP_IMPORT_EXT_CONF_DESC;
+
+	if (!add_export_dev(pctx, devno, req->busid, &udev)) {
+		err("failed to export device: %s", req->busid);
+		free(dsc_conf);
+		goto err_na;
+	}
+	/* importing goes on without resume if a session cannot be created */
+	if (ext_flags & USBIP_IMPORT_EXT_RESUME) {
+		pctx->session = create_session(pctx->sockfd);
+		if (pctx->session == NULL)
+			ext_flags &= ~USBIP_IMPORT_EXT_RESUME;
+	}
+
+	rc = send_reply_import(pctx->sockfd, &udev, ext_flags, dsc_conf, len_conf, pctx->session ? pctx->session->token: 0);
+	free(dsc_conf);
+	if (rc < 0)
+		return -1;
+
+	dbg("import request busid %s: complete", req->busid);
+	return 0;
+err_na:
+	if (usbip_net_send_op_common(pctx->sockfd, OP_REP_IMPORT, ST_NA) < 0)
+		return -1;
+	return 1;
+}
+
+static int
+recv_import_request(SOCKET sockfd, struct op_import_request *req)
+{
+	memset(req, 0, sizeof(*req));
+	if (usbip_net_recv(sockfd, req, sizeof(*req)) < 0) {
+		dbg("usbip_net_recv failed: import request");
 		return -1;
 	}
+	PACK_OP_IMPORT_REQUEST(0, req);
+	return 0;
+}
 
-	/* should set TCP_NODELAY for usbip */
-	usbip_net_set_nodelay(sockfd);
+/* more requests follow on a connection until one of an empty busid */
+static int
+import_devices_mux(forwarder_ctx_t *pctx, struct op_import_request *req)
+{
+	pctx->mux = TRUE;
+	while (req->busid[0] != '\0') {
+		uint16_t	code = OP_REQ_IMPORT;
 
-	/* export device needs a TCP/IP socket descriptor */
-	rc = export_device(devno, sockfd);
-	if (rc < 0) {
-		err("failed to export device: %s, err:%d", req.busid, rc);
-		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NA);
+		if (import_device(pctx, req) < 0)
+			return -1;
+		if (usbip_net_recv_op_common(pctx->sockfd, &code) < 0 || recv_import_request(pctx->sockfd, req) < 0) {
+			dbg("failed to receive next import request");
+			return -1;
+		}
+	}
+	if (pctx->n_devs == 0)
+		return -1;
+	info("%d devices multiplexed", pctx->n_devs);
+	return 0;
+}
+
+int
+recv_request_import(SOCKET sockfd)
+{
+	struct op_import_request req;
+	forwarder_ctx_t	*pctx;
+	int	rc;
+
+	if (recv_import_request(sockfd, &req) < 0)
+		return -1;
+
+	pctx = (forwarder_ctx_t *)calloc(1, sizeof(forwarder_ctx_t));
+	if (pctx == NULL) {
+		err("recv_request_import: out of memory");
 		return -1;
 	}
+	pctx->sockfd = sockfd;
 
-	rc = usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_OK);
-	if (rc < 0) {
-		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
+	if (usbip_net_get_import_ext(req.busid) & USBIP_IMPORT_EXT_MUX)
+		rc = import_devices_mux(pctx, &req);
+	else
+		rc = import_device(pctx, &req) == 0 ? 0: -1;
+	if (rc < 0 || export_devices(pctx) < 0) {
+		free_forwarder_ctx(pctx);
 		return -1;
 	}
+	return 0;
+}
 
-	build_udev(devno, &udev);
-	usbip_net_pack_usb_device(1, &udev);
+/* A new connection of OP_REQ_RESUME is handed over to a forwarder thread of a session */
+int
+recv_request_resume(SOCKET sockfd)
+{
+	struct op_resume_request	req;
+	uint32_t	*seqnums;
+	session_t	*session;
+	uint32_t	i;
 
-	rc = usbip_net_send(sockfd, &udev, sizeof(udev));
-	if (rc < 0) {
-		dbg("usbip_net_send failed: devinfo");
+	if (usbip_net_recv(sockfd, &req, sizeof(req)) < 0) {
+		dbg("usbip_net_recv failed: resume request");
+		return -1;
+	}
+	PACK_OP_RESUME_REQUEST(0, &req);
+	if (req.n_seqnums > USBIP_RESUME_MAX_SEQNUMS) {
+		err("too many seqnums to resume: %u", req.n_seqnums);
+		return -1;
+	}
+	seqnums = (uint32_t *)malloc(sizeof(uint32_t) * (req.n_seqnums + 1));
+	if (seqnums == NULL) {
+		err("recv_request_resume: out of memory");
+		return -1;
+	}
+	if (usbip_net_recv(sockfd, seqnums, sizeof(uint32_t) * req.n_seqnums) < 0) {
+		dbg("usbip_net_recv failed: seqnums");
+		free(seqnums);
 		return -1;
 	}
+	for (i = 0; i < req.n_seqnums; i++)
+		seqnums[i] = ntohl(seqnums[i]);
 
-	dbg("import request busid %s: complete", req.busid);
+	AcquireSRWLockExclusive(&lock_sessions);
+	session = find_session(req.token);
+	if (session != NULL) {
+		/* the latest connection of a client wins */
+		if (session->sockfd_resumed != INVALID_SOCKET)
+			closesocket(session->sockfd_resumed);
+		free(session->seqnums);
+		session->sockfd_resumed = sockfd;
+		session->seqnums = seqnums;
+		session->n_seqnums = (int)req.n_seqnums;
+		/* An old connection may look alive until a peer gives up on it */
+		if (session->sockfd != INVALID_SOCKET) {
+			session->resume.abandoned = TRUE;
+			CancelIoEx((HANDLE)session->sockfd, NULL);
+		}
+		SetEvent(session->hevt_resumed);
+	}
+	ReleaseSRWLockExclusive(&lock_sessions);
 
+	if (session == NULL) {
+		err("no session to resume: %08x", req.token);
+		free(seqnums);
+		usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_NA);
+		return -1;
+	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,72 +1,81 @@
 #include "usbipd.h"
 
+#include <cfgmgr32.h>
+
 #include "usbip_network.h"
+#include "usbip_stub_api.h"
 #include "usbipd_stub.h"
 
+/*
+ * OP_REP_DEVLIST is served from a cached buffer, which is already packed in network byte order.
+ * Arrival or removal of any usb device invalidates the cache because devno of an exported device
+ * depends on the enumeration order of all usb devices. The buffer is rebuilt once on the next request.
+ * If notifications are not available, the buffer is rebuilt for every request.
+ * Exporting or releasing a device changes its entry without any notification, so
+ * the forwarder side calls invalidate_devlist().
+ */
+
+typedef struct {
+	LONG	refcnt;
+	int	len;
+	char	data[1];
+} devlist_buf_t;
+
 typedef struct {
 	struct usbip_usb_device	udev;
 	struct list_head	list;
+	/* as many as udev.bNumInterfaces, which a client relies on */
+	struct usbip_usb_interface	uinfs[1];
 } edev_t;
 
-static int
-send_reply_devlist_devices(SOCKET connfd, struct list_head *pedev_list)
-{
-	struct list_head	*p;
-
-	list_for_each(p, pedev_list) {
-		edev_t	*edev;
-		int	rc;
+/* GUID_DEVINTERFACE_USB_DEVICE */
+static const GUID	guid_usb_device =
+	{ 0xa5dcbf10, 0x6530, 0x11d2, { 0x90, 0x1f, 0x00, 0xc0, 0x4f, 0xb9, 0x51, 0xed } };
 
-		edev = list_entry(p, edev_t, list);
-		dump_usb_device(&edev->udev);
-		usbip_net_pack_usb_device(1, &edev->udev);
-
-		rc = usbip_net_send(connfd, &edev->udev, sizeof(edev->udev));
-		if (rc < 0) {
-			dbg("usbip_net_send failed: udev");
-			return -1;
-		}
-		/* usb interface count is always zero */
-	}
-	return 0;
-}
+static CRITICAL_SECTION	lock_devlist;
+static devlist_buf_t	*devlist_cached;
+static volatile LONG	devlist_dirty = TRUE;
+static BOOL	devlist_notified;
+static HCMNOTIFICATION	hnotis[2];
 
 typedef struct {
 	struct list_head	*head;
 	int	n_edevs;
+	int	n_uinfs;
 } edev_list_ctx_t;
 
-static int
-walker_edev_list(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t devno, void *ctx)
+static void
+walker_edev_list(struct usbip_usb_device *pudev, const unsigned char *dsc_conf, unsigned len, void *ctx)
 {
 	edev_t	*edev;
 	edev_list_ctx_t	*pctx = (edev_list_ctx_t *)ctx;
 
-	edev = (edev_t *)malloc(sizeof(edev_t));
+	edev = (edev_t *)malloc(sizeof(edev_t) + sizeof(struct usbip_usb_interface) * pudev->bNumInterfaces);
 	if (edev == NULL) {
 		err("%s: out of memory", __FUNCTION__);
-		return 0;
-	}
-	if (!build_udev(devno, &edev->udev)) {
-		err("%s: cannot build usbip dev", __FUNCTION__);
-		free(edev);
-		return 0;
+		return;
 	}
+	memcpy(&edev->udev, pudev, sizeof(struct usbip_usb_device));
+	memset(edev->uinfs, 0, sizeof(struct usbip_usb_interface) * pudev->bNumInterfaces);
+	if (dsc_conf != NULL)
+		usbip_get_conf_interfaces(dsc_conf, len, edev->uinfs, pudev->bNumInterfaces);
 	list_add(&edev->list, pctx->head->prev);
 	pctx->n_edevs++;
-	return 0;
+	pctx->n_uinfs += pudev->bNumInterfaces;
 }
 
 static void
-get_edev_list(struct list_head *head, int *pn_edevs)
+get_edev_list(struct list_head *head, int *pn_edevs, int *pn_uinfs)
 {
 	edev_list_ctx_t	ctx;
 
 	INIT_LIST_HEAD(head);
 	ctx.head = head;
 	ctx.n_edevs = 0;
-	traverse_usbdevs(walker_edev_list, TRUE, &ctx);
+	ctx.n_uinfs = 0;
+	walk_udevs(walker_edev_list, &ctx);
 	*pn_edevs = ctx.n_edevs;
+	*pn_uinfs = ctx.n_uinfs;
 }
 
 static void
@@ -83,40 +92,185 @@ free_edev_list(struct list_head *head)
 	}
 }
 
-static int
-send_reply_devlist(SOCKET connfd)
+static devlist_buf_t *
+build_devlist_buf(void)
 {
-	struct op_devlist_reply		reply;
-	struct list_head	edev_list;
-	int	n_edevs;
-	int	rc;
+	devlist_buf_t	*buf;
+	struct op_common	*op_common;
+	struct op_devlist_reply	*reply;
+	char	*pos;
+	struct list_head	edev_list, *p;
+	int	n_edevs, n_uinfs;
 
-	get_edev_list(&edev_list, &n_edevs);
+	get_edev_list(&edev_list, &n_edevs, &n_uinfs);
 	info("exportable devices: %d", n_edevs);
 
-	reply.ndev = n_edevs;
-
-	rc = usbip_net_send_op_common(connfd, OP_REP_DEVLIST, ST_OK);
-	if (rc < 0) {
-		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_DEVLIST);
+	buf = (devlist_buf_t *)malloc(sizeof(devlist_buf_t) + sizeof(struct op_common) + sizeof(struct op_devlist_reply) +
+		sizeof(struct usbip_usb_device) * n_edevs + sizeof(struct usbip_usb_interface) * n_uinfs);
+	if (buf == NULL) {
+		err("%s: out of memory", __FUNCTION__);
 		free_edev_list(&edev_list);
-		return -1;
+		return NULL;
 	}
-	PACK_OP_DEVLIST_REPLY(1, &reply);
+	buf->refcnt = 1;
 
-	rc = usbip_net_send(connfd, &reply, sizeof(reply));
-	if (rc < 0) {
-		dbg("usbip_net_send failed: %#0x", OP_REP_DEVLIST);
-		free_edev_list(&edev_list);
-		return -1;
+	op_common = (struct op_common *)buf->data;
+	op_common->version = USBIP_VERSION;
+	op_common->code = OP_REP_DEVLIST;
+	op_common->status = ST_OK;
+	PACK_OP_COMMON(1, op_common);
+
+	reply = (struct op_devlist_reply *)(op_common + 1);
+	reply->ndev = n_edevs;
+	PACK_OP_DEVLIST_REPLY(1, reply);
+
+	pos = (char *)(reply + 1);
+	list_for_each(p, &edev_list) {
+		edev_t	*edev;
+		struct usbip_usb_device	*pudev;
+		int	i;
+
+		edev = list_entry(p, edev_t, list);
+		dump_usb_device(&edev->udev);
+		pudev = (struct usbip_usb_device *)pos;
+		memcpy(pudev, &edev->udev, sizeof(struct usbip_usb_device));
+		usbip_net_pack_usb_device(1, pudev);
+		pos += sizeof(struct usbip_usb_device);
+
+		/* interface records save a client from fetching a configuration descriptor */
+		for (i = 0; i < edev->udev.bNumInterfaces; i++) {
+			struct usbip_usb_interface	*puinf = (struct usbip_usb_interface *)pos;
+
+			dump_usb_interface(&edev->uinfs[i]);
+			memcpy(puinf, &edev->uinfs[i], sizeof(struct usbip_usb_interface));
+			usbip_net_pack_usb_interface(1, puinf);
+			pos += sizeof(struct usbip_usb_interface);
+		}
 	}
+	buf->len = (int)(pos - buf->data);
 
-	if (send_reply_devlist_devices(connfd, &edev_list) < 0) {
-		free_edev_list(&edev_list);
+	free_edev_list(&edev_list);
+	return buf;
+}
+
+static void
+unref_devlist_buf(devlist_buf_t *buf)
+{
+	if (buf != NULL && InterlockedDecrement(&buf->refcnt) == 0)
+		free(buf);
+}
+
+static devlist_buf_t *
+get_devlist_buf(void)
+{
+	devlist_buf_t	*buf;
+
+	EnterCriticalSection(&lock_devlist);
+
+	/* A notification during rebuild makes the cache dirty again */
+	if (InterlockedExchange(&devlist_dirty, FALSE) || !devlist_notified || devlist_cached == NULL) {
+		buf = build_devlist_buf();
+		if (buf != NULL) {
+			unref_devlist_buf(devlist_cached);
+			devlist_cached = buf;
+		}
+		else {
+			InterlockedExchange(&devlist_dirty, TRUE);
+		}
+	}
+	buf = devlist_cached;
+	if (buf != NULL)
+		InterlockedIncrement(&buf->refcnt);
+
+	LeaveCriticalSection(&lock_devlist);
+
+	return buf;
+}
+
+void
+invalidate_devlist(void)
+{
+	InterlockedExchange(&devlist_dirty, TRUE);
+	invalidate_stub_devs();
+}
+
+static DWORD CALLBACK
+on_devlist_changed(HCMNOTIFICATION hnoti, PVOID ctx, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA data, DWORD len)
+{
+	if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+		dbg("device list changed");
+		invalidate_devlist();
+	}
+	return ERROR_SUCCESS;
+}
+
+static BOOL
+register_devlist_noti(LPCGUID pguid, HCMNOTIFICATION *phnoti)
+{
+	CM_NOTIFY_FILTER	filter;
+	CONFIGRET	cret;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.cbSize = sizeof(filter);
+	filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	filter.u.DeviceInterface.ClassGuid = *pguid;
+
+	cret = CM_Register_Notification(&filter, NULL, on_devlist_changed, phnoti);
+	if (cret != CR_SUCCESS) {
+		err("%s: failed to register notification: cret: %lx", __FUNCTION__, cret);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void
+init_devlist(void)
+{
+	InitializeCriticalSection(&lock_devlist);
+
+	/* Any usb device may shift devno's. A stub interface appears without a new usb device. */
+	if (!register_devlist_noti(&guid_usb_device, &hnotis[0]))
+		return;
+	if (!register_devlist_noti(&GUID_DEVINTERFACE_STUB_USBIP, &hnotis[1])) {
+		CM_Unregister_Notification(hnotis[0]);
+		return;
+	}
+	devlist_notified = TRUE;
+	set_stub_devs_notified(TRUE);
+}
+
+void
+cleanup_devlist(void)
+{
+	if (devlist_notified) {
+		CM_Unregister_Notification(hnotis[0]);
+		CM_Unregister_Notification(hnotis[1]);
+		devlist_notified = FALSE;
+		set_stub_devs_notified(FALSE);
+	}
+	unref_devlist_buf(devlist_cached);
+	devlist_cached = NULL;
+	DeleteCriticalSection(&lock_devlist);
+}
+
+static int
+send_reply_devlist(SOCKET connfd)
+{
+	devlist_buf_t	*buf;
+	int	rc;
+
+	buf = get_devlist_buf();
+	if (buf == NULL) {
+		usbip_net_send_op_common(connfd, OP_REP_DEVLIST, ST_NA);
 		return -1;
 	}
 
-	free_edev_list(&edev_list);
+	rc = usbip_net_send(connfd, buf->data, buf->len);
+	unref_devlist_buf(buf);
+	if (rc < 0) {
+		dbg("usbip_net_send failed: %#0x", OP_REP_DEVLIST);
+		return -1;
+	}
 	return 0;
 }
 
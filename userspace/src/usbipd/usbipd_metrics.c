@@ -0,0 +1,341 @@
+#include "usbipd.h"
+
+#include <ws2tcpip.h>
+#include <stdarg.h>
+
+#include "list.h"
+#include "usbip_network.h"
+#include "usbip_stats.h"
+
+/*
+ * Metrics in Prometheus text format are served over plain HTTP on a loopback port.
+ * Forwarders update their own stats without locking. lock_metrics only protects
+ * the list of forwarders against registration while a scrape is in progress.
+ */
+
+#define METRICS_TIMEOUT	2000	/* msec */
+
+typedef struct {
+	char	busid[USBIP_BUS_ID_SIZE];
+	usbip_stats_t	*stats;
+	struct list_head	list;
+} metrics_dev_t;
+
+typedef struct {
+	char	*buf;
+	int	len, size;
+} textbuf_t;
+
+static LIST_HEAD(metrics_devs);
+static SRWLOCK	lock_metrics = SRWLOCK_INIT;
+static int	n_metrics_devs;
+
+static BOOL	metrics_enabled;
+static SOCKET	metrics_sockfd = INVALID_SOCKET;
+static HANDLE	hthread_metrics;
+
+usbip_stats_t *
+register_metrics(const char *busid)
+{
+	metrics_dev_t	*mdev;
+
+	if (!metrics_enabled)
+		return NULL;
+
+	mdev = (metrics_dev_t *)malloc(sizeof(metrics_dev_t));
+	if (mdev == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	mdev->stats = usbip_stats_create();
+	if (mdev->stats == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		free(mdev);
+		return NULL;
+	}
+	strncpy_s(mdev->busid, USBIP_BUS_ID_SIZE, busid, _TRUNCATE);
+
+	AcquireSRWLockExclusive(&lock_metrics);
+	list_add(&mdev->list, metrics_devs.prev);
+	n_metrics_devs++;
+	ReleaseSRWLockExclusive(&lock_metrics);
+
+	return mdev->stats;
+}
+
+void
+unregister_metrics(usbip_stats_t *stats)
+{
+	struct list_head	*p;
+
+	if (stats == NULL)
+		return;
+
+	AcquireSRWLockExclusive(&lock_metrics);
+	list_for_each(p, &metrics_devs) {
+		metrics_dev_t	*mdev = list_entry(p, metrics_dev_t, list);
+
+		if (mdev->stats == stats) {
+			list_del(&mdev->list);
+			n_metrics_devs--;
+			usbip_stats_free(mdev->stats);
+			free(mdev);
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_metrics);
+}
+
+static void
+tb_printf(textbuf_t *tb, const char *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+
+	if (tb->len + len + 1 > tb->size) {
+		int	size = tb->size ? tb->size * 2: 4096;
+		char	*buf;
+
+		while (size < tb->len + len + 1)
+			size *= 2;
+		buf = (char *)realloc(tb->buf, size);
+		if (buf == NULL)
+			return;
+		tb->buf = buf;
+		tb->size = size;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(tb->buf + tb->len, tb->size - tb->len, fmt, ap);
+	va_end(ap);
+	tb->len += len;
+}
+
+/*
+ * Log-linear buckets are too fine for a scraper.
+ * Only buckets ending at a power of 2 are exported as cumulative counts.
+ */
+static void
+build_metrics_hist_ep(textbuf_t *tb, metrics_dev_t *mdev, int ep_idx)
+{
+	const usbip_hist_t	*hist = &mdev->stats->lat[ep_idx];
+	char	labels[128];
+	LONG64	cumulative = 0;
+	int	i;
+
+	snprintf(labels, sizeof(labels), "busid=\"%s\",ep=\"0x%02x\",type=\"%s\"", mdev->busid,
+		(ep_idx & 0xf) | ((ep_idx & 0x10) ? 0x80: 0), usbip_xfer_type_name(mdev->stats->ep_types[ep_idx] - 1));
+
+	for (i = 0; i < USBIP_HIST_BUCKETS - 1; i++) {
+		unsigned long long	upper = usbip_hist_bucket_us(i);
+
+		cumulative += hist->buckets[i];
+		if (((upper + 1) & upper) == 0)
+			tb_printf(tb, "usbip_ret_submit_latency_seconds_bucket{%s,le=\"%g\"} %lld\n", labels, (upper + 1) / 1e6, cumulative);
+	}
+	cumulative += hist->buckets[i];
+	tb_printf(tb, "usbip_ret_submit_latency_seconds_bucket{%s,le=\"+Inf\"} %lld\n", labels, cumulative);
+	tb_printf(tb, "usbip_ret_submit_latency_seconds_sum{%s} %g\n", labels, hist->sum_us / 1e6);
+	tb_printf(tb, "usbip_ret_submit_latency_seconds_count{%s} %lld\n", labels, cumulative);
+}
+
+static void
+build_metrics_hist(textbuf_t *tb)
+{
+	struct list_head	*p;
+	metrics_dev_t	*mdev;
+	int	i;
+
+	tb_printf(tb, "# HELP usbip_ret_submit_latency_seconds Time from CMD_SUBMIT to RET_SUBMIT by endpoint.\n");
+	tb_printf(tb, "# TYPE usbip_ret_submit_latency_seconds histogram\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		for (i = 0; i < USBIP_STATS_EPS; i++) {
+			if (mdev->stats->ep_types[i] != 0)
+				build_metrics_hist_ep(tb, mdev, i);
+		}
+	}
+}
+
+static void
+build_metrics(textbuf_t *tb)
+{
+	struct list_head	*p;
+	metrics_dev_t	*mdev;
+	int	i;
+
+	AcquireSRWLockShared(&lock_metrics);
+
+	tb_printf(tb, "# HELP usbip_connections Devices being forwarded.\n");
+	tb_printf(tb, "# TYPE usbip_connections gauge\n");
+	tb_printf(tb, "usbip_connections %d\n", n_metrics_devs);
+
+	tb_printf(tb, "# HELP usbip_cmd_submit_total CMD_SUBMIT PDUs by transfer type.\n");
+	tb_printf(tb, "# TYPE usbip_cmd_submit_total counter\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		for (i = 0; i < USBIP_XFER_TYPES; i++)
+			tb_printf(tb, "usbip_cmd_submit_total{busid=\"%s\",type=\"%s\"} %lld\n",
+				mdev->busid, usbip_xfer_type_name(i), mdev->stats->n_cmd_submits[i]);
+	}
+	tb_printf(tb, "# HELP usbip_ret_submit_total RET_SUBMIT PDUs by transfer type.\n");
+	tb_printf(tb, "# TYPE usbip_ret_submit_total counter\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		for (i = 0; i < USBIP_XFER_TYPES; i++)
+			tb_printf(tb, "usbip_ret_submit_total{busid=\"%s\",type=\"%s\"} %lld\n",
+				mdev->busid, usbip_xfer_type_name(i), mdev->stats->n_ret_submits[i]);
+	}
+	tb_printf(tb, "# HELP usbip_cmd_unlink_total CMD_UNLINK PDUs.\n");
+	tb_printf(tb, "# TYPE usbip_cmd_unlink_total counter\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		tb_printf(tb, "usbip_cmd_unlink_total{busid=\"%s\"} %lld\n", mdev->busid, mdev->stats->n_cmd_unlinks);
+	}
+
+	tb_printf(tb, "# HELP usbip_transfer_bytes_total Transferred data bytes. in is device to host.\n");
+	tb_printf(tb, "# TYPE usbip_transfer_bytes_total counter\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		tb_printf(tb, "usbip_transfer_bytes_total{busid=\"%s\",direction=\"in\"} %lld\n", mdev->busid, mdev->stats->bytes_in);
+		tb_printf(tb, "usbip_transfer_bytes_total{busid=\"%s\",direction=\"out\"} %lld\n", mdev->busid, mdev->stats->bytes_out);
+	}
+	tb_printf(tb, "# HELP usbip_inflight_urbs URBs submitted but not yet returned.\n");
+	tb_printf(tb, "# TYPE usbip_inflight_urbs gauge\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		tb_printf(tb, "usbip_inflight_urbs{busid=\"%s\"} %ld\n", mdev->busid, mdev->stats->n_inflight);
+	}
+
+	tb_printf(tb, "# HELP usbip_forward_buffer_max_bytes High water mark of forwarder buffers.\n");
+	tb_printf(tb, "# TYPE usbip_forward_buffer_max_bytes gauge\n");
+	list_for_each(p, &metrics_devs) {
+		mdev = list_entry(p, metrics_dev_t, list);
+		tb_printf(tb, "usbip_forward_buffer_max_bytes{busid=\"%s\",queue=\"request\"} %ld\n", mdev->busid, mdev->stats->hwm_buf_req);
+		tb_printf(tb, "usbip_forward_buffer_max_bytes{busid=\"%s\",queue=\"reply\"} %ld\n", mdev->busid, mdev->stats->hwm_buf_rep);
+	}
+
+	build_metrics_hist(tb);
+
+	ReleaseSRWLockShared(&lock_metrics);
+}
+
+void
+dump_metrics(void)
+{
+	struct list_head	*p;
+
+	AcquireSRWLockShared(&lock_metrics);
+	list_for_each(p, &metrics_devs) {
+		metrics_dev_t	*mdev = list_entry(p, metrics_dev_t, list);
+
+		printf("busid %s:\n", mdev->busid);
+		usbip_stats_dump(mdev->stats, stdout);
+	}
+	ReleaseSRWLockShared(&lock_metrics);
+}
+
+static void
+serve_metrics(SOCKET connfd)
+{
+	textbuf_t	tb = { NULL, 0, 0 };
+	char	req[1024], hdr[256];
+	int	len;
+
+	usbip_net_set_timeout(connfd, METRICS_TIMEOUT);
+
+	/* Any request gets metrics. A request is read just not to reset the connection. */
+	if (recv(connfd, req, sizeof(req), 0) <= 0)
+		return;
+
+	build_metrics(&tb);
+	if (tb.buf == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return;
+	}
+
+	len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", tb.len);
+	if (usbip_net_send(connfd, hdr, len) >= 0)
+		usbip_net_send(connfd, tb.buf, tb.len);
+	free(tb.buf);
+}
+
+static DWORD WINAPI
+metrics_thread(LPVOID ctx)
+{
+	while (TRUE) {
+		SOCKET	connfd;
+
+		connfd = accept(metrics_sockfd, NULL, NULL);
+		if (connfd == INVALID_SOCKET)
+			break;
+		serve_metrics(connfd);
+		closesocket(connfd);
+	}
+	return 0;
+}
+
+BOOL
+init_metrics(const char *port)
+{
+	struct sockaddr_in	sin;
+	unsigned long	portnum;
+	char	*end;
+
+	portnum = strtoul(port, &end, 10);
+	if (end == port || *end != '\0' || portnum == 0 || portnum > UINT16_MAX) {
+		err("invalid metrics port: %s", port);
+		return FALSE;
+	}
+
+	metrics_sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (metrics_sockfd == INVALID_SOCKET) {
+		err("%s: socket error: %d", __FUNCTION__, WSAGetLastError());
+		return FALSE;
+	}
+	usbip_net_set_reuseaddr(metrics_sockfd);
+
+	/* metrics are exposed only to a local scraper */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons((u_short)portnum);
+	if (bind(metrics_sockfd, (struct sockaddr *)&sin, sizeof(sin)) == SOCKET_ERROR ||
+		listen(metrics_sockfd, SOMAXCONN) == SOCKET_ERROR) {
+		err("%s: failed to listen on port %lu: err: %d", __FUNCTION__, portnum, WSAGetLastError());
+		closesocket(metrics_sockfd);
+		metrics_sockfd = INVALID_SOCKET;
+		return FALSE;
+	}
+
+	hthread_metrics = CreateThread(NULL, 0, metrics_thread, NULL, 0, NULL);
+	if (hthread_metrics == NULL) {
+		err("%s: failed to create thread: err: %lx", __FUNCTION__, GetLastError());
+		closesocket(metrics_sockfd);
+		metrics_sockfd = INVALID_SOCKET;
+		return FALSE;
+	}
+	metrics_enabled = TRUE;
+	info("serving metrics on 127.0.0.1:%lu", portnum);
+	return TRUE;
+}
+
+void
+cleanup_metrics(void)
+{
+	if (!metrics_enabled)
+		return;
+
+	/* closing a listening socket makes accept fail */
+	closesocket(metrics_sockfd);
+	WaitForSingleObject(hthread_metrics, INFINITE);
+	CloseHandle(hthread_metrics);
+	metrics_sockfd = INVALID_SOCKET;
+	metrics_enabled = FALSE;
+}
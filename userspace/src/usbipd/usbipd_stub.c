@@ -10,171 +10,375 @@
 #include "usbip_common.h"
 #include "usbip_stub_api.h"
 #include "usbip_setupdi.h"
+#include "usbipd_stub.h"
 
 #include <winsock2.h>
 #include <stdlib.h>
 
-typedef struct {
-	const char	*id_inst;
-	char	*devpath;
-} devpath_ctx_t;
-
-static int
-walker_devpath(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t devno, void *ctx)
+static BOOL
+get_devinfo(HANDLE hdev, ioctl_usbip_stub_devinfo_t *devinfo)
 {
-	devpath_ctx_t	*pctx = (devpath_ctx_t *)ctx;
-	PSP_DEVICE_INTERFACE_DETAIL_DATA	pdetail;
-	char	*id_inst;
+	DWORD	len;
 
-	id_inst = get_id_inst(dev_info, pdev_info_data);
-	if (id_inst == NULL)
-		return 0;
-	if (strcmp(id_inst, pctx->id_inst) != 0) {
-		free(id_inst);
-		return 0;
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_GET_DEVINFO, NULL, 0, devinfo, sizeof(ioctl_usbip_stub_devinfo_t), &len, NULL)) {
+		err("get_devinfo: DeviceIoControl failed: err: 0x%lx", GetLastError());
+		return FALSE;
 	}
-	free(id_inst);
-
-	pdetail = get_intf_detail(dev_info, pdev_info_data, &GUID_DEVINTERFACE_STUB_USBIP);
-	if (pdetail == NULL) {
-		return 0;
+	if (len != sizeof(ioctl_usbip_stub_devinfo_t)) {
+		err("get_devinfo: DeviceIoControl failed: invalid size: len: %d", len);
+		return FALSE;
 	}
-	pctx->devpath = _strdup(pdetail->DevicePath);
-	free(pdetail);
-	return -1;
+
+	return TRUE;
 }
 
-static char *
-get_device_path(const char *id_inst)
+/*
+ * Read a configuration descriptor with its interfaces and endpoints.
+ * The header is read first to get wTotalLength.
+ */
+static unsigned char *
+get_conf_desc(HANDLE hdev, unsigned *plen)
 {
-	devpath_ctx_t	devpath_ctx;
-	int rc;
+	unsigned char	dsc_hdr[9];
+	unsigned char	*dsc;
+	unsigned	total_len;
+	DWORD	len;
 
-	devpath_ctx.id_inst = id_inst;
-	rc = traverse_intfdevs(walker_devpath, &GUID_DEVINTERFACE_STUB_USBIP, &devpath_ctx);
-	if (rc != -1) {
-		err("%s: traverse_intfdevs failed, returned: %d", __FUNCTION__, rc);
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_GET_CONF_DESC, NULL, 0, dsc_hdr, sizeof(dsc_hdr), &len, NULL)) {
+		err("get_conf_desc: DeviceIoControl failed: err: 0x%lx", GetLastError());
+		return NULL;
+	}
+	/* wTotalLength */
+	total_len = dsc_hdr[2] | (dsc_hdr[3] << 8);
+	if (len < sizeof(dsc_hdr) || total_len < sizeof(dsc_hdr)) {
+		err("get_conf_desc: invalid size: len: %d", len);
 		return NULL;
 	}
 
-	return devpath_ctx.devpath;
+	dsc = (unsigned char *)malloc(total_len);
+	if (dsc == NULL) {
+		err("get_conf_desc: out of memory");
+		return NULL;
+	}
+	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_GET_CONF_DESC, NULL, 0, dsc, total_len, &len, NULL)) {
+		err("get_conf_desc: DeviceIoControl failed: err: 0x%lx", GetLastError());
+		free(dsc);
+		return NULL;
+	}
+	*plen = len;
+	return dsc;
 }
 
+/*
+ * If pdsc_conf is not NULL, a configuration descriptor is returned, which should be freed by a caller.
+ * *pdsc_conf is set to NULL if it is not available.
+ * Returns FALSE if a device cannot be opened, for example while it is exported.
+ */
 static BOOL
-get_devinfo(const char *devpath, ioctl_usbip_stub_devinfo_t *devinfo)
+fill_udev(devno_t devno, const char *devpath, struct usbip_usb_device *pudev, unsigned char **pdsc_conf, unsigned *plen)
 {
+	ioctl_usbip_stub_devinfo_t	Devinfo;
 	HANDLE	hdev;
-	DWORD	len;
+	unsigned char	*dsc_conf = NULL;
+	unsigned	len = 0;
+	BOOL	opened = FALSE;
+
+	memset(pudev, 0, sizeof(struct usbip_usb_device));
+
+	pudev->busnum = 1;
+	pudev->devnum = (int)devno;
+	snprintf(pudev->path, USBIP_DEV_PATH_MAX, devpath);
+	snprintf(pudev->busid, USBIP_BUS_ID_SIZE, "1-%hhu", devno);
 
 	hdev = CreateFile(devpath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
 	if (hdev == INVALID_HANDLE_VALUE) {
-		err("get_devinfo: cannot open device: %s", devpath);
-		return FALSE;
+		err("fill_udev: cannot open device: %s", devpath);
 	}
-	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_GET_DEVINFO, NULL, 0, devinfo, sizeof(ioctl_usbip_stub_devinfo_t), &len, NULL)) {
-		err("get_devinfo: DeviceIoControl failed: err: 0x%lx", GetLastError());
+	else {
+		opened = TRUE;
+		if (get_devinfo(hdev, &Devinfo)) {
+			pudev->idVendor = Devinfo.vendor;
+			pudev->idProduct = Devinfo.product;
+			pudev->speed = Devinfo.speed;
+			pudev->bDeviceClass = Devinfo.class;
+			pudev->bDeviceSubClass = Devinfo.subclass;
+			pudev->bDeviceProtocol = Devinfo.protocol;
+		}
+		dsc_conf = get_conf_desc(hdev, &len);
 		CloseHandle(hdev);
-		return FALSE;
 	}
-	CloseHandle(hdev);
 
-	if (len != sizeof(ioctl_usbip_stub_devinfo_t)) {
-		err("get_devinfo: DeviceIoControl failed: invalid size: len: %d", len);
-		return FALSE;
+	if (dsc_conf != NULL) {
+		/* bNumInterfaces, bConfigurationValue */
+		pudev->bNumInterfaces = dsc_conf[4];
+		pudev->bConfigurationValue = dsc_conf[5];
 	}
-
-	return TRUE;
+	if (pdsc_conf != NULL) {
+		*pdsc_conf = dsc_conf;
+		*plen = len;
+	}
+	else {
+		free(dsc_conf);
+	}
+	return opened;
 }
 
+/*
+ * Index of exportable devices
+ *
+ * devno of a device depends on the enumeration order of all usb devices, and its stub interface
+ * path is found by an instance id. Both are collected by a single pass over stub interfaces and
+ * another over usb devices, rather than by enumerating all devices for every devno.
+ * devinfo and a configuration descriptor are kept once a device has been opened.
+ * An index is reused until a device change is notified. Without notifications, it is built
+ * again for every use.
+ */
 typedef struct {
 	devno_t	devno;
+	char	*devpath;
+	/* udev and dsc_conf are kept once a device has been opened */
+	BOOL	filled;
+	struct usbip_usb_device	udev;
+	unsigned char	*dsc_conf;
+	unsigned	len_conf;
+	struct list_head	list;
+} stub_dev_t;
+
+typedef struct {
+	char	*id_inst;
+	char	*devpath;
+} stub_intf_t;
+
+typedef struct {
+	stub_intf_t	*intfs;
+	int	n_intfs, n_max;
+} stub_intfs_t;
+
+static SRWLOCK	lock_stub_devs = SRWLOCK_INIT;
+/* in order of enumeration */
+static LIST_HEAD(stub_devs);
+static stub_dev_t	*stub_devs_by_devno[256];
+static BOOL	stub_devs_notified;
+static volatile LONG	stub_devs_dirty = TRUE;
+
+void
+set_stub_devs_notified(BOOL notified)
+{
+	stub_devs_notified = notified;
+	InterlockedExchange(&stub_devs_dirty, TRUE);
+}
+
+void
+invalidate_stub_devs(void)
+{
+	InterlockedExchange(&stub_devs_dirty, TRUE);
+}
+
+static int
+cmp_stub_intf(const void *a, const void *b)
+{
+	return strcmp(((const stub_intf_t *)a)->id_inst, ((const stub_intf_t *)b)->id_inst);
+}
+
+static int
+walker_stub_intfs(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t devno, void *ctx)
+{
+	stub_intfs_t	*intfs = (stub_intfs_t *)ctx;
+	PSP_DEVICE_INTERFACE_DETAIL_DATA	pdetail;
 	char	*id_inst;
-} get_id_inst_ctx_t;
+
+	if (intfs->n_intfs == intfs->n_max) {
+		int	n_max = intfs->n_max > 0 ? intfs->n_max * 2: 16;
+		stub_intf_t	*intfs_new;
+
+		intfs_new = (stub_intf_t *)realloc(intfs->intfs, sizeof(stub_intf_t) * n_max);
+		if (intfs_new == NULL) {
+			err("%s: out of memory", __FUNCTION__);
+			return 0;
+		}
+		intfs->intfs = intfs_new;
+		intfs->n_max = n_max;
+	}
+
+	id_inst = get_id_inst(dev_info, pdev_info_data);
+	if (id_inst == NULL)
+		return 0;
+	pdetail = get_intf_detail(dev_info, pdev_info_data, &GUID_DEVINTERFACE_STUB_USBIP);
+	if (pdetail == NULL) {
+		free(id_inst);
+		return 0;
+	}
+	intfs->intfs[intfs->n_intfs].id_inst = id_inst;
+	intfs->intfs[intfs->n_intfs].devpath = _strdup(pdetail->DevicePath);
+	intfs->n_intfs++;
+	free(pdetail);
+	return 0;
+}
 
 static int
-walker_get_id_inst(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t devno, void *ctx)
+walker_index_usbdevs(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, devno_t devno, void *ctx)
 {
-	get_id_inst_ctx_t	*pctx = (get_id_inst_ctx_t *)ctx;
+	stub_intfs_t	*intfs = (stub_intfs_t *)ctx;
+	stub_intf_t	key, *intf;
+	stub_dev_t	*sdev;
+
+	key.id_inst = get_id_inst(dev_info, pdev_info_data);
+	if (key.id_inst == NULL)
+		return 0;
+	intf = (stub_intf_t *)bsearch(&key, intfs->intfs, intfs->n_intfs, sizeof(stub_intf_t), cmp_stub_intf);
+	free(key.id_inst);
+	if (intf == NULL || intf->devpath == NULL)
+		return 0;
 
-	if (devno == pctx->devno) {
-		pctx->id_inst = get_id_inst(dev_info, pdev_info_data);
-		return -1;
+	sdev = (stub_dev_t *)calloc(1, sizeof(stub_dev_t));
+	if (sdev == NULL) {
+		err("%s: out of memory", __FUNCTION__);
+		return 0;
 	}
+	sdev->devno = devno;
+	/* taken over from an interface */
+	sdev->devpath = intf->devpath;
+	intf->devpath = NULL;
+	list_add(&sdev->list, stub_devs.prev);
+	stub_devs_by_devno[devno] = sdev;
 	return 0;
 }
 
-static char *
-get_devpath_from_devno(devno_t devno)
+static void
+free_stub_devs(void)
 {
-	get_id_inst_ctx_t	ctx;
-	char	*devpath;
-	int rc;
+	struct list_head	*p, *n;
 
-	ctx.devno = devno;
-	rc = traverse_usbdevs(walker_get_id_inst, TRUE, &ctx);
-	if (rc != -1) {
-		err("%s: traverse_usbdevs failed. traverse_usbdevs returned %d.", __FUNCTION__, rc);
-		return NULL;
+	list_for_each_safe(p, n, &stub_devs) {
+		stub_dev_t	*sdev = list_entry(p, stub_dev_t, list);
+
+		list_del(&sdev->list);
+		free(sdev->devpath);
+		free(sdev->dsc_conf);
+		free(sdev);
 	}
+	memset(stub_devs_by_devno, 0, sizeof(stub_devs_by_devno));
+}
+
+/* lock_stub_devs should be held exclusively */
+static void
+index_stub_devs(void)
+{
+	stub_intfs_t	intfs;
+	int	rc;
+	int	i;
 
-	devpath = get_device_path(ctx.id_inst);
-	free(ctx.id_inst);
+	/* A notification during indexing makes an index dirty again */
+	if (stub_devs_notified && !InterlockedExchange(&stub_devs_dirty, FALSE))
+		return;
 
-	return devpath;
+	free_stub_devs();
+
+	memset(&intfs, 0, sizeof(intfs));
+	rc = traverse_intfdevs(walker_stub_intfs, &GUID_DEVINTERFACE_STUB_USBIP, &intfs);
+	if (rc == 0 && intfs.n_intfs > 0) {
+		qsort(intfs.intfs, intfs.n_intfs, sizeof(stub_intf_t), cmp_stub_intf);
+		rc = traverse_usbdevs(walker_index_usbdevs, TRUE, &intfs);
+	}
+	if (rc != 0) {
+		err("%s: failed to enumerate devices: %d", __FUNCTION__, rc);
+		InterlockedExchange(&stub_devs_dirty, TRUE);
+	}
+
+	for (i = 0; i < intfs.n_intfs; i++) {
+		free(intfs.intfs[i].id_inst);
+		free(intfs.intfs[i].devpath);
+	}
+	free(intfs.intfs);
+}
+
+static void
+fill_stub_dev(stub_dev_t *sdev)
+{
+	if (sdev->filled)
+		return;
+	free(sdev->dsc_conf);
+	sdev->dsc_conf = NULL;
+	sdev->len_conf = 0;
+	/* An exported device is opened exclusively, and it will be filled on a next use */
+	sdev->filled = fill_udev(sdev->devno, sdev->devpath, &sdev->udev, &sdev->dsc_conf, &sdev->len_conf);
 }
 
 BOOL
-build_udev(devno_t devno, struct usbip_usb_device *pudev)
+build_udev(devno_t devno, struct usbip_usb_device *pudev, unsigned char **pdsc_conf, unsigned *plen)
 {
-	char	*devpath;
-	ioctl_usbip_stub_devinfo_t	Devinfo;
+	stub_dev_t	*sdev;
+
+	AcquireSRWLockExclusive(&lock_stub_devs);
+	index_stub_devs();
+	sdev = stub_devs_by_devno[devno];
+	if (sdev != NULL) {
+		fill_stub_dev(sdev);
+		memcpy(pudev, &sdev->udev, sizeof(struct usbip_usb_device));
+		if (pdsc_conf != NULL) {
+			*pdsc_conf = NULL;
+			*plen = 0;
+			if (sdev->dsc_conf != NULL) {
+				*pdsc_conf = (unsigned char *)malloc(sdev->len_conf);
+				if (*pdsc_conf != NULL) {
+					memcpy(*pdsc_conf, sdev->dsc_conf, sdev->len_conf);
+					*plen = sdev->len_conf;
+				}
+			}
+		}
+	}
+	ReleaseSRWLockExclusive(&lock_stub_devs);
 
-	devpath = get_devpath_from_devno(devno);
-	if (devpath == NULL) {
-		err("%s: invalid devno: %hhu. devpath returned %s", __FUNCTION__, devno, devpath);
+	if (sdev == NULL) {
+		err("%s: invalid devno: %hhu", __FUNCTION__, devno);
 		return FALSE;
 	}
+	return TRUE;
+}
 
-	memset(pudev, 0, sizeof(struct usbip_usb_device));
+/* Visit all exportable devices in order of enumeration */
+int
+walk_udevs(udev_walkfunc_t walker, void *ctx)
+{
+	struct list_head	*p;
 
-	pudev->busnum = 1;
-	pudev->devnum = (int)devno;
-	snprintf(pudev->path, USBIP_DEV_PATH_MAX, devpath);
-	snprintf(pudev->busid, USBIP_BUS_ID_SIZE, "1-%hhu", devno);
+	AcquireSRWLockExclusive(&lock_stub_devs);
+	index_stub_devs();
+	list_for_each(p, &stub_devs) {
+		stub_dev_t	*sdev = list_entry(p, stub_dev_t, list);
 
-	if (get_devinfo(devpath, &Devinfo)) {
-		pudev->idVendor = Devinfo.vendor;
-		pudev->idProduct = Devinfo.product;
-		pudev->speed = Devinfo.speed;
-		pudev->bDeviceClass = Devinfo.class;
-		pudev->bDeviceSubClass = Devinfo.subclass;
-		pudev->bDeviceProtocol = Devinfo.protocol;
+		fill_stub_dev(sdev);
+		walker(&sdev->udev, sdev->dsc_conf, sdev->len_conf, ctx);
 	}
-	free(devpath);
-
-	return TRUE;
+	ReleaseSRWLockExclusive(&lock_stub_devs);
+	return 0;
 }
 
 HANDLE
 open_stub_dev(devno_t devno)
 {
 	HANDLE	hdev;
-	char	*devpath;
+	char	*devpath = NULL;
 	DWORD	len;
 
-	devpath = get_devpath_from_devno(devno);
+	AcquireSRWLockExclusive(&lock_stub_devs);
+	index_stub_devs();
+	if (stub_devs_by_devno[devno] != NULL)
+		devpath = _strdup(stub_devs_by_devno[devno]->devpath);
+	ReleaseSRWLockExclusive(&lock_stub_devs);
+
 	if (devpath == NULL) {
 		err("%s: invalid devno: %hhu", __FUNCTION__, devno);
 		return INVALID_HANDLE_VALUE;
 	}
 
 	hdev = CreateFile(devpath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-	free(devpath);
-
 	if (hdev == INVALID_HANDLE_VALUE) {
 		err("%s: cannot open device: %s", __FUNCTION__, devpath);
+		free(devpath);
 		return INVALID_HANDLE_VALUE;
 	}
+	free(devpath);
 
 	if (!DeviceIoControl(hdev, IOCTL_USBIP_STUB_EXPORT, NULL, 0, NULL, 0, &len, NULL)) {
 		err("%s: DeviceIoControl failed: err: 0x%lx", __FUNCTION__, GetLastError());
@@ -30,5 +30,13 @@
 
 #include <winsock2.h>
 
-BOOL build_udev(devno_t devno, struct usbip_usb_device *pudev);
+/* dsc_conf is NULL if a configuration descriptor is not available */
+typedef void (*udev_walkfunc_t)(struct usbip_usb_device *pudev, const unsigned char *dsc_conf, unsigned len, void *ctx);
+
+BOOL build_udev(devno_t devno, struct usbip_usb_device *pudev, unsigned char **pdsc_conf, unsigned *plen);
+int walk_udevs(udev_walkfunc_t walker, void *ctx);
 HANDLE open_stub_dev(devno_t devno);
+
+/* Exportable devices are indexed until invalidate_stub_devs(), or for every use without notifications */
+void set_stub_devs_notified(BOOL notified);
+void invalidate_stub_devs(void);
@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+ * Device notifications which usbipd_list.c uses.
+ * They are implemented by mock_setupdi.c, where mock_notify_change() fires them.
+ */
+
+#include "windows.h"
+#include "guiddef.h"
+
+typedef DWORD	CONFIGRET;
+typedef void	*HCMNOTIFICATION;
+
+#define CR_SUCCESS		0
+#define CR_OUT_OF_MEMORY	2
+
+typedef enum _CM_NOTIFY_FILTER_TYPE {
+	CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE = 0,
+	CM_NOTIFY_FILTER_TYPE_DEVICEHANDLE,
+	CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE
+} CM_NOTIFY_FILTER_TYPE;
+
+typedef enum _CM_NOTIFY_ACTION {
+	CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL = 0,
+	CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL
+} CM_NOTIFY_ACTION;
+
+typedef struct _CM_NOTIFY_FILTER {
+	DWORD	cbSize;
+	DWORD	Flags;
+	CM_NOTIFY_FILTER_TYPE	FilterType;
+	DWORD	Reserved;
+	union {
+		struct {
+			GUID	ClassGuid;
+		} DeviceInterface;
+	} u;
+} CM_NOTIFY_FILTER, *PCM_NOTIFY_FILTER;
+
+typedef struct _CM_NOTIFY_EVENT_DATA {
+	CM_NOTIFY_FILTER_TYPE	FilterType;
+	DWORD	Reserved;
+} CM_NOTIFY_EVENT_DATA, *PCM_NOTIFY_EVENT_DATA;
+
+typedef DWORD (CALLBACK *PCM_NOTIFY_CALLBACK)(HCMNOTIFICATION hnoti, PVOID ctx, CM_NOTIFY_ACTION action,
+					      PCM_NOTIFY_EVENT_DATA data, DWORD len);
+
+CONFIGRET CM_Register_Notification(PCM_NOTIFY_FILTER pfilter, PVOID ctx, PCM_NOTIFY_CALLBACK callback,
+				   HCMNOTIFICATION *phnoti);
+CONFIGRET CM_Unregister_Notification(HCMNOTIFICATION hnoti);
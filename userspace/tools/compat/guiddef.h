@@ -0,0 +1,22 @@
+#pragma once
+
+#include "windows.h"
+
+typedef struct _GUID {
+	uint32_t	Data1;
+	uint16_t	Data2;
+	uint16_t	Data3;
+	uint8_t		Data4[8];
+} GUID;
+
+typedef const GUID	*LPCGUID;
+
+#ifdef INITGUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8)	\
+	const GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+#else
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8)	\
+	extern const GUID name
+#endif
+
+#define IsEqualGUID(a, b)	(memcmp((a), (b), sizeof(GUID)) == 0)
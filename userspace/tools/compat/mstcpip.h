@@ -0,0 +1,49 @@
+#pragma once
+
+/*
+ * SIO_KEEPALIVE_VALS and TCP_MAXRT in terms of linux socket options.
+ * Windows sends 10 keepalive probes, and TCP_MAXRT is in seconds.
+ */
+
+#include "winsock2.h"
+
+struct tcp_keepalive {
+	unsigned long	onoff;
+	unsigned long	keepalivetime;		/* msec */
+	unsigned long	keepaliveinterval;	/* msec */
+};
+
+#define SIO_KEEPALIVE_VALS	1
+#define TCP_MAXRT		(-1)
+
+static inline int
+WSAIoctl(SOCKET sockfd, DWORD code, void *in, DWORD len_in, void *out, DWORD len_out, DWORD *plen, void *ov, void *cr)
+{
+	struct tcp_keepalive	*ka = (struct tcp_keepalive *)in;
+	int	on = ka->onoff ? 1: 0;
+	int	idle = ka->keepalivetime / 1000, intvl = ka->keepaliveinterval / 1000, cnt = 10;
+
+	(void)code; (void)len_in; (void)out; (void)len_out; (void)plen; (void)ov; (void)cr;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0)
+		return -1;
+	if (!on)
+		return 0;
+	idle = idle > 0 ? idle: 1;
+	intvl = intvl > 0 ? intvl: 1;
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+	    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0)
+		return -1;
+	return setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+}
+
+static inline int
+compat_setsockopt(SOCKET sockfd, int level, int name, const void *val, socklen_t len)
+{
+	if (level == IPPROTO_TCP && name == TCP_MAXRT) {
+		unsigned int	msecs = *(const DWORD *)val * 1000;
+
+		return setsockopt(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &msecs, sizeof(msecs));
+	}
+	return setsockopt(sockfd, level, name, val, len);
+}
+#define setsockopt	compat_setsockopt
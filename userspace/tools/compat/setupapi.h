@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * SetupDi declarations which usbip_setupdi.c uses.
+ * They are implemented by mock_setupdi.c over a synthetic device tree.
+ */
+
+#include "windows.h"
+#include "guiddef.h"
+
+typedef void	*HDEVINFO;
+
+typedef struct _SP_DEVINFO_DATA {
+	DWORD	cbSize;
+	GUID	ClassGuid;
+	DWORD	DevInst;
+	uintptr_t	Reserved;
+} SP_DEVINFO_DATA, *PSP_DEVINFO_DATA;
+
+typedef struct _SP_DEVICE_INTERFACE_DATA {
+	DWORD	cbSize;
+	GUID	InterfaceClassGuid;
+	DWORD	Flags;
+	uintptr_t	Reserved;
+} SP_DEVICE_INTERFACE_DATA, *PSP_DEVICE_INTERFACE_DATA;
+
+typedef struct _SP_DEVICE_INTERFACE_DETAIL_DATA {
+	DWORD	cbSize;
+	char	DevicePath[1];
+} SP_DEVICE_INTERFACE_DETAIL_DATA, *PSP_DEVICE_INTERFACE_DETAIL_DATA;
+
+typedef struct _SP_CLASSINSTALL_HEADER {
+	DWORD	cbSize;
+	DWORD	InstallFunction;
+} SP_CLASSINSTALL_HEADER;
+
+typedef struct _SP_PROPCHANGE_PARAMS {
+	SP_CLASSINSTALL_HEADER	ClassInstallHeader;
+	DWORD	StateChange;
+	DWORD	Scope;
+	DWORD	HwProfile;
+} SP_PROPCHANGE_PARAMS;
+
+#define DIGCF_PRESENT		0x02
+#define DIGCF_ALLCLASSES	0x04
+#define DIGCF_DEVICEINTERFACE	0x10
+
+#define SPDRP_HARDWAREID	0x01
+#define SPDRP_UPPERFILTERS	0x11
+
+#define DIF_PROPERTYCHANGE	0x12
+#define DICS_ENABLE		1
+#define DICS_DISABLE		2
+#define DICS_FLAG_CONFIGSPECIFIC	2
+
+HDEVINFO SetupDiGetClassDevs(LPCGUID pguid, const char *enumerator, void *hwnd, DWORD flags);
+BOOL SetupDiEnumDeviceInfo(HDEVINFO dev_info, DWORD idx, PSP_DEVINFO_DATA pdev_info_data);
+BOOL SetupDiDestroyDeviceInfoList(HDEVINFO dev_info);
+BOOL SetupDiGetDeviceInstanceId(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, char *id, DWORD size, DWORD *preq);
+BOOL SetupDiGetDeviceRegistryProperty(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, DWORD prop, DWORD *ptype,
+				      PBYTE buf, DWORD size, DWORD *preq);
+BOOL SetupDiEnumDeviceInterfaces(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, LPCGUID pguid, DWORD idx,
+				 PSP_DEVICE_INTERFACE_DATA pintf_data);
+/* preq is a PDWORD, which usbip_setupdi.c passes as an unsigned long like windows does */
+BOOL SetupDiGetDeviceInterfaceDetail(HDEVINFO dev_info, PSP_DEVICE_INTERFACE_DATA pintf_data,
+				     PSP_DEVICE_INTERFACE_DETAIL_DATA pdetail, DWORD size, unsigned long *preq, PSP_DEVINFO_DATA pdev_info_data);
+BOOL SetupDiSetClassInstallParams(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, SP_CLASSINSTALL_HEADER *params, DWORD size);
+BOOL SetupDiCallClassInstaller(DWORD func, HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data);
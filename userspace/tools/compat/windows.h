@@ -0,0 +1,105 @@
+#pragma once
+
+/*
+ * Minimal windows.h for building the portable parts of userspace/lib on POSIX.
+ * Only what usbip_proto.h and usbip_network.c use is defined here, and below what usbip_setupdi.c
+ * and usbipd_stub.c use against the mocked device layer of usbip-enum-bench, what
+ * vhci_sched.c of the vhci driver uses for usbip-sched-bench, and what usbipd_accept.c and
+ * usbipd_list.c use for usbip-accept-bench.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+typedef uint8_t		UINT8;
+typedef uint16_t	UINT16;
+typedef uint32_t	UINT32;
+typedef int32_t		INT32;
+typedef uint32_t	DWORD;
+typedef int		BOOL;
+
+#ifndef TRUE
+#define TRUE	1
+#define FALSE	0
+#endif
+
+#define UNREFERENCED_PARAMETER(p)	(void)(p)
+
+typedef int32_t		LONG;
+typedef uint32_t	ULONG;
+typedef int64_t		LONGLONG;
+typedef uint64_t	ULONGLONG;
+typedef uint8_t		UCHAR;
+typedef uint8_t		BOOLEAN;
+typedef unsigned char	BYTE, *PBYTE;
+typedef void		*HANDLE;
+typedef void		VOID;
+typedef void		*PVOID;
+
+#define CALLBACK
+
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+
+#define ERROR_SUCCESS			0
+#define ERROR_INVALID_DATA		13
+#define ERROR_INSUFFICIENT_BUFFER	122
+#define ERROR_NO_MORE_ITEMS		259
+#define ERROR_FILE_NOT_FOUND		2
+#define ERROR_INVALID_FUNCTION		1
+
+#define GENERIC_READ		0x80000000
+#define GENERIC_WRITE		0x40000000
+#define OPEN_EXISTING		3
+#define FILE_FLAG_OVERLAPPED	0x40000000
+
+#define _strdup		strdup
+#define sscanf_s	sscanf
+
+typedef pthread_rwlock_t	SRWLOCK;
+
+#define SRWLOCK_INIT	PTHREAD_RWLOCK_INITIALIZER
+
+#define AcquireSRWLockExclusive(l)	pthread_rwlock_wrlock(l)
+#define ReleaseSRWLockExclusive(l)	pthread_rwlock_unlock(l)
+#define AcquireSRWLockShared(l)		pthread_rwlock_rdlock(l)
+#define ReleaseSRWLockShared(l)		pthread_rwlock_unlock(l)
+
+#define InterlockedExchange(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement(p)		__atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)		__atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+
+typedef pthread_mutex_t	CRITICAL_SECTION;
+
+#define InitializeCriticalSection(cs)	pthread_mutex_init((cs), NULL)
+#define DeleteCriticalSection(cs)	pthread_mutex_destroy(cs)
+#define EnterCriticalSection(cs)	pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs)	pthread_mutex_unlock(cs)
+
+/* a thread pool of windows over pthreads, implemented by compat_threadpool.c */
+typedef struct _TP_POOL		*PTP_POOL;
+typedef struct _TP_CALLBACK_INSTANCE	*PTP_CALLBACK_INSTANCE;
+typedef VOID (CALLBACK *PTP_SIMPLE_CALLBACK)(PTP_CALLBACK_INSTANCE inst, PVOID ctx);
+
+typedef struct _TP_CALLBACK_ENVIRON {
+	PTP_POOL	Pool;
+} TP_CALLBACK_ENVIRON, *PTP_CALLBACK_ENVIRON;
+
+#define InitializeThreadpoolEnvironment(pcbe)	((pcbe)->Pool = NULL)
+#define SetThreadpoolCallbackPool(pcbe, ptpp)	((pcbe)->Pool = (ptpp))
+#define DestroyThreadpoolEnvironment(pcbe)	((void)(pcbe))
+
+PTP_POOL CreateThreadpool(PVOID reserved);
+VOID SetThreadpoolThreadMaximum(PTP_POOL ptpp, DWORD max);
+BOOL SetThreadpoolThreadMinimum(PTP_POOL ptpp, DWORD min);
+VOID CloseThreadpool(PTP_POOL ptpp);
+BOOL TrySubmitThreadpoolCallback(PTP_SIMPLE_CALLBACK pfns, PVOID pv, PTP_CALLBACK_ENVIRON pcbe);
+
+/* implemented by a mocked device layer */
+DWORD GetLastError(void);
+void SetLastError(DWORD err);
+HANDLE CreateFile(const char *path, DWORD access, DWORD share, void *sa, DWORD disposition, DWORD flags, HANDLE htemplate);
+BOOL DeviceIoControl(HANDLE hdev, DWORD code, void *in, DWORD len_in, void *out, DWORD len_out, DWORD *plen, void *ov);
+BOOL CloseHandle(HANDLE h);
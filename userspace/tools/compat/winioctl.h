@@ -0,0 +1,10 @@
+#pragma once
+
+#include "windows.h"
+
+#define CTL_CODE(type, func, method, access)	\
+	(((type) << 16) | ((access) << 14) | ((func) << 2) | (method))
+
+#define FILE_DEVICE_UNKNOWN	0x22
+#define METHOD_BUFFERED		0
+#define FILE_READ_DATA		1
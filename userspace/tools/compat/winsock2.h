@@ -0,0 +1,15 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "windows.h"
+
+typedef int	SOCKET;
+
+#define INVALID_SOCKET	(-1)
+#define closesocket	close
@@ -0,0 +1,163 @@
+/*
+ * A private thread pool of windows over pthreads
+ *
+ * A pool starts a thread for a submitted callback if queued callbacks outnumber idle threads
+ * and the maximum is not reached, as windows does. Idle threads are kept until the pool is closed. CloseThreadpool()
+ * waits for callbacks in flight unlike windows, so that a caller may tear down what they use.
+ */
+
+#include <windows.h>
+
+typedef struct _tp_work {
+	PTP_SIMPLE_CALLBACK	pfns;
+	PVOID	pv;
+	struct _tp_work	*next;
+} tp_work_t;
+
+struct _TP_POOL {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond_work, cond_exit;
+	tp_work_t	*head, **ptail;
+	DWORD	n_max, n_threads, n_idle, n_queued;
+	BOOL	closing;
+};
+
+static void *
+tp_thread(void *arg)
+{
+	PTP_POOL	ptpp = (PTP_POOL)arg;
+
+	pthread_mutex_lock(&ptpp->lock);
+	for (;;) {
+		tp_work_t	*work;
+
+		while (ptpp->head == NULL && !ptpp->closing) {
+			ptpp->n_idle++;
+			pthread_cond_wait(&ptpp->cond_work, &ptpp->lock);
+			ptpp->n_idle--;
+		}
+		if (ptpp->head == NULL)
+			break;
+
+		work = ptpp->head;
+		ptpp->head = work->next;
+		ptpp->n_queued--;
+		if (ptpp->head == NULL)
+			ptpp->ptail = &ptpp->head;
+		pthread_mutex_unlock(&ptpp->lock);
+
+		work->pfns(NULL, work->pv);
+		free(work);
+
+		pthread_mutex_lock(&ptpp->lock);
+	}
+	ptpp->n_threads--;
+	pthread_cond_signal(&ptpp->cond_exit);
+	pthread_mutex_unlock(&ptpp->lock);
+	return NULL;
+}
+
+/* called with a lock held */
+static BOOL
+tp_start_thread(PTP_POOL ptpp)
+{
+	pthread_t	thread;
+	pthread_attr_t	attr;
+	int	ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, tp_thread, ptpp);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		SetLastError((DWORD)ret);
+		return FALSE;
+	}
+	ptpp->n_threads++;
+	return TRUE;
+}
+
+PTP_POOL
+CreateThreadpool(PVOID reserved)
+{
+	PTP_POOL	ptpp;
+
+	ptpp = (PTP_POOL)calloc(1, sizeof(*ptpp));
+	if (ptpp == NULL) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return NULL;
+	}
+	pthread_mutex_init(&ptpp->lock, NULL);
+	pthread_cond_init(&ptpp->cond_work, NULL);
+	pthread_cond_init(&ptpp->cond_exit, NULL);
+	ptpp->ptail = &ptpp->head;
+	/* the default maximum of windows */
+	ptpp->n_max = 512;
+	return ptpp;
+}
+
+VOID
+SetThreadpoolThreadMaximum(PTP_POOL ptpp, DWORD max)
+{
+	pthread_mutex_lock(&ptpp->lock);
+	ptpp->n_max = max;
+	pthread_mutex_unlock(&ptpp->lock);
+}
+
+BOOL
+SetThreadpoolThreadMinimum(PTP_POOL ptpp, DWORD min)
+{
+	BOOL	res = TRUE;
+
+	pthread_mutex_lock(&ptpp->lock);
+	while (res && ptpp->n_threads < min)
+		res = tp_start_thread(ptpp);
+	pthread_mutex_unlock(&ptpp->lock);
+	return res;
+}
+
+VOID
+CloseThreadpool(PTP_POOL ptpp)
+{
+	pthread_mutex_lock(&ptpp->lock);
+	ptpp->closing = TRUE;
+	pthread_cond_broadcast(&ptpp->cond_work);
+	while (ptpp->n_threads > 0)
+		pthread_cond_wait(&ptpp->cond_exit, &ptpp->lock);
+	pthread_mutex_unlock(&ptpp->lock);
+
+	pthread_cond_destroy(&ptpp->cond_exit);
+	pthread_cond_destroy(&ptpp->cond_work);
+	pthread_mutex_destroy(&ptpp->lock);
+	free(ptpp);
+}
+
+BOOL
+TrySubmitThreadpoolCallback(PTP_SIMPLE_CALLBACK pfns, PVOID pv, PTP_CALLBACK_ENVIRON pcbe)
+{
+	PTP_POOL	ptpp = pcbe->Pool;
+	tp_work_t	*work;
+
+	work = (tp_work_t *)malloc(sizeof(*work));
+	if (work == NULL) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+	work->pfns = pfns;
+	work->pv = pv;
+	work->next = NULL;
+
+	pthread_mutex_lock(&ptpp->lock);
+	if (ptpp->n_queued >= ptpp->n_idle && ptpp->n_threads < ptpp->n_max &&
+	    !tp_start_thread(ptpp) && ptpp->n_threads == 0) {
+		pthread_mutex_unlock(&ptpp->lock);
+		free(work);
+		return FALSE;
+	}
+	*ptpp->ptail = work;
+	ptpp->ptail = &work->next;
+	ptpp->n_queued++;
+	pthread_cond_signal(&ptpp->cond_work);
+	pthread_mutex_unlock(&ptpp->lock);
+	return TRUE;
+}
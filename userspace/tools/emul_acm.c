@@ -0,0 +1,191 @@
+/*
+ * CDC-ACM loopback
+ *
+ * Bytes written to the bulk OUT endpoint are read back from the bulk IN endpoint.
+ * An IN URB is parked until data arrives, and an OUT URB is parked while the FIFO is full.
+ * The notification endpoint never completes.
+ */
+
+#include <stdio.h>
+
+#include "usbip_emul.h"
+
+#define ACM_EP_DATA_IN	1
+#define ACM_EP_DATA_OUT	2
+#define ACM_EP_NOTIFY	3
+/* an OUT URB larger than this is still accepted into an empty FIFO */
+#define ACM_FIFO_SIZE	(64 * 1024)
+
+typedef struct {
+	unsigned char	*fifo;
+	uint32_t	len_alloc;
+	/* bytes from head to tail are buffered */
+	uint32_t	head, tail;
+	uint8_t		line_coding[7];
+} acm_t;
+
+static const uint8_t	dsc_dev[] = {
+	18, 1, 0x00, 0x02, 0x02, 0x00, 0x00, 64,
+	0x09, 0x12, 0x03, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t	dsc_conf[] = {
+	9, 2, 67, 0, 2, 1, 0, 0x80, 50,
+	/* communication interface: ACM, AT commands */
+	9, 4, 0, 0, 1, 0x02, 0x02, 0x01, 0,
+	5, 0x24, 0x00, 0x10, 0x01,
+	5, 0x24, 0x01, 0x00, 0x01,
+	4, 0x24, 0x02, 0x02,
+	5, 0x24, 0x06, 0, 1,
+	7, 5, 0x80 | ACM_EP_NOTIFY, 3, 8, 0, 16,
+	/* data interface */
+	9, 4, 1, 0, 2, 0x0a, 0x00, 0x00, 0,
+	7, 5, ACM_EP_DATA_OUT, 2, 64, 0, 0,
+	7, 5, 0x80 | ACM_EP_DATA_IN, 2, 64, 0, 0
+};
+
+static const char	*strings[] = { "usbip-win", "Emulated CDC-ACM Loopback" };
+
+/* 115200 bps, 1 stop bit, no parity, 8 data bits */
+static const uint8_t	line_coding_default[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 0, 8 };
+
+static BOOL
+put_fifo(acm_t *acm, emul_urb_t *urb)
+{
+	uint32_t	len = EMUL_URB_LEN(urb);
+	uint32_t	len_used = acm->tail - acm->head;
+
+	if (len_used > 0 && len_used + len > ACM_FIFO_SIZE)
+		return FALSE;
+	if (acm->head > 0) {
+		memmove(acm->fifo, acm->fifo + acm->head, len_used);
+		acm->head = 0;
+		acm->tail = len_used;
+	}
+	if (acm->tail + len > acm->len_alloc) {
+		unsigned char	*fifo = (unsigned char *)realloc(acm->fifo, acm->tail + len);
+
+		if (fifo == NULL)
+			return FALSE;
+		acm->fifo = fifo;
+		acm->len_alloc = acm->tail + len;
+	}
+	memcpy(acm->fifo + acm->tail, urb->buf, len);
+	acm->tail += len;
+	urb->actual_length = len;
+	return TRUE;
+}
+
+static BOOL
+get_fifo(acm_t *acm, emul_urb_t *urb)
+{
+	if (acm->head == acm->tail)
+		return FALSE;
+	emul_urb_set_data(urb, acm->fifo + acm->head, acm->tail - acm->head);
+	acm->head += urb->actual_length;
+	return TRUE;
+}
+
+/* move data while any parked URB can progress */
+static void
+kick_fifo(emul_dev_t *dev, uint64_t now)
+{
+	acm_t	*acm = (acm_t *)dev->priv;
+	BOOL	progress = TRUE;
+
+	while (progress) {
+		emul_urb_t	*urb;
+
+		progress = FALSE;
+		urb = emul_take_parked(dev, ACM_EP_DATA_IN, TRUE);
+		if (urb != NULL) {
+			if (get_fifo(acm, urb)) {
+				emul_schedule(dev, urb, now + dev->latency_us);
+				progress = TRUE;
+			}
+			else
+				emul_park(dev, urb);
+		}
+		urb = emul_take_parked(dev, ACM_EP_DATA_OUT, FALSE);
+		if (urb != NULL) {
+			if (put_fifo(acm, urb)) {
+				emul_schedule(dev, urb, now + dev->latency_us);
+				progress = TRUE;
+			}
+			else
+				emul_park(dev, urb);
+		}
+	}
+}
+
+static void
+acm_submit(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	if (EMUL_URB_EP(urb) == ACM_EP_NOTIFY && EMUL_URB_IS_IN(urb)) {
+		emul_park(dev, urb);
+		return;
+	}
+	if ((EMUL_URB_EP(urb) == ACM_EP_DATA_IN && EMUL_URB_IS_IN(urb)) ||
+	    (EMUL_URB_EP(urb) == ACM_EP_DATA_OUT && !EMUL_URB_IS_IN(urb))) {
+		/* parked URBs go first to keep the order of an endpoint */
+		emul_park(dev, urb);
+		kick_fifo(dev, now);
+		return;
+	}
+	urb->status = -USBIP_EPIPE;
+	emul_schedule(dev, urb, now + dev->latency_us);
+}
+
+static BOOL
+acm_control(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup)
+{
+	acm_t	*acm = (acm_t *)dev->priv;
+
+	switch ((setup[0] << 8) | setup[1]) {
+	case 0x2120:	/* SET_LINE_CODING */
+		if (EMUL_URB_LEN(urb) < sizeof(acm->line_coding))
+			return FALSE;
+		memcpy(acm->line_coding, urb->buf, sizeof(acm->line_coding));
+		urb->actual_length = sizeof(acm->line_coding);
+		return TRUE;
+	case 0xa121:	/* GET_LINE_CODING */
+		emul_urb_set_data(urb, acm->line_coding, sizeof(acm->line_coding));
+		return TRUE;
+	case 0x2122:	/* SET_CONTROL_LINE_STATE */
+	case 0x2123:	/* SEND_BREAK */
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+acm_reset(emul_dev_t *dev)
+{
+	acm_t	*acm = (acm_t *)dev->priv;
+
+	acm->head = acm->tail = 0;
+	memcpy(acm->line_coding, line_coding_default, sizeof(acm->line_coding));
+}
+
+static int
+acm_init(emul_dev_t *dev, const char *arg)
+{
+	acm_t	*acm;
+
+	UNREFERENCED_PARAMETER(arg);
+
+	acm = (acm_t *)calloc(1, sizeof(acm_t));
+	if (acm == NULL)
+		return -1;
+	dev->priv = acm;
+	dev->dsc_dev = dsc_dev;
+	dev->dsc_conf = dsc_conf;
+	dev->strings = strings;
+	dev->n_strings = 2;
+	return 0;
+}
+
+const emul_dev_ops_t	emul_acm_ops = {
+	"acm", acm_init, acm_reset, acm_control, acm_submit
+};
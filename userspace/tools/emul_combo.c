@@ -0,0 +1,178 @@
+/*
+ * Composite device of a HID mouse and a bulk source and sink
+ *
+ * Interface 0 reports on an interrupt IN endpoint at a configurable rate like emul_hid, and
+ * interface 1 takes bulk OUT data and returns bulk IN data at once like emul_zero. Interrupt
+ * URBs queued behind bulk ones show how a host schedules endpoints of a single device.
+ */
+
+#include <stdio.h>
+
+#include "usbip_emul.h"
+
+#define COMBO_EP_INTR	1
+#define COMBO_EP_OUT	2
+#define COMBO_EP_IN	3
+#define COMBO_REPORT_LEN	4
+
+typedef struct {
+	uint8_t		dsc_conf[57];
+	/* report period in microseconds */
+	uint64_t	period_us;
+	uint64_t	next_report_us;
+	unsigned	n_reports;
+} combo_t;
+
+static const uint8_t	dsc_dev[] = {
+	18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+	0x09, 0x12, 0x06, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t	dsc_report[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+	0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+	0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38,
+	0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+	0xc0, 0xc0
+};
+
+static const uint8_t	dsc_hid[] = {
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22, sizeof(dsc_report), 0
+};
+
+static const uint8_t	dsc_conf_head[] = {
+	9, 2, 57, 0, 2, 1, 0, 0xa0, 50,
+	/* interface 0: HID, boot, mouse */
+	9, 4, 0, 0, 1, 0x03, 0x01, 0x02, 0
+};
+
+static const uint8_t	dsc_conf_tail[] = {
+	/* interface 1: vendor specific bulk source and sink */
+	9, 4, 1, 0, 2, 0xff, 0x00, 0x00, 0,
+	7, 5, COMBO_EP_OUT, 2, 0x00, 0x02, 0,
+	7, 5, 0x80 | COMBO_EP_IN, 2, 0x00, 0x02, 0
+};
+
+static const char	*strings[] = { "usbip-win", "Emulated Composite Device" };
+
+static void
+combo_submit_intr(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	combo_t	*combo = (combo_t *)dev->priv;
+	uint8_t	report[COMBO_REPORT_LEN];
+	uint64_t	slot, due;
+
+	/* a host polling late gets a report at once, not a burst of missed ones */
+	slot = combo->next_report_us > now ? combo->next_report_us: now;
+	combo->next_report_us = slot + combo->period_us;
+	due = slot > now + dev->latency_us ? slot: now + dev->latency_us;
+
+	memset(report, 0, sizeof(report));
+	report[1] = (uint8_t)(combo->n_reports & 1 ? 1: -1);
+	combo->n_reports++;
+	emul_urb_set_data(urb, report, COMBO_REPORT_LEN);
+	emul_schedule(dev, urb, due);
+}
+
+static void
+combo_submit(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	if (EMUL_URB_EP(urb) == COMBO_EP_INTR && EMUL_URB_IS_IN(urb)) {
+		combo_submit_intr(dev, urb, now);
+		return;
+	}
+	if ((EMUL_URB_EP(urb) == COMBO_EP_IN && EMUL_URB_IS_IN(urb)) ||
+	    (EMUL_URB_EP(urb) == COMBO_EP_OUT && !EMUL_URB_IS_IN(urb)))
+		urb->actual_length = EMUL_URB_LEN(urb);
+	else
+		urb->status = -USBIP_EPIPE;
+	emul_schedule(dev, urb, now + dev->latency_us);
+}
+
+static BOOL
+combo_control(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup)
+{
+	static const uint8_t	idle = 0, protocol = 1;
+
+	UNREFERENCED_PARAMETER(dev);
+
+	switch ((setup[0] << 8) | setup[1]) {
+	case 0x8106:	/* GET_DESCRIPTOR of an interface */
+		if (setup[3] == 0x22)
+			emul_urb_set_data(urb, dsc_report, sizeof(dsc_report));
+		else if (setup[3] == 0x21)
+			emul_urb_set_data(urb, dsc_hid, sizeof(dsc_hid));
+		else
+			return FALSE;
+		return TRUE;
+	case 0xa102:	/* GET_IDLE */
+		emul_urb_set_data(urb, &idle, 1);
+		return TRUE;
+	case 0xa103:	/* GET_PROTOCOL */
+		emul_urb_set_data(urb, &protocol, 1);
+		return TRUE;
+	case 0x210a:	/* SET_IDLE */
+	case 0x210b:	/* SET_PROTOCOL */
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+combo_reset(emul_dev_t *dev)
+{
+	combo_t	*combo = (combo_t *)dev->priv;
+
+	combo->next_report_us = 0;
+	combo->n_reports = 0;
+}
+
+static int
+combo_init(emul_dev_t *dev, const char *arg)
+{
+	combo_t	*combo;
+	unsigned	hz = 1000;
+	uint8_t	*dsc, interval;
+
+	if (arg != NULL && (sscanf(arg, "%u", &hz) != 1 || hz == 0 || hz > 8000)) {
+		err("combo: invalid report rate: %s", arg);
+		return -1;
+	}
+	combo = (combo_t *)calloc(1, sizeof(combo_t));
+	if (combo == NULL)
+		return -1;
+	combo->period_us = 1000000 / hz;
+
+	/* bInterval of a high speed interrupt endpoint is 2^(n-1) microframes */
+	for (interval = 1; interval < 16 && (125u << interval) <= combo->period_us; interval++)
+		;
+	dsc = combo->dsc_conf;
+	memcpy(dsc, dsc_conf_head, sizeof(dsc_conf_head));
+	dsc += sizeof(dsc_conf_head);
+	memcpy(dsc, dsc_hid, sizeof(dsc_hid));
+	dsc += sizeof(dsc_hid);
+	dsc[0] = 7;
+	dsc[1] = 5;
+	dsc[2] = 0x80 | COMBO_EP_INTR;
+	dsc[3] = 3;
+	dsc[4] = COMBO_REPORT_LEN;
+	dsc[5] = 0;
+	dsc[6] = interval;
+	dsc += 7;
+	memcpy(dsc, dsc_conf_tail, sizeof(dsc_conf_tail));
+
+	/* 512-byte bulk packets */
+	dev->speed = USB_SPEED_HIGH;
+	dev->priv = combo;
+	dev->dsc_dev = dsc_dev;
+	dev->dsc_conf = combo->dsc_conf;
+	dev->strings = strings;
+	dev->n_strings = 2;
+	return 0;
+}
+
+const emul_dev_ops_t	emul_combo_ops = {
+	"combo", combo_init, combo_reset, combo_control, combo_submit
+};
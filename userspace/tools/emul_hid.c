@@ -0,0 +1,177 @@
+/*
+ * HID boot mouse reporting at a configurable rate
+ *
+ * An interrupt IN URB completes at the next report slot. The pointer keeps drawing a square
+ * so that reports differ from each other.
+ */
+
+#include <stdio.h>
+
+#include "usbip_emul.h"
+
+#define HID_EP_IN	1
+#define HID_REPORT_LEN	4
+#define HID_SQUARE_STEPS	50
+
+typedef struct {
+	uint8_t		dsc_conf[34];
+	/* report period in microseconds */
+	uint64_t	period_us;
+	uint64_t	next_report_us;
+	unsigned	n_reports;
+} hid_t;
+
+static const uint8_t	dsc_dev[] = {
+	18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+	0x09, 0x12, 0x02, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+/* buttons 1-3, X, Y and wheel */
+static const uint8_t	dsc_report[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+	0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+	0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38,
+	0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+	0xc0, 0xc0
+};
+
+static const uint8_t	dsc_hid[] = {
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22, sizeof(dsc_report), 0
+};
+
+static const uint8_t	dsc_conf_head[] = {
+	9, 2, 34, 0, 1, 1, 0, 0xa0, 50,
+	/* interface: HID, boot, mouse */
+	9, 4, 0, 0, 1, 0x03, 0x01, 0x02, 0
+};
+
+static const char	*strings[] = { "usbip-win", "Emulated HID Mouse" };
+
+static void
+get_report(hid_t *hid, uint8_t *report)
+{
+	static const int8_t	dirs[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+	int	side = (hid->n_reports / HID_SQUARE_STEPS) % 4;
+
+	report[0] = 0;
+	report[1] = (uint8_t)dirs[side][0];
+	report[2] = (uint8_t)dirs[side][1];
+	report[3] = 0;
+}
+
+static void
+hid_submit(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	hid_t	*hid = (hid_t *)dev->priv;
+	uint8_t	report[HID_REPORT_LEN];
+	uint64_t	slot, due;
+
+	if (EMUL_URB_EP(urb) != HID_EP_IN || !EMUL_URB_IS_IN(urb)) {
+		urb->status = -USBIP_EPIPE;
+		emul_schedule(dev, urb, now + dev->latency_us);
+		return;
+	}
+
+	/* a host polling late gets a report at once, not a burst of missed ones */
+	slot = hid->next_report_us > now ? hid->next_report_us: now;
+	hid->next_report_us = slot + hid->period_us;
+	due = slot > now + dev->latency_us ? slot: now + dev->latency_us;
+
+	get_report(hid, report);
+	hid->n_reports++;
+	emul_urb_set_data(urb, report, HID_REPORT_LEN);
+	emul_schedule(dev, urb, due);
+}
+
+static BOOL
+hid_control(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup)
+{
+	hid_t	*hid = (hid_t *)dev->priv;
+	uint8_t	report[HID_REPORT_LEN];
+	static const uint8_t	idle = 0, protocol = 1;
+
+	switch ((setup[0] << 8) | setup[1]) {
+	case 0x8106:	/* GET_DESCRIPTOR of an interface */
+		if (setup[3] == 0x22)
+			emul_urb_set_data(urb, dsc_report, sizeof(dsc_report));
+		else if (setup[3] == 0x21)
+			emul_urb_set_data(urb, dsc_hid, sizeof(dsc_hid));
+		else
+			return FALSE;
+		return TRUE;
+	case 0xa101:	/* GET_REPORT */
+		get_report(hid, report);
+		emul_urb_set_data(urb, report, HID_REPORT_LEN);
+		return TRUE;
+	case 0xa102:	/* GET_IDLE */
+		emul_urb_set_data(urb, &idle, 1);
+		return TRUE;
+	case 0xa103:	/* GET_PROTOCOL */
+		emul_urb_set_data(urb, &protocol, 1);
+		return TRUE;
+	case 0x2109:	/* SET_REPORT */
+	case 0x210a:	/* SET_IDLE */
+	case 0x210b:	/* SET_PROTOCOL */
+		urb->actual_length = EMUL_URB_LEN(urb);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+hid_reset(emul_dev_t *dev)
+{
+	hid_t	*hid = (hid_t *)dev->priv;
+
+	hid->next_report_us = 0;
+	hid->n_reports = 0;
+}
+
+static int
+hid_init(emul_dev_t *dev, const char *arg)
+{
+	hid_t	*hid;
+	unsigned	hz = 125, interval;
+	uint8_t	*dsc;
+
+	if (arg != NULL && (sscanf(arg, "%u", &hz) != 1 || hz == 0 || hz > 1000)) {
+		err("hid: invalid report rate: %s", arg);
+		return -1;
+	}
+	hid = (hid_t *)calloc(1, sizeof(hid_t));
+	if (hid == NULL)
+		return -1;
+	hid->period_us = 1000000 / hz;
+
+	/* bInterval of a full speed interrupt endpoint is in milliseconds */
+	interval = 1000 / hz;
+	if (interval == 0)
+		interval = 1;
+	if (interval > 255)
+		interval = 255;
+	dsc = hid->dsc_conf;
+	memcpy(dsc, dsc_conf_head, sizeof(dsc_conf_head));
+	dsc += sizeof(dsc_conf_head);
+	memcpy(dsc, dsc_hid, sizeof(dsc_hid));
+	dsc += sizeof(dsc_hid);
+	dsc[0] = 7;
+	dsc[1] = 5;
+	dsc[2] = 0x80 | HID_EP_IN;
+	dsc[3] = 3;
+	dsc[4] = HID_REPORT_LEN;
+	dsc[5] = 0;
+	dsc[6] = (uint8_t)interval;
+
+	dev->priv = hid;
+	dev->dsc_dev = dsc_dev;
+	dev->dsc_conf = hid->dsc_conf;
+	dev->strings = strings;
+	dev->n_strings = 2;
+	return 0;
+}
+
+const emul_dev_ops_t	emul_hid_ops = {
+	"hid", hid_init, hid_reset, hid_control, hid_submit
+};
@@ -0,0 +1,130 @@
+/*
+ * Isochronous IN source
+ *
+ * Every frame of 1 ms carries a packet of a configured length, like an audio capture device.
+ * A URB of n packets completes when its last frame has passed.
+ */
+
+#include <stdio.h>
+
+#include "usbip_emul.h"
+
+#define ISO_EP_IN	1
+#define ISO_FRAME_US	1000
+/* the largest full speed isochronous packet */
+#define ISO_MAX_PACKET	1023
+
+typedef struct {
+	uint8_t		dsc_conf[34];
+	uint32_t	len_packet;
+	uint64_t	next_frame_us;
+} iso_t;
+
+static const uint8_t	dsc_dev[] = {
+	18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+	0x09, 0x12, 0x04, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+/* alternate setting 0 has no bandwidth like a usual isochronous interface */
+static const uint8_t	dsc_conf_head[] = {
+	9, 2, 34, 0, 1, 1, 0, 0x80, 50,
+	9, 4, 0, 0, 0, 0xff, 0x00, 0x00, 0,
+	9, 4, 0, 1, 1, 0xff, 0x00, 0x00, 0
+};
+
+static const char	*strings[] = { "usbip-win", "Emulated Isochronous Source" };
+
+static void
+fill_packets(iso_t *iso, emul_urb_t *urb, uint32_t frame)
+{
+	int	i;
+
+	urb->actual_length = 0;
+	for (i = 0; i < EMUL_URB_N_PACKETS(urb); i++) {
+		struct usbip_iso_packet_descriptor	*desc = urb->descs + i;
+		uint32_t	len = desc->length < iso->len_packet ? desc->length: iso->len_packet;
+
+		if (desc->offset > EMUL_URB_LEN(urb) || len > EMUL_URB_LEN(urb) - desc->offset) {
+			desc->actual_length = 0;
+			desc->status = (uint32_t)-USBIP_EOVERFLOW;
+			urb->error_count++;
+			continue;
+		}
+		/* each packet is filled with its frame number */
+		memset(urb->buf + desc->offset, (frame + i) & 0xff, len);
+		desc->actual_length = len;
+		desc->status = 0;
+		urb->actual_length += len;
+	}
+}
+
+static void
+iso_submit(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	iso_t	*iso = (iso_t *)dev->priv;
+	uint64_t	slot, due;
+	int	n_pkts = EMUL_URB_N_PACKETS(urb);
+
+	if (EMUL_URB_EP(urb) != ISO_EP_IN || !EMUL_URB_IS_IN(urb) || n_pkts <= 0) {
+		urb->status = -USBIP_EPIPE;
+		emul_schedule(dev, urb, now + dev->latency_us);
+		return;
+	}
+
+	/* URBs queued back to back get consecutive frames */
+	slot = iso->next_frame_us > now ? iso->next_frame_us: now;
+	iso->next_frame_us = slot + (uint64_t)n_pkts * ISO_FRAME_US;
+	due = iso->next_frame_us > now + dev->latency_us ? iso->next_frame_us: now + dev->latency_us;
+
+	urb->start_frame = (int32_t)((slot / ISO_FRAME_US) & 0x7ff);
+	fill_packets(iso, urb, (uint32_t)(slot / ISO_FRAME_US));
+	emul_schedule(dev, urb, due);
+}
+
+static void
+iso_reset(emul_dev_t *dev)
+{
+	iso_t	*iso = (iso_t *)dev->priv;
+
+	iso->next_frame_us = 0;
+}
+
+static int
+iso_init(emul_dev_t *dev, const char *arg)
+{
+	iso_t	*iso;
+	unsigned	len = 192;
+	uint8_t	*dsc;
+
+	if (arg != NULL && (sscanf(arg, "%u", &len) != 1 || len == 0 || len > ISO_MAX_PACKET)) {
+		err("iso: invalid packet length: %s", arg);
+		return -1;
+	}
+	iso = (iso_t *)calloc(1, sizeof(iso_t));
+	if (iso == NULL)
+		return -1;
+	iso->len_packet = len;
+
+	dsc = iso->dsc_conf;
+	memcpy(dsc, dsc_conf_head, sizeof(dsc_conf_head));
+	dsc += sizeof(dsc_conf_head);
+	dsc[0] = 7;
+	dsc[1] = 5;
+	dsc[2] = 0x80 | ISO_EP_IN;
+	/* isochronous, asynchronous */
+	dsc[3] = 0x05;
+	dsc[4] = (uint8_t)len;
+	dsc[5] = (uint8_t)(len >> 8);
+	dsc[6] = 1;
+
+	dev->priv = iso;
+	dev->dsc_dev = dsc_dev;
+	dev->dsc_conf = iso->dsc_conf;
+	dev->strings = strings;
+	dev->n_strings = 2;
+	return 0;
+}
+
+const emul_dev_ops_t	emul_iso_ops = {
+	"iso", iso_init, iso_reset, NULL, iso_submit
+};
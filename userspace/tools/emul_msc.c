@@ -0,0 +1,400 @@
+/*
+ * Bulk-only mass storage device backed by a file
+ *
+ * Only what hosts use for a simple disk of 512-byte blocks is implemented.
+ * Commands other than those get ILLEGAL REQUEST.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "usbip_emul.h"
+
+#define MSC_BLOCK_SIZE	512
+#define MSC_EP_IN	1
+#define MSC_EP_OUT	2
+
+#define CBW_SIGNATURE	0x43425355
+#define CSW_SIGNATURE	0x53425355
+#define CBW_LEN		31
+#define CSW_LEN		13
+
+#define SENSE_MEDIUM_ERROR	0x03
+#define SENSE_ILLEGAL_REQUEST	0x05
+#define ASC_INVALID_COMMAND	0x20
+#define ASC_LBA_OUT_OF_RANGE	0x21
+
+typedef enum {
+	MSC_CBW,
+	MSC_DATA_IN,
+	MSC_DATA_OUT,
+	MSC_CSW
+} msc_phase_t;
+
+typedef struct {
+	int	fd;
+	uint64_t	n_blocks;
+
+	msc_phase_t	phase;
+	uint32_t	tag;
+	/* dCBWDataTransferLength and bytes transferred so far */
+	uint32_t	len_xfer, len_done;
+	uint8_t		status;
+	/* data phase: a small response or blocks of a file from offset */
+	BOOL	is_file;
+	uint8_t	resp[64];
+	uint32_t	len_data;
+	uint64_t	offset;
+
+	uint8_t	sense_key, asc;
+} msc_t;
+
+static const uint8_t	dsc_dev[] = {
+	18, 1, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+	0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 1, 2, 3, 1
+};
+
+static const uint8_t	dsc_conf[] = {
+	9, 2, 32, 0, 1, 1, 0, 0x80, 50,
+	/* interface: mass storage, SCSI transparent, bulk-only */
+	9, 4, 0, 0, 2, 0x08, 0x06, 0x50, 0,
+	7, 5, 0x80 | MSC_EP_IN, 2, 64, 0, 0,
+	7, 5, MSC_EP_OUT, 2, 64, 0, 0
+};
+
+static const char	*strings[] = { "usbip-win", "Emulated Mass Storage", "EMUL0001" };
+
+static uint32_t
+get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t
+get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+static void
+set_resp(msc_t *msc, const uint8_t *resp, uint32_t len)
+{
+	memcpy(msc->resp, resp, len);
+	msc->len_data = len;
+}
+
+static BOOL
+set_rw(msc_t *msc, const uint8_t *cb)
+{
+	uint32_t	lba = get_be32(cb + 2);
+	uint32_t	n_blocks = (cb[7] << 8) | cb[8];
+
+	if ((uint64_t)lba + n_blocks > msc->n_blocks) {
+		msc->sense_key = SENSE_ILLEGAL_REQUEST;
+		msc->asc = ASC_LBA_OUT_OF_RANGE;
+		return FALSE;
+	}
+	msc->is_file = TRUE;
+	msc->offset = (uint64_t)lba * MSC_BLOCK_SIZE;
+	msc->len_data = n_blocks * MSC_BLOCK_SIZE;
+	return TRUE;
+}
+
+static BOOL
+exec_scsi(msc_t *msc, const uint8_t *cb)
+{
+	uint8_t	resp[36];
+
+	memset(resp, 0, sizeof(resp));
+	switch (cb[0]) {
+	case 0x00:	/* TEST UNIT READY */
+	case 0x1b:	/* START STOP UNIT */
+	case 0x1e:	/* PREVENT ALLOW MEDIUM REMOVAL */
+	case 0x2f:	/* VERIFY(10) */
+		return TRUE;
+	case 0x35:	/* SYNCHRONIZE CACHE(10) */
+		fsync(msc->fd);
+		return TRUE;
+	case 0x03:	/* REQUEST SENSE */
+		resp[0] = 0x70;
+		resp[2] = msc->sense_key;
+		resp[7] = 10;
+		resp[12] = msc->asc;
+		set_resp(msc, resp, 18);
+		msc->sense_key = 0;
+		msc->asc = 0;
+		return TRUE;
+	case 0x12:	/* INQUIRY */
+		resp[1] = 0x80;
+		resp[2] = 0x04;
+		resp[3] = 0x02;
+		resp[4] = 31;
+		memcpy(resp + 8, "usbip   ", 8);
+		memcpy(resp + 16, "Emulated Disk   ", 16);
+		memcpy(resp + 32, "1.00", 4);
+		set_resp(msc, resp, 36);
+		return TRUE;
+	case 0x1a:	/* MODE SENSE(6) */
+		resp[0] = 3;
+		set_resp(msc, resp, 4);
+		return TRUE;
+	case 0x5a:	/* MODE SENSE(10) */
+		resp[1] = 6;
+		set_resp(msc, resp, 8);
+		return TRUE;
+	case 0x23:	/* READ FORMAT CAPACITIES */
+		resp[3] = 8;
+		put_be32(resp + 4, (uint32_t)msc->n_blocks);
+		put_be32(resp + 8, MSC_BLOCK_SIZE);
+		/* formatted media */
+		resp[8] = 0x02;
+		set_resp(msc, resp, 12);
+		return TRUE;
+	case 0x25:	/* READ CAPACITY(10) */
+		put_be32(resp, (uint32_t)(msc->n_blocks - 1));
+		put_be32(resp + 4, MSC_BLOCK_SIZE);
+		set_resp(msc, resp, 8);
+		return TRUE;
+	case 0x28:	/* READ(10) */
+	case 0x2a:	/* WRITE(10) */
+		return set_rw(msc, cb);
+	default:
+		dbg("msc: unsupported command: %02x", cb[0]);
+		msc->sense_key = SENSE_ILLEGAL_REQUEST;
+		msc->asc = ASC_INVALID_COMMAND;
+		return FALSE;
+	}
+}
+
+static BOOL
+recv_cbw(msc_t *msc, emul_urb_t *urb)
+{
+	const uint8_t	*cbw = urb->buf;
+	BOOL	is_in;
+
+	if (EMUL_URB_LEN(urb) != CBW_LEN || get_le32(cbw) != CBW_SIGNATURE)
+		return FALSE;
+
+	msc->tag = get_le32(cbw + 4);
+	msc->len_xfer = get_le32(cbw + 8);
+	is_in = (cbw[12] & 0x80) != 0;
+	msc->len_done = 0;
+	msc->len_data = 0;
+	msc->is_file = FALSE;
+
+	msc->status = exec_scsi(msc, cbw + 15) ? 0: 1;
+	if (msc->status != 0)
+		msc->len_data = 0;
+	if (msc->len_data > msc->len_xfer)
+		msc->len_data = msc->len_xfer;
+
+	if (msc->len_xfer == 0)
+		msc->phase = MSC_CSW;
+	else
+		msc->phase = is_in ? MSC_DATA_IN: MSC_DATA_OUT;
+	return TRUE;
+}
+
+static void
+send_data(msc_t *msc, emul_urb_t *urb)
+{
+	uint32_t	len = msc->len_data - msc->len_done;
+
+	if (len > EMUL_URB_LEN(urb))
+		len = EMUL_URB_LEN(urb);
+	if (msc->is_file) {
+		if (pread(msc->fd, urb->buf, len, (off_t)(msc->offset + msc->len_done)) != (ssize_t)len) {
+			msc->sense_key = SENSE_MEDIUM_ERROR;
+			msc->status = 1;
+		}
+		urb->actual_length = len;
+	}
+	else
+		emul_urb_set_data(urb, msc->resp + msc->len_done, len);
+	msc->len_done += len;
+
+	/* a short packet ends a data phase */
+	if (msc->len_done == msc->len_data)
+		msc->phase = MSC_CSW;
+}
+
+static void
+recv_data(msc_t *msc, emul_urb_t *urb)
+{
+	uint32_t	len = EMUL_URB_LEN(urb);
+
+	if (msc->is_file && msc->status == 0) {
+		uint32_t	len_write = len;
+
+		if (len_write > msc->len_data - msc->len_done)
+			len_write = msc->len_data - msc->len_done;
+		if (pwrite(msc->fd, urb->buf, len_write, (off_t)(msc->offset + msc->len_done)) != (ssize_t)len_write) {
+			msc->sense_key = SENSE_MEDIUM_ERROR;
+			msc->status = 1;
+		}
+	}
+	urb->actual_length = len;
+	msc->len_done += len;
+	if (msc->len_done >= msc->len_xfer)
+		msc->phase = MSC_CSW;
+}
+
+static void
+send_csw(msc_t *msc, emul_urb_t *urb)
+{
+	uint8_t	csw[CSW_LEN];
+	uint32_t	residue = msc->len_xfer > msc->len_done ? msc->len_xfer - msc->len_done: 0;
+	int	i;
+
+	for (i = 0; i < 4; i++) {
+		csw[i] = (uint8_t)(CSW_SIGNATURE >> (i * 8));
+		csw[4 + i] = (uint8_t)(msc->tag >> (i * 8));
+		csw[8 + i] = (uint8_t)(residue >> (i * 8));
+	}
+	csw[12] = msc->status;
+	emul_urb_set_data(urb, csw, CSW_LEN);
+	msc->phase = MSC_CBW;
+}
+
+/* TRUE if an IN URB is completed */
+static BOOL
+handle_in(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	msc_t	*msc = (msc_t *)dev->priv;
+
+	switch (msc->phase) {
+	case MSC_DATA_IN:
+		send_data(msc, urb);
+		break;
+	case MSC_CSW:
+		send_csw(msc, urb);
+		break;
+	default:
+		return FALSE;
+	}
+	emul_schedule(dev, urb, now + dev->latency_us);
+	return TRUE;
+}
+
+static void
+handle_out(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	msc_t	*msc = (msc_t *)dev->priv;
+
+	switch (msc->phase) {
+	case MSC_CBW:
+		if (!recv_cbw(msc, urb)) {
+			dbg("msc: invalid CBW");
+			urb->status = -USBIP_EPIPE;
+		}
+		else
+			urb->actual_length = CBW_LEN;
+		break;
+	case MSC_DATA_OUT:
+		recv_data(msc, urb);
+		break;
+	default:
+		urb->status = -USBIP_EPIPE;
+		break;
+	}
+	emul_schedule(dev, urb, now + dev->latency_us);
+}
+
+static void
+msc_submit(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	emul_urb_t	*urb_in;
+
+	if (EMUL_URB_EP(urb) == MSC_EP_IN && EMUL_URB_IS_IN(urb)) {
+		if (!handle_in(dev, urb, now))
+			emul_park(dev, urb);
+		return;
+	}
+	if (EMUL_URB_EP(urb) != MSC_EP_OUT || EMUL_URB_IS_IN(urb)) {
+		urb->status = -USBIP_EPIPE;
+		emul_schedule(dev, urb, now + dev->latency_us);
+		return;
+	}
+
+	handle_out(dev, urb, now);
+	/* an IN URB may have been queued ahead of its phase */
+	urb_in = emul_take_parked(dev, MSC_EP_IN, TRUE);
+	if (urb_in != NULL && !handle_in(dev, urb_in, now))
+		emul_park(dev, urb_in);
+}
+
+static BOOL
+msc_control(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup)
+{
+	msc_t	*msc = (msc_t *)dev->priv;
+	static const uint8_t	max_lun = 0;
+
+	switch ((setup[0] << 8) | setup[1]) {
+	case 0x21ff:	/* Bulk-Only Mass Storage Reset */
+		msc->phase = MSC_CBW;
+		return TRUE;
+	case 0xa1fe:	/* Get Max LUN */
+		emul_urb_set_data(urb, &max_lun, 1);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+msc_reset(emul_dev_t *dev)
+{
+	msc_t	*msc = (msc_t *)dev->priv;
+
+	msc->phase = MSC_CBW;
+	msc->sense_key = 0;
+	msc->asc = 0;
+}
+
+static int
+msc_init(emul_dev_t *dev, const char *arg)
+{
+	msc_t	*msc;
+	struct stat	st;
+
+	if (arg == NULL) {
+		err("msc: backing file required");
+		return -1;
+	}
+	msc = (msc_t *)calloc(1, sizeof(msc_t));
+	if (msc == NULL)
+		return -1;
+	msc->fd = open(arg, O_RDWR);
+	if (msc->fd < 0 || fstat(msc->fd, &st) < 0 || st.st_size < MSC_BLOCK_SIZE) {
+		err("msc: cannot open or too small: %s", arg);
+		if (msc->fd >= 0)
+			close(msc->fd);
+		free(msc);
+		return -1;
+	}
+	msc->n_blocks = (uint64_t)st.st_size / MSC_BLOCK_SIZE;
+	if (msc->n_blocks > UINT32_MAX)
+		msc->n_blocks = UINT32_MAX;
+
+	dev->priv = msc;
+	dev->dsc_dev = dsc_dev;
+	dev->dsc_conf = dsc_conf;
+	dev->strings = strings;
+	dev->n_strings = 3;
+	return 0;
+}
+
+const emul_dev_ops_t	emul_msc_ops = {
+	"msc", msc_init, msc_reset, msc_control, msc_submit
+};
@@ -0,0 +1,56 @@
+/*
+ * Bulk source and sink like the linux gadget zero
+ *
+ * IN URBs get a full buffer of zeros and OUT data is dropped, so that only the transport
+ * limits throughput.
+ */
+
+#include <stdio.h>
+
+#include "usbip_emul.h"
+
+#define ZERO_EP_IN	1
+#define ZERO_EP_OUT	2
+
+static const uint8_t	dsc_dev[] = {
+	18, 1, 0x00, 0x02, 0xff, 0x00, 0x00, 64,
+	0x09, 0x12, 0x05, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t	dsc_conf[] = {
+	9, 2, 32, 0, 1, 1, 0, 0x80, 50,
+	9, 4, 0, 0, 2, 0xff, 0x00, 0x00, 0,
+	7, 5, 0x80 | ZERO_EP_IN, 2, 0x00, 0x02, 0,
+	7, 5, ZERO_EP_OUT, 2, 0x00, 0x02, 0
+};
+
+static const char	*strings[] = { "usbip-win", "Emulated Bulk Source/Sink" };
+
+static void
+zero_submit(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	if ((EMUL_URB_EP(urb) == ZERO_EP_IN && EMUL_URB_IS_IN(urb)) ||
+	    (EMUL_URB_EP(urb) == ZERO_EP_OUT && !EMUL_URB_IS_IN(urb)))
+		urb->actual_length = EMUL_URB_LEN(urb);
+	else
+		urb->status = -USBIP_EPIPE;
+	emul_schedule(dev, urb, now + dev->latency_us);
+}
+
+static int
+zero_init(emul_dev_t *dev, const char *arg)
+{
+	UNREFERENCED_PARAMETER(arg);
+
+	/* 512-byte bulk packets */
+	dev->speed = USB_SPEED_HIGH;
+	dev->dsc_dev = dsc_dev;
+	dev->dsc_conf = dsc_conf;
+	dev->strings = strings;
+	dev->n_strings = 2;
+	return 0;
+}
+
+const emul_dev_ops_t	emul_zero_ops = {
+	"zero", zero_init, NULL, NULL, zero_submit
+};
@@ -0,0 +1,360 @@
+/*
+ * A mocked SetupDi and stub device layer
+ *
+ * Usb device i has an instance id of USB\VID_1209&PID_<i>\<serial> and, if it is a stub one,
+ * an interface path which carries i. Devices with a stub interface are spread evenly over
+ * all devices. A device exported by IOCTL_USBIP_STUB_EXPORT is opened exclusively until closed.
+ * Registered device notifications fire only by mock_notify_change().
+ */
+
+#include <setupapi.h>
+#include <cfgmgr32.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "usbip_stub_api.h"
+
+#include "mock_setupdi.h"
+
+typedef struct {
+	BOOL	intf;
+	/* indices of devices in this set */
+	unsigned	*devs;
+	unsigned	n_devs;
+} mock_devinfo_t;
+
+static mock_config_t	config;
+static mock_counters_t	counters;
+static BOOL	*exported;
+
+#define MAX_NOTIS	4
+
+static PCM_NOTIFY_CALLBACK	notis[MAX_NOTIS];
+static pthread_mutex_t	lock_notis = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread DWORD	last_error;
+
+DWORD
+GetLastError(void)
+{
+	return last_error;
+}
+
+void
+SetLastError(DWORD err)
+{
+	last_error = err;
+}
+
+static BOOL
+is_stub(unsigned i)
+{
+	return config.n_stubs > 0 && (i * config.n_stubs) % config.n_devs < config.n_stubs;
+}
+
+static void
+get_id_inst_mock(unsigned i, char *buf, size_t size)
+{
+	snprintf(buf, size, "USB\\VID_1209&PID_%04X\\%08X", i, i * 2654435761u);
+}
+
+static void
+get_devpath_mock(unsigned i, char *buf, size_t size)
+{
+	snprintf(buf, size, "\\\\?\\usb#vid_1209&pid_%04x#%u#{fb265267-c609-41e6-8eca-a20d92a833e6}", i, i);
+}
+
+static void
+charge(uint64_t *pcount, unsigned cost_us)
+{
+	(*pcount)++;
+	counters.cost_us += cost_us;
+}
+
+void
+mock_setup(const mock_config_t *conf)
+{
+	config = *conf;
+	if (config.n_stubs > config.n_devs)
+		config.n_stubs = config.n_devs;
+	exported = (BOOL *)calloc(config.n_devs, sizeof(BOOL));
+	mock_reset_counters();
+}
+
+void
+mock_cleanup(void)
+{
+	free(exported);
+	exported = NULL;
+}
+
+unsigned
+mock_n_stubs(void)
+{
+	unsigned	n = 0;
+	unsigned	i;
+
+	for (i = 0; i < config.n_devs; i++)
+		if (is_stub(i))
+			n++;
+	return n;
+}
+
+void
+mock_get_counters(mock_counters_t *pcounters)
+{
+	*pcounters = counters;
+}
+
+void
+mock_reset_counters(void)
+{
+	memset(&counters, 0, sizeof(counters));
+}
+
+HDEVINFO
+SetupDiGetClassDevs(LPCGUID pguid, const char *enumerator, void *hwnd, DWORD flags)
+{
+	mock_devinfo_t	*set;
+	unsigned	i;
+
+	(void)enumerator; (void)hwnd;
+	charge(&counters.n_enums, config.cost_enum_us);
+
+	set = (mock_devinfo_t *)calloc(1, sizeof(mock_devinfo_t));
+	if (set == NULL)
+		return INVALID_HANDLE_VALUE;
+	set->devs = (unsigned *)malloc(sizeof(unsigned) * (config.n_devs + 1));
+	if (set->devs == NULL) {
+		free(set);
+		return INVALID_HANDLE_VALUE;
+	}
+	set->intf = (flags & DIGCF_DEVICEINTERFACE) ? TRUE: FALSE;
+	if (set->intf && (pguid == NULL || !IsEqualGUID(pguid, &GUID_DEVINTERFACE_STUB_USBIP)))
+		return set;
+	/* interfaces come in an order unrelated to that of devices */
+	for (i = 0; i < config.n_devs; i++) {
+		unsigned	idx = set->intf ? config.n_devs - 1 - i: i;
+
+		if (!set->intf || is_stub(idx))
+			set->devs[set->n_devs++] = idx;
+	}
+	return set;
+}
+
+BOOL
+SetupDiEnumDeviceInfo(HDEVINFO dev_info, DWORD idx, PSP_DEVINFO_DATA pdev_info_data)
+{
+	mock_devinfo_t	*set = (mock_devinfo_t *)dev_info;
+
+	charge(&counters.n_calls, config.cost_call_us);
+	if (idx >= set->n_devs) {
+		SetLastError(ERROR_NO_MORE_ITEMS);
+		return FALSE;
+	}
+	pdev_info_data->DevInst = set->devs[idx];
+	return TRUE;
+}
+
+BOOL
+SetupDiDestroyDeviceInfoList(HDEVINFO dev_info)
+{
+	mock_devinfo_t	*set = (mock_devinfo_t *)dev_info;
+
+	free(set->devs);
+	free(set);
+	return TRUE;
+}
+
+BOOL
+SetupDiGetDeviceInstanceId(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, char *id, DWORD size, DWORD *preq)
+{
+	char	id_inst[64];
+	DWORD	len;
+
+	(void)dev_info;
+	charge(&counters.n_calls, config.cost_call_us);
+	get_id_inst_mock(pdev_info_data->DevInst, id_inst, sizeof(id_inst));
+	len = (DWORD)strlen(id_inst) + 1;
+	if (preq != NULL)
+		*preq = len;
+	if (id == NULL || size < len) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+	memcpy(id, id_inst, len);
+	return TRUE;
+}
+
+BOOL
+SetupDiGetDeviceRegistryProperty(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, DWORD prop, DWORD *ptype,
+				 PBYTE buf, DWORD size, DWORD *preq)
+{
+	(void)dev_info; (void)pdev_info_data; (void)prop; (void)ptype; (void)buf; (void)size; (void)preq;
+	charge(&counters.n_calls, config.cost_call_us);
+	SetLastError(ERROR_INVALID_DATA);
+	return FALSE;
+}
+
+BOOL
+SetupDiEnumDeviceInterfaces(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, LPCGUID pguid, DWORD idx,
+			    PSP_DEVICE_INTERFACE_DATA pintf_data)
+{
+	mock_devinfo_t	*set = (mock_devinfo_t *)dev_info;
+
+	(void)pguid;
+	charge(&counters.n_calls, config.cost_call_us);
+	if (!set->intf || idx > 0) {
+		SetLastError(ERROR_NO_MORE_ITEMS);
+		return FALSE;
+	}
+	pintf_data->Reserved = pdev_info_data->DevInst;
+	return TRUE;
+}
+
+BOOL
+SetupDiGetDeviceInterfaceDetail(HDEVINFO dev_info, PSP_DEVICE_INTERFACE_DATA pintf_data,
+				PSP_DEVICE_INTERFACE_DETAIL_DATA pdetail, DWORD size, unsigned long *preq, PSP_DEVINFO_DATA pdev_info_data)
+{
+	char	devpath[128];
+	DWORD	len;
+
+	(void)dev_info; (void)pdev_info_data;
+	charge(&counters.n_calls, config.cost_call_us);
+	get_devpath_mock((unsigned)pintf_data->Reserved, devpath, sizeof(devpath));
+	len = (DWORD)(offsetof(SP_DEVICE_INTERFACE_DETAIL_DATA, DevicePath) + strlen(devpath) + 1);
+	if (preq != NULL)
+		*preq = len;
+	if (pdetail == NULL || size < len) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+	strcpy(pdetail->DevicePath, devpath);
+	return TRUE;
+}
+
+BOOL
+SetupDiSetClassInstallParams(HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data, SP_CLASSINSTALL_HEADER *params, DWORD size)
+{
+	(void)dev_info; (void)pdev_info_data; (void)params; (void)size;
+	SetLastError(ERROR_INVALID_FUNCTION);
+	return FALSE;
+}
+
+BOOL
+SetupDiCallClassInstaller(DWORD func, HDEVINFO dev_info, PSP_DEVINFO_DATA pdev_info_data)
+{
+	(void)func; (void)dev_info; (void)pdev_info_data;
+	SetLastError(ERROR_INVALID_FUNCTION);
+	return FALSE;
+}
+
+/* A handle is an index of a device plus one */
+HANDLE
+CreateFile(const char *path, DWORD access, DWORD share, void *sa, DWORD disposition, DWORD flags, HANDLE htemplate)
+{
+	const char	*p;
+	unsigned	i;
+
+	(void)access; (void)share; (void)sa; (void)disposition; (void)flags; (void)htemplate;
+	charge(&counters.n_opens, config.cost_open_us);
+	p = strchr(path, '#');
+	if (p != NULL)
+		p = strchr(p + 1, '#');
+	if (p == NULL || sscanf(p + 1, "%u", &i) != 1 || i >= config.n_devs || !is_stub(i)) {
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return INVALID_HANDLE_VALUE;
+	}
+	if (exported[i]) {
+		SetLastError(ERROR_INVALID_FUNCTION);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)(uintptr_t)(i + 1);
+}
+
+BOOL
+DeviceIoControl(HANDLE hdev, DWORD code, void *in, DWORD len_in, void *out, DWORD len_out, DWORD *plen, void *ov)
+{
+	/* a configuration with an interface of a bulk IN and OUT endpoint */
+	static const unsigned char	dsc_conf[] = {
+		0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+		0x09, 0x04, 0x00, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+		0x07, 0x05, 0x81, 0x02, 0x00, 0x02, 0x00,
+		0x07, 0x05, 0x02, 0x02, 0x00, 0x02, 0x00
+	};
+	unsigned	i = (unsigned)((uintptr_t)hdev - 1);
+
+	(void)in; (void)len_in; (void)ov;
+	charge(&counters.n_ioctls, config.cost_ioctl_us);
+	switch (code) {
+	case IOCTL_USBIP_STUB_GET_DEVINFO: {
+		ioctl_usbip_stub_devinfo_t	devinfo = { 0x1209, (unsigned short)i, 3, 0, 0, 0 };
+
+		if (len_out < sizeof(devinfo))
+			break;
+		memcpy(out, &devinfo, sizeof(devinfo));
+		*plen = sizeof(devinfo);
+		return TRUE;
+	}
+	case IOCTL_USBIP_STUB_GET_CONF_DESC:
+		*plen = len_out < sizeof(dsc_conf) ? len_out: sizeof(dsc_conf);
+		memcpy(out, dsc_conf, *plen);
+		return TRUE;
+	case IOCTL_USBIP_STUB_EXPORT:
+		exported[i] = TRUE;
+		*plen = 0;
+		return TRUE;
+	default:
+		break;
+	}
+	SetLastError(ERROR_INVALID_FUNCTION);
+	return FALSE;
+}
+
+BOOL
+CloseHandle(HANDLE h)
+{
+	exported[(uintptr_t)h - 1] = FALSE;
+	return TRUE;
+}
+
+CONFIGRET
+CM_Register_Notification(PCM_NOTIFY_FILTER pfilter, PVOID ctx, PCM_NOTIFY_CALLBACK callback, HCMNOTIFICATION *phnoti)
+{
+	uintptr_t	i;
+
+	pthread_mutex_lock(&lock_notis);
+	for (i = 0; i < MAX_NOTIS; i++) {
+		if (notis[i] == NULL) {
+			notis[i] = callback;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock_notis);
+	if (i == MAX_NOTIS)
+		return CR_OUT_OF_MEMORY;
+	*phnoti = (HCMNOTIFICATION)(i + 1);
+	return CR_SUCCESS;
+}
+
+CONFIGRET
+CM_Unregister_Notification(HCMNOTIFICATION hnoti)
+{
+	pthread_mutex_lock(&lock_notis);
+	notis[(uintptr_t)hnoti - 1] = NULL;
+	pthread_mutex_unlock(&lock_notis);
+	return CR_SUCCESS;
+}
+
+void
+mock_notify_change(void)
+{
+	uintptr_t	i;
+
+	pthread_mutex_lock(&lock_notis);
+	for (i = 0; i < MAX_NOTIS; i++) {
+		if (notis[i] != NULL)
+			notis[i]((HCMNOTIFICATION)(i + 1), NULL, CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL, NULL, 0);
+	}
+	pthread_mutex_unlock(&lock_notis);
+}
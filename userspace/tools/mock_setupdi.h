@@ -0,0 +1,37 @@
+#pragma once
+
+/*
+ * A mocked SetupDi and stub device layer for usbip-enum-bench and usbip-accept-bench.
+ * It serves a synthetic tree of usb devices, some of which have a stub interface, and counts
+ * what a caller asks for. The cost of each call is modeled rather than spent, so that a run is
+ * fast and repeatable.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+	/* usb devices, of which n_stubs have a stub interface */
+	unsigned	n_devs, n_stubs;
+	/* modeled cost in microseconds */
+	unsigned	cost_enum_us;	/* SetupDiGetClassDevs */
+	unsigned	cost_call_us;	/* every other SetupDi call */
+	unsigned	cost_open_us;	/* CreateFile of a stub device */
+	unsigned	cost_ioctl_us;	/* DeviceIoControl */
+} mock_config_t;
+
+typedef struct {
+	uint64_t	n_enums, n_calls, n_opens, n_ioctls;
+	uint64_t	cost_us;
+} mock_counters_t;
+
+void mock_setup(const mock_config_t *conf);
+void mock_cleanup(void);
+
+/* devno's of stub devices are not known to a mock, but the number of them is */
+unsigned mock_n_stubs(void);
+
+void mock_get_counters(mock_counters_t *counters);
+void mock_reset_counters(void);
+
+/* fires registered device notifications as if a device arrived */
+void mock_notify_change(void);
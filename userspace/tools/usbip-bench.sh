@@ -0,0 +1,154 @@
+#!/bin/sh
+#
+# Loopback benchmark suite of the usbip data path
+#
+# usbip-emul serves emulated devices on localhost and usbip-bench runs every case against them:
+# bulk IN/OUT of 4K to 1M, interrupt at 1 to 8 ms intervals, control request rate and
+# isochronous frame delivery. usbip-sched-bench compares vhci scheduling policies by latency of
+# interrupt URBs behind bulk ones of a composite device. Results are appended to a tab-separated report file, and two
+# reports, say of before and after a change, are compared case by case with -c.
+# Sequential reads of an emulated mass storage are run with its device latency, which stages of
+# a command submitted with its CBW by -B share.
+# With -W, connections go through usbip-wan, which emulates a WAN link.
+
+usage()
+{
+	cat <<EOF
+usage: usbip-bench.sh [-q <depth>] [-R <rtt usec>] [-d <sec>] [-L <label>] [-B <bytes>[:<cache>]] [-W <args>] <report file>
+       usbip-bench.sh -c <base report> <new report>
+    -q  in-flight URBs, default 4
+    -R  round trip time added to every URB, default 0
+    -d  duration of each case, default 3
+    -L  label of results, default the current git commit
+    -B  bulk-only mass storage acceleration of usbip-emul and its READ(10) cache size, default 0
+    -W  arguments of usbip-wan to run through, e.g. "-d 20000 -j 2000 -b 100000 -L 0.1"
+    -c  compare throughput and latency of a new report with a base one
+environment:
+    USBIP_BENCH_PORT  port of usbip-emul, default 3250, and usbip-wan on the next one.
+                      Those of a mass storage are on the next two.
+EOF
+	exit 1
+}
+
+compare()
+{
+	awk -F '\t' '
+	function change(base, new) { return base > 0 ? (new / base - 1) * 100: 0 }
+	BEGIN {
+		printf "%-36s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n", "case", "urb/s", "(new)", "", "p50(us)", "(new)", "", "p99(us)", "(new)", ""
+	}
+	/^#/ { next }
+	{ key = $2 " " $3 " " $4 " q" $5 " rtt" $6 }
+	FNR == NR { urb_s[key] = $9; p50[key] = $13; p99[key] = $15; next }
+	key in urb_s {
+		printf "%-36s %10.1f %10.1f %+7.1f%% %8u %8u %+7.1f%% %8u %8u %+7.1f%%\n", key,
+		       urb_s[key], $9, change(urb_s[key], $9), p50[key], $13, change(p50[key], $13),
+		       p99[key], $15, change(p99[key], $15)
+	}' "$1" "$2"
+}
+
+dir=$(dirname "$0")
+port=${USBIP_BENCH_PORT:-3250}
+depth=4
+rtt=0
+secs=3
+label=
+botaccel=0
+wan=
+
+while getopts "q:R:d:L:B:W:c" opt; do
+	case $opt in
+	q) depth=$OPTARG ;;
+	R) rtt=$OPTARG ;;
+	d) secs=$OPTARG ;;
+	L) label=$OPTARG ;;
+	B) botaccel=$OPTARG ;;
+	W) wan=$OPTARG ;;
+	c) cmp=1 ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ -n "$cmp" ]; then
+	[ $# -eq 2 ] || usage
+	compare "$1" "$2"
+	exit
+fi
+[ $# -eq 1 ] || usage
+report=$1
+[ -n "$label" ] || label=$(git -C "$dir" rev-parse --short HEAD 2>/dev/null || echo -)
+
+for prog in usbip-emul usbip-bench usbip-wan usbip-sched-bench; do
+	if [ ! -x "$dir/$prog" ]; then
+		echo "$dir/$prog not found: run make first" >&2
+		exit 1
+	fi
+done
+
+img=$(mktemp) || exit 1
+dd if=/dev/zero of="$img" bs=1M count=16 2>/dev/null
+
+# 1-1: bulk, 1-2..1-5: interrupt of 1, 2, 4 and 8 ms, 1-6: isochronous, 1-7: interrupt and bulk
+"$dir/usbip-emul" -t "$port" -d zero -d hid:1000 -d hid:500 -d hid:250 -d hid:125 -d iso:192 -d combo 2>/dev/null &
+emul=$!
+# 1-1: mass storage of 1 ms device latency
+"$dir/usbip-emul" -t "$((port + 2))" -a "$botaccel" -l 1000 -d msc:"$img" 2>/dev/null &
+pids="$emul $!"
+trap 'kill $pids 2>/dev/null; rm -f "$img"' EXIT INT TERM
+bench_port=$port
+msc_port=$((port + 2))
+if [ -n "$wan" ]; then
+	bench_port=$((port + 1))
+	msc_port=$((port + 3))
+	# word splitting of $wan is intended
+	"$dir/usbip-wan" -t "$bench_port" -r 127.0.0.1 -P "$port" $wan 2>/dev/null &
+	pids="$pids $!"
+	"$dir/usbip-wan" -t "$msc_port" -r 127.0.0.1 -P "$((port + 2))" $wan 2>/dev/null &
+	pids="$pids $!"
+fi
+sleep 1
+
+failed=0
+run()
+{
+	run_on "$bench_port" "$@"
+}
+
+run_on()
+{
+	p=$1
+	shift
+	if "$dir/usbip-bench" -r 127.0.0.1 -t "$p" -q "$depth" -R "$rtt" -d "$secs" \
+			  -o "$report" -L "$label" "$@" >/dev/null 2>&1; then
+		echo "done: $*"
+	else
+		echo "failed: $*" >&2
+		failed=1
+	fi
+}
+
+for size in 4K 16K 64K 256K 1M; do
+	run -b 1-1 -w bulk-in -s $size
+	run -b 1-1 -w bulk-out -s $size
+done
+run -b 1-1 -w ctrl
+for busid in 1-2 1-3 1-4 1-5; do
+	run -b $busid -w intr
+done
+run -b 1-6 -w iso
+for size in 4K 64K; do
+	run_on "$msc_port" -b 1-1 -w msc-read -s $size
+done
+
+for policy in fifo priority wfq; do
+	if "$dir/usbip-sched-bench" -r 127.0.0.1 -t "$bench_port" -b 1-7 -S $policy -q "$depth" -d "$secs" \
+				-o "$report" -L "$label" >/dev/null 2>&1; then
+		echo "done: -b 1-7 -S $policy"
+	else
+		echo "failed: -b 1-7 -S $policy" >&2
+		failed=1
+	fi
+done
+
+exit $failed
@@ -0,0 +1,468 @@
+/*
+ * usbip-accept-bench: latency of OP_REQ_DEVLIST under many clients and stalled ones
+ *
+ * usbipd_accept.c and usbipd_list.c run as they are, with usbipd_stub.c and usbip_setupdi.c over
+ * the mocked device layer of usbip-enum-bench, behind a listening socket on the loopback.
+ * Stalled clients connect and send nothing, each of which holds a handshake thread of usbipd.
+ * Then list clients connect at once and the latency of each from connect to the end of a reply
+ * is taken. A socket of linux does not take the handshake timeout of usbipd as a DWORD, so
+ * a stalled client hangs up by itself after the timeout or when list clients are done.
+ */
+
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#include "usbip_tools.h"
+#include "usbipd.h"
+#include "names.h"
+#include "mock_setupdi.h"
+
+extern BOOL init_accept(void);
+extern void cleanup_accept(void);
+extern void accept_request(SOCKET *sockfds, fd_set *pfds);
+extern void init_devlist(void);
+extern void cleanup_devlist(void);
+
+static const char usbip_accept_bench_usage_string[] =
+	"usage: usbip-accept-bench <args>\n"
+	"    -l, --lists=<n>         concurrent list clients, default 500\n"
+	"    -s, --stalled=<n>       stalled clients, default 4. A run without them goes first\n"
+	"    -t, --timeout=<msec>    how long a stalled client holds, default 10000 like usbipd\n"
+	"    -c, --change=<n>        notify a device change before every n-th list client, default 0 for never\n"
+	"    -n, --devices=<n>       usb devices, default 128\n"
+	"    -e, --exportable=<n>    devices with a stub interface, default 60\n";
+
+static void
+usbip_accept_bench_usage(void)
+{
+	printf("%s", usbip_accept_bench_usage_string);
+}
+
+#define CLIENT_STACK_SIZE	(256 * 1024)
+
+static char	port_listen[NI_MAXSERV];
+static volatile BOOL	listening;
+
+static pthread_barrier_t	barrier_lists;
+static pthread_mutex_t	lock_lists = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	cond_lists = PTHREAD_COND_INITIALIZER;
+static BOOL	lists_done;
+
+typedef struct {
+	pthread_t	thread;
+	BOOL	change;
+	BOOL	failed;
+	uint64_t	latency_us;
+} lister_t;
+
+typedef struct {
+	pthread_t	thread;
+	unsigned	timeout;
+} staller_t;
+
+/* usb.ids of names.c is not loaded, so devices are unnamed in debug logs of usbipd */
+char *
+get_module_dir(void)
+{
+	return NULL;
+}
+
+int
+names_init(const char *path)
+{
+	return -1;
+}
+
+void
+names_free(void)
+{
+}
+
+const char *
+names_vendor(uint16_t vendorid)
+{
+	return NULL;
+}
+
+const char *
+names_product(uint16_t vendorid, uint16_t productid)
+{
+	return NULL;
+}
+
+const char *
+names_class(uint8_t classid)
+{
+	return NULL;
+}
+
+const char *
+names_subclass(uint8_t classid, uint8_t subclassid)
+{
+	return NULL;
+}
+
+const char *
+names_protocol(uint8_t classid, uint8_t subclassid, uint8_t protocolid)
+{
+	return NULL;
+}
+
+/* imports are not served here, which need the forwarder of usbipd_import.c */
+int
+recv_request_import(SOCKET sockfd)
+{
+	usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NA);
+	return -1;
+}
+
+int
+recv_request_resume(SOCKET sockfd)
+{
+	usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_NA);
+	return -1;
+}
+
+static SOCKET
+listen_loopback(void)
+{
+	SOCKET	sockfd;
+	struct sockaddr_in	sin;
+	socklen_t	len = sizeof(sin);
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sockfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(sockfd, SOMAXCONN) < 0 ||
+	    getsockname(sockfd, (struct sockaddr *)&sin, &len) < 0) {
+		closesocket(sockfd);
+		return INVALID_SOCKET;
+	}
+	snprintf(port_listen, sizeof(port_listen), "%u", ntohs(sin.sin_port));
+	return sockfd;
+}
+
+/* the accept loop of usbipd */
+static void *
+listener(void *arg)
+{
+	SOCKET	*sockfds = (SOCKET *)arg;
+
+	while (listening) {
+		fd_set	fds;
+		struct timeval	tv = { 0, 100000 };
+
+		FD_ZERO(&fds);
+		FD_SET(sockfds[0], &fds);
+		if (select(sockfds[0] + 1, &fds, NULL, NULL, &tv) > 0)
+			accept_request(sockfds, &fds);
+	}
+	return NULL;
+}
+
+static BOOL
+recv_devlist(SOCKET sockfd)
+{
+	struct op_devlist_reply	reply;
+	uint16_t	code = OP_REP_DEVLIST;
+	unsigned	i;
+
+	if (usbip_net_send_op_common(sockfd, OP_REQ_DEVLIST, ST_OK) < 0)
+		return FALSE;
+	if (usbip_net_recv_op_common(sockfd, &code) < 0)
+		return FALSE;
+	if (usbip_net_recv(sockfd, &reply, sizeof(reply)) < 0)
+		return FALSE;
+	PACK_OP_DEVLIST_REPLY(0, &reply);
+	if (reply.ndev != mock_n_stubs())
+		return FALSE;
+
+	for (i = 0; i < reply.ndev; i++) {
+		struct usbip_usb_device	udev;
+		struct usbip_usb_interface	uinf;
+		int	j;
+
+		if (usbip_net_recv(sockfd, &udev, sizeof(udev)) < 0)
+			return FALSE;
+		usbip_net_pack_usb_device(0, &udev);
+		for (j = 0; j < udev.bNumInterfaces; j++) {
+			if (usbip_net_recv(sockfd, &uinf, sizeof(uinf)) < 0)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void *
+list_client(void *arg)
+{
+	lister_t	*lister = (lister_t *)arg;
+	SOCKET	sockfd;
+	uint64_t	start_us;
+
+	pthread_barrier_wait(&barrier_lists);
+	if (lister->change)
+		mock_notify_change();
+
+	start_us = tools_now_us();
+	sockfd = usbip_net_tcp_connect("127.0.0.1", port_listen);
+	if (sockfd == INVALID_SOCKET) {
+		lister->failed = TRUE;
+		return NULL;
+	}
+	lister->failed = !recv_devlist(sockfd);
+	lister->latency_us = tools_now_us() - start_us;
+	closesocket(sockfd);
+	return NULL;
+}
+
+static void *
+stalled_client(void *arg)
+{
+	staller_t	*staller = (staller_t *)arg;
+	struct timespec	ts;
+	SOCKET	sockfd;
+
+	sockfd = usbip_net_tcp_connect("127.0.0.1", port_listen);
+	if (sockfd == INVALID_SOCKET)
+		return NULL;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += staller->timeout / 1000;
+	ts.tv_nsec += (staller->timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&lock_lists);
+	while (!lists_done && pthread_cond_timedwait(&cond_lists, &lock_lists, &ts) != ETIMEDOUT);
+	pthread_mutex_unlock(&lock_lists);
+
+	closesocket(sockfd);
+	return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static BOOL
+create_client(pthread_t *pthread, void *(*func)(void *), void *arg)
+{
+	pthread_attr_t	attr;
+	int	ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+	ret = pthread_create(pthread, &attr, func, arg);
+	pthread_attr_destroy(&attr);
+	return ret == 0;
+}
+
+static int
+run_bench(unsigned n_lists, unsigned n_stalled, unsigned timeout, unsigned change, BOOL quiet)
+{
+	lister_t	*listers;
+	staller_t	*stallers;
+	uint64_t	*latencies;
+	mock_counters_t	counters;
+	unsigned	n_done = 0, n_failed = 0, i;
+	int	saved_use_stderr = usbip_use_stderr;
+
+	listers = (lister_t *)calloc(n_lists, sizeof(lister_t));
+	stallers = (staller_t *)calloc(n_stalled + 1, sizeof(staller_t));
+	latencies = (uint64_t *)calloc(n_lists, sizeof(uint64_t));
+	if (listers == NULL || stallers == NULL || latencies == NULL) {
+		err("out of memory");
+		free(listers);
+		free(stallers);
+		free(latencies);
+		return 1;
+	}
+
+	/* usbipd logs every request */
+	usbip_use_stderr = 0;
+	lists_done = FALSE;
+	mock_reset_counters();
+
+	for (i = 0; i < n_stalled; i++) {
+		stallers[i].timeout = timeout;
+		if (!create_client(&stallers[i].thread, stalled_client, &stallers[i]))
+			break;
+	}
+	n_stalled = i;
+	/* stalled ones are taken by handshake threads before list clients come */
+	tools_sleep_until_us(tools_now_us() + 200000);
+
+	pthread_barrier_init(&barrier_lists, NULL, n_lists);
+	for (i = 0; i < n_lists; i++) {
+		listers[i].change = change > 0 && i % change == change - 1;
+		if (!create_client(&listers[i].thread, list_client, &listers[i])) {
+			usbip_use_stderr = saved_use_stderr;
+			err("failed to create a list client: %u", i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < n_lists; i++) {
+		pthread_join(listers[i].thread, NULL);
+		if (listers[i].failed)
+			n_failed++;
+		else
+			latencies[n_done++] = listers[i].latency_us;
+	}
+	pthread_barrier_destroy(&barrier_lists);
+
+	pthread_mutex_lock(&lock_lists);
+	lists_done = TRUE;
+	pthread_cond_broadcast(&cond_lists);
+	pthread_mutex_unlock(&lock_lists);
+	for (i = 0; i < n_stalled; i++)
+		pthread_join(stallers[i].thread, NULL);
+
+	usbip_use_stderr = saved_use_stderr;
+	mock_get_counters(&counters);
+
+	qsort(latencies, n_done, sizeof(uint64_t), compare_u64);
+	if (!quiet && n_done == 0)
+		printf("%-8u %8u %10s %10s %10s %8s\n", n_stalled, n_failed, "-", "-", "-", "-");
+	else if (!quiet)
+		printf("%-8u %8u %10.2f %10.2f %10.2f %8llu\n", n_stalled, n_failed,
+		       (double)latencies[(n_done - 1) * 50 / 100] / 1000, (double)latencies[(n_done - 1) * 99 / 100] / 1000,
+		       (double)latencies[n_done - 1] / 1000, (unsigned long long)counters.n_enums);
+
+	free(listers);
+	free(stallers);
+	free(latencies);
+	return n_failed > 0;
+}
+
+/* list clients and the server side of them take as many descriptors */
+static void
+raise_nofile(void)
+{
+	struct rlimit	rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "lists", required_argument, NULL, 'l' },
+		{ "stalled", required_argument, NULL, 's' },
+		{ "timeout", required_argument, NULL, 't' },
+		{ "change", required_argument, NULL, 'c' },
+		{ "devices", required_argument, NULL, 'n' },
+		{ "exportable", required_argument, NULL, 'e' },
+		{ NULL, 0, NULL, 0 }
+	};
+	mock_config_t	conf = { 128, 60, 2000, 20, 500, 50 };
+	unsigned	n_lists = 500, n_stalled = 4, timeout = 10000, change = 0;
+	SOCKET	sockfds[2];
+	pthread_t	thread_listener;
+	int	opt, ret;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "l:s:t:c:n:e:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'l':
+			if (sscanf(optarg, "%u", &n_lists) != 1 || n_lists == 0) {
+				err("invalid number of list clients: %s", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			if (sscanf(optarg, "%u", &n_stalled) != 1) {
+				err("invalid number of stalled clients: %s", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			if (sscanf(optarg, "%u", &timeout) != 1) {
+				err("invalid timeout: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			if (sscanf(optarg, "%u", &change) != 1) {
+				err("invalid change interval: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if (sscanf(optarg, "%u", &conf.n_devs) != 1 || conf.n_devs == 0 || conf.n_devs > 255) {
+				err("invalid number of devices: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'e':
+			if (sscanf(optarg, "%u", &conf.n_stubs) != 1) {
+				err("invalid number of exportable devices: %s", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usbip_accept_bench_usage();
+			return 1;
+		}
+	}
+	if (optind != argc) {
+		usbip_accept_bench_usage();
+		return 1;
+	}
+
+	raise_nofile();
+	mock_setup(&conf);
+	init_devlist();
+	if (!init_accept()) {
+		err("failed to initialize accept");
+		return 1;
+	}
+	sockfds[0] = listen_loopback();
+	sockfds[1] = INVALID_SOCKET;
+	if (sockfds[0] == INVALID_SOCKET) {
+		err("failed to listen: %s", strerror(errno));
+		return 1;
+	}
+	listening = TRUE;
+	if (pthread_create(&thread_listener, NULL, listener, sockfds) != 0) {
+		err("failed to create a listener");
+		return 1;
+	}
+
+	printf("%u list clients at once, %u devices, %u exportable\n", n_lists, conf.n_devs, mock_n_stubs());
+	printf("%-8s %8s %10s %10s %10s %8s\n", "stalled", "failed", "p50(ms)", "p99(ms)", "max(ms)", "enums");
+	/* a first run starts threads of the pool and builds the device list */
+	ret = run_bench(n_lists, 0, timeout, change, TRUE);
+	if (ret == 0)
+		ret = run_bench(n_lists, 0, timeout, change, FALSE);
+	if (ret == 0 && n_stalled > 0)
+		ret = run_bench(n_lists, n_stalled, timeout, change, FALSE);
+
+	listening = FALSE;
+	pthread_join(thread_listener, NULL);
+	closesocket(sockfds[0]);
+	cleanup_accept();
+	cleanup_devlist();
+	mock_cleanup();
+	return ret;
+}
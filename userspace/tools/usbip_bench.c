@@ -0,0 +1,910 @@
+/*
+ * usbip-bench: measures throughput and latency of a transfer type against a usbip server
+ *
+ * A device is imported like a client does and URBs of a synthetic workload are kept in flight
+ * up to a depth. Its server may be usbip-emul, so that the data path of the protocol can be
+ * compared between changes on a single machine, or usbipd with a real device.
+ * Results are printed and appended to a tab-separated report file for usbip-bench.sh.
+ *
+ * msc-read is not a window of URBs but sequential READ(10) commands of a bulk-only mass storage,
+ * each of which is a CBW, a data stage and a CSW in turn like a class driver does.
+ */
+
+#include <ws2tcpip.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbip_tools.h"
+
+/* a power of 2 above the maximum depth, so that seqnums in flight map to distinct slots */
+#define N_BENCH_SLOTS	4096
+#define MAX_BENCH_DEPTH	1024
+#define MAX_BENCH_LEN	(16 * 1024 * 1024)
+
+/* bulk-only transport of a mass storage */
+#define MSC_BLOCK_SIZE	512
+#define MSC_CBW_LEN	31
+#define MSC_CSW_LEN	13
+
+/* bmAttributes of an endpoint descriptor */
+#define EP_XFER_ISO	1
+#define EP_XFER_BULK	2
+#define EP_XFER_INTR	3
+
+typedef enum {
+	WL_BULK_IN,
+	WL_BULK_OUT,
+	WL_INTR,
+	WL_CTRL,
+	WL_ISO,
+	WL_MSC_READ
+} workload_t;
+
+static const char	*workload_names[] = { "bulk-in", "bulk-out", "intr", "ctrl", "iso", "msc-read" };
+
+typedef struct {
+	uint64_t	ts_sent;
+	BOOL	busy;
+} bench_slot_t;
+
+/* a reply held back by an injected RTT */
+typedef struct {
+	unsigned long	seqnum;
+	uint64_t	t_recv;
+	int32_t		status;
+	uint32_t	actual_length;
+} bench_reply_t;
+
+typedef struct {
+	SOCKET	sockfd;
+	uint32_t	devid;
+	workload_t	wl;
+
+	/* URB of a workload */
+	uint8_t		ep;
+	BOOL	is_in;
+	uint32_t	len;
+	int32_t		interval;
+	int	n_packets;
+	unsigned char	*data_out;
+	struct usbip_iso_packet_descriptor	*descs;
+	/* bulk OUT endpoint of CBWs and blocks of a medium for msc-read */
+	uint8_t		ep_out;
+	uint32_t	n_blocks;
+
+	unsigned	depth;
+	uint64_t	rtt_us;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	bench_slot_t	slots[N_BENCH_SLOTS];
+	unsigned	n_inflight;
+	size_t	n_sent, n_done;
+	BOOL	failed;
+
+	/* replies in order of receipt until their RTT passes */
+	bench_reply_t	delayed[N_BENCH_SLOTS];
+	size_t	delayed_head, delayed_tail;
+	BOOL	receiver_done;
+
+	/* results */
+	uint64_t	t_start, t_last_done, t_last_recv;
+	uint64_t	bytes;
+	size_t	n_errors;
+	tools_lat_t	lat;
+	/* completion intervals of interrupt transfers */
+	tools_lat_t	intervals;
+	/* isochronous frames */
+	size_t	n_frames, n_frame_gaps;
+	int32_t		next_frame;
+} bench_t;
+
+static const char usbip_bench_usage_string[] =
+	"usage: usbip-bench <args>\n"
+	"    -r, --remote=<host>       The machine with exported USB devices\n"
+	"    -b, --busid=<busid>       Bus ID of a device to benchmark\n"
+	"    -w, --workload=<type>     bulk-in, bulk-out, intr, ctrl, iso or msc-read\n"
+	"    -t, --tcp-port=<port>     (Optional) usbip server port, default 3240\n"
+	"    -s, --size=<bytes>[K|M]   (Optional) bulk URB length or data of a READ(10), default 64K\n"
+	"    -p, --packets=<n>         (Optional) packets of an iso URB, default 8\n"
+	"    -q, --depth=<n>           (Optional) in-flight URBs, default 4\n"
+	"    -R, --rtt=<usec>          (Optional) round trip time added to every URB, default 0\n"
+	"    -d, --duration=<sec>      (Optional) time to submit URBs, default 5\n"
+	"    -n, --count=<n>           (Optional) number of URBs, instead of a duration\n"
+	"    -T, --timeout=<sec>       (Optional) time to wait for the last replies, default 10\n"
+	"    -o, --output=<file>       (Optional) report file to append a result to\n"
+	"    -L, --label=<label>       (Optional) label of a result in a report file, default \"-\"\n";
+
+static void
+usbip_bench_usage(void)
+{
+	printf("%s", usbip_bench_usage_string);
+}
+
+static int
+recv_data(bench_t *bench, struct usbip_header *hdr, void *buf, uint32_t len_buf)
+{
+	uint32_t	len = 0;
+
+	if (hdr->base.command != USBIP_RET_SUBMIT) {
+		err("unexpected command: %x", hdr->base.command);
+		return -1;
+	}
+	if (bench->is_in) {
+		if (hdr->u.ret_submit.actual_length < 0 || (uint32_t)hdr->u.ret_submit.actual_length > len_buf) {
+			err("invalid actual length: %d", hdr->u.ret_submit.actual_length);
+			return -1;
+		}
+		len = hdr->u.ret_submit.actual_length;
+	}
+	if (len > 0 && usbip_net_recv(bench->sockfd, buf, len) < 0)
+		return -1;
+	return (int)len;
+}
+
+/* finds the first endpoint of a workload and selects its alternate setting */
+static int
+setup_endpoint(bench_t *bench, uint8_t xfer_type)
+{
+	unsigned char	*dsc;
+	uint8_t	ifnum = 0, altnum = 0;
+	int	len, i;
+	BOOL	found = FALSE;
+
+	dsc = tools_get_conf_desc(bench->sockfd, bench->devid, &len);
+	if (dsc == NULL)
+		return -1;
+	for (i = 0; i + 2 <= len && dsc[i] >= 2; i += dsc[i]) {
+		if (dsc[i + 1] == 4 && i + 4 <= len) {
+			ifnum = dsc[i + 2];
+			altnum = dsc[i + 3];
+		}
+		else if (dsc[i + 1] == 5 && i + 7 <= len &&
+			 (dsc[i + 3] & 0x03) == xfer_type && ((dsc[i + 2] & 0x80) != 0) == bench->is_in) {
+			uint16_t	maxp = dsc[i + 4] | (dsc[i + 5] << 8);
+
+			bench->ep = dsc[i + 2] & 0x7f;
+			/* an interrupt URB is a packet and an iso packet is a frame */
+			if (xfer_type != EP_XFER_BULK)
+				bench->len = maxp & 0x7ff;
+			bench->interval = dsc[i + 6];
+			found = TRUE;
+			break;
+		}
+	}
+	free(dsc);
+
+	if (!found) {
+		err("no %s endpoint", workload_names[bench->wl]);
+		return -1;
+	}
+	if (altnum != 0) {
+		uint8_t	setup[8] = { 0x01, 11, altnum, 0, ifnum, 0, 0, 0 };
+
+		if (tools_control_sync(bench->sockfd, bench->devid, setup, NULL, 0) < 0) {
+			err("failed to set interface %u to alternate setting %u", ifnum, altnum);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* a bulk transfer which waits for its reply like a class driver does. The actual length or -1 is returned. */
+static int
+bulk_sync(bench_t *bench, unsigned long seqnum, uint8_t ep, BOOL is_in, void *data, uint32_t len)
+{
+	struct usbip_header	hdr;
+	int32_t	len_recv;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_CMD_SUBMIT;
+	hdr.base.seqnum = seqnum;
+	hdr.base.devid = bench->devid;
+	hdr.base.direction = is_in ? USBIP_DIR_IN: USBIP_DIR_OUT;
+	hdr.base.ep = ep;
+	hdr.u.cmd_submit.transfer_buffer_length = len;
+	if (tools_send_pdu(bench->sockfd, &hdr, data, is_in ? 0: len, NULL, 0) < 0)
+		return -1;
+
+	if (usbip_net_recv(bench->sockfd, &hdr, sizeof(hdr)) < 0)
+		return -1;
+	tools_swap_header(&hdr, TRUE);
+	if (hdr.base.command != USBIP_RET_SUBMIT || hdr.base.seqnum != seqnum) {
+		err("unexpected reply: command %x, seqnum %u", hdr.base.command, hdr.base.seqnum);
+		return -1;
+	}
+	len_recv = hdr.u.ret_submit.actual_length;
+	if (len_recv < 0 || (uint32_t)len_recv > len) {
+		err("invalid actual length: %d", len_recv);
+		return -1;
+	}
+	if (is_in && len_recv > 0 && usbip_net_recv(bench->sockfd, data, len_recv) < 0)
+		return -1;
+	/* a reply arrives at a client after a round trip */
+	if (bench->rtt_us > 0)
+		tools_sleep_until_us(tools_now_us() + bench->rtt_us);
+	if (hdr.u.ret_submit.status != 0) {
+		dbg("bulk transfer failed: ep %u, status %d", ep, hdr.u.ret_submit.status);
+		return -1;
+	}
+	return len_recv;
+}
+
+/* a SCSI command of a bulk-only transport, which returns the length of an IN data stage or -1 */
+static int
+msc_command(bench_t *bench, unsigned long *pseqnum, const uint8_t *cb, void *data, uint32_t len)
+{
+	uint8_t	cbw[MSC_CBW_LEN], csw[MSC_CSW_LEN];
+	uint32_t	tag = (uint32_t)*pseqnum;
+	int	len_data = 0, i;
+
+	memset(cbw, 0, sizeof(cbw));
+	for (i = 0; i < 4; i++) {
+		cbw[i] = (uint8_t)(0x43425355 >> (i * 8));
+		cbw[4 + i] = (uint8_t)(tag >> (i * 8));
+		cbw[8 + i] = (uint8_t)(len >> (i * 8));
+	}
+	cbw[12] = 0x80;
+	cbw[14] = 10;
+	memcpy(cbw + 15, cb, 10);
+
+	if (bulk_sync(bench, (*pseqnum)++, bench->ep_out, FALSE, cbw, MSC_CBW_LEN) != MSC_CBW_LEN)
+		return -1;
+	if (len > 0) {
+		len_data = bulk_sync(bench, (*pseqnum)++, bench->ep, TRUE, data, len);
+		if (len_data < 0)
+			return -1;
+	}
+	if (bulk_sync(bench, (*pseqnum)++, bench->ep, TRUE, csw, MSC_CSW_LEN) != MSC_CSW_LEN)
+		return -1;
+	if (csw[0] != 'U' || csw[1] != 'S' || csw[2] != 'B' || csw[3] != 'S' || memcmp(csw + 4, cbw + 4, 4) != 0) {
+		err("invalid CSW");
+		return -1;
+	}
+	return csw[12] == 0 ? len_data: -1;
+}
+
+static int
+setup_msc(bench_t *bench)
+{
+	uint8_t	cb[10] = { 0x25 }, cap[8];
+	unsigned long	seqnum = 2;
+
+	bench->is_in = FALSE;
+	if (setup_endpoint(bench, EP_XFER_BULK) < 0)
+		return -1;
+	bench->ep_out = bench->ep;
+	bench->is_in = TRUE;
+	if (setup_endpoint(bench, EP_XFER_BULK) < 0)
+		return -1;
+	if (bench->len % MSC_BLOCK_SIZE != 0 || bench->len / MSC_BLOCK_SIZE > 0xffff) {
+		err("size of msc-read should be of up to 65535 blocks of %u bytes", MSC_BLOCK_SIZE);
+		return -1;
+	}
+	/* READ CAPACITY(10) */
+	if (msc_command(bench, &seqnum, cb, cap, sizeof(cap)) != sizeof(cap)) {
+		err("failed to read capacity");
+		return -1;
+	}
+	bench->n_blocks = ((cap[0] << 24) | (cap[1] << 16) | (cap[2] << 8) | cap[3]) + 1;
+	if (bench->n_blocks < bench->len / MSC_BLOCK_SIZE) {
+		err("medium of %u blocks is too small", bench->n_blocks);
+		return -1;
+	}
+	/* commands are issued one at a time */
+	bench->depth = 1;
+	return 0;
+}
+
+static int
+setup_workload(bench_t *bench)
+{
+	int	i;
+
+	switch (bench->wl) {
+	case WL_BULK_IN:
+	case WL_BULK_OUT:
+		bench->is_in = bench->wl == WL_BULK_IN;
+		if (setup_endpoint(bench, EP_XFER_BULK) < 0)
+			return -1;
+		break;
+	case WL_INTR:
+		bench->is_in = TRUE;
+		if (setup_endpoint(bench, EP_XFER_INTR) < 0)
+			return -1;
+		break;
+	case WL_CTRL:
+		/* GET_DESCRIPTOR of a device descriptor */
+		bench->is_in = TRUE;
+		bench->ep = 0;
+		bench->len = 18;
+		break;
+	case WL_ISO:
+		bench->is_in = TRUE;
+		if (setup_endpoint(bench, EP_XFER_ISO) < 0)
+			return -1;
+		bench->descs = (struct usbip_iso_packet_descriptor *)calloc(bench->n_packets, USBIP_ISO_DESC_SIZE);
+		if (bench->descs == NULL) {
+			err("out of memory");
+			return -1;
+		}
+		for (i = 0; i < bench->n_packets; i++) {
+			bench->descs[i].offset = bench->len * i;
+			bench->descs[i].length = bench->len;
+		}
+		bench->len *= bench->n_packets;
+		bench->next_frame = -1;
+		break;
+	case WL_MSC_READ:
+		if (setup_msc(bench) < 0)
+			return -1;
+		break;
+	}
+
+	if (!bench->is_in) {
+		bench->data_out = (unsigned char *)malloc(bench->len);
+		if (bench->data_out == NULL) {
+			err("out of memory");
+			return -1;
+		}
+		for (i = 0; (uint32_t)i < bench->len; i++)
+			bench->data_out[i] = (unsigned char)i;
+	}
+	return 0;
+}
+
+static void
+complete_urb(bench_t *bench, unsigned long seqnum, int32_t status, uint32_t actual_length, uint64_t t_done)
+{
+	bench_slot_t	*slot;
+
+	pthread_mutex_lock(&bench->lock);
+	slot = &bench->slots[seqnum % N_BENCH_SLOTS];
+	if (!slot->busy) {
+		err("unexpected reply: seqnum %lu", seqnum);
+		bench->failed = TRUE;
+		pthread_cond_broadcast(&bench->cond);
+		pthread_mutex_unlock(&bench->lock);
+		return;
+	}
+	slot->busy = FALSE;
+	tools_lat_add(&bench->lat, t_done - slot->ts_sent);
+	if (status != 0)
+		bench->n_errors++;
+	else
+		bench->bytes += bench->is_in ? actual_length: bench->len;
+	bench->t_last_done = t_done;
+	bench->n_done++;
+	bench->n_inflight--;
+	pthread_cond_broadcast(&bench->cond);
+	pthread_mutex_unlock(&bench->lock);
+}
+
+static void
+count_frames(bench_t *bench, struct usbip_header *hdr, struct usbip_iso_packet_descriptor *descs)
+{
+	int	n_pkts = hdr->u.ret_submit.number_of_packets;
+	int	i;
+
+	tools_swap_iso_descs(descs, n_pkts);
+	for (i = 0; i < n_pkts; i++) {
+		if (descs[i].status == 0 && descs[i].actual_length > 0)
+			bench->n_frames++;
+	}
+	/* a frame number has 11 bits */
+	if (bench->next_frame >= 0 && hdr->u.ret_submit.start_frame != bench->next_frame)
+		bench->n_frame_gaps++;
+	bench->next_frame = (hdr->u.ret_submit.start_frame + n_pkts) & 0x7ff;
+}
+
+static int
+recv_ret_submit(bench_t *bench, struct usbip_header *hdr, unsigned char *buf)
+{
+	uint64_t	now;
+	int	len;
+
+	len = recv_data(bench, hdr, buf, bench->len);
+	if (len < 0)
+		return -1;
+	if (bench->wl == WL_ISO && hdr->u.ret_submit.number_of_packets > 0) {
+		struct usbip_iso_packet_descriptor	descs[USBIP_MAX_ISO_PACKETS];
+
+		if (hdr->u.ret_submit.number_of_packets > bench->n_packets) {
+			err("invalid number of packets: %d", hdr->u.ret_submit.number_of_packets);
+			return -1;
+		}
+		if (usbip_net_recv(bench->sockfd, descs, hdr->u.ret_submit.number_of_packets * USBIP_ISO_DESC_SIZE) < 0)
+			return -1;
+		count_frames(bench, hdr, descs);
+	}
+	now = tools_now_us();
+
+	if (bench->wl == WL_INTR && bench->t_last_recv != 0)
+		tools_lat_add(&bench->intervals, now - bench->t_last_recv);
+	bench->t_last_recv = now;
+
+	if (bench->rtt_us == 0) {
+		complete_urb(bench, hdr->base.seqnum, hdr->u.ret_submit.status, hdr->u.ret_submit.actual_length, now);
+		return 0;
+	}
+
+	pthread_mutex_lock(&bench->lock);
+	bench->delayed[bench->delayed_tail % N_BENCH_SLOTS].seqnum = hdr->base.seqnum;
+	bench->delayed[bench->delayed_tail % N_BENCH_SLOTS].t_recv = now;
+	bench->delayed[bench->delayed_tail % N_BENCH_SLOTS].status = hdr->u.ret_submit.status;
+	bench->delayed[bench->delayed_tail % N_BENCH_SLOTS].actual_length = hdr->u.ret_submit.actual_length;
+	bench->delayed_tail++;
+	pthread_cond_broadcast(&bench->cond);
+	pthread_mutex_unlock(&bench->lock);
+	return 0;
+}
+
+static void *
+receiver(void *ctx)
+{
+	bench_t	*bench = (bench_t *)ctx;
+	unsigned char	*buf;
+
+	buf = (unsigned char *)malloc(bench->len > 0 ? bench->len: 1);
+	while (buf != NULL) {
+		struct usbip_header	hdr;
+
+		if (usbip_net_recv(bench->sockfd, &hdr, sizeof(hdr)) < 0)
+			break;
+		tools_swap_header(&hdr, TRUE);
+		if (recv_ret_submit(bench, &hdr, buf) < 0)
+			break;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&bench->lock);
+	bench->receiver_done = TRUE;
+	if (bench->n_done + (bench->delayed_tail - bench->delayed_head) < bench->n_sent)
+		bench->failed = TRUE;
+	pthread_cond_broadcast(&bench->cond);
+	pthread_mutex_unlock(&bench->lock);
+	return NULL;
+}
+
+/*
+ * An injected RTT holds back every reply. A client only sees a reply after a round trip anyway,
+ * so for the throughput and latency of a window of URBs, it makes no difference whether a delay
+ * occurs on the way out or back.
+ */
+static void *
+releaser(void *ctx)
+{
+	bench_t	*bench = (bench_t *)ctx;
+
+	pthread_mutex_lock(&bench->lock);
+	while (TRUE) {
+		bench_reply_t	reply;
+
+		while (bench->delayed_head == bench->delayed_tail && !bench->receiver_done)
+			pthread_cond_wait(&bench->cond, &bench->lock);
+		if (bench->delayed_head == bench->delayed_tail)
+			break;
+		reply = bench->delayed[bench->delayed_head % N_BENCH_SLOTS];
+		bench->delayed_head++;
+		pthread_mutex_unlock(&bench->lock);
+
+		tools_sleep_until_us(reply.t_recv + bench->rtt_us);
+		complete_urb(bench, reply.seqnum, reply.status, reply.actual_length, reply.t_recv + bench->rtt_us);
+
+		pthread_mutex_lock(&bench->lock);
+	}
+	pthread_mutex_unlock(&bench->lock);
+	return NULL;
+}
+
+static int
+submit_urb(bench_t *bench, unsigned long seqnum)
+{
+	struct usbip_header	hdr;
+	int	n_pkts = bench->wl == WL_ISO ? bench->n_packets: 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_CMD_SUBMIT;
+	hdr.base.seqnum = seqnum;
+	hdr.base.devid = bench->devid;
+	hdr.base.direction = bench->is_in ? USBIP_DIR_IN: USBIP_DIR_OUT;
+	hdr.base.ep = bench->ep;
+	hdr.u.cmd_submit.transfer_buffer_length = bench->len;
+	hdr.u.cmd_submit.interval = bench->interval;
+	hdr.u.cmd_submit.number_of_packets = n_pkts;
+	if (bench->wl == WL_ISO) {
+		/* URB_ISO_ASAP */
+		hdr.u.cmd_submit.transfer_flags = 0x0002;
+	}
+	else if (bench->wl == WL_CTRL) {
+		static const uint8_t	setup[8] = { 0x80, 6, 0, 1, 0, 0, 18, 0 };
+
+		memcpy(hdr.u.cmd_submit.setup, setup, 8);
+	}
+	return tools_send_pdu(bench->sockfd, &hdr, bench->data_out, bench->is_in ? 0: bench->len, bench->descs, n_pkts);
+}
+
+static void
+send_urbs(bench_t *bench, unsigned secs, size_t count)
+{
+	uint64_t	t_end = bench->t_start + (uint64_t)secs * 1000000;
+	/* seqnum 1 was used by control transfers of a setup */
+	unsigned long	seqnum = 1;
+	struct timespec	ts;
+
+	/* a device may hold URBs, such as a bulk IN without data */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += secs;
+
+	while (count > 0 ? bench->n_sent < count: tools_now_us() < t_end) {
+		BOOL	timedout = FALSE;
+
+		pthread_mutex_lock(&bench->lock);
+		while (bench->n_inflight >= bench->depth && !bench->failed && !timedout) {
+			if (count > 0)
+				pthread_cond_wait(&bench->cond, &bench->lock);
+			else
+				timedout = pthread_cond_timedwait(&bench->cond, &bench->lock, &ts) == ETIMEDOUT;
+		}
+		if (bench->failed || timedout) {
+			pthread_mutex_unlock(&bench->lock);
+			return;
+		}
+		seqnum++;
+		bench->slots[seqnum % N_BENCH_SLOTS].busy = TRUE;
+		bench->slots[seqnum % N_BENCH_SLOTS].ts_sent = tools_now_us();
+		bench->n_inflight++;
+		bench->n_sent++;
+		pthread_mutex_unlock(&bench->lock);
+
+		if (submit_urb(bench, seqnum) < 0) {
+			err("failed to send CMD_SUBMIT");
+			return;
+		}
+	}
+}
+
+/* sequential READ(10) commands, which wrap around at the end of a medium */
+static void
+run_msc_read(bench_t *bench, unsigned secs, size_t count)
+{
+	uint64_t	t_end = bench->t_start + (uint64_t)secs * 1000000;
+	/* seqnums up to 4 were used by a setup */
+	unsigned long	seqnum = 5;
+	uint32_t	n_blocks = bench->len / MSC_BLOCK_SIZE, lba = 0;
+	unsigned char	*buf;
+
+	buf = (unsigned char *)malloc(bench->len);
+	if (buf == NULL) {
+		err("out of memory");
+		return;
+	}
+	while (count > 0 ? bench->n_sent < count: tools_now_us() < t_end) {
+		uint8_t	cb[10] = { 0x28 };
+		uint64_t	t_sent = tools_now_us(), now;
+		int	len;
+
+		if (lba + n_blocks > bench->n_blocks)
+			lba = 0;
+		cb[2] = (uint8_t)(lba >> 24);
+		cb[3] = (uint8_t)(lba >> 16);
+		cb[4] = (uint8_t)(lba >> 8);
+		cb[5] = (uint8_t)lba;
+		cb[7] = (uint8_t)(n_blocks >> 8);
+		cb[8] = (uint8_t)n_blocks;
+		bench->n_sent++;
+		len = msc_command(bench, &seqnum, cb, buf, bench->len);
+		if (len < 0) {
+			/* a transport which failed cannot go on without a reset recovery */
+			err("READ(10) failed: lba %u", lba);
+			bench->n_errors++;
+			break;
+		}
+		now = tools_now_us();
+		tools_lat_add(&bench->lat, now - t_sent);
+		bench->bytes += len;
+		bench->t_last_done = now;
+		bench->n_done++;
+		lba += n_blocks;
+	}
+	free(buf);
+}
+
+static void
+wait_replies(bench_t *bench, unsigned timeout)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout;
+
+	pthread_mutex_lock(&bench->lock);
+	while (bench->n_done < bench->n_sent && !bench->failed) {
+		if (pthread_cond_timedwait(&bench->cond, &bench->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&bench->lock);
+}
+
+static void
+get_extra(bench_t *bench, double secs, char *extra, size_t len)
+{
+	switch (bench->wl) {
+	case WL_INTR:
+		snprintf(extra, len, "interval_p50=%u,interval_p99=%u",
+			 tools_lat_percentile(&bench->intervals, 50), tools_lat_percentile(&bench->intervals, 99));
+		break;
+	case WL_ISO:
+		snprintf(extra, len, "frames_s=%.1f,gaps=%zu", secs > 0 ? bench->n_frames / secs: 0, bench->n_frame_gaps);
+		break;
+	default:
+		snprintf(extra, len, "-");
+		break;
+	}
+}
+
+static void
+print_report(bench_t *bench, const char *busid, double secs)
+{
+	printf("%s %s ep %u: %u bytes, depth %u, rtt %llu us\n", workload_names[bench->wl], busid, bench->ep,
+	       bench->len, bench->depth, (unsigned long long)bench->rtt_us);
+	printf("urbs: %zu/%zu in %.3f s, %.1f URB/s, %zu errors\n", bench->n_done, bench->n_sent, secs,
+	       secs > 0 ? bench->n_done / secs: 0, bench->n_errors);
+	printf("data: %llu bytes(%.2f MB/s)\n", (unsigned long long)bench->bytes, secs > 0 ? bench->bytes / secs / 1000000: 0);
+	if (bench->wl == WL_ISO)
+		printf("frames: %zu(%.1f/s), %zu gaps\n", bench->n_frames, secs > 0 ? bench->n_frames / secs: 0, bench->n_frame_gaps);
+	printf("\n");
+
+	tools_lat_print_header(stdout);
+	tools_lat_print(&bench->lat, "latency", stdout);
+	tools_lat_print(&bench->intervals, "interval", stdout);
+}
+
+static int
+append_report(bench_t *bench, const char *path, const char *label, const char *busid, double secs)
+{
+	FILE	*fp;
+	char	extra[64];
+
+	fp = fopen(path, "a");
+	if (fp == NULL) {
+		err("cannot open: %s", path);
+		return -1;
+	}
+	if (ftell(fp) == 0)
+		fprintf(fp, "#label\tworkload\tbusid\tsize\tdepth\trtt_us\tsecs\turbs\turb_s\tmb_s\terrors\tmean_us\tp50_us\tp90_us\tp99_us\tmax_us\textra\n");
+	get_extra(bench, secs, extra, sizeof(extra));
+	fprintf(fp, "%s\t%s\t%s\t%u\t%u\t%llu\t%.3f\t%zu\t%.1f\t%.2f\t%zu\t%llu\t%u\t%u\t%u\t%u\t%s\n",
+		label, workload_names[bench->wl], busid, bench->len, bench->depth, (unsigned long long)bench->rtt_us,
+		secs, bench->n_done, secs > 0 ? bench->n_done / secs: 0, secs > 0 ? bench->bytes / secs / 1000000: 0,
+		bench->n_errors, (unsigned long long)(bench->lat.n > 0 ? bench->lat.sum / bench->lat.n: 0),
+		tools_lat_percentile(&bench->lat, 50), tools_lat_percentile(&bench->lat, 90),
+		tools_lat_percentile(&bench->lat, 99), tools_lat_percentile(&bench->lat, 100), extra);
+	fclose(fp);
+	return 0;
+}
+
+/* URBs in flight up to a depth */
+static int
+run_window(bench_t *bench, unsigned secs, size_t count, unsigned timeout)
+{
+	pthread_t	thread_recv, thread_rel;
+
+	if (pthread_create(&thread_recv, NULL, receiver, bench) != 0) {
+		err("failed to create receiver thread");
+		return -1;
+	}
+	if (bench->rtt_us > 0 && pthread_create(&thread_rel, NULL, releaser, bench) != 0) {
+		err("failed to create releaser thread");
+		shutdown(bench->sockfd, SHUT_RDWR);
+		pthread_join(thread_recv, NULL);
+		return -1;
+	}
+	send_urbs(bench, secs, count);
+	wait_replies(bench, timeout);
+
+	/* unblock the receiver */
+	shutdown(bench->sockfd, SHUT_RDWR);
+	pthread_join(thread_recv, NULL);
+	if (bench->rtt_us > 0)
+		pthread_join(thread_rel, NULL);
+	return 0;
+}
+
+static int
+run_bench(bench_t *bench, const char *host, const char *busid, unsigned secs, size_t count, unsigned timeout,
+	  const char *path_report, const char *label)
+{
+	struct usbip_usb_device	udev;
+	double	elapsed;
+	int	ret = 0;
+
+	bench->sockfd = tools_import(host, usbip_port_string, busid, &udev);
+	if (bench->sockfd == INVALID_SOCKET)
+		return 1;
+	bench->devid = (udev.busnum << 16) | udev.devnum;
+	if (setup_workload(bench) < 0) {
+		closesocket(bench->sockfd);
+		return 1;
+	}
+
+	info("benchmarking %s of %s:%s/%s", workload_names[bench->wl], host, usbip_port_string, busid);
+	bench->t_start = tools_now_us();
+	if (bench->wl == WL_MSC_READ)
+		run_msc_read(bench, secs, count);
+	else if (run_window(bench, secs, count, timeout) < 0) {
+		closesocket(bench->sockfd);
+		return 1;
+	}
+	closesocket(bench->sockfd);
+
+	elapsed = bench->t_last_done > bench->t_start ? (bench->t_last_done - bench->t_start) / 1000000.0: 0;
+	print_report(bench, busid, elapsed);
+	if (bench->n_done < bench->n_sent) {
+		err("%zu URBs without reply", bench->n_sent - bench->n_done);
+		ret = 1;
+	}
+	if (path_report != NULL && append_report(bench, path_report, label, busid, elapsed) < 0)
+		ret = 1;
+	return ret;
+}
+
+static int
+parse_size(const char *str, uint32_t *psize)
+{
+	unsigned	size;
+	char	unit = '\0';
+
+	if (sscanf(str, "%u%c", &size, &unit) < 1)
+		return -1;
+	if (unit == 'K' || unit == 'k')
+		size *= 1024;
+	else if (unit == 'M' || unit == 'm')
+		size *= 1024 * 1024;
+	else if (unit != '\0')
+		return -1;
+	if (size == 0 || size > MAX_BENCH_LEN)
+		return -1;
+	*psize = size;
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "remote", required_argument, NULL, 'r' },
+		{ "busid", required_argument, NULL, 'b' },
+		{ "workload", required_argument, NULL, 'w' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "size", required_argument, NULL, 's' },
+		{ "packets", required_argument, NULL, 'p' },
+		{ "depth", required_argument, NULL, 'q' },
+		{ "rtt", required_argument, NULL, 'R' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "count", required_argument, NULL, 'n' },
+		{ "timeout", required_argument, NULL, 'T' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "label", required_argument, NULL, 'L' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static bench_t	bench;
+	char	*host = NULL, *busid = NULL, *path_report = NULL, *label = "-";
+	unsigned	secs = 5, timeout = 10, n_packets = 8;
+	unsigned long long	rtt = 0;
+	size_t	count = 0;
+	BOOL	wl_set = FALSE;
+	int	opt, ret;
+	unsigned	i;
+
+	bench.len = 64 * 1024;
+	bench.depth = 4;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "r:b:w:t:s:p:q:R:d:n:T:o:L:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'r':
+			host = optarg;
+			break;
+		case 'b':
+			busid = optarg;
+			break;
+		case 'w':
+			for (i = 0; i < sizeof(workload_names) / sizeof(workload_names[0]); i++) {
+				if (strcmp(optarg, workload_names[i]) == 0)
+					break;
+			}
+			if (i == sizeof(workload_names) / sizeof(workload_names[0])) {
+				err("unknown workload: %s", optarg);
+				return 1;
+			}
+			bench.wl = (workload_t)i;
+			wl_set = TRUE;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 's':
+			if (parse_size(optarg, &bench.len) < 0) {
+				err("invalid size: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (sscanf(optarg, "%u", &n_packets) != 1 || n_packets == 0 || n_packets > USBIP_MAX_ISO_PACKETS) {
+				err("invalid number of packets: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			if (sscanf(optarg, "%u", &bench.depth) != 1 || bench.depth == 0 || bench.depth > MAX_BENCH_DEPTH) {
+				err("invalid depth: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'R':
+			if (sscanf(optarg, "%llu", &rtt) != 1) {
+				err("invalid rtt: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			if (sscanf(optarg, "%u", &secs) != 1 || secs == 0) {
+				err("invalid duration: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if (sscanf(optarg, "%zu", &count) != 1 || count == 0) {
+				err("invalid count: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			if (sscanf(optarg, "%u", &timeout) != 1) {
+				err("invalid timeout: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			path_report = optarg;
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		default:
+			usbip_bench_usage();
+			return 1;
+		}
+	}
+
+	if (host == NULL || busid == NULL || !wl_set || optind != argc) {
+		usbip_bench_usage();
+		return 1;
+	}
+
+	bench.rtt_us = rtt;
+	bench.n_packets = (int)n_packets;
+	tools_lat_init(&bench.lat);
+	tools_lat_init(&bench.intervals);
+	pthread_mutex_init(&bench.lock, NULL);
+	pthread_cond_init(&bench.cond, NULL);
+
+	ret = run_bench(&bench, host, busid, secs, count, timeout, path_report, label);
+
+	tools_lat_free(&bench.lat);
+	tools_lat_free(&bench.intervals);
+	pthread_mutex_destroy(&bench.lock);
+	pthread_cond_destroy(&bench.cond);
+	free(bench.data_out);
+	free(bench.descs);
+	return ret;
+}
@@ -0,0 +1,1182 @@
+/*
+ * usbip-emul: a usbip server of emulated USB devices
+ *
+ * It answers OP_REQ_DEVLIST and OP_REQ_IMPORT like usbipd and serves URBs of
+ * emulated devices, so that a client or forwarder can be tested without USB hardware.
+ */
+
+#include <ws2tcpip.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "usbip_emul.h"
+#include "stub_bot.h"
+
+#define MAX_EMUL_DEVS		16
+#define MAX_EMUL_INTERFACES	16
+/* the largest transfer buffer accepted */
+#define MAX_EMUL_XFER_LEN	(16 * 1024 * 1024)
+
+#define EMUL_BOT_STAGE_DATA	0
+#define EMUL_BOT_STAGE_CSW	1
+#define EMUL_BOT_N_STAGES	2
+#define MAX_EMUL_BOT_REQS	16
+
+/*
+ * The same acceleration of a bulk-only mass storage as BotAccelLen and BotCacheLen of the stub,
+ * whose stub_bot.c parses CBWs and caches READ(10)s here as well. A data stage and a CSW are URBs
+ * which a device model serves right after a CBW, and whose results are held for next CMD_SUBMITs
+ * of a bulk IN endpoint.
+ */
+typedef struct {
+	/* bulk endpoints of a bulk-only interface, or ep_in of 0 if no acceleration is done */
+	unsigned	ep_in, ep_out;
+	bot_cbw_t	cbw;
+	/* stages in flight or done, NULL if not a part of a current command */
+	emul_urb_t	*stages[EMUL_BOT_N_STAGES];
+	BOOL	done[EMUL_BOT_N_STAGES];
+	/* a stage which a next CMD_SUBMIT is served by, and its data served so far */
+	unsigned	idx_stage;
+	uint32_t	len_served;
+	/* a current command is READ(10) whose data may be cached */
+	BOOL	cacheable;
+	ULONG	lba, n_blocks;
+	/* CMD_SUBMITs waiting for stages in order */
+	unsigned long	seqnums_waiting[MAX_EMUL_BOT_REQS];
+	uint32_t	lens_waiting[MAX_EMUL_BOT_REQS];
+	unsigned	n_waiting;
+	bot_cache_t	cache;
+	unsigned	n_cmds, n_accelerated;
+} emul_bot_t;
+
+struct emul_conn {
+	SOCKET	sockfd;
+	emul_dev_t	*dev;
+	/* scheduled URBs sorted by due */
+	struct list_head	urbs_timed;
+	/* URBs waiting for a device event */
+	struct list_head	urbs_parked;
+	emul_bot_t	bot;
+};
+
+static const struct {
+	const char	*name;
+	const emul_dev_ops_t	*ops;
+} dev_types[] = {
+	{ "msc", &emul_msc_ops },
+	{ "hid", &emul_hid_ops },
+	{ "acm", &emul_acm_ops },
+	{ "iso", &emul_iso_ops },
+	{ "zero", &emul_zero_ops },
+	{ "combo", &emul_combo_ops }
+};
+
+static emul_dev_t	devs[MAX_EMUL_DEVS];
+static int	n_devs;
+/* protects conn of devs */
+static pthread_mutex_t	lock_devs = PTHREAD_MUTEX_INITIALIZER;
+/* maximum length of a data stage submitted with a CBW, 0 if disabled, and size of a READ(10) cache */
+static uint32_t	bot_accel_len, bot_cache_len;
+
+static const char usbip_emul_usage_string[] =
+	"usage: usbip-emul <args>\n"
+	"    -d, --device=<type>[:<arg>]  Add an emulated device. Bus ID's are 1-1, 1-2, ... in order.\n"
+	"                                   msc:<file>   bulk-only mass storage backed by a file\n"
+	"                                   hid[:<hz>]   HID mouse reporting at hz, default 125\n"
+	"                                   acm          CDC-ACM loopback\n"
+	"                                   iso[:<len>]  isochronous IN source of len bytes per frame, default 192\n"
+	"                                   zero         bulk IN source and OUT sink\n"
+	"                                   combo[:<hz>] HID mouse reporting at hz, default 1000, and zero\n"
+	"    -l, --latency=<usec>         (Optional) service latency of every URB, default 0\n"
+	"    -a, --bot-accel=<bytes>[:<cache bytes>]\n"
+	"                                 (Optional) submit stages of a bulk-only mass storage command of up to\n"
+	"                                 bytes with its CBW, and cache READ(10)s, like the stub. default 0\n"
+	"    -t, --tcp-port=<port>        (Optional) listening port, default 3240\n"
+	"    -D, --debug                  (Optional) print debugging information\n";
+
+static void
+usbip_emul_usage(void)
+{
+	printf("%s", usbip_emul_usage_string);
+}
+
+void
+emul_schedule(emul_dev_t *dev, emul_urb_t *urb, uint64_t due)
+{
+	struct list_head	*p;
+
+	urb->due_us = due;
+	/* dues mostly increase, so search from the tail */
+	for (p = dev->conn->urbs_timed.prev; p != &dev->conn->urbs_timed; p = p->prev) {
+		if (list_entry(p, emul_urb_t, list)->due_us <= due)
+			break;
+	}
+	list_add(&urb->list, p);
+}
+
+void
+emul_park(emul_dev_t *dev, emul_urb_t *urb)
+{
+	list_add(&urb->list, dev->conn->urbs_parked.prev);
+}
+
+emul_urb_t *
+emul_take_parked(emul_dev_t *dev, unsigned ep, BOOL is_in)
+{
+	struct list_head	*p;
+
+	list_for_each(p, &dev->conn->urbs_parked) {
+		emul_urb_t	*urb = list_entry(p, emul_urb_t, list);
+
+		if (EMUL_URB_EP(urb) == ep && EMUL_URB_IS_IN(urb) == is_in) {
+			list_del(p);
+			return urb;
+		}
+	}
+	return NULL;
+}
+
+void
+emul_urb_set_data(emul_urb_t *urb, const void *data, uint32_t len)
+{
+	if (len > EMUL_URB_LEN(urb))
+		len = EMUL_URB_LEN(urb);
+	memcpy(urb->buf, data, len);
+	urb->actual_length = len;
+}
+
+static void
+free_urb(emul_urb_t *urb)
+{
+	free(urb->buf);
+	free(urb->descs);
+	free(urb);
+}
+
+static void
+free_urbs(struct list_head *head)
+{
+	struct list_head	*p, *n;
+
+	list_for_each_safe(p, n, head) {
+		list_del(p);
+		free_urb(list_entry(p, emul_urb_t, list));
+	}
+}
+
+static BOOL
+get_string_descriptor(emul_dev_t *dev, emul_urb_t *urb, uint8_t idx)
+{
+	uint8_t	dsc[256];
+	const char	*str;
+	int	i;
+
+	if (idx == 0) {
+		/* English(US) only */
+		static const uint8_t	dsc_langid[] = { 4, 3, 0x09, 0x04 };
+
+		emul_urb_set_data(urb, dsc_langid, sizeof(dsc_langid));
+		return TRUE;
+	}
+	if (idx > dev->n_strings)
+		return FALSE;
+	str = dev->strings[idx - 1];
+	for (i = 0; str[i] != '\0' && i < 126; i++) {
+		dsc[2 + i * 2] = (uint8_t)str[i];
+		dsc[3 + i * 2] = 0;
+	}
+	dsc[0] = (uint8_t)(2 + i * 2);
+	dsc[1] = 3;
+	emul_urb_set_data(urb, dsc, dsc[0]);
+	return TRUE;
+}
+
+static BOOL
+get_descriptor(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup)
+{
+	switch (setup[3]) {
+	case 1:
+		emul_urb_set_data(urb, dev->dsc_dev, dev->dsc_dev[0]);
+		return TRUE;
+	case 2:
+		emul_urb_set_data(urb, dev->dsc_conf, EMUL_CONF_LEN(dev->dsc_conf));
+		return TRUE;
+	case 3:
+		return get_string_descriptor(dev, urb, setup[2]);
+	default:
+		/* a device qualifier is not supported either, as a full speed device */
+		return FALSE;
+	}
+}
+
+static BOOL
+handle_std_request(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup)
+{
+	static const uint8_t	zeros[2];
+
+	switch (setup[1]) {
+	case 0:	/* GET_STATUS */
+		emul_urb_set_data(urb, zeros, 2);
+		return TRUE;
+	case 1:	/* CLEAR_FEATURE */
+	case 3:	/* SET_FEATURE */
+	case 5:	/* SET_ADDRESS */
+	case 9:	/* SET_CONFIGURATION */
+	case 11: /* SET_INTERFACE */
+		return TRUE;
+	case 6:	/* GET_DESCRIPTOR */
+		/* class descriptors of an interface such as a HID report descriptor */
+		if ((setup[0] & 0x1f) == 1)
+			return dev->ops->control ? dev->ops->control(dev, urb, setup): FALSE;
+		return get_descriptor(dev, urb, setup);
+	case 8:	/* GET_CONFIGURATION */
+		emul_urb_set_data(urb, dev->dsc_conf + 5, 1);
+		return TRUE;
+	case 10: /* GET_INTERFACE */
+		emul_urb_set_data(urb, zeros, 1);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+handle_control(emul_dev_t *dev, emul_urb_t *urb, uint64_t now)
+{
+	const uint8_t	*setup = urb->hdr.u.cmd_submit.setup;
+	BOOL	ok;
+
+	if ((setup[0] & 0x60) == 0)
+		ok = handle_std_request(dev, urb, setup);
+	else
+		ok = dev->ops->control ? dev->ops->control(dev, urb, setup): FALSE;
+	if (!ok) {
+		dbg("stall: control request: %02x %02x", setup[0], setup[1]);
+		urb->status = -USBIP_EPIPE;
+		urb->actual_length = 0;
+	}
+	emul_schedule(dev, urb, now + dev->latency_us);
+}
+
+/* iso IN data goes packed by actual lengths */
+static uint32_t
+pack_iso_data(emul_urb_t *urb)
+{
+	uint32_t	len = 0;
+	int	i;
+
+	for (i = 0; i < EMUL_URB_N_PACKETS(urb); i++) {
+		if (urb->descs[i].offset != len)
+			memmove(urb->buf + len, urb->buf + urb->descs[i].offset, urb->descs[i].actual_length);
+		len += urb->descs[i].actual_length;
+	}
+	return len;
+}
+
+static int
+send_ret_submit(emul_conn_t *conn, emul_urb_t *urb)
+{
+	struct usbip_header	hdr;
+	int	n_pkts = EMUL_URB_N_PACKETS(urb) > 0 ? EMUL_URB_N_PACKETS(urb): 0;
+	uint32_t	len_data = 0;
+
+	/* like linux usbip-host, RET_SUBMIT has neither devid nor endpoint */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_RET_SUBMIT;
+	hdr.base.seqnum = urb->hdr.base.seqnum;
+	hdr.u.ret_submit.status = urb->status;
+	hdr.u.ret_submit.actual_length = urb->actual_length;
+	hdr.u.ret_submit.start_frame = urb->start_frame;
+	hdr.u.ret_submit.number_of_packets = n_pkts;
+	hdr.u.ret_submit.error_count = urb->error_count;
+
+	if (EMUL_URB_IS_IN(urb))
+		len_data = n_pkts > 0 ? pack_iso_data(urb): urb->actual_length;
+	return tools_send_pdu(conn->sockfd, &hdr, urb->buf, len_data, urb->descs, n_pkts);
+}
+
+static void
+init_bot_accel(emul_conn_t *conn)
+{
+	emul_bot_t	*bot = &conn->bot;
+	const uint8_t	*dsc_conf = conn->dev->dsc_conf;
+	unsigned	len = EMUL_CONF_LEN(dsc_conf), offset;
+	BOOL	in_bot = FALSE;
+
+	memset(bot, 0, sizeof(emul_bot_t));
+	bot->idx_stage = EMUL_BOT_N_STAGES;
+	if (bot_accel_len == 0)
+		return;
+	for (offset = 0; offset + 2 <= len && dsc_conf[offset] >= 2; offset += dsc_conf[offset]) {
+		const uint8_t	*dsc = dsc_conf + offset;
+
+		if (dsc[1] == 4 && dsc[0] >= 9 && offset + 9 <= len)
+			in_bot = BOT_IS_INTERFACE(dsc[5], dsc[6], dsc[7]) && bot->ep_out == 0;
+		else if (in_bot && dsc[1] == 5 && dsc[0] >= 7 && offset + 7 <= len && (dsc[3] & 0x03) == 2) {
+			if (dsc[2] & 0x80)
+				bot->ep_in = dsc[2] & 0x0f;
+			else
+				bot->ep_out = dsc[2] & 0x0f;
+		}
+	}
+	if (bot->ep_in == 0 || bot->ep_out == 0) {
+		bot->ep_in = 0;
+		return;
+	}
+	bot_cache_init(&bot->cache, NULL, 0);
+	if (bot_cache_len > 0) {
+		UCHAR	*buf = (UCHAR *)malloc(bot_cache_len);
+
+		if (buf != NULL)
+			bot_cache_init(&bot->cache, buf, bot_cache_len);
+	}
+}
+
+static void
+free_bot_stages(emul_bot_t *bot)
+{
+	int	i;
+
+	for (i = 0; i < EMUL_BOT_N_STAGES; i++) {
+		if (bot->stages[i] == NULL)
+			continue;
+		/* one in flight is in a list of a connection */
+		if (!bot->done[i])
+			list_del(&bot->stages[i]->list);
+		free_urb(bot->stages[i]);
+		bot->stages[i] = NULL;
+		bot->done[i] = FALSE;
+	}
+	bot->idx_stage = EMUL_BOT_N_STAGES;
+	bot->len_served = 0;
+	bot->cacheable = FALSE;
+}
+
+static void
+free_bot_accel(emul_conn_t *conn)
+{
+	emul_bot_t	*bot = &conn->bot;
+
+	if (bot->ep_in == 0)
+		return;
+	info("%s: bot-accel: %u commands, %u accelerated, cache %u hits, %u misses", conn->dev->busid,
+	     bot->n_cmds, bot->n_accelerated, bot->cache.n_hits, bot->cache.n_misses);
+	free_bot_stages(bot);
+	free(bot->cache.buf);
+}
+
+static void
+advance_bot_stage(emul_bot_t *bot)
+{
+	do {
+		bot->idx_stage++;
+	} while (bot->idx_stage < EMUL_BOT_N_STAGES && bot->stages[bot->idx_stage] == NULL);
+	bot->len_served = 0;
+}
+
+/* a CMD_SUBMIT gets data of a current stage from where a previous one has left */
+static int
+reply_bot_req(emul_conn_t *conn, unsigned long seqnum, uint32_t len_req)
+{
+	emul_bot_t	*bot = &conn->bot;
+	emul_urb_t	*stage = bot->stages[bot->idx_stage];
+	emul_urb_t	reply;
+	uint32_t	len = 0;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.hdr.base.seqnum = seqnum;
+	reply.hdr.base.direction = USBIP_DIR_IN;
+	reply.status = stage->status;
+	if (stage->status == 0) {
+		len = stage->actual_length - bot->len_served;
+		if (len > len_req)
+			len = len_req;
+		reply.buf = stage->buf + bot->len_served;
+		bot->len_served += len;
+	}
+	else {
+		bot->len_served = stage->actual_length;
+	}
+	reply.actual_length = len;
+	if (bot->len_served == stage->actual_length)
+		advance_bot_stage(bot);
+	return send_ret_submit(conn, &reply);
+}
+
+static int
+serve_bot_reqs(emul_conn_t *conn)
+{
+	emul_bot_t	*bot = &conn->bot;
+
+	while (bot->n_waiting > 0 && bot->idx_stage < EMUL_BOT_N_STAGES && bot->done[bot->idx_stage]) {
+		unsigned long	seqnum = bot->seqnums_waiting[0];
+		uint32_t	len_req = bot->lens_waiting[0];
+
+		bot->n_waiting--;
+		memmove(bot->seqnums_waiting, bot->seqnums_waiting + 1, bot->n_waiting * sizeof(unsigned long));
+		memmove(bot->lens_waiting, bot->lens_waiting + 1, bot->n_waiting * sizeof(uint32_t));
+		if (reply_bot_req(conn, seqnum, len_req) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* stages left by a client are discarded, and CMD_SUBMITs waiting for them fail */
+static int
+abort_bot_stages(emul_conn_t *conn)
+{
+	emul_bot_t	*bot = &conn->bot;
+
+	free_bot_stages(bot);
+	while (bot->n_waiting > 0) {
+		emul_urb_t	reply;
+
+		bot->n_waiting--;
+		memset(&reply, 0, sizeof(reply));
+		reply.hdr.base.seqnum = bot->seqnums_waiting[bot->n_waiting];
+		reply.status = -1;
+		if (send_ret_submit(conn, &reply) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* a class reset or clearing a halt of a bulk-only interface aborts a command and drops a cache */
+static int
+reset_bot_accel(emul_conn_t *conn, const uint8_t *setup)
+{
+	emul_bot_t	*bot = &conn->bot;
+	unsigned	ep = setup[4] & 0x0f;
+
+	if (bot->ep_in == 0)
+		return 0;
+	if (!(setup[0] == 0x21 && setup[1] == BOT_REQUEST_RESET) &&
+	    !(setup[0] == 0x02 && setup[1] == 1 && (ep == bot->ep_in || ep == bot->ep_out)))
+		return 0;
+	bot_cache_invalidate(&bot->cache);
+	return abort_bot_stages(conn);
+}
+
+static emul_urb_t *
+new_bot_stage(emul_conn_t *conn, uint32_t len)
+{
+	emul_urb_t	*urb;
+
+	urb = (emul_urb_t *)calloc(1, sizeof(emul_urb_t));
+	if (urb == NULL)
+		return NULL;
+	urb->buf = (unsigned char *)calloc(1, len);
+	if (urb->buf == NULL) {
+		free(urb);
+		return NULL;
+	}
+	urb->hdr.base.command = USBIP_CMD_SUBMIT;
+	urb->hdr.base.direction = USBIP_DIR_IN;
+	urb->hdr.base.ep = conn->bot.ep_in;
+	urb->hdr.u.cmd_submit.transfer_buffer_length = len;
+	urb->bot_stage = TRUE;
+	return urb;
+}
+
+static void
+finish_bot_cmd(emul_bot_t *bot)
+{
+	emul_urb_t	*data = bot->stages[EMUL_BOT_STAGE_DATA];
+	emul_urb_t	*csw = bot->stages[EMUL_BOT_STAGE_CSW];
+	ULONG	residue = 0;
+	UCHAR	status = BOT_CSW_PHASE_ERROR;
+
+	if (bot->cache.buf == NULL)
+		return;
+	if (csw->status == 0)
+		status = bot_parse_csw(csw->buf, csw->actual_length, bot->cbw.tag, &residue);
+	if (status != BOT_CSW_PASSED) {
+		bot_cache_invalidate(&bot->cache);
+		return;
+	}
+	if (bot->cacheable && data != NULL && bot->done[EMUL_BOT_STAGE_DATA] && data->status == 0 &&
+	    residue == 0 && data->actual_length == bot->cbw.len_data)
+		bot_cache_store(&bot->cache, bot->cbw.lun, bot->lba, bot->n_blocks, data->buf, data->actual_length);
+}
+
+static int
+done_bot_stage(emul_conn_t *conn, emul_urb_t *urb)
+{
+	emul_bot_t	*bot = &conn->bot;
+	int	i;
+
+	for (i = 0; i < EMUL_BOT_N_STAGES; i++) {
+		if (bot->stages[i] == urb)
+			bot->done[i] = TRUE;
+	}
+	if (urb == bot->stages[EMUL_BOT_STAGE_CSW])
+		finish_bot_cmd(bot);
+	return serve_bot_reqs(conn);
+}
+
+/* a READ(10) of cached blocks has a data stage and a CSW without a device */
+static BOOL
+fill_bot_stages_cached(emul_conn_t *conn, const UCHAR *data)
+{
+	emul_bot_t	*bot = &conn->bot;
+	emul_urb_t	*stage_data, *stage_csw;
+
+	stage_data = new_bot_stage(conn, bot->cbw.len_data);
+	stage_csw = new_bot_stage(conn, BOT_CSW_LEN);
+	if (stage_data == NULL || stage_csw == NULL) {
+		if (stage_data != NULL)
+			free_urb(stage_data);
+		if (stage_csw != NULL)
+			free_urb(stage_csw);
+		return FALSE;
+	}
+	memcpy(stage_data->buf, data, bot->cbw.len_data);
+	stage_data->actual_length = bot->cbw.len_data;
+	bot_build_csw(stage_csw->buf, bot->cbw.tag, 0, BOT_CSW_PASSED);
+	stage_csw->actual_length = BOT_CSW_LEN;
+
+	bot->stages[EMUL_BOT_STAGE_DATA] = stage_data;
+	bot->stages[EMUL_BOT_STAGE_CSW] = stage_csw;
+	bot->done[EMUL_BOT_STAGE_DATA] = bot->done[EMUL_BOT_STAGE_CSW] = TRUE;
+	bot->idx_stage = EMUL_BOT_STAGE_DATA;
+	bot->cacheable = FALSE;
+	return TRUE;
+}
+
+static int
+submit_bot_cbw(emul_conn_t *conn, emul_urb_t *urb, uint64_t now)
+{
+	emul_bot_t	*bot = &conn->bot;
+	emul_dev_t	*dev = conn->dev;
+	bot_cbw_t	cbw;
+	int	i;
+
+	if (!bot_parse_cbw(urb->buf, EMUL_URB_LEN(urb), &cbw))
+		return 0;
+	if (abort_bot_stages(conn) < 0)
+		return -1;
+
+	bot->cbw = cbw;
+	bot->n_cmds++;
+	if (!bot_is_read_only(&cbw))
+		bot_cache_invalidate(&bot->cache);
+	bot->cacheable = bot->cache.buf != NULL && bot_get_read10(&cbw, &bot->lba, &bot->n_blocks);
+
+	if (bot->cacheable) {
+		const UCHAR	*data = bot_cache_lookup(&bot->cache, cbw.lun, bot->lba, bot->n_blocks, cbw.len_data);
+
+		if (data != NULL && fill_bot_stages_cached(conn, data)) {
+			/* a CBW is taken as if a device has received it */
+			urb->actual_length = BOT_CBW_LEN;
+			emul_schedule(dev, urb, now);
+			return 1;
+		}
+	}
+
+	/* a CBW goes first so that a device model is in its data or status phase for stages */
+	dev->ops->submit(dev, urb, now);
+
+	if (cbw.is_in && cbw.len_data > 0) {
+		if (cbw.len_data <= bot_accel_len) {
+			bot->stages[EMUL_BOT_STAGE_DATA] = new_bot_stage(conn, cbw.len_data);
+			if (bot->stages[EMUL_BOT_STAGE_DATA] != NULL)
+				bot->stages[EMUL_BOT_STAGE_CSW] = new_bot_stage(conn, BOT_CSW_LEN);
+		}
+	}
+	else {
+		bot->stages[EMUL_BOT_STAGE_CSW] = new_bot_stage(conn, BOT_CSW_LEN);
+	}
+	bot->idx_stage = EMUL_BOT_N_STAGES;
+	for (i = EMUL_BOT_N_STAGES - 1; i >= 0; i--) {
+		if (bot->stages[i] != NULL)
+			bot->idx_stage = i;
+	}
+	if (bot->idx_stage == EMUL_BOT_N_STAGES) {
+		bot->cacheable = FALSE;
+		return 1;
+	}
+	bot->n_accelerated++;
+	for (i = 0; i < EMUL_BOT_N_STAGES; i++) {
+		if (bot->stages[i] != NULL)
+			dev->ops->submit(dev, bot->stages[i], now);
+	}
+	return 1;
+}
+
+/* 1 if a CMD_SUBMIT is taken by an accelerator, 0 if it should go on, or -1 on error */
+static int
+submit_bot_req(emul_conn_t *conn, emul_urb_t *urb, uint64_t now)
+{
+	emul_bot_t	*bot = &conn->bot;
+
+	if (bot->ep_in == 0)
+		return 0;
+	if (!EMUL_URB_IS_IN(urb)) {
+		if (EMUL_URB_EP(urb) != bot->ep_out)
+			return 0;
+		return submit_bot_cbw(conn, urb, now);
+	}
+	if (EMUL_URB_EP(urb) != bot->ep_in || bot->idx_stage >= EMUL_BOT_N_STAGES || bot->n_waiting == MAX_EMUL_BOT_REQS)
+		return 0;
+	bot->seqnums_waiting[bot->n_waiting] = urb->hdr.base.seqnum;
+	bot->lens_waiting[bot->n_waiting] = EMUL_URB_LEN(urb);
+	bot->n_waiting++;
+	free_urb(urb);
+	return serve_bot_reqs(conn) < 0 ? -1: 1;
+}
+
+/* CMD_SUBMITs waiting for stages which a range covers are forgotten. ep of -1 means any. */
+static int
+take_bot_reqs(emul_conn_t *conn, unsigned long seqnum_first, unsigned long seqnum_last, int ep)
+{
+	emul_bot_t	*bot = &conn->bot;
+	unsigned	i, n_kept = 0;
+	int	n_taken = 0;
+
+	if (ep >= 0 && (unsigned)ep != bot->ep_in)
+		return 0;
+	for (i = 0; i < bot->n_waiting; i++) {
+		if (USBIP_UNLINK_BATCH_HAS(seqnum_first, seqnum_last, bot->seqnums_waiting[i])) {
+			n_taken++;
+			continue;
+		}
+		bot->seqnums_waiting[n_kept] = bot->seqnums_waiting[i];
+		bot->lens_waiting[n_kept] = bot->lens_waiting[i];
+		n_kept++;
+	}
+	bot->n_waiting = n_kept;
+	return n_taken;
+}
+
+static int
+send_ret_unlink(emul_conn_t *conn, unsigned long seqnum, int32_t status)
+{
+	struct usbip_header	hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_RET_UNLINK;
+	hdr.base.seqnum = seqnum;
+	hdr.u.ret_unlink.status = status;
+	return tools_send_pdu(conn->sockfd, &hdr, NULL, 0, NULL, 0);
+}
+
+static emul_urb_t *
+take_urb(struct list_head *head, unsigned long seqnum)
+{
+	struct list_head	*p;
+
+	list_for_each(p, head) {
+		emul_urb_t	*urb = list_entry(p, emul_urb_t, list);
+
+		if (urb->hdr.base.seqnum == seqnum && !urb->bot_stage) {
+			list_del(p);
+			return urb;
+		}
+	}
+	return NULL;
+}
+
+static int
+handle_cmd_unlink(emul_conn_t *conn, struct usbip_header *hdr)
+{
+	emul_urb_t	*urb;
+
+	urb = take_urb(&conn->urbs_timed, hdr->u.cmd_unlink.seqnum);
+	if (urb == NULL)
+		urb = take_urb(&conn->urbs_parked, hdr->u.cmd_unlink.seqnum);
+	if (urb == NULL) {
+		unsigned long	seqnum = hdr->u.cmd_unlink.seqnum;
+
+		if (take_bot_reqs(conn, seqnum, seqnum, -1) > 0)
+			return send_ret_unlink(conn, hdr->base.seqnum, -USBIP_ECONNRESET);
+		return send_ret_unlink(conn, hdr->base.seqnum, 0);
+	}
+	free_urb(urb);
+	return send_ret_unlink(conn, hdr->base.seqnum, -USBIP_ECONNRESET);
+}
+
+/* frees URBs of head which a batch covers, and returns how many */
+static int
+take_batch_urbs(struct list_head *head, struct usbip_header *hdr)
+{
+	struct usbip_header_cmd_unlink_batch	*batch = &hdr->u.cmd_unlink_batch;
+	struct list_head	*p, *n;
+	int	n_taken = 0;
+
+	list_for_each_safe(p, n, head) {
+		emul_urb_t	*urb = list_entry(p, emul_urb_t, list);
+
+		if (urb->bot_stage)
+			continue;
+		if (!USBIP_UNLINK_BATCH_HAS(batch->seqnum_first, batch->seqnum_last, urb->hdr.base.seqnum))
+			continue;
+		if ((batch->flags & USBIP_UNLINK_BATCH_EP) && EMUL_URB_EP(urb) != hdr->base.ep)
+			continue;
+		list_del(p);
+		free_urb(urb);
+		n_taken++;
+	}
+	return n_taken;
+}
+
+static int
+handle_cmd_unlink_batch(emul_conn_t *conn, struct usbip_header *hdr)
+{
+	int	ep = (hdr->u.cmd_unlink_batch.flags & USBIP_UNLINK_BATCH_EP) ? (int)hdr->base.ep: -1;
+	int	n_taken;
+
+	n_taken = take_batch_urbs(&conn->urbs_timed, hdr);
+	n_taken += take_batch_urbs(&conn->urbs_parked, hdr);
+	n_taken += take_bot_reqs(conn, hdr->u.cmd_unlink_batch.seqnum_first, hdr->u.cmd_unlink_batch.seqnum_last, ep);
+	return send_ret_unlink(conn, hdr->base.seqnum, n_taken > 0 ? -USBIP_ECONNRESET: 0);
+}
+
+static int
+handle_cmd_submit(emul_conn_t *conn, struct usbip_header *hdr)
+{
+	emul_dev_t	*dev = conn->dev;
+	emul_urb_t	*urb;
+	int32_t	len = hdr->u.cmd_submit.transfer_buffer_length;
+	int32_t	n_pkts = hdr->u.cmd_submit.number_of_packets;
+	int	ret;
+
+	if (len < 0 || len > MAX_EMUL_XFER_LEN || n_pkts > USBIP_MAX_ISO_PACKETS) {
+		err("invalid CMD_SUBMIT: length %d, packets %d", len, n_pkts);
+		return -1;
+	}
+	urb = (emul_urb_t *)calloc(1, sizeof(emul_urb_t));
+	if (urb == NULL)
+		return -1;
+	urb->hdr = *hdr;
+	urb->buf = (unsigned char *)calloc(1, len > 0 ? len: 1);
+	if (urb->buf == NULL)
+		goto err_out;
+	if (!EMUL_URB_IS_IN(urb) && usbip_net_recv(conn->sockfd, urb->buf, len) < 0)
+		goto err_out;
+	if (n_pkts > 0) {
+		urb->descs = (struct usbip_iso_packet_descriptor *)calloc(n_pkts, USBIP_ISO_DESC_SIZE);
+		if (urb->descs == NULL || usbip_net_recv(conn->sockfd, urb->descs, n_pkts * USBIP_ISO_DESC_SIZE) < 0)
+			goto err_out;
+		tools_swap_iso_descs(urb->descs, n_pkts);
+	}
+
+	if (EMUL_URB_EP(urb) == 0) {
+		if (reset_bot_accel(conn, urb->hdr.u.cmd_submit.setup) < 0)
+			goto err_out;
+		handle_control(dev, urb, tools_now_us());
+	}
+	else if (EMUL_URB_EP(urb) > 15) {
+		urb->status = -USBIP_EPIPE;
+		emul_schedule(dev, urb, tools_now_us());
+	}
+	else {
+		ret = submit_bot_req(conn, urb, tools_now_us());
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			dev->ops->submit(dev, urb, tools_now_us());
+	}
+	return 0;
+err_out:
+	free_urb(urb);
+	return -1;
+}
+
+static int
+recv_pdu(emul_conn_t *conn)
+{
+	struct usbip_header	hdr;
+
+	if (usbip_net_recv(conn->sockfd, &hdr, sizeof(hdr)) < 0)
+		return -1;
+	tools_swap_header(&hdr, TRUE);
+
+	switch (hdr.base.command) {
+	case USBIP_CMD_SUBMIT:
+		return handle_cmd_submit(conn, &hdr);
+	case USBIP_CMD_UNLINK:
+		return handle_cmd_unlink(conn, &hdr);
+	case USBIP_CMD_UNLINK_BATCH:
+		return handle_cmd_unlink_batch(conn, &hdr);
+	default:
+		err("unknown command: %x", hdr.base.command);
+		return -1;
+	}
+}
+
+static int
+complete_due_urbs(emul_conn_t *conn, uint64_t now)
+{
+	while (!list_empty(&conn->urbs_timed)) {
+		emul_urb_t	*urb = list_entry(conn->urbs_timed.next, emul_urb_t, list);
+		int	ret;
+
+		if (urb->due_us > now)
+			break;
+		list_del(&urb->list);
+		if (urb->bot_stage) {
+			if (done_bot_stage(conn, urb) < 0)
+				return -1;
+			continue;
+		}
+		ret = send_ret_submit(conn, urb);
+		free_urb(urb);
+		if (ret < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+run_conn(emul_conn_t *conn)
+{
+	struct pollfd	pfd;
+
+	pfd.fd = conn->sockfd;
+	pfd.events = POLLIN;
+
+	while (TRUE) {
+		struct timespec	ts, *pts = NULL;
+		uint64_t	now = tools_now_us();
+		int	ret;
+
+		if (complete_due_urbs(conn, now) < 0)
+			break;
+		if (!list_empty(&conn->urbs_timed)) {
+			uint64_t	wait = list_entry(conn->urbs_timed.next, emul_urb_t, list)->due_us - now;
+
+			ts.tv_sec = wait / 1000000;
+			ts.tv_nsec = (wait % 1000000) * 1000;
+			pts = &ts;
+		}
+		ret = ppoll(&pfd, 1, pts, NULL);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (ret > 0 && recv_pdu(conn) < 0)
+			break;
+	}
+}
+
+static void
+fill_udev(emul_dev_t *dev, struct usbip_usb_device *udev)
+{
+	const uint8_t	*dsc = dev->dsc_dev;
+
+	memset(udev, 0, sizeof(*udev));
+	snprintf(udev->path, sizeof(udev->path), "/emul/%s/%s", dev->ops->name, dev->busid);
+	strcpy(udev->busid, dev->busid);
+	udev->busnum = 1;
+	udev->devnum = dev->devnum;
+	udev->speed = dev->speed;
+	udev->idVendor = dsc[8] | (dsc[9] << 8);
+	udev->idProduct = dsc[10] | (dsc[11] << 8);
+	udev->bcdDevice = dsc[12] | (dsc[13] << 8);
+	udev->bDeviceClass = dsc[4];
+	udev->bDeviceSubClass = dsc[5];
+	udev->bDeviceProtocol = dsc[6];
+	udev->bConfigurationValue = dev->dsc_conf[5];
+	udev->bNumConfigurations = dsc[17];
+	udev->bNumInterfaces = dev->dsc_conf[4];
+}
+
+/* the same walk as usbip_get_conf_interfaces(), whose usbip_common.c needs the windows names database */
+static int
+get_interfaces(emul_dev_t *dev, struct usbip_usb_interface *uinfs)
+{
+	const uint8_t	*dsc_conf = dev->dsc_conf;
+	unsigned	len = EMUL_CONF_LEN(dsc_conf), offset;
+	int	n_uinfs = 0;
+
+	for (offset = dsc_conf[0]; offset + 9 <= len && n_uinfs < MAX_EMUL_INTERFACES; offset += dsc_conf[offset]) {
+		const uint8_t	*dsc = dsc_conf + offset;
+
+		if (dsc[0] < 2)
+			break;
+		if (dsc[1] != 4 || dsc[3] != 0)
+			continue;
+		uinfs[n_uinfs].bInterfaceClass = dsc[5];
+		uinfs[n_uinfs].bInterfaceSubClass = dsc[6];
+		uinfs[n_uinfs].bInterfaceProtocol = dsc[7];
+		uinfs[n_uinfs].padding = 0;
+		n_uinfs++;
+	}
+	return n_uinfs;
+}
+
+static int
+send_reply_devlist(SOCKET sockfd)
+{
+	struct op_devlist_reply	reply;
+	int	i;
+
+	if (usbip_net_send_op_common(sockfd, OP_REP_DEVLIST, ST_OK) < 0)
+		return -1;
+	reply.ndev = n_devs;
+	PACK_OP_DEVLIST_REPLY(1, &reply);
+	if (usbip_net_send(sockfd, &reply, sizeof(reply)) < 0)
+		return -1;
+
+	for (i = 0; i < n_devs; i++) {
+		struct usbip_usb_device	udev;
+		struct usbip_usb_interface	uinfs[MAX_EMUL_INTERFACES];
+		int	n_uinfs;
+
+		fill_udev(devs + i, &udev);
+		n_uinfs = get_interfaces(devs + i, uinfs);
+		/* a client reads bNumInterfaces records */
+		udev.bNumInterfaces = (uint8_t)n_uinfs;
+		usbip_net_pack_usb_device(1, &udev);
+		if (usbip_net_send(sockfd, &udev, sizeof(udev)) < 0 ||
+		    usbip_net_send(sockfd, uinfs, n_uinfs * sizeof(struct usbip_usb_interface)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static emul_dev_t *
+get_dev(const char *busid)
+{
+	int	i;
+
+	for (i = 0; i < n_devs; i++) {
+		if (strcmp(devs[i].busid, busid) == 0)
+			return devs + i;
+	}
+	return NULL;
+}
+
+static int
+send_reply_import(SOCKET sockfd, emul_dev_t *dev, uint32_t ext_flags)
+{
+	struct usbip_usb_device	udev;
+	uint32_t	len_conf = EMUL_CONF_LEN(dev->dsc_conf);
+
+	if (usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_OK) < 0)
+		return -1;
+	fill_udev(dev, &udev);
+	ext_flags &= (USBIP_IMPORT_EXT_CONF_DESC | USBIP_IMPORT_EXT_UNLINK_BATCH);
+	if (ext_flags != 0)
+		usbip_net_set_import_ext(udev.busid, ext_flags);
+	usbip_net_pack_usb_device(1, &udev);
+	if (usbip_net_send(sockfd, &udev, sizeof(udev)) < 0)
+		return -1;
+
+	if (ext_flags & USBIP_IMPORT_EXT_CONF_DESC) {
+		uint32_t	len = htonl(len_conf);
+
+		if (usbip_net_send(sockfd, &len, sizeof(len)) < 0 ||
+		    usbip_net_send(sockfd, (void *)dev->dsc_conf, len_conf) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+serve_import(SOCKET sockfd)
+{
+	struct op_import_request	req;
+	emul_conn_t	conn;
+	emul_dev_t	*dev;
+
+	if (usbip_net_recv(sockfd, &req, sizeof(req)) < 0)
+		return;
+	PACK_OP_IMPORT_REQUEST(0, &req);
+
+	pthread_mutex_lock(&lock_devs);
+	dev = get_dev(req.busid);
+	if (dev == NULL || dev->conn != NULL) {
+		pthread_mutex_unlock(&lock_devs);
+		info("import rejected: %.*s", USBIP_BUS_ID_SIZE, req.busid);
+		usbip_net_send_op_common(sockfd, OP_REP_IMPORT, ST_NA);
+		return;
+	}
+	memset(&conn, 0, sizeof(conn));
+	conn.sockfd = sockfd;
+	conn.dev = dev;
+	INIT_LIST_HEAD(&conn.urbs_timed);
+	INIT_LIST_HEAD(&conn.urbs_parked);
+	init_bot_accel(&conn);
+	dev->conn = &conn;
+	pthread_mutex_unlock(&lock_devs);
+
+	if (send_reply_import(sockfd, dev, usbip_net_get_import_ext(req.busid)) == 0) {
+		info("%s: imported: %s", dev->busid, dev->ops->name);
+		if (dev->ops->reset)
+			dev->ops->reset(dev);
+		run_conn(&conn);
+		info("%s: disconnected", dev->busid);
+	}
+
+	free_bot_accel(&conn);
+	free_urbs(&conn.urbs_timed);
+	free_urbs(&conn.urbs_parked);
+	pthread_mutex_lock(&lock_devs);
+	dev->conn = NULL;
+	pthread_mutex_unlock(&lock_devs);
+}
+
+static void *
+serve_conn(void *ctx)
+{
+	SOCKET	sockfd = (SOCKET)(intptr_t)ctx;
+	uint16_t	code = OP_UNSPEC;
+
+	if (usbip_net_recv_op_common(sockfd, &code) == 0) {
+		switch (code) {
+		case OP_REQ_DEVLIST:
+			send_reply_devlist(sockfd);
+			break;
+		case OP_REQ_IMPORT:
+			serve_import(sockfd);
+			break;
+		default:
+			err("unknown op code: %x", code);
+			break;
+		}
+	}
+	closesocket(sockfd);
+	return NULL;
+}
+
+static void
+accept_loop(SOCKET sockfd)
+{
+	while (TRUE) {
+		SOCKET	connfd;
+		pthread_t	thread;
+
+		connfd = accept(sockfd, NULL, NULL);
+		if (connfd == INVALID_SOCKET) {
+			if (errno == EINTR)
+				continue;
+			err("failed to accept: %s", strerror(errno));
+			break;
+		}
+		usbip_net_set_nodelay(connfd);
+		if (pthread_create(&thread, NULL, serve_conn, (void *)(intptr_t)connfd) != 0) {
+			err("failed to create thread");
+			closesocket(connfd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+static int
+add_dev(const char *spec, uint64_t latency_us)
+{
+	emul_dev_t	*dev;
+	const char	*arg;
+	size_t	len_type;
+	unsigned	i;
+
+	if (n_devs == MAX_EMUL_DEVS) {
+		err("too many devices");
+		return -1;
+	}
+	arg = strchr(spec, ':');
+	len_type = arg ? (size_t)(arg - spec): strlen(spec);
+	if (arg)
+		arg++;
+
+	dev = devs + n_devs;
+	for (i = 0; i < sizeof(dev_types) / sizeof(dev_types[0]); i++) {
+		if (strlen(dev_types[i].name) == len_type && strncmp(dev_types[i].name, spec, len_type) == 0)
+			dev->ops = dev_types[i].ops;
+	}
+	if (dev->ops == NULL) {
+		err("unknown device type: %s", spec);
+		return -1;
+	}
+	snprintf(dev->busid, sizeof(dev->busid), "1-%d", n_devs + 1);
+	dev->devnum = n_devs + 2;
+	dev->speed = USB_SPEED_FULL;
+	dev->latency_us = latency_us;
+	if (dev->ops->init(dev, arg) < 0)
+		return -1;
+	info("%s: %s", dev->busid, spec);
+	n_devs++;
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "device", required_argument, NULL, 'd' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "bot-accel", required_argument, NULL, 'a' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "debug", no_argument, NULL, 'D' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char	*specs[MAX_EMUL_DEVS];
+	int	n_specs = 0;
+	uint64_t	latency_us = 0;
+	SOCKET	sockfd;
+	int	opt, i;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "d:l:a:t:D", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'd':
+			if (n_specs == MAX_EMUL_DEVS) {
+				err("too many devices");
+				return 1;
+			}
+			specs[n_specs++] = optarg;
+			break;
+		case 'l':
+			if (sscanf(optarg, "%llu", (unsigned long long *)&latency_us) != 1) {
+				err("invalid latency: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'a':
+			if (sscanf(optarg, "%u:%u", &bot_accel_len, &bot_cache_len) < 1 || bot_accel_len > MAX_EMUL_XFER_LEN) {
+				err("invalid bot-accel length: %s", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'D':
+			usbip_use_debug = 1;
+			break;
+		default:
+			usbip_emul_usage();
+			return 1;
+		}
+	}
+	if (n_specs == 0 || optind != argc) {
+		usbip_emul_usage();
+		return 1;
+	}
+
+	/* a peer closing a connection should not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < n_specs; i++) {
+		if (add_dev(specs[i], latency_us) < 0)
+			return 1;
+	}
+
+	sockfd = tools_listen(usbip_port_string);
+	if (sockfd == INVALID_SOCKET)
+		return 1;
+	info("listening on port %s", usbip_port_string);
+	accept_loop(sockfd);
+	closesocket(sockfd);
+	return 1;
+}
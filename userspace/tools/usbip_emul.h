@@ -0,0 +1,88 @@
+#pragma once
+
+/*
+ * Emulated USB devices of usbip-emul
+ *
+ * A connection which has imported a device runs a single thread. CMD_SUBMIT's are handed to
+ * a device model, which completes a URB at a due time or parks it until it can be completed.
+ * Because everything of a connection happens on its thread, device models need no lock.
+ */
+
+#include <stdint.h>
+
+#include "usbip_tools.h"
+#include "list.h"
+
+typedef struct emul_conn	emul_conn_t;
+typedef struct emul_dev		emul_dev_t;
+
+typedef struct {
+	struct list_head	list;
+	/* CMD_SUBMIT in host byte order */
+	struct usbip_header	hdr;
+	/* transfer buffer of transfer_buffer_length bytes */
+	unsigned char	*buf;
+	struct usbip_iso_packet_descriptor	*descs;
+
+	/* result */
+	int32_t		status;
+	uint32_t	actual_length;
+	int32_t		start_frame, error_count;
+	uint64_t	due_us;
+	/* a stage of a bulk-only mass storage command submitted by -a */
+	BOOL	bot_stage;
+} emul_urb_t;
+
+#define EMUL_URB_EP(urb)	((urb)->hdr.base.ep)
+#define EMUL_URB_IS_IN(urb)	((urb)->hdr.base.direction == USBIP_DIR_IN)
+#define EMUL_URB_LEN(urb)	((uint32_t)(urb)->hdr.u.cmd_submit.transfer_buffer_length)
+#define EMUL_URB_N_PACKETS(urb)	((urb)->hdr.u.cmd_submit.number_of_packets)
+
+typedef struct {
+	const char	*name;
+	/* arg is a string after ':' of a device option, or NULL */
+	int	(*init)(emul_dev_t *dev, const char *arg);
+	/* called when a device is imported */
+	void	(*reset)(emul_dev_t *dev);
+	/* class or vendor request. FALSE makes it stall */
+	BOOL	(*control)(emul_dev_t *dev, emul_urb_t *urb, const uint8_t *setup);
+	/* URB to a non-control endpoint, which should be scheduled or parked */
+	void	(*submit)(emul_dev_t *dev, emul_urb_t *urb, uint64_t now);
+} emul_dev_ops_t;
+
+struct emul_dev {
+	char	busid[USBIP_BUS_ID_SIZE];
+	uint32_t	devnum;
+	const emul_dev_ops_t	*ops;
+
+	uint32_t	speed;
+	const uint8_t	*dsc_dev;
+	const uint8_t	*dsc_conf;
+	const char	**strings;
+	int	n_strings;
+	/* service latency of every URB */
+	uint64_t	latency_us;
+
+	/* connection importing this device, NULL if available */
+	emul_conn_t	*conn;
+	void	*priv;
+};
+
+/* wTotalLength of a configuration descriptor */
+#define EMUL_CONF_LEN(dsc_conf)	((dsc_conf)[2] | ((dsc_conf)[3] << 8))
+
+/* URB completes at due */
+void emul_schedule(emul_dev_t *dev, emul_urb_t *urb, uint64_t due);
+/* URB waits for emul_take_parked() */
+void emul_park(emul_dev_t *dev, emul_urb_t *urb);
+/* the oldest parked URB of an endpoint */
+emul_urb_t *emul_take_parked(emul_dev_t *dev, unsigned ep, BOOL is_in);
+/* copies data up to the transfer buffer length and sets actual_length */
+void emul_urb_set_data(emul_urb_t *urb, const void *data, uint32_t len);
+
+extern const emul_dev_ops_t	emul_msc_ops;
+extern const emul_dev_ops_t	emul_hid_ops;
+extern const emul_dev_ops_t	emul_acm_ops;
+extern const emul_dev_ops_t	emul_iso_ops;
+extern const emul_dev_ops_t	emul_zero_ops;
+extern const emul_dev_ops_t	emul_combo_ops;
@@ -0,0 +1,177 @@
+/*
+ * usbip-enum-bench: cost of enumerating exportable devices in usbipd
+ *
+ * usbipd_stub.c and usbip_setupdi.c run as they are over a mocked SetupDi layer. Each round
+ * lists devices like OP_REQ_DEVLIST and then imports every stub device like OP_REQ_IMPORT.
+ * A round is run with an index which is built again for every use, as without device change
+ * notifications, and with an index kept until a notification. SetupDi calls, device opens
+ * and ioctls are counted per round along with their modeled cost.
+ */
+
+#include <stdio.h>
+#include <getopt.h>
+
+#include "usbip_tools.h"
+#include "usbipd_stub.h"
+#include "mock_setupdi.h"
+
+static const char usbip_enum_bench_usage_string[] =
+	"usage: usbip-enum-bench <args>\n"
+	"    -n, --devices=<n>       usb devices, default 128\n"
+	"    -e, --exportable=<n>    devices with a stub interface, default 60\n"
+	"    -r, --rounds=<n>        rounds of a devlist and imports, default 100\n"
+	"    -c, --change=<n>        notify a device change every n rounds, default 0 for never\n"
+	"    -C, --cost=<enum>,<call>,<open>,<ioctl>\n"
+	"                            modeled cost in usec of SetupDiGetClassDevs, other SetupDi calls,\n"
+	"                            opening a device and an ioctl, default 2000,20,500,50\n";
+
+static void
+usbip_enum_bench_usage(void)
+{
+	printf("%s", usbip_enum_bench_usage_string);
+}
+
+typedef struct {
+	devno_t	devnos[256];
+	unsigned	n_devnos;
+} listed_t;
+
+static void
+walker_listed(struct usbip_usb_device *pudev, const unsigned char *dsc_conf, unsigned len, void *ctx)
+{
+	listed_t	*listed = (listed_t *)ctx;
+
+	(void)dsc_conf; (void)len;
+	listed->devnos[listed->n_devnos++] = (devno_t)pudev->devnum;
+}
+
+/* returns the number of imported devices */
+static unsigned
+run_round(void)
+{
+	listed_t	listed;
+	unsigned	n_imported = 0;
+	unsigned	i;
+
+	listed.n_devnos = 0;
+	walk_udevs(walker_listed, &listed);
+
+	/* like clients, import every listed device by busid */
+	for (i = 0; i < listed.n_devnos; i++) {
+		struct usbip_usb_device	udev;
+		unsigned char	*dsc_conf;
+		unsigned	len;
+		HANDLE	hdev;
+
+		if (!build_udev(listed.devnos[i], &udev, &dsc_conf, &len))
+			continue;
+		free(dsc_conf);
+		hdev = open_stub_dev(listed.devnos[i]);
+		if (hdev != INVALID_HANDLE_VALUE) {
+			n_imported++;
+			CloseHandle(hdev);
+		}
+	}
+	return n_imported;
+}
+
+static int
+run_bench(const char *name, BOOL notified, unsigned rounds, unsigned change)
+{
+	mock_counters_t	counters;
+	uint64_t	start_us, elapsed_us;
+	unsigned	i;
+
+	set_stub_devs_notified(notified);
+	mock_reset_counters();
+	start_us = tools_now_us();
+	for (i = 0; i < rounds; i++) {
+		if (change > 0 && i > 0 && i % change == 0)
+			invalidate_stub_devs();
+		if (run_round() != mock_n_stubs()) {
+			err("%s: round %u: not all devices are imported", name, i);
+			return 1;
+		}
+	}
+	elapsed_us = tools_now_us() - start_us;
+	mock_get_counters(&counters);
+
+	printf("%-8s %10.1f %10.1f %10.1f %10.1f %12.1f %10.1f\n", name,
+	       (double)counters.n_enums / rounds, (double)counters.n_calls / rounds,
+	       (double)counters.n_opens / rounds, (double)counters.n_ioctls / rounds,
+	       (double)counters.cost_us / rounds / 1000, (double)elapsed_us / rounds);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "devices", required_argument, NULL, 'n' },
+		{ "exportable", required_argument, NULL, 'e' },
+		{ "rounds", required_argument, NULL, 'r' },
+		{ "change", required_argument, NULL, 'c' },
+		{ "cost", required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+	mock_config_t	conf = { 128, 60, 2000, 20, 500, 50 };
+	unsigned	rounds = 100, change = 0;
+	int	opt, ret;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "n:e:r:c:C:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'n':
+			if (sscanf(optarg, "%u", &conf.n_devs) != 1 || conf.n_devs == 0 || conf.n_devs > 255) {
+				err("invalid number of devices: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'e':
+			if (sscanf(optarg, "%u", &conf.n_stubs) != 1) {
+				err("invalid number of exportable devices: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u", &rounds) != 1 || rounds == 0) {
+				err("invalid rounds: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			if (sscanf(optarg, "%u", &change) != 1) {
+				err("invalid change interval: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'C':
+			if (sscanf(optarg, "%u,%u,%u,%u", &conf.cost_enum_us, &conf.cost_call_us,
+				   &conf.cost_open_us, &conf.cost_ioctl_us) != 4) {
+				err("invalid cost: %s", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usbip_enum_bench_usage();
+			return 1;
+		}
+	}
+	if (optind != argc) {
+		usbip_enum_bench_usage();
+		return 1;
+	}
+
+	mock_setup(&conf);
+	printf("%u devices, %u exportable, per round of a devlist and %u imports\n", conf.n_devs, mock_n_stubs(), mock_n_stubs());
+	printf("%-8s %10s %10s %10s %10s %12s %10s\n", "index", "enums", "calls", "opens", "ioctls", "cost(ms)", "cpu(us)");
+	ret = run_bench("rescan", FALSE, rounds, change);
+	if (ret == 0)
+		ret = run_bench("kept", TRUE, rounds, change);
+	mock_cleanup();
+	return ret;
+}
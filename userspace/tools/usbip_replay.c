@@ -0,0 +1,892 @@
+/*
+ * usbip-replay: replays URBs of a usbmon capture against a usbip server
+ *
+ * A capture is a pcap or pcapng file of LINKTYPE_USB_LINUX(_MMAPPED), which is written by
+ * "usbipd -c", "usbip attach -c" or tcpdump/Wireshark on a linux usbmon interface.
+ * Submissions of a single device are sent as CMD_SUBMIT's and their RET_SUBMIT's are checked
+ * against completions in the capture.
+ */
+
+#include <ws2tcpip.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbip_tools.h"
+
+#define LINKTYPE_USB_LINUX		189
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+/* usbmon transfer types */
+#define MON_XFER_ISO	0
+#define MON_XFER_INTR	1
+#define MON_XFER_CTRL	2
+#define MON_XFER_BULK	3
+
+#define N_URB_HASH	4096
+#define MAX_IFS		16
+#define MAX_MISMATCHES_SHOWN	20
+
+#pragma pack(push,1)
+
+/* struct usbmon_packet of linux. LINKTYPE_USB_LINUX has only the first 48 bytes. */
+typedef struct {
+	uint64_t	id;
+	uint8_t		type;
+	uint8_t		xfer_type;
+	uint8_t		epnum;
+	uint8_t		devnum;
+	uint16_t	busnum;
+	char		flag_setup;
+	char		flag_data;
+	int64_t		ts_sec;
+	int32_t		ts_usec;
+	int32_t		status;
+	uint32_t	length;
+	uint32_t	len_cap;
+	union {
+		uint8_t	setup[8];
+		struct {
+			int32_t	error_count;
+			int32_t	numdesc;
+		} iso;
+	} s;
+	int32_t		interval;
+	int32_t		start_frame;
+	uint32_t	xfer_flags;
+	uint32_t	ndesc;
+} usbmon_packet_t;
+
+typedef struct {
+	int32_t		status;
+	uint32_t	offset;
+	uint32_t	length;
+	uint32_t	pad;
+} usbmon_isodesc_t;
+
+#pragma pack(pop)
+
+#define USBMON_HDR_LEN		48
+#define USBMON_MMAPPED_HDR_LEN	64
+
+typedef enum {
+	URB_PENDING,
+	URB_DONE,
+	URB_CANCELLED
+} urb_state_t;
+
+typedef struct {
+	uint64_t	id;
+	int	next_hash;
+	urb_state_t	state;
+
+	/* submission */
+	uint64_t	ts_us;
+	uint8_t		epnum, xfer_type;
+	uint32_t	length, xfer_flags;
+	int32_t		interval, start_frame;
+	uint8_t		setup[8];
+	/* OUT data zero-padded to length */
+	unsigned char	*data;
+	int	n_packets;
+	struct usbip_iso_packet_descriptor	*descs;
+
+	/* completion in a capture */
+	int32_t		status_exp;
+	uint32_t	len_exp;
+
+	/* replay */
+	uint64_t	ts_sent;
+	BOOL	replied;
+} replay_urb_t;
+
+typedef struct {
+	replay_urb_t	*urbs;
+	size_t	n_urbs, n_max;
+	int	hash[N_URB_HASH];
+
+	BOOL	dev_set;
+	unsigned	busnum, devnum;
+	size_t	n_other_devs;
+
+	struct {
+		int	linktype;
+		/* timestamp units per second */
+		uint64_t	ts_res;
+	} ifs[MAX_IFS];
+	int	n_ifs;
+} trace_t;
+
+typedef struct {
+	SOCKET	sockfd;
+	uint32_t	devid;
+	replay_urb_t	**urbs;
+	size_t	n_urbs;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned	n_inflight;
+	size_t	n_sent, n_replied;
+	BOOL	failed;
+
+	uint64_t	bytes_in, bytes_out;
+	size_t	n_mismatch_status, n_mismatch_len;
+	tools_lat_t	lat[4], lat_all;
+	BOOL	verbose;
+} replay_t;
+
+static const char *mon_xfer_names[] = { "isochronous", "interrupt", "control", "bulk" };
+/* latency is grouped in the order of usbip stats */
+static const char *lat_names[] = { "control", "bulk", "interrupt", "isochronous" };
+
+static const char usbip_replay_usage_string[] =
+	"usage: usbip-replay <args> <capture file>\n"
+	"    -r, --remote=<host>    The machine with exported USB devices\n"
+	"    -b, --busid=<busid>    Bus ID of a device to replay against\n"
+	"    -t, --tcp-port=<port>  (Optional) usbip server port, default 3240\n"
+	"    -d, --device=<bus.dev> (Optional) device in a capture, default the first one submitted to\n"
+	"    -s, --speed=<x>        (Optional) 1 for original timing(default), x for x-times speed, 0 for max speed\n"
+	"    -w, --window=<n>       (Optional) maximum in-flight URBs, default 16\n"
+	"    -T, --timeout=<sec>    (Optional) time to wait for the last replies, default 10\n"
+	"    -v, --verbose          (Optional) show each mismatch\n";
+
+static void
+usbip_replay_usage(void)
+{
+	printf("%s", usbip_replay_usage_string);
+}
+
+static replay_urb_t *
+new_urb(trace_t *trace)
+{
+	replay_urb_t	*urb;
+
+	if (trace->n_urbs == trace->n_max) {
+		size_t	n_max = trace->n_max ? trace->n_max * 2: 4096;
+		replay_urb_t	*urbs;
+
+		urbs = (replay_urb_t *)realloc(trace->urbs, n_max * sizeof(replay_urb_t));
+		if (urbs == NULL)
+			return NULL;
+		trace->urbs = urbs;
+		trace->n_max = n_max;
+	}
+	urb = trace->urbs + trace->n_urbs;
+	memset(urb, 0, sizeof(replay_urb_t));
+	return urb;
+}
+
+static int
+set_iso_descs(replay_urb_t *urb, const usbmon_packet_t *mon, const usbmon_isodesc_t *mdescs, unsigned n_mdescs)
+{
+	int	i;
+
+	urb->n_packets = mon->s.iso.numdesc;
+	if (urb->n_packets <= 0 || urb->n_packets > USBIP_MAX_ISO_PACKETS) {
+		urb->n_packets = 0;
+		return 0;
+	}
+	urb->descs = (struct usbip_iso_packet_descriptor *)calloc(urb->n_packets, USBIP_ISO_DESC_SIZE);
+	if (urb->descs == NULL)
+		return -1;
+	for (i = 0; i < urb->n_packets; i++) {
+		/* a capture without descriptors gets the buffer split evenly */
+		if ((unsigned)i < n_mdescs) {
+			urb->descs[i].offset = mdescs[i].offset;
+			urb->descs[i].length = mdescs[i].length;
+		}
+		else {
+			urb->descs[i].offset = urb->length / urb->n_packets * i;
+			urb->descs[i].length = urb->length / urb->n_packets;
+		}
+	}
+	return 0;
+}
+
+static int
+add_submission(trace_t *trace, const usbmon_packet_t *mon, const unsigned char *payload, unsigned len_payload, uint64_t ts_us)
+{
+	replay_urb_t	*urb;
+	const usbmon_isodesc_t	*mdescs = (const usbmon_isodesc_t *)payload;
+	unsigned	n_mdescs = mon->ndesc;
+	int	idx;
+
+	if (n_mdescs * sizeof(usbmon_isodesc_t) > len_payload)
+		n_mdescs = len_payload / sizeof(usbmon_isodesc_t);
+	payload += n_mdescs * sizeof(usbmon_isodesc_t);
+	len_payload -= n_mdescs * (unsigned)sizeof(usbmon_isodesc_t);
+
+	urb = new_urb(trace);
+	if (urb == NULL)
+		return -1;
+	urb->id = mon->id;
+	urb->state = URB_PENDING;
+	urb->ts_us = ts_us;
+	urb->epnum = mon->epnum;
+	urb->xfer_type = mon->xfer_type;
+	urb->length = mon->length;
+	urb->xfer_flags = mon->xfer_flags;
+	urb->interval = mon->interval;
+	urb->start_frame = mon->start_frame;
+	if (mon->flag_setup == 0)
+		memcpy(urb->setup, mon->s.setup, 8);
+
+	if (!(urb->epnum & 0x80) && urb->length > 0) {
+		urb->data = (unsigned char *)calloc(1, urb->length);
+		if (urb->data == NULL)
+			return -1;
+		/* data beyond a snaplen is replayed as zeros */
+		if (mon->flag_data == 0)
+			memcpy(urb->data, payload, len_payload < urb->length ? len_payload: urb->length);
+	}
+	if (urb->xfer_type == MON_XFER_ISO && set_iso_descs(urb, mon, mdescs, n_mdescs) < 0)
+		return -1;
+
+	idx = (int)(mon->id % N_URB_HASH);
+	urb->next_hash = trace->hash[idx];
+	trace->hash[idx] = (int)trace->n_urbs;
+	trace->n_urbs++;
+	return 0;
+}
+
+/* a usbmon id is a kernel URB address, which is reused after completion */
+static replay_urb_t *
+take_pending(trace_t *trace, uint64_t id)
+{
+	int	*pidx = &trace->hash[id % N_URB_HASH];
+
+	while (*pidx >= 0) {
+		replay_urb_t	*urb = trace->urbs + *pidx;
+
+		if (urb->id == id && urb->state == URB_PENDING) {
+			*pidx = urb->next_hash;
+			return urb;
+		}
+		pidx = &urb->next_hash;
+	}
+	return NULL;
+}
+
+static void
+add_completion(trace_t *trace, const usbmon_packet_t *mon)
+{
+	replay_urb_t	*urb;
+
+	urb = take_pending(trace, mon->id);
+	if (urb == NULL)
+		return;
+	switch (-mon->status) {
+	case USBIP_ECONNRESET:
+	case USBIP_ENOENT:
+	case USBIP_ESHUTDOWN:
+		urb->state = URB_CANCELLED;
+		break;
+	default:
+		urb->state = URB_DONE;
+		urb->status_exp = mon->status;
+		urb->len_exp = mon->length;
+		break;
+	}
+}
+
+static int
+add_usbmon(trace_t *trace, int linktype, const unsigned char *pkt, unsigned caplen, uint64_t ts_us)
+{
+	usbmon_packet_t	mon;
+	unsigned	len_hdr;
+	replay_urb_t	*urb;
+
+	len_hdr = linktype == LINKTYPE_USB_LINUX_MMAPPED ? USBMON_MMAPPED_HDR_LEN: USBMON_HDR_LEN;
+	if (caplen < len_hdr)
+		return 0;
+	memset(&mon, 0, sizeof(mon));
+	memcpy(&mon, pkt, len_hdr);
+
+	if (!trace->dev_set && mon.type == 'S') {
+		trace->busnum = mon.busnum;
+		trace->devnum = mon.devnum;
+		trace->dev_set = TRUE;
+	}
+	if (!trace->dev_set || mon.busnum != trace->busnum || mon.devnum != trace->devnum) {
+		if (mon.type == 'S')
+			trace->n_other_devs++;
+		return 0;
+	}
+
+	switch (mon.type) {
+	case 'S':
+		return add_submission(trace, &mon, pkt + len_hdr, caplen - len_hdr, ts_us);
+	case 'C':
+		add_completion(trace, &mon);
+		break;
+	case 'E':
+		/* submission error */
+		urb = take_pending(trace, mon.id);
+		if (urb != NULL)
+			urb->state = URB_CANCELLED;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static BOOL
+is_usbmon(int linktype)
+{
+	return linktype == LINKTYPE_USB_LINUX || linktype == LINKTYPE_USB_LINUX_MMAPPED;
+}
+
+static int
+parse_pcap(trace_t *trace, const unsigned char *buf, size_t len)
+{
+	uint32_t	magic, linktype;
+	uint64_t	ts_res;
+	size_t	offset = 24;
+
+	memcpy(&magic, buf, 4);
+	memcpy(&linktype, buf + 20, 4);
+	ts_res = magic == 0xa1b23c4d ? 1000000000: 1000000;
+	if (!is_usbmon(linktype)) {
+		err("not a usbmon capture: linktype %u", linktype);
+		return -1;
+	}
+
+	while (offset + 16 <= len) {
+		uint32_t	rec[4];
+
+		memcpy(rec, buf + offset, 16);
+		offset += 16;
+		if (rec[2] > len - offset)
+			break;
+		if (add_usbmon(trace, linktype, buf + offset, rec[2], (uint64_t)rec[0] * 1000000 + rec[1] * 1000000 / ts_res) < 0)
+			return -1;
+		offset += rec[2];
+	}
+	return 0;
+}
+
+static uint64_t
+get_tsresol(const unsigned char *opts, size_t len)
+{
+	size_t	offset = 0;
+
+	while (offset + 4 <= len) {
+		uint16_t	code, len_opt;
+
+		memcpy(&code, opts + offset, 2);
+		memcpy(&len_opt, opts + offset + 2, 2);
+		offset += 4;
+		if (code == 0 || offset + len_opt > len)
+			break;
+		/* if_tsresol */
+		if (code == 9 && len_opt == 1) {
+			uint8_t	resol = opts[offset];
+			uint64_t	res = 1;
+
+			if (resol & 0x80)
+				return (uint64_t)1 << (resol & 0x7f);
+			while (resol-- > 0)
+				res *= 10;
+			return res;
+		}
+		offset += (len_opt + 3) & ~3;
+	}
+	return 1000000;
+}
+
+static int
+parse_pcapng(trace_t *trace, const unsigned char *buf, size_t len)
+{
+	size_t	offset = 0;
+
+	while (offset + 12 <= len) {
+		const unsigned char	*body = buf + offset + 8;
+		uint32_t	type, len_block;
+
+		memcpy(&type, buf + offset, 4);
+		memcpy(&len_block, buf + offset + 4, 4);
+		if (len_block < 12 || len_block > len - offset)
+			break;
+
+		switch (type) {
+		case 0x0a0d0d0a: {
+			uint32_t	bom;
+
+			memcpy(&bom, body, 4);
+			if (bom != 0x1a2b3c4d) {
+				err("pcapng of a different byte order is not supported");
+				return -1;
+			}
+			trace->n_ifs = 0;
+			break;
+		}
+		case 0x00000001: {
+			uint16_t	linktype;
+
+			if (trace->n_ifs == MAX_IFS)
+				break;
+			memcpy(&linktype, body, 2);
+			trace->ifs[trace->n_ifs].linktype = linktype;
+			trace->ifs[trace->n_ifs].ts_res = get_tsresol(body + 8, len_block - 20);
+			trace->n_ifs++;
+			break;
+		}
+		case 0x00000006: {
+			uint32_t	epb[5];
+			uint64_t	ts;
+
+			memcpy(epb, body, 20);
+			if (epb[0] >= (uint32_t)trace->n_ifs || !is_usbmon(trace->ifs[epb[0]].linktype))
+				break;
+			if (epb[3] > len_block - 32)
+				break;
+			ts = ((uint64_t)epb[1] << 32) | epb[2];
+			ts = ts / trace->ifs[epb[0]].ts_res * 1000000 + ts % trace->ifs[epb[0]].ts_res * 1000000 / trace->ifs[epb[0]].ts_res;
+			if (add_usbmon(trace, trace->ifs[epb[0]].linktype, body + 20, epb[3], ts) < 0)
+				return -1;
+			break;
+		}
+		default:
+			break;
+		}
+		offset += len_block;
+	}
+	return 0;
+}
+
+static int
+load_trace(trace_t *trace, const char *path)
+{
+	FILE	*fp;
+	unsigned char	*buf;
+	long	len;
+	uint32_t	magic;
+	int	ret;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		err("cannot open: %s", path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (len < 24) {
+		err("too short capture: %s", path);
+		fclose(fp);
+		return -1;
+	}
+	buf = (unsigned char *)malloc(len);
+	if (buf == NULL || fread(buf, len, 1, fp) != 1) {
+		err("failed to read: %s", path);
+		free(buf);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	memset(trace->hash, 0xff, sizeof(trace->hash));
+	memcpy(&magic, buf, 4);
+	if (magic == 0x0a0d0d0a)
+		ret = parse_pcapng(trace, buf, len);
+	else if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+		ret = parse_pcap(trace, buf, len);
+	else {
+		err("unknown capture format: %s", path);
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+static void
+free_trace(trace_t *trace)
+{
+	size_t	i;
+
+	for (i = 0; i < trace->n_urbs; i++) {
+		free(trace->urbs[i].data);
+		free(trace->urbs[i].descs);
+	}
+	free(trace->urbs);
+}
+
+static int
+get_lat_idx(replay_urb_t *urb)
+{
+	switch (urb->xfer_type) {
+	case MON_XFER_CTRL:
+		return 0;
+	case MON_XFER_BULK:
+		return 1;
+	case MON_XFER_INTR:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+static void
+check_reply(replay_t *replay, replay_urb_t *urb, unsigned long seqnum, struct usbip_header *hdr)
+{
+	BOOL	bad_status = hdr->u.ret_submit.status != urb->status_exp;
+	BOOL	bad_len = (uint32_t)hdr->u.ret_submit.actual_length != urb->len_exp;
+
+	if (bad_status)
+		replay->n_mismatch_status++;
+	if (bad_len)
+		replay->n_mismatch_len++;
+	if ((bad_status || bad_len) && replay->verbose &&
+	    replay->n_mismatch_status + replay->n_mismatch_len <= MAX_MISMATCHES_SHOWN)
+		info("mismatch: seqnum %lu ep 0x%02x %s: status %d/%d, length %u/%d", seqnum, urb->epnum,
+		     mon_xfer_names[urb->xfer_type & 3], urb->status_exp, hdr->u.ret_submit.status,
+		     urb->len_exp, hdr->u.ret_submit.actual_length);
+}
+
+static int
+recv_ret_submit(replay_t *replay, struct usbip_header *hdr, char **pbuf, size_t *plen_buf)
+{
+	replay_urb_t	*urb;
+	unsigned long	seqnum = hdr->base.seqnum;
+	size_t	len = 0;
+	uint64_t	now;
+
+	if (seqnum == 0 || seqnum > replay->n_urbs) {
+		err("unknown seqnum: %lu", seqnum);
+		return -1;
+	}
+	urb = replay->urbs[seqnum - 1];
+	if (urb->epnum & 0x80) {
+		if (hdr->u.ret_submit.actual_length < 0 || (uint32_t)hdr->u.ret_submit.actual_length > urb->length) {
+			err("invalid actual length: %d", hdr->u.ret_submit.actual_length);
+			return -1;
+		}
+		len = hdr->u.ret_submit.actual_length;
+	}
+	if (urb->xfer_type == MON_XFER_ISO && hdr->u.ret_submit.number_of_packets > 0) {
+		if (hdr->u.ret_submit.number_of_packets > USBIP_MAX_ISO_PACKETS) {
+			err("invalid number of packets: %d", hdr->u.ret_submit.number_of_packets);
+			return -1;
+		}
+		len += hdr->u.ret_submit.number_of_packets * USBIP_ISO_DESC_SIZE;
+	}
+	if (len > *plen_buf) {
+		char	*buf = (char *)realloc(*pbuf, len);
+
+		if (buf == NULL) {
+			err("out of memory");
+			return -1;
+		}
+		*pbuf = buf;
+		*plen_buf = len;
+	}
+	if (usbip_net_recv(replay->sockfd, *pbuf, len) < 0)
+		return -1;
+	now = tools_now_us();
+
+	pthread_mutex_lock(&replay->lock);
+	if (urb->ts_sent == 0 || urb->replied) {
+		pthread_mutex_unlock(&replay->lock);
+		err("unexpected reply: seqnum %lu", seqnum);
+		return -1;
+	}
+	urb->replied = TRUE;
+	tools_lat_add(&replay->lat[get_lat_idx(urb)], now - urb->ts_sent);
+	tools_lat_add(&replay->lat_all, now - urb->ts_sent);
+	if (urb->epnum & 0x80)
+		replay->bytes_in += hdr->u.ret_submit.actual_length;
+	else
+		replay->bytes_out += urb->length;
+	check_reply(replay, urb, seqnum, hdr);
+	replay->n_replied++;
+	replay->n_inflight--;
+	pthread_cond_broadcast(&replay->cond);
+	pthread_mutex_unlock(&replay->lock);
+	return 0;
+}
+
+static void *
+receiver(void *ctx)
+{
+	replay_t	*replay = (replay_t *)ctx;
+	char	*buf = NULL;
+	size_t	len_buf = 0;
+
+	while (TRUE) {
+		struct usbip_header	hdr;
+
+		if (usbip_net_recv(replay->sockfd, &hdr, sizeof(hdr)) < 0)
+			break;
+		tools_swap_header(&hdr, TRUE);
+		if (hdr.base.command == USBIP_RET_SUBMIT) {
+			if (recv_ret_submit(replay, &hdr, &buf, &len_buf) < 0)
+				break;
+		}
+		else if (hdr.base.command != USBIP_RET_UNLINK) {
+			err("unexpected command: %x", hdr.base.command);
+			break;
+		}
+	}
+	free(buf);
+
+	pthread_mutex_lock(&replay->lock);
+	if (replay->n_replied < replay->n_urbs)
+		replay->failed = TRUE;
+	pthread_cond_broadcast(&replay->cond);
+	pthread_mutex_unlock(&replay->lock);
+	return NULL;
+}
+
+static int
+submit_urb(replay_t *replay, replay_urb_t *urb, unsigned long seqnum)
+{
+	struct usbip_header	hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_CMD_SUBMIT;
+	hdr.base.seqnum = seqnum;
+	hdr.base.devid = replay->devid;
+	hdr.base.direction = (urb->epnum & 0x80) ? USBIP_DIR_IN: USBIP_DIR_OUT;
+	hdr.base.ep = urb->epnum & 0x7f;
+	hdr.u.cmd_submit.transfer_flags = urb->xfer_flags;
+	hdr.u.cmd_submit.transfer_buffer_length = urb->length;
+	hdr.u.cmd_submit.start_frame = urb->start_frame;
+	hdr.u.cmd_submit.number_of_packets = urb->n_packets;
+	hdr.u.cmd_submit.interval = urb->interval;
+	memcpy(hdr.u.cmd_submit.setup, urb->setup, 8);
+
+	return tools_send_pdu(replay->sockfd, &hdr, urb->data, urb->data ? urb->length: 0, urb->descs, urb->n_packets);
+}
+
+static void
+send_urbs(replay_t *replay, double speed, unsigned window)
+{
+	uint64_t	t_start = tools_now_us(), ts_first = replay->urbs[0]->ts_us;
+	size_t	i;
+
+	for (i = 0; i < replay->n_urbs; i++) {
+		replay_urb_t	*urb = replay->urbs[i];
+
+		if (speed > 0 && urb->ts_us > ts_first)
+			tools_sleep_until_us(t_start + (uint64_t)((urb->ts_us - ts_first) / speed));
+
+		pthread_mutex_lock(&replay->lock);
+		while (replay->n_inflight >= window && !replay->failed)
+			pthread_cond_wait(&replay->cond, &replay->lock);
+		if (replay->failed) {
+			pthread_mutex_unlock(&replay->lock);
+			return;
+		}
+		replay->n_inflight++;
+		replay->n_sent++;
+		urb->ts_sent = tools_now_us();
+		pthread_mutex_unlock(&replay->lock);
+
+		if (submit_urb(replay, urb, (unsigned long)(i + 1)) < 0) {
+			err("failed to send CMD_SUBMIT");
+			return;
+		}
+	}
+}
+
+static void
+wait_replies(replay_t *replay, unsigned timeout)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout;
+
+	pthread_mutex_lock(&replay->lock);
+	while (replay->n_replied < replay->n_sent && !replay->failed) {
+		if (pthread_cond_timedwait(&replay->cond, &replay->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&replay->lock);
+}
+
+static void
+print_report(replay_t *replay, trace_t *trace, size_t n_skipped, uint64_t elapsed_us)
+{
+	double	secs = elapsed_us / 1000000.0;
+	int	i;
+
+	printf("capture: bus %u device %u, %zu URBs, %zu skipped(cancelled or incomplete), %zu of other devices\n",
+	       trace->busnum, trace->devnum, trace->n_urbs, n_skipped, trace->n_other_devs);
+	printf("replayed: %zu/%zu URBs in %.3f s, %.1f URB/s, %zu without reply\n",
+	       replay->n_replied, replay->n_urbs, secs, secs > 0 ? replay->n_replied / secs: 0,
+	       replay->n_sent - replay->n_replied);
+	printf("data: in %llu bytes(%.2f MB/s), out %llu bytes(%.2f MB/s)\n",
+	       (unsigned long long)replay->bytes_in, secs > 0 ? replay->bytes_in / secs / 1000000: 0,
+	       (unsigned long long)replay->bytes_out, secs > 0 ? replay->bytes_out / secs / 1000000: 0);
+	printf("mismatches: status %zu, length %zu\n\n", replay->n_mismatch_status, replay->n_mismatch_len);
+
+	tools_lat_print_header(stdout);
+	for (i = 0; i < 4; i++)
+		tools_lat_print(&replay->lat[i], lat_names[i], stdout);
+	tools_lat_print(&replay->lat_all, "all", stdout);
+}
+
+static int
+replay_trace(trace_t *trace, const char *host, const char *busid, double speed, unsigned window, unsigned timeout, BOOL verbose)
+{
+	replay_t	replay;
+	struct usbip_usb_device	udev;
+	pthread_t	thread;
+	uint64_t	t_start, elapsed;
+	size_t	i, n_skipped = 0;
+	int	ret = 0;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.urbs = (replay_urb_t **)malloc(trace->n_urbs * sizeof(replay_urb_t *) + 1);
+	if (replay.urbs == NULL) {
+		err("out of memory");
+		return 1;
+	}
+	for (i = 0; i < trace->n_urbs; i++) {
+		if (trace->urbs[i].state == URB_DONE)
+			replay.urbs[replay.n_urbs++] = trace->urbs + i;
+		else
+			n_skipped++;
+	}
+	if (replay.n_urbs == 0) {
+		err("no URB to replay");
+		free(replay.urbs);
+		return 1;
+	}
+
+	replay.sockfd = tools_import(host, usbip_port_string, busid, &udev);
+	if (replay.sockfd == INVALID_SOCKET) {
+		free(replay.urbs);
+		return 1;
+	}
+	replay.devid = (udev.busnum << 16) | udev.devnum;
+	replay.verbose = verbose;
+	for (i = 0; i < 4; i++)
+		tools_lat_init(&replay.lat[i]);
+	tools_lat_init(&replay.lat_all);
+	pthread_mutex_init(&replay.lock, NULL);
+	pthread_cond_init(&replay.cond, NULL);
+
+	info("replaying %zu URBs to %s:%s/%s", replay.n_urbs, host, usbip_port_string, busid);
+	t_start = tools_now_us();
+	if (pthread_create(&thread, NULL, receiver, &replay) != 0) {
+		err("failed to create receiver thread");
+		closesocket(replay.sockfd);
+		free(replay.urbs);
+		return 1;
+	}
+	send_urbs(&replay, speed, window);
+	wait_replies(&replay, timeout);
+	elapsed = tools_now_us() - t_start;
+
+	/* unblock the receiver */
+	shutdown(replay.sockfd, SHUT_RDWR);
+	pthread_join(thread, NULL);
+	closesocket(replay.sockfd);
+
+	print_report(&replay, trace, n_skipped, elapsed);
+	if (replay.n_replied < replay.n_urbs)
+		ret = 1;
+
+	for (i = 0; i < 4; i++)
+		tools_lat_free(&replay.lat[i]);
+	tools_lat_free(&replay.lat_all);
+	pthread_mutex_destroy(&replay.lock);
+	pthread_cond_destroy(&replay.cond);
+	free(replay.urbs);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "remote", required_argument, NULL, 'r' },
+		{ "busid", required_argument, NULL, 'b' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "device", required_argument, NULL, 'd' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "timeout", required_argument, NULL, 'T' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	trace_t	trace;
+	char	*host = NULL, *busid = NULL;
+	double	speed = 1;
+	unsigned	window = 16, timeout = 10;
+	BOOL	verbose = FALSE;
+	int	opt, ret;
+
+	memset(&trace, 0, sizeof(trace));
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "r:b:t:d:s:w:T:v", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'r':
+			host = optarg;
+			break;
+		case 'b':
+			busid = optarg;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'd':
+			if (sscanf(optarg, "%u.%u", &trace.busnum, &trace.devnum) != 2) {
+				err("invalid device: %s", optarg);
+				return 1;
+			}
+			trace.dev_set = TRUE;
+			break;
+		case 's':
+			if (strcmp(optarg, "max") == 0)
+				speed = 0;
+			else if (sscanf(optarg, "%lf", &speed) != 1 || speed < 0) {
+				err("invalid speed: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'w':
+			if (sscanf(optarg, "%u", &window) != 1 || window == 0) {
+				err("invalid window: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			if (sscanf(optarg, "%u", &timeout) != 1) {
+				err("invalid timeout: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			verbose = TRUE;
+			break;
+		default:
+			usbip_replay_usage();
+			return 1;
+		}
+	}
+
+	if (host == NULL || busid == NULL || optind != argc - 1) {
+		usbip_replay_usage();
+		return 1;
+	}
+
+	if (load_trace(&trace, argv[optind]) < 0) {
+		free_trace(&trace);
+		return 1;
+	}
+	ret = replay_trace(&trace, host, busid, speed, window, timeout, verbose);
+	free_trace(&trace);
+	return ret;
+}
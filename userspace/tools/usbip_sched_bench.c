@@ -0,0 +1,626 @@
+/*
+ * usbip-sched-bench: measures latency of interrupt transfers under bulk load of a composite device
+ *
+ * URBs are queued per endpoint like vhci does, and sent over a link of a given rate in the order
+ * which the scheduler of vhci picks. vhci_sched.c of the driver is built as it is, so that its
+ * policies can be compared on a single machine. Bulk OUT URBs are kept queued up to a depth,
+ * while a single interrupt IN URB polls another endpoint like a HID driver does.
+ * Its server is usbip-emul with a combo device, or usbipd with a real composite device.
+ * Results are printed and appended to a report file of usbip-bench.
+ */
+
+#include <ws2tcpip.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "usbip_tools.h"
+#include "list.h"
+#include "vhci_sched.h"
+
+/* a power of 2 above the maximum depth and an interrupt URB */
+#define N_SB_SLOTS	1024
+#define MAX_SB_DEPTH	512
+#define MAX_SB_LEN	(16 * 1024 * 1024)
+
+/* the same queue of an endpoint as vhci */
+#define SB_QUEUE(ep, is_in)	(2 + ((ep) & 0x0f) + ((is_in) ? 16: 0))
+
+/* bmAttributes of an endpoint descriptor */
+#define EP_XFER_BULK	2
+#define EP_XFER_INTR	3
+
+typedef struct {
+	struct list_head	list;
+	unsigned long	seqnum;
+	BOOL	is_intr;
+	ULONG	order;
+} sb_urb_t;
+
+typedef struct {
+	uint64_t	t_queued;
+	BOOL	busy;
+	BOOL	is_intr;
+} sb_slot_t;
+
+typedef struct {
+	SOCKET	sockfd;
+	uint32_t	devid;
+
+	uint8_t		ep_intr, ep_bulk;
+	uint32_t	len_intr, len_bulk;
+	int32_t		interval;
+	unsigned	depth;
+	/* bytes per second of a link, 0 for unlimited */
+	uint64_t	rate;
+	unsigned char	*data_out;
+
+	vhci_sched_params_t	params;
+	vhci_sched_t	sched;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct list_head	queues[VHCI_SCHED_N_QUEUES];
+	ULONG	order;
+	sb_slot_t	slots[N_SB_SLOTS];
+	unsigned long	seqnum;
+	/* sent URBs without their reply */
+	unsigned	n_outstanding;
+	BOOL	stopping, failed;
+
+	/* results */
+	uint64_t	t_start, t_end;
+	uint64_t	bytes_bulk;
+	size_t	n_intr, n_bulk, n_errors;
+	tools_lat_t	lat_intr, lat_bulk;
+} sbench_t;
+
+static const char usbip_sched_bench_usage_string[] =
+	"usage: usbip-sched-bench <args>\n"
+	"    -r, --remote=<host>       The machine with exported USB devices\n"
+	"    -b, --busid=<busid>       Bus ID of a composite device with interrupt IN and bulk OUT endpoints\n"
+	"    -t, --tcp-port=<port>     (Optional) usbip server port, default 3240\n"
+	"    -S, --sched=<policy>      (Optional) fifo, priority or wfq, default fifo\n"
+	"    -Q, --quantum=<bytes>[K|M] (Optional) bulk quantum of priority, 0 for an URB, default 64K\n"
+	"    -W, --weights=<c,i,b,n>   (Optional) wfq weights of control, iso, bulk and interrupt, default 8,8,1,8\n"
+	"    -s, --size=<bytes>[K|M]   (Optional) bulk URB length, default 1M\n"
+	"    -q, --depth=<n>           (Optional) queued bulk URBs, default 32\n"
+	"    -B, --bandwidth=<mbps>    (Optional) link rate in Mbit/s, 0 for unlimited, default 100\n"
+	"    -d, --duration=<sec>      (Optional) time to submit URBs, default 5\n"
+	"    -T, --timeout=<sec>       (Optional) time to wait for the last replies, default 10\n"
+	"    -o, --output=<file>       (Optional) report file to append a result to\n"
+	"    -L, --label=<label>       (Optional) label of a result in a report file, default \"-\"\n";
+
+static void
+usbip_sched_bench_usage(void)
+{
+	printf("%s", usbip_sched_bench_usage_string);
+}
+
+static BOOLEAN
+peek_queue(void *ctx, ULONG queue, ULONG *plen, ULONG *porder)
+{
+	sbench_t	*sb = (sbench_t *)ctx;
+	sb_urb_t	*urb;
+
+	if (list_empty(&sb->queues[queue]))
+		return FALSE;
+	urb = list_entry(sb->queues[queue].next, sb_urb_t, list);
+	*plen = urb->is_intr ? sb->len_intr: sb->len_bulk;
+	*porder = urb->order;
+	return TRUE;
+}
+
+/* finds an interrupt IN and a bulk OUT endpoint of the first configuration */
+static int
+setup_endpoints(sbench_t *sb)
+{
+	unsigned char	*dsc;
+	BOOL	found_intr = FALSE, found_bulk = FALSE;
+	int	len, i;
+
+	dsc = tools_get_conf_desc(sb->sockfd, sb->devid, &len);
+	if (dsc == NULL)
+		return -1;
+	for (i = 0; i + 2 <= len && dsc[i] >= 2; i += dsc[i]) {
+		if (dsc[i + 1] != 5 || i + 7 > len)
+			continue;
+		if (!found_intr && (dsc[i + 3] & 0x03) == EP_XFER_INTR && (dsc[i + 2] & 0x80)) {
+			sb->ep_intr = dsc[i + 2] & 0x0f;
+			sb->len_intr = (dsc[i + 4] | (dsc[i + 5] << 8)) & 0x7ff;
+			sb->interval = dsc[i + 6];
+			found_intr = TRUE;
+		}
+		else if (!found_bulk && (dsc[i + 3] & 0x03) == EP_XFER_BULK && !(dsc[i + 2] & 0x80)) {
+			sb->ep_bulk = dsc[i + 2] & 0x0f;
+			found_bulk = TRUE;
+		}
+	}
+	free(dsc);
+
+	if (!found_intr || !found_bulk) {
+		err("no interrupt IN or bulk OUT endpoint");
+		return -1;
+	}
+	vhci_sched_set_type(&sb->sched, SB_QUEUE(sb->ep_intr, TRUE), VHCI_SCHED_INTR);
+	vhci_sched_set_type(&sb->sched, SB_QUEUE(sb->ep_bulk, FALSE), VHCI_SCHED_BULK);
+	return 0;
+}
+
+/* a class driver submits an URB, which waits in a queue of its endpoint. Called with lock held. */
+static void
+queue_urb(sbench_t *sb, BOOL is_intr)
+{
+	sb_urb_t	*urb;
+	sb_slot_t	*slot;
+
+	urb = (sb_urb_t *)malloc(sizeof(sb_urb_t));
+	if (urb == NULL) {
+		err("out of memory");
+		sb->failed = TRUE;
+		return;
+	}
+	urb->seqnum = ++sb->seqnum;
+	urb->is_intr = is_intr;
+	urb->order = sb->order++;
+
+	slot = &sb->slots[urb->seqnum % N_SB_SLOTS];
+	slot->busy = TRUE;
+	slot->is_intr = is_intr;
+	slot->t_queued = tools_now_us();
+
+	if (is_intr)
+		list_add(&urb->list, sb->queues[SB_QUEUE(sb->ep_intr, TRUE)].prev);
+	else
+		list_add(&urb->list, sb->queues[SB_QUEUE(sb->ep_bulk, FALSE)].prev);
+	pthread_cond_broadcast(&sb->cond);
+}
+
+static int
+send_urb(sbench_t *sb, sb_urb_t *urb)
+{
+	struct usbip_header	hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_CMD_SUBMIT;
+	hdr.base.seqnum = urb->seqnum;
+	hdr.base.devid = sb->devid;
+	if (urb->is_intr) {
+		hdr.base.direction = USBIP_DIR_IN;
+		hdr.base.ep = sb->ep_intr;
+		hdr.u.cmd_submit.transfer_buffer_length = sb->len_intr;
+		hdr.u.cmd_submit.interval = sb->interval;
+		return tools_send_pdu(sb->sockfd, &hdr, NULL, 0, NULL, 0);
+	}
+	hdr.base.direction = USBIP_DIR_OUT;
+	hdr.base.ep = sb->ep_bulk;
+	hdr.u.cmd_submit.transfer_buffer_length = sb->len_bulk;
+	return tools_send_pdu(sb->sockfd, &hdr, sb->data_out, sb->len_bulk, NULL, 0);
+}
+
+/* the read path of vhci, which takes a single URB at a time over a link of a rate */
+static void *
+sender(void *ctx)
+{
+	sbench_t	*sb = (sbench_t *)ctx;
+	uint64_t	t_link = 0;
+
+	pthread_mutex_lock(&sb->lock);
+	while (TRUE) {
+		sb_urb_t	*urb;
+		ULONG	queue;
+		uint64_t	len;
+
+		while (!sb->stopping && !sb->failed && (queue = vhci_sched_pick(&sb->sched)) == VHCI_SCHED_N_QUEUES)
+			pthread_cond_wait(&sb->cond, &sb->lock);
+		if (sb->stopping || sb->failed)
+			break;
+		urb = list_entry(sb->queues[queue].next, sb_urb_t, list);
+		list_del(&urb->list);
+		sb->n_outstanding++;
+		pthread_mutex_unlock(&sb->lock);
+
+		if (send_urb(sb, urb) < 0) {
+			err("failed to send CMD_SUBMIT");
+			free(urb);
+			pthread_mutex_lock(&sb->lock);
+			sb->failed = TRUE;
+			break;
+		}
+		len = sizeof(struct usbip_header) + (urb->is_intr ? 0: sb->len_bulk);
+		free(urb);
+		if (sb->rate > 0) {
+			uint64_t	now = tools_now_us();
+
+			t_link = (t_link > now ? t_link: now) + len * 1000000 / sb->rate;
+			tools_sleep_until_us(t_link);
+		}
+
+		pthread_mutex_lock(&sb->lock);
+	}
+	pthread_cond_broadcast(&sb->cond);
+	pthread_mutex_unlock(&sb->lock);
+	return NULL;
+}
+
+static void
+complete_urb(sbench_t *sb, struct usbip_header *hdr, uint64_t now)
+{
+	sb_slot_t	*slot;
+
+	pthread_mutex_lock(&sb->lock);
+	slot = &sb->slots[hdr->base.seqnum % N_SB_SLOTS];
+	if (!slot->busy) {
+		err("unexpected reply: seqnum %u", hdr->base.seqnum);
+		sb->failed = TRUE;
+		pthread_cond_broadcast(&sb->cond);
+		pthread_mutex_unlock(&sb->lock);
+		return;
+	}
+	slot->busy = FALSE;
+	sb->n_outstanding--;
+	if (hdr->u.ret_submit.status != 0)
+		sb->n_errors++;
+	if (slot->is_intr) {
+		tools_lat_add(&sb->lat_intr, now - slot->t_queued);
+		sb->n_intr++;
+	}
+	else {
+		tools_lat_add(&sb->lat_bulk, now - slot->t_queued);
+		if (hdr->u.ret_submit.status == 0)
+			sb->bytes_bulk += sb->len_bulk;
+		sb->n_bulk++;
+	}
+	sb->t_end = now;
+	/* a class driver resubmits at once */
+	if (!sb->stopping)
+		queue_urb(sb, slot->is_intr);
+	pthread_cond_broadcast(&sb->cond);
+	pthread_mutex_unlock(&sb->lock);
+}
+
+static void *
+receiver(void *ctx)
+{
+	sbench_t	*sb = (sbench_t *)ctx;
+	unsigned char	buf[2048];
+
+	while (TRUE) {
+		struct usbip_header	hdr;
+		BOOL	is_intr;
+		int32_t	len;
+
+		if (usbip_net_recv(sb->sockfd, &hdr, sizeof(hdr)) < 0)
+			break;
+		tools_swap_header(&hdr, TRUE);
+		if (hdr.base.command != USBIP_RET_SUBMIT) {
+			err("unexpected command: %x", hdr.base.command);
+			break;
+		}
+		/* a reply has no direction, and only an interrupt IN URB has data */
+		pthread_mutex_lock(&sb->lock);
+		is_intr = sb->slots[hdr.base.seqnum % N_SB_SLOTS].is_intr;
+		pthread_mutex_unlock(&sb->lock);
+		len = is_intr ? hdr.u.ret_submit.actual_length: 0;
+		if (len < 0 || len > (int32_t)sizeof(buf)) {
+			err("invalid actual length: %d", len);
+			break;
+		}
+		if (len > 0 && usbip_net_recv(sb->sockfd, buf, len) < 0)
+			break;
+		complete_urb(sb, &hdr, tools_now_us());
+	}
+
+	pthread_mutex_lock(&sb->lock);
+	if (!sb->stopping || sb->n_outstanding > 0)
+		sb->failed = TRUE;
+	pthread_cond_broadcast(&sb->cond);
+	pthread_mutex_unlock(&sb->lock);
+	return NULL;
+}
+
+static void
+wait_stop(sbench_t *sb, unsigned secs, unsigned timeout)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += secs;
+
+	pthread_mutex_lock(&sb->lock);
+	while (!sb->failed) {
+		if (pthread_cond_timedwait(&sb->cond, &sb->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	sb->stopping = TRUE;
+	pthread_cond_broadcast(&sb->cond);
+
+	ts.tv_sec += timeout;
+	while (sb->n_outstanding > 0 && !sb->failed) {
+		if (pthread_cond_timedwait(&sb->cond, &sb->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&sb->lock);
+}
+
+static void
+print_report(sbench_t *sb, const char *busid, double secs)
+{
+	printf("%s %s: intr ep %u, bulk ep %u of %u bytes, depth %u, link %llu bytes/s, quantum %u\n",
+	       vhci_sched_policy_names[sb->params.policy], busid, sb->ep_intr, sb->ep_bulk, sb->len_bulk, sb->depth,
+	       (unsigned long long)sb->rate, sb->params.bulk_quantum);
+	printf("urbs: %zu interrupt, %zu bulk in %.3f s, %zu errors\n", sb->n_intr, sb->n_bulk, secs, sb->n_errors);
+	printf("bulk: %llu bytes(%.2f MB/s)\n", (unsigned long long)sb->bytes_bulk, secs > 0 ? sb->bytes_bulk / secs / 1000000: 0);
+	printf("\n");
+
+	tools_lat_print_header(stdout);
+	tools_lat_print(&sb->lat_intr, "interrupt", stdout);
+	tools_lat_print(&sb->lat_bulk, "bulk", stdout);
+}
+
+/* a row of a usbip-bench report, of which latency is of interrupt URBs */
+static int
+append_report(sbench_t *sb, const char *path, const char *label, const char *busid, double secs)
+{
+	FILE	*fp;
+
+	fp = fopen(path, "a");
+	if (fp == NULL) {
+		err("cannot open: %s", path);
+		return -1;
+	}
+	if (ftell(fp) == 0)
+		fprintf(fp, "#label\tworkload\tbusid\tsize\tdepth\trtt_us\tsecs\turbs\turb_s\tmb_s\terrors\tmean_us\tp50_us\tp90_us\tp99_us\tmax_us\textra\n");
+	fprintf(fp, "%s\tsched-%s\t%s\t%u\t%u\t0\t%.3f\t%zu\t%.1f\t%.2f\t%zu\t%llu\t%u\t%u\t%u\t%u\tquantum=%u,p99.9=%u,bulk_p99=%u\n",
+		label, vhci_sched_policy_names[sb->params.policy], busid, sb->len_bulk, sb->depth, secs,
+		sb->n_intr, secs > 0 ? sb->n_intr / secs: 0, secs > 0 ? sb->bytes_bulk / secs / 1000000: 0, sb->n_errors,
+		(unsigned long long)(sb->lat_intr.n > 0 ? sb->lat_intr.sum / sb->lat_intr.n: 0),
+		tools_lat_percentile(&sb->lat_intr, 50), tools_lat_percentile(&sb->lat_intr, 90),
+		tools_lat_percentile(&sb->lat_intr, 99), tools_lat_percentile(&sb->lat_intr, 100),
+		sb->params.bulk_quantum, tools_lat_percentile(&sb->lat_intr, 99.9), tools_lat_percentile(&sb->lat_bulk, 99));
+	fclose(fp);
+	return 0;
+}
+
+static int
+run_bench(sbench_t *sb, const char *host, const char *busid, unsigned secs, unsigned timeout,
+	  const char *path_report, const char *label)
+{
+	struct usbip_usb_device	udev;
+	pthread_t	thread_send, thread_recv;
+	double	elapsed;
+	unsigned	i;
+	int	ret = 0;
+
+	sb->sockfd = tools_import(host, usbip_port_string, busid, &udev);
+	if (sb->sockfd == INVALID_SOCKET)
+		return 1;
+	sb->devid = (udev.busnum << 16) | udev.devnum;
+	if (setup_endpoints(sb) < 0) {
+		closesocket(sb->sockfd);
+		return 1;
+	}
+
+	info("benchmarking %s scheduling of %s:%s/%s", vhci_sched_policy_names[sb->params.policy], host, usbip_port_string, busid);
+	sb->t_start = tools_now_us();
+	pthread_mutex_lock(&sb->lock);
+	queue_urb(sb, TRUE);
+	for (i = 0; i < sb->depth; i++)
+		queue_urb(sb, FALSE);
+	pthread_mutex_unlock(&sb->lock);
+
+	if (pthread_create(&thread_recv, NULL, receiver, sb) != 0) {
+		err("failed to create receiver thread");
+		closesocket(sb->sockfd);
+		return 1;
+	}
+	if (pthread_create(&thread_send, NULL, sender, sb) != 0) {
+		err("failed to create sender thread");
+		shutdown(sb->sockfd, SHUT_RDWR);
+		pthread_join(thread_recv, NULL);
+		closesocket(sb->sockfd);
+		return 1;
+	}
+	wait_stop(sb, secs, timeout);
+	pthread_join(thread_send, NULL);
+
+	/* unblock the receiver */
+	shutdown(sb->sockfd, SHUT_RDWR);
+	pthread_join(thread_recv, NULL);
+	closesocket(sb->sockfd);
+
+	elapsed = sb->t_end > sb->t_start ? (sb->t_end - sb->t_start) / 1000000.0: 0;
+	print_report(sb, busid, elapsed);
+	if (sb->n_outstanding > 0) {
+		err("%u URBs without reply", sb->n_outstanding);
+		ret = 1;
+	}
+	if (sb->failed)
+		ret = 1;
+	if (path_report != NULL && append_report(sb, path_report, label, busid, elapsed) < 0)
+		ret = 1;
+	return ret;
+}
+
+static int
+parse_size(const char *str, uint32_t *psize, BOOL zero_ok)
+{
+	unsigned	size;
+	char	unit = '\0';
+
+	if (sscanf(str, "%u%c", &size, &unit) < 1)
+		return -1;
+	if (unit == 'K' || unit == 'k')
+		size *= 1024;
+	else if (unit == 'M' || unit == 'm')
+		size *= 1024 * 1024;
+	else if (unit != '\0')
+		return -1;
+	if ((size == 0 && !zero_ok) || size > MAX_SB_LEN)
+		return -1;
+	*psize = size;
+	return 0;
+}
+
+static int
+parse_weights(const char *str, vhci_sched_params_t *params)
+{
+	unsigned	w[4];
+	int	i;
+
+	if (sscanf(str, "%u,%u,%u,%u", &w[0], &w[1], &w[2], &w[3]) != 4)
+		return -1;
+	for (i = 0; i < 4; i++) {
+		if (w[i] == 0)
+			return -1;
+	}
+	params->weights[VHCI_SCHED_CONTROL] = w[0];
+	params->weights[VHCI_SCHED_ISO] = w[1];
+	params->weights[VHCI_SCHED_BULK] = w[2];
+	params->weights[VHCI_SCHED_INTR] = w[3];
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "remote", required_argument, NULL, 'r' },
+		{ "busid", required_argument, NULL, 'b' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "sched", required_argument, NULL, 'S' },
+		{ "quantum", required_argument, NULL, 'Q' },
+		{ "weights", required_argument, NULL, 'W' },
+		{ "size", required_argument, NULL, 's' },
+		{ "depth", required_argument, NULL, 'q' },
+		{ "bandwidth", required_argument, NULL, 'B' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "timeout", required_argument, NULL, 'T' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "label", required_argument, NULL, 'L' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static sbench_t	sb;
+	char	*host = NULL, *busid = NULL, *path_report = NULL, *label = "-";
+	unsigned	secs = 5, timeout = 10, mbps = 100;
+	int	opt, ret;
+	unsigned	i;
+
+	sb.params.policy = VHCI_SCHED_FIFO;
+	sb.params.bulk_quantum = 64 * 1024;
+	sb.params.weights[VHCI_SCHED_CONTROL] = 8;
+	sb.params.weights[VHCI_SCHED_ISO] = 8;
+	sb.params.weights[VHCI_SCHED_BULK] = 1;
+	sb.params.weights[VHCI_SCHED_INTR] = 8;
+	sb.len_bulk = 1024 * 1024;
+	sb.depth = 32;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "r:b:t:S:Q:W:s:q:B:d:T:o:L:", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'r':
+			host = optarg;
+			break;
+		case 'b':
+			busid = optarg;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'S':
+			for (i = 0; i < VHCI_N_SCHED_POLICIES; i++) {
+				if (strcmp(optarg, vhci_sched_policy_names[i]) == 0)
+					break;
+			}
+			if (i == VHCI_N_SCHED_POLICIES) {
+				err("unknown policy: %s", optarg);
+				return 1;
+			}
+			sb.params.policy = i;
+			break;
+		case 'Q':
+			if (parse_size(optarg, &sb.params.bulk_quantum, TRUE) < 0) {
+				err("invalid quantum: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'W':
+			if (parse_weights(optarg, &sb.params) < 0) {
+				err("invalid weights: %s", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			if (parse_size(optarg, &sb.len_bulk, FALSE) < 0) {
+				err("invalid size: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			if (sscanf(optarg, "%u", &sb.depth) != 1 || sb.depth == 0 || sb.depth > MAX_SB_DEPTH) {
+				err("invalid depth: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			if (sscanf(optarg, "%u", &mbps) != 1) {
+				err("invalid bandwidth: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			if (sscanf(optarg, "%u", &secs) != 1 || secs == 0) {
+				err("invalid duration: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			if (sscanf(optarg, "%u", &timeout) != 1) {
+				err("invalid timeout: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			path_report = optarg;
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		default:
+			usbip_sched_bench_usage();
+			return 1;
+		}
+	}
+	if (host == NULL || busid == NULL) {
+		usbip_sched_bench_usage();
+		return 1;
+	}
+
+	sb.rate = (uint64_t)mbps * 1000000 / 8;
+	sb.data_out = (unsigned char *)calloc(1, sb.len_bulk);
+	if (sb.data_out == NULL) {
+		err("out of memory");
+		return 1;
+	}
+	for (i = 0; i < VHCI_SCHED_N_QUEUES; i++)
+		INIT_LIST_HEAD(&sb.queues[i]);
+	vhci_sched_init(&sb.sched, &sb.params, peek_queue, &sb);
+	pthread_mutex_init(&sb.lock, NULL);
+	pthread_cond_init(&sb.cond, NULL);
+	tools_lat_init(&sb.lat_intr);
+	tools_lat_init(&sb.lat_bulk);
+
+	ret = run_bench(&sb, host, busid, secs, timeout, path_report, label);
+
+	tools_lat_free(&sb.lat_intr);
+	tools_lat_free(&sb.lat_bulk);
+	free(sb.data_out);
+	return ret;
+}
@@ -0,0 +1,339 @@
+#include <ws2tcpip.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "usbip_tools.h"
+
+int usbip_use_stderr = 1;
+int usbip_use_debug;
+
+uint64_t
+tools_now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+tools_sleep_until_us(uint64_t t_us)
+{
+	struct timespec	ts;
+
+	ts.tv_sec = t_us / 1000000;
+	ts.tv_nsec = (t_us % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void
+swap_header_cmd(unsigned int cmd, struct usbip_header *hdr)
+{
+	switch (cmd) {
+	case USBIP_CMD_SUBMIT:
+		hdr->u.cmd_submit.transfer_flags = ntohl(hdr->u.cmd_submit.transfer_flags);
+		hdr->u.cmd_submit.transfer_buffer_length = ntohl(hdr->u.cmd_submit.transfer_buffer_length);
+		hdr->u.cmd_submit.start_frame = ntohl(hdr->u.cmd_submit.start_frame);
+		hdr->u.cmd_submit.number_of_packets = ntohl(hdr->u.cmd_submit.number_of_packets);
+		hdr->u.cmd_submit.interval = ntohl(hdr->u.cmd_submit.interval);
+		break;
+	case USBIP_RET_SUBMIT:
+		hdr->u.ret_submit.status = ntohl(hdr->u.ret_submit.status);
+		hdr->u.ret_submit.actual_length = ntohl(hdr->u.ret_submit.actual_length);
+		hdr->u.ret_submit.start_frame = ntohl(hdr->u.ret_submit.start_frame);
+		hdr->u.ret_submit.number_of_packets = ntohl(hdr->u.ret_submit.number_of_packets);
+		hdr->u.ret_submit.error_count = ntohl(hdr->u.ret_submit.error_count);
+		break;
+	case USBIP_CMD_UNLINK:
+		hdr->u.cmd_unlink.seqnum = ntohl(hdr->u.cmd_unlink.seqnum);
+		break;
+	case USBIP_CMD_UNLINK_BATCH:
+		hdr->u.cmd_unlink_batch.seqnum_first = ntohl(hdr->u.cmd_unlink_batch.seqnum_first);
+		hdr->u.cmd_unlink_batch.seqnum_last = ntohl(hdr->u.cmd_unlink_batch.seqnum_last);
+		hdr->u.cmd_unlink_batch.flags = ntohl(hdr->u.cmd_unlink_batch.flags);
+		break;
+	case USBIP_RET_UNLINK:
+		hdr->u.ret_unlink.status = ntohl(hdr->u.ret_unlink.status);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+tools_swap_header(struct usbip_header *hdr, BOOL from_net)
+{
+	unsigned int	cmd;
+
+	if (from_net)
+		cmd = ntohl(hdr->base.command);
+	else
+		cmd = hdr->base.command;
+	hdr->base.command = ntohl(hdr->base.command);
+	hdr->base.seqnum = ntohl(hdr->base.seqnum);
+	hdr->base.devid = ntohl(hdr->base.devid);
+	hdr->base.direction = ntohl(hdr->base.direction);
+	hdr->base.ep = ntohl(hdr->base.ep);
+	swap_header_cmd(cmd, hdr);
+}
+
+void
+tools_swap_iso_descs(struct usbip_iso_packet_descriptor *descs, int n_descs)
+{
+	int	i;
+
+	for (i = 0; i < n_descs; i++) {
+		descs[i].offset = ntohl(descs[i].offset);
+		descs[i].length = ntohl(descs[i].length);
+		descs[i].actual_length = ntohl(descs[i].actual_length);
+		descs[i].status = ntohl(descs[i].status);
+	}
+}
+
+int
+tools_send_pdu(SOCKET sockfd, struct usbip_header *hdr, const void *data, unsigned len_data,
+	       const struct usbip_iso_packet_descriptor *descs, int n_descs)
+{
+	struct usbip_header	hdr_net;
+	size_t	len = sizeof(hdr_net) + len_data + (size_t)n_descs * USBIP_ISO_DESC_SIZE;
+	char	*buf;
+	int	ret;
+
+	/* a single send keeps a small PDU in one segment under TCP_NODELAY */
+	buf = (char *)malloc(len);
+	if (buf == NULL) {
+		err("%s: out of memory", __func__);
+		return -1;
+	}
+	hdr_net = *hdr;
+	tools_swap_header(&hdr_net, FALSE);
+	memcpy(buf, &hdr_net, sizeof(hdr_net));
+	if (len_data > 0)
+		memcpy(buf + sizeof(hdr_net), data, len_data);
+	if (n_descs > 0) {
+		struct usbip_iso_packet_descriptor	*descs_net;
+
+		descs_net = (struct usbip_iso_packet_descriptor *)(buf + sizeof(hdr_net) + len_data);
+		memcpy(descs_net, descs, (size_t)n_descs * USBIP_ISO_DESC_SIZE);
+		tools_swap_iso_descs(descs_net, n_descs);
+	}
+	ret = usbip_net_send(sockfd, buf, len);
+	free(buf);
+	return ret < 0 ? -1: 0;
+}
+
+SOCKET
+tools_import(const char *host, const char *port, const char *busid, struct usbip_usb_device *udev)
+{
+	struct op_import_request	request;
+	struct op_import_reply	reply;
+	uint16_t	code = OP_REP_IMPORT;
+	SOCKET	sockfd;
+
+	sockfd = usbip_net_tcp_connect(host, port);
+	if (sockfd == INVALID_SOCKET) {
+		err("failed to connect: %s:%s", host, port);
+		return INVALID_SOCKET;
+	}
+
+	memset(&request, 0, sizeof(request));
+	strncpy(request.busid, busid, USBIP_BUS_ID_SIZE - 1);
+	if (usbip_net_send_op_common(sockfd, OP_REQ_IMPORT, 0) < 0 ||
+	    usbip_net_send(sockfd, &request, sizeof(request)) < 0) {
+		err("failed to send import request");
+		goto err_out;
+	}
+	if (usbip_net_recv_op_common(sockfd, &code) < 0) {
+		err("import rejected: %s", busid);
+		goto err_out;
+	}
+	if (usbip_net_recv(sockfd, &reply, sizeof(reply)) < 0) {
+		err("failed to recv import reply");
+		goto err_out;
+	}
+	PACK_OP_IMPORT_REPLY(0, &reply);
+	if (strncmp(reply.udev.busid, busid, USBIP_BUS_ID_SIZE) != 0) {
+		err("recv different busid: %s", reply.udev.busid);
+		goto err_out;
+	}
+	*udev = reply.udev;
+	return sockfd;
+err_out:
+	closesocket(sockfd);
+	return INVALID_SOCKET;
+}
+
+/*
+ * A control transfer before a workload starts, while no other URB is in flight.
+ * Returns the length of IN data or 0 for OUT.
+ */
+int
+tools_control_sync(SOCKET sockfd, uint32_t devid, const uint8_t *setup, void *data, uint16_t len)
+{
+	struct usbip_header	hdr;
+	BOOL	is_in = (setup[0] & 0x80) != 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base.command = USBIP_CMD_SUBMIT;
+	hdr.base.seqnum = 1;
+	hdr.base.devid = devid;
+	hdr.base.direction = is_in ? USBIP_DIR_IN: USBIP_DIR_OUT;
+	hdr.u.cmd_submit.transfer_buffer_length = len;
+	memcpy(hdr.u.cmd_submit.setup, setup, 8);
+	if (tools_send_pdu(sockfd, &hdr, data, is_in ? 0: len, NULL, 0) < 0)
+		return -1;
+
+	if (usbip_net_recv(sockfd, &hdr, sizeof(hdr)) < 0)
+		return -1;
+	tools_swap_header(&hdr, TRUE);
+	if (hdr.base.command != USBIP_RET_SUBMIT) {
+		err("unexpected command: %x", hdr.base.command);
+		return -1;
+	}
+	if (!is_in)
+		return hdr.u.ret_submit.status == 0 ? 0: -1;
+	if (hdr.u.ret_submit.actual_length < 0 || hdr.u.ret_submit.actual_length > len) {
+		err("invalid actual length: %d", hdr.u.ret_submit.actual_length);
+		return -1;
+	}
+	if (usbip_net_recv(sockfd, data, hdr.u.ret_submit.actual_length) < 0)
+		return -1;
+	if (hdr.u.ret_submit.status != 0)
+		return -1;
+	return hdr.u.ret_submit.actual_length;
+}
+
+unsigned char *
+tools_get_conf_desc(SOCKET sockfd, uint32_t devid, int *plen)
+{
+	uint8_t	setup[8] = { 0x80, 6, 0, 2, 0, 0, 9, 0 };
+	unsigned char	head[9], *dsc;
+	uint16_t	len;
+
+	if (tools_control_sync(sockfd, devid, setup, head, 9) < 9) {
+		err("failed to get configuration descriptor");
+		return NULL;
+	}
+	len = head[2] | (head[3] << 8);
+	dsc = (unsigned char *)malloc(len);
+	if (dsc == NULL) {
+		err("out of memory");
+		return NULL;
+	}
+	setup[6] = (uint8_t)len;
+	setup[7] = (uint8_t)(len >> 8);
+	*plen = tools_control_sync(sockfd, devid, setup, dsc, len);
+	if (*plen < 9) {
+		err("failed to get configuration descriptor");
+		free(dsc);
+		return NULL;
+	}
+	return dsc;
+}
+
+SOCKET
+tools_listen(const char *port)
+{
+	struct addrinfo	hints, *res;
+	SOCKET	sockfd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+		err("invalid port: %s", port);
+		return INVALID_SOCKET;
+	}
+	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sockfd != INVALID_SOCKET) {
+		usbip_net_set_reuseaddr(sockfd);
+		if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0 || listen(sockfd, SOMAXCONN) < 0) {
+			err("failed to listen: port %s: %s", port, strerror(errno));
+			closesocket(sockfd);
+			sockfd = INVALID_SOCKET;
+		}
+	}
+	freeaddrinfo(res);
+	return sockfd;
+}
+
+void
+tools_lat_init(tools_lat_t *lat)
+{
+	memset(lat, 0, sizeof(*lat));
+}
+
+void
+tools_lat_free(tools_lat_t *lat)
+{
+	free(lat->samples);
+	memset(lat, 0, sizeof(*lat));
+}
+
+void
+tools_lat_add(tools_lat_t *lat, uint64_t us)
+{
+	if (lat->n == lat->n_max) {
+		size_t	n_max = lat->n_max ? lat->n_max * 2: 1024;
+		uint32_t	*samples;
+
+		samples = (uint32_t *)realloc(lat->samples, n_max * sizeof(uint32_t));
+		if (samples == NULL)
+			return;
+		lat->samples = samples;
+		lat->n_max = n_max;
+	}
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+	lat->samples[lat->n++] = (uint32_t)us;
+	lat->sum += us;
+	lat->sorted = FALSE;
+}
+
+static int
+cmp_sample(const void *a, const void *b)
+{
+	uint32_t	va = *(const uint32_t *)a, vb = *(const uint32_t *)b;
+
+	return va < vb ? -1: (va > vb);
+}
+
+uint32_t
+tools_lat_percentile(tools_lat_t *lat, double pct)
+{
+	size_t	idx;
+
+	if (lat->n == 0)
+		return 0;
+	if (!lat->sorted) {
+		qsort(lat->samples, lat->n, sizeof(uint32_t), cmp_sample);
+		lat->sorted = TRUE;
+	}
+	/* nearest rank */
+	idx = (size_t)(pct / 100.0 * lat->n + 0.5);
+	if (idx > 0)
+		idx--;
+	if (idx >= lat->n)
+		idx = lat->n - 1;
+	return lat->samples[idx];
+}
+
+void
+tools_lat_print_header(FILE *fp)
+{
+	fprintf(fp, "%-12s %10s %10s %10s %10s %10s %10s %10s\n", "", "count", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+}
+
+void
+tools_lat_print(tools_lat_t *lat, const char *name, FILE *fp)
+{
+	if (lat->n == 0)
+		return;
+	fprintf(fp, "%-12s %10zu %10llu %10u %10u %10u %10u %10u\n", name, lat->n,
+		(unsigned long long)(lat->sum / lat->n),
+		tools_lat_percentile(lat, 50), tools_lat_percentile(lat, 90), tools_lat_percentile(lat, 99),
+		tools_lat_percentile(lat, 99.9), tools_lat_percentile(lat, 100));
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ * Common code of portable test tools, which run on Linux without any USB hardware.
+ * Protocol definitions come from usbip_proto.h and usbip_network.h as they are.
+ */
+
+#include <winsock2.h>
+#include <stdint.h>
+
+#include "usbip_common.h"
+#include "usbip_proto.h"
+#include "usbip_network.h"
+
+#define USBIP_ISO_DESC_SIZE	sizeof(struct usbip_iso_packet_descriptor)
+
+/* linux errno values carried in usbip status */
+#define USBIP_ENOENT		2
+#define USBIP_EPIPE		32
+#define USBIP_ENOSR		63
+#define USBIP_EOVERFLOW		75
+#define USBIP_ECONNRESET	104
+#define USBIP_ESHUTDOWN		108
+
+uint64_t tools_now_us(void);
+void tools_sleep_until_us(uint64_t t_us);
+
+/* from_net is TRUE if hdr is in network byte order */
+void tools_swap_header(struct usbip_header *hdr, BOOL from_net);
+void tools_swap_iso_descs(struct usbip_iso_packet_descriptor *descs, int n_descs);
+
+/* hdr and iso descriptors are in host byte order. data is OUT data for CMD_SUBMIT, IN for RET_SUBMIT */
+int tools_send_pdu(SOCKET sockfd, struct usbip_header *hdr, const void *data, unsigned len_data,
+		   const struct usbip_iso_packet_descriptor *descs, int n_descs);
+
+/* connect and import busid. udev is in host byte order */
+SOCKET tools_import(const char *host, const char *port, const char *busid, struct usbip_usb_device *udev);
+/* a control transfer of seqnum 1 on an imported device, which waits for its reply */
+int tools_control_sync(SOCKET sockfd, uint32_t devid, const uint8_t *setup, void *data, uint16_t len);
+/* a configuration descriptor of *plen bytes, which should be freed */
+unsigned char *tools_get_conf_desc(SOCKET sockfd, uint32_t devid, int *plen);
+/* a listening socket of IPv4 */
+SOCKET tools_listen(const char *port);
+
+/* latency samples in microseconds */
+typedef struct {
+	uint32_t	*samples;
+	size_t	n, n_max;
+	uint64_t	sum;
+	BOOL	sorted;
+} tools_lat_t;
+
+void tools_lat_init(tools_lat_t *lat);
+void tools_lat_free(tools_lat_t *lat);
+void tools_lat_add(tools_lat_t *lat, uint64_t us);
+/* samples get sorted */
+uint32_t tools_lat_percentile(tools_lat_t *lat, double pct);
+void tools_lat_print_header(FILE *fp);
+void tools_lat_print(tools_lat_t *lat, const char *name, FILE *fp);
@@ -0,0 +1,391 @@
+/*
+ * usbip-wan: a TCP proxy emulating a WAN link between a usbip client and server
+ *
+ * Each direction of a connection is a link of its own. Data read from one side is cut into
+ * segments, which leave the link after a serialization time of a bandwidth, a delay and a jitter.
+ * A lost segment leaves after a retransmit delay more. As TCP delivers bytes in order, no segment
+ * leaves before an earlier one, so that a loss stalls what follows it like a real retransmit.
+ */
+
+#include <ws2tcpip.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "usbip_tools.h"
+
+/* an ethernet TCP segment */
+#define WAN_SEG_SIZE	1448
+#define WAN_READ_SIZE	(64 * 1024)
+/* bytes queued in a link before a reader waits */
+#define WAN_QUEUE_MAX	(16 * 1024 * 1024)
+
+typedef struct wan_seg {
+	struct wan_seg	*next;
+	uint64_t	release_us;
+	uint32_t	len;
+	char	data[];
+} wan_seg_t;
+
+typedef struct {
+	const char	*name;
+	SOCKET	src, dst;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	wan_seg_t	*head, *tail;
+	size_t	queued;
+	BOOL	eof, broken;
+
+	/* link state, owned by a reader */
+	double	link_free_us;
+	uint64_t	last_release_us;
+	unsigned	seed;
+
+	uint64_t	bytes;
+	size_t	n_segs, n_lost;
+} wan_pipe_t;
+
+typedef struct {
+	SOCKET	clientfd, serverfd;
+	wan_pipe_t	pipes[2];
+} wan_conn_t;
+
+static struct {
+	uint64_t	delay_us, jitter_us, rto_us;
+	/* kbit/s, 0 for unlimited */
+	uint64_t	bandwidth;
+	/* percent */
+	double	loss;
+} wan_link = { 0, 0, 200000, 0, 0 };
+
+static const char	*remote_host;
+static const char	*remote_port = "3240";
+
+static const char usbip_wan_usage_string[] =
+	"usage: usbip-wan <args>\n"
+	"    -r, --remote=<host>         usbip server to forward connections to\n"
+	"    -P, --remote-port=<port>    (Optional) port of a server, default 3240\n"
+	"    -t, --tcp-port=<port>       (Optional) listening port, default 3241\n"
+	"    -d, --delay=<usec>          (Optional) one-way delay of each direction, default 0\n"
+	"    -j, --jitter=<usec>         (Optional) random delay up to usec added to a delay, default 0\n"
+	"    -b, --bandwidth=<kbit/s>    (Optional) bandwidth of each direction, default unlimited\n"
+	"    -L, --loss=<percent>        (Optional) segments lost and retransmitted, default 0\n"
+	"    -x, --rto=<usec>            (Optional) retransmit delay of a lost segment, default 200000\n"
+	"    -D, --debug                 (Optional) print debugging information\n";
+
+static void
+usbip_wan_usage(void)
+{
+	printf("%s", usbip_wan_usage_string);
+}
+
+static uint64_t
+get_release(wan_pipe_t *wpipe, uint32_t len, uint64_t now)
+{
+	double	start = wpipe->link_free_us > now ? wpipe->link_free_us: (double)now;
+	uint64_t	release;
+
+	wpipe->link_free_us = start;
+	if (wan_link.bandwidth > 0)
+		wpipe->link_free_us += len * 8000.0 / wan_link.bandwidth;
+	release = (uint64_t)wpipe->link_free_us + wan_link.delay_us;
+	if (wan_link.jitter_us > 0)
+		release += (uint64_t)(rand_r(&wpipe->seed) / (RAND_MAX + 1.0) * wan_link.jitter_us);
+	if (wan_link.loss > 0 && rand_r(&wpipe->seed) / (RAND_MAX + 1.0) * 100 < wan_link.loss) {
+		release += wan_link.rto_us;
+		wpipe->n_lost++;
+	}
+	/* no reordering */
+	if (release < wpipe->last_release_us)
+		release = wpipe->last_release_us;
+	wpipe->last_release_us = release;
+	return release;
+}
+
+static int
+enqueue(wan_pipe_t *wpipe, const char *data, uint32_t len, uint64_t now)
+{
+	wan_seg_t	*seg;
+
+	seg = (wan_seg_t *)malloc(sizeof(wan_seg_t) + len);
+	if (seg == NULL) {
+		err("out of memory");
+		return -1;
+	}
+	seg->next = NULL;
+	seg->release_us = get_release(wpipe, len, now);
+	seg->len = len;
+	memcpy(seg->data, data, len);
+
+	pthread_mutex_lock(&wpipe->lock);
+	while (wpipe->queued >= WAN_QUEUE_MAX && !wpipe->broken)
+		pthread_cond_wait(&wpipe->cond, &wpipe->lock);
+	if (wpipe->tail != NULL)
+		wpipe->tail->next = seg;
+	else
+		wpipe->head = seg;
+	wpipe->tail = seg;
+	wpipe->queued += len;
+	wpipe->n_segs++;
+	pthread_cond_broadcast(&wpipe->cond);
+	pthread_mutex_unlock(&wpipe->lock);
+	return 0;
+}
+
+static void *
+reader(void *ctx)
+{
+	wan_pipe_t	*wpipe = (wan_pipe_t *)ctx;
+	char	*buf;
+
+	buf = (char *)malloc(WAN_READ_SIZE);
+	while (buf != NULL && !wpipe->broken) {
+		uint64_t	now;
+		int	len, off;
+
+		len = recv(wpipe->src, buf, WAN_READ_SIZE, 0);
+		if (len <= 0)
+			break;
+		now = tools_now_us();
+		for (off = 0; off < len; off += WAN_SEG_SIZE) {
+			if (enqueue(wpipe, buf + off, len - off < WAN_SEG_SIZE ? len - off: WAN_SEG_SIZE, now) < 0)
+				break;
+		}
+		if (off < len)
+			break;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&wpipe->lock);
+	wpipe->eof = TRUE;
+	pthread_cond_broadcast(&wpipe->cond);
+	pthread_mutex_unlock(&wpipe->lock);
+	return NULL;
+}
+
+static void *
+writer(void *ctx)
+{
+	wan_pipe_t	*wpipe = (wan_pipe_t *)ctx;
+
+	pthread_mutex_lock(&wpipe->lock);
+	while (TRUE) {
+		wan_seg_t	*seg;
+
+		while (wpipe->head == NULL && !wpipe->eof)
+			pthread_cond_wait(&wpipe->cond, &wpipe->lock);
+		seg = wpipe->head;
+		if (seg == NULL)
+			break;
+		wpipe->head = seg->next;
+		if (wpipe->head == NULL)
+			wpipe->tail = NULL;
+		pthread_mutex_unlock(&wpipe->lock);
+
+		if (!wpipe->broken) {
+			tools_sleep_until_us(seg->release_us);
+			if (usbip_net_send(wpipe->dst, seg->data, seg->len) < 0) {
+				dbg("%s: failed to send", wpipe->name);
+				wpipe->broken = TRUE;
+				/* unblock a reader */
+				shutdown(wpipe->src, SHUT_RD);
+			}
+			else
+				wpipe->bytes += seg->len;
+		}
+
+		pthread_mutex_lock(&wpipe->lock);
+		wpipe->queued -= seg->len;
+		pthread_cond_broadcast(&wpipe->cond);
+		free(seg);
+	}
+	pthread_mutex_unlock(&wpipe->lock);
+
+	/* the other side sees an end of stream after all data */
+	shutdown(wpipe->dst, SHUT_WR);
+	return NULL;
+}
+
+static void
+init_pipe(wan_pipe_t *wpipe, const char *name, SOCKET src, SOCKET dst, unsigned seed)
+{
+	memset(wpipe, 0, sizeof(*wpipe));
+	wpipe->name = name;
+	wpipe->src = src;
+	wpipe->dst = dst;
+	/* a fixed seed makes runs of a benchmark comparable */
+	wpipe->seed = seed;
+	pthread_mutex_init(&wpipe->lock, NULL);
+	pthread_cond_init(&wpipe->cond, NULL);
+}
+
+static void *
+serve_conn(void *ctx)
+{
+	wan_conn_t	*conn = (wan_conn_t *)ctx;
+	pthread_t	threads[4];
+	int	n_threads = 0, i;
+
+	conn->serverfd = usbip_net_tcp_connect(remote_host, remote_port);
+	if (conn->serverfd == INVALID_SOCKET) {
+		err("failed to connect: %s:%s", remote_host, remote_port);
+		closesocket(conn->clientfd);
+		free(conn);
+		return NULL;
+	}
+	init_pipe(&conn->pipes[0], "up", conn->clientfd, conn->serverfd, 1);
+	init_pipe(&conn->pipes[1], "down", conn->serverfd, conn->clientfd, 2);
+
+	for (i = 0; i < 2; i++) {
+		if (pthread_create(&threads[n_threads], NULL, reader, &conn->pipes[i]) == 0)
+			n_threads++;
+		else
+			conn->pipes[i].eof = TRUE;
+		if (pthread_create(&threads[n_threads], NULL, writer, &conn->pipes[i]) == 0)
+			n_threads++;
+	}
+	if (n_threads < 4) {
+		err("failed to create thread");
+		shutdown(conn->clientfd, SHUT_RDWR);
+		shutdown(conn->serverfd, SHUT_RDWR);
+	}
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	info("closed: up %llu bytes, %zu/%zu lost, down %llu bytes, %zu/%zu lost",
+	     (unsigned long long)conn->pipes[0].bytes, conn->pipes[0].n_lost, conn->pipes[0].n_segs,
+	     (unsigned long long)conn->pipes[1].bytes, conn->pipes[1].n_lost, conn->pipes[1].n_segs);
+	for (i = 0; i < 2; i++) {
+		pthread_mutex_destroy(&conn->pipes[i].lock);
+		pthread_cond_destroy(&conn->pipes[i].cond);
+	}
+	closesocket(conn->clientfd);
+	closesocket(conn->serverfd);
+	free(conn);
+	return NULL;
+}
+
+static void
+accept_loop(SOCKET sockfd)
+{
+	while (TRUE) {
+		wan_conn_t	*conn;
+		SOCKET	connfd;
+		pthread_t	thread;
+
+		connfd = accept(sockfd, NULL, NULL);
+		if (connfd == INVALID_SOCKET) {
+			if (errno == EINTR)
+				continue;
+			err("failed to accept: %s", strerror(errno));
+			break;
+		}
+		usbip_net_set_nodelay(connfd);
+		conn = (wan_conn_t *)calloc(1, sizeof(wan_conn_t));
+		if (conn == NULL) {
+			err("out of memory");
+			closesocket(connfd);
+			continue;
+		}
+		conn->clientfd = connfd;
+		if (pthread_create(&thread, NULL, serve_conn, conn) != 0) {
+			err("failed to create thread");
+			closesocket(connfd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "remote", required_argument, NULL, 'r' },
+		{ "remote-port", required_argument, NULL, 'P' },
+		{ "tcp-port", required_argument, NULL, 't' },
+		{ "delay", required_argument, NULL, 'd' },
+		{ "jitter", required_argument, NULL, 'j' },
+		{ "bandwidth", required_argument, NULL, 'b' },
+		{ "loss", required_argument, NULL, 'L' },
+		{ "rto", required_argument, NULL, 'x' },
+		{ "debug", no_argument, NULL, 'D' },
+		{ NULL, 0, NULL, 0 }
+	};
+	unsigned long long	val;
+	SOCKET	sockfd;
+	int	opt;
+
+	usbip_setup_port_number("3241");
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "r:P:t:d:j:b:L:x:D", opts, NULL);
+
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'r':
+			remote_host = optarg;
+			break;
+		case 'P':
+			remote_port = optarg;
+			break;
+		case 't':
+			usbip_setup_port_number(optarg);
+			break;
+		case 'd':
+		case 'j':
+		case 'b':
+		case 'x':
+			if (sscanf(optarg, "%llu", &val) != 1) {
+				err("invalid value: -%c %s", opt, optarg);
+				return 1;
+			}
+			if (opt == 'd')
+				wan_link.delay_us = val;
+			else if (opt == 'j')
+				wan_link.jitter_us = val;
+			else if (opt == 'b')
+				wan_link.bandwidth = val;
+			else
+				wan_link.rto_us = val;
+			break;
+		case 'L':
+			if (sscanf(optarg, "%lf", &wan_link.loss) != 1 || wan_link.loss < 0 || wan_link.loss > 100) {
+				err("invalid loss: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'D':
+			usbip_use_debug = 1;
+			break;
+		default:
+			usbip_wan_usage();
+			return 1;
+		}
+	}
+	if (remote_host == NULL || optind != argc) {
+		usbip_wan_usage();
+		return 1;
+	}
+
+	/* a peer closing a connection should not kill a proxy */
+	signal(SIGPIPE, SIG_IGN);
+
+	sockfd = tools_listen(usbip_port_string);
+	if (sockfd == INVALID_SOCKET)
+		return 1;
+	info("forwarding port %s to %s:%s: delay %llu us, jitter %llu us, bandwidth %llu kbit/s, loss %.2f%%, rto %llu us",
+	     usbip_port_string, remote_host, remote_port, (unsigned long long)wan_link.delay_us,
+	     (unsigned long long)wan_link.jitter_us, (unsigned long long)wan_link.bandwidth, wan_link.loss,
+	     (unsigned long long)wan_link.rto_us);
+	accept_loop(sockfd);
+	closesocket(sockfd);
+	return 1;
+}